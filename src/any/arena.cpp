@@ -0,0 +1,190 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file arena.cpp
+ * @author lotuspar / par0-git
+ * @brief MemoryArena / MemoryArenaPool
+ */
+
+#include "arena.h"
+#include "debug.h" // sasm_*
+#include "memory.h" // bulk_fill
+#include <sys/mman.h> // mmap, munmap, madvise
+#include <unistd.h> // sysconf
+
+using namespace sasm;
+
+// Size of a huge page used for MAP_HUGETLB mappings
+static const u64 kHugePageSize = 2 << 20;
+
+bool MemoryArena::init(u64 _capacity, u8 _flags) {
+    release();
+    arena_flags = _flags;
+
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (_flags & kArenaPrefault)
+        map_flags |= MAP_POPULATE;
+
+    void* result = MAP_FAILED;
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    u64 capacity = _capacity != 0 ? _capacity : 1;
+
+#ifdef MAP_HUGETLB
+    // Explicit huge pages, only works if the system reserved some
+    if (_flags & kArenaHugePages) {
+        u64 huge_length = (capacity + kHugePageSize - 1) & ~(kHugePageSize - 1);
+        result = mmap(0x0, huge_length, PROT_READ | PROT_WRITE, map_flags | MAP_HUGETLB, -1, 0);
+        if (result != MAP_FAILED) {
+            length = huge_length;
+            huge_pages = true;
+        }
+    }
+#endif
+
+    // Regular pages
+    if (result == MAP_FAILED) {
+        u64 regular_length = (capacity + page_size - 1) & ~(page_size - 1);
+        result = mmap(0x0, regular_length, PROT_READ | PROT_WRITE, map_flags, -1, 0);
+        if (result == MAP_FAILED) {
+            sasm_print("Failed to map MemoryArena of %lu bytes", (unsigned long) regular_length);
+            return false;
+        }
+        length = regular_length;
+
+#ifdef MADV_HUGEPAGE
+        // Ask for transparent huge pages instead
+        if (_flags & kArenaHugePages)
+            madvise(result, length, MADV_HUGEPAGE);
+#endif
+    }
+
+    memory = (u8*) result;
+    position = 0;
+    return true;
+}
+
+void MemoryArena::release() {
+    if (memory != 0x0)
+        munmap(memory, length);
+
+    memory = 0x0;
+    length = 0;
+    position = 0;
+    huge_pages = false;
+    file_start = 0;
+    file_end = 0;
+}
+
+u8* MemoryArena::allocate(u64 amount, u64 alignment) {
+    if (alignment < kAlignment)
+        alignment = kAlignment;
+
+    u64 start = footprint(position, alignment);
+    u64 block = footprint(amount);
+    if (memory == 0x0 || start > length || block > length - start)
+        return 0x0;
+
+    position = start + block;
+    return memory + start;
+}
+
+bool MemoryArena::map_file(u8* at, int fd, u64 file_offset, u64 amount) {
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    u64 mapped = (amount + page_size - 1) & ~(page_size - 1);
+    if (memory == 0x0 || huge_pages || at < memory || ((u64) at & (page_size - 1)) != 0 || (file_offset & (page_size - 1)) != 0)
+        return false;
+    if ((u64) (at - memory) > length || mapped > length - (at - memory))
+        return false;
+
+    void* result = mmap(at, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, file_offset);
+    if (result == MAP_FAILED)
+        return false;
+
+    // Remember the range so reset() can drop the file pages
+    u64 start = at - memory;
+    if (file_end == file_start || start < file_start)
+        file_start = start;
+    if (start + mapped > file_end)
+        file_end = start + mapped;
+    return true;
+}
+
+bool MemoryArena::remap_zero(u64 offset, u64 amount) {
+    int map_flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+    if (arena_flags & kArenaPrefault)
+        map_flags |= MAP_POPULATE;
+
+    if (mmap(memory + offset, amount, PROT_READ | PROT_WRITE, map_flags, -1, 0) == MAP_FAILED)
+        return false;
+
+#ifdef MADV_HUGEPAGE
+    if (arena_flags & kArenaHugePages)
+        madvise(memory + offset, amount, MADV_HUGEPAGE);
+#endif
+    return true;
+}
+
+void MemoryArena::reset(bool zero) {
+    // File pages have to go, the arena would keep the files mapped otherwise
+    bool remapped = file_end > file_start && remap_zero(file_start, file_end - file_start);
+
+    // Only the used part can be dirty, anonymous memory is cleared in place
+    if (zero && memory != 0x0) {
+        if (!remapped) {
+            bulk_fill(memory, 0, position);
+        } else {
+            bulk_fill(memory, 0, file_start < position ? file_start : position);
+            if (file_end < position)
+                bulk_fill(memory + file_end, 0, position - file_end);
+        }
+    }
+
+    file_start = 0;
+    file_end = 0;
+    position = 0;
+}
+
+std::unique_ptr<MemoryArena> MemoryArenaPool::acquire(u64 capacity, u8 flags) {
+    std::unique_ptr<MemoryArena> arena;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+
+        // Smallest released arena that fits
+        u64 best = arenas.size();
+        for (u64 i = 0; i < arenas.size(); i++) {
+            if (arenas[i]->flags() != flags || arenas[i]->capacity() < capacity)
+                continue;
+            if (best == arenas.size() || arenas[i]->capacity() < arenas[best]->capacity())
+                best = i;
+        }
+
+        if (best != arenas.size()) {
+            arena = std::move(arenas[best]);
+            arenas[best] = std::move(arenas.back());
+            arenas.pop_back();
+        }
+    }
+
+    // Reused, zero outside of the lock
+    if (arena) {
+        arena->reset();
+        return arena;
+    }
+
+    arena.reset(new MemoryArena());
+    if (!arena->init(capacity, flags))
+        return std::unique_ptr<MemoryArena>();
+    return arena;
+}
+
+void MemoryArenaPool::release(std::unique_ptr<MemoryArena> arena) {
+    if (!arena)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    arenas.push_back(std::move(arena));
+}
+
+u64 MemoryArenaPool::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return arenas.size();
+}
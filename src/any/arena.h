@@ -0,0 +1,135 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file arena.h
+ * @author lotuspar / par0-git
+ * @brief Contiguous memory arenas for backing many memory devices with one mapping
+ *
+ * A MemoryArena is one anonymous memory mapping handing out cache line aligned blocks
+ * with a bump pointer. Blocks aren't freed one by one: the whole arena is reset or
+ * unmapped at once. MemoryArenaPool keeps released arenas around so restarting a
+ * processor doesn't pay for mmap and page faults again.
+ */
+
+#pragma once
+
+#include "number.h" // u*
+#include <memory> // std::unique_ptr
+#include <mutex> // std::mutex
+#include <vector> // std::vector
+
+namespace sasm {
+    /**
+     * @brief Bitflags for how an arena is backed
+     */
+    enum MemoryArenaFlags {
+        kArenaHugePages = 0b01, // "kArenaHugePages" Use huge pages (MAP_HUGETLB, falls back to transparent huge pages)
+        kArenaPrefault = 0b10 // "kArenaPrefault" Fault every page in when mapping instead of on first use
+    };
+
+    class MemoryArena {
+        public:
+            // Alignment of every block
+            static const u64 kAlignment = 64;
+
+            MemoryArena() {}
+            MemoryArena(u64 _capacity, u8 _flags = 0) { init(_capacity, _flags); }
+            ~MemoryArena() { release(); }
+
+            MemoryArena(const MemoryArena&) = delete;
+            MemoryArena& operator=(const MemoryArena&) = delete;
+
+            /**
+             * @brief Map memory for the arena, releasing previous memory
+             *
+             * @param _capacity Minimum amount of bytes, rounded up to the page size
+             * @param _flags Backing options (MemoryArenaFlags)
+             * @return bool False if mapping failed
+             */
+            bool init(u64 _capacity, u8 _flags = 0);
+
+            /**
+             * @brief Unmap the arena memory
+             */
+            void release();
+
+            /**
+             * @brief Take a block from the arena
+             *
+             * @param amount Size of the block
+             * @param alignment Alignment of the block (power of two, at least kAlignment)
+             * @return u8* Block aligned to alignment, 0x0 if the arena is full
+             */
+            u8* allocate(u64 amount, u64 alignment = kAlignment);
+
+            /**
+             * @brief Map part of a file over arena memory (private copy-on-write mapping)
+             *
+             * Pages are only read from the file once they are touched. Fails on huge page
+             * arenas and unaligned ranges, copy the data instead then.
+             *
+             * @param at Arena memory to map over, aligned to the page size
+             * @param fd File to map
+             * @param file_offset Offset into the file, aligned to the page size
+             * @param length Amount of bytes to map, rounded up to the page size
+             * @return bool False if the range couldn't be mapped
+             */
+            bool map_file(u8* at, int fd, u64 file_offset, u64 length);
+
+            /**
+             * @brief Forget every block, memory is kept mapped
+             *
+             * Used memory is cleared in place, only ranges mapped from files are replaced with
+             * fresh zero pages (so the arena doesn't keep the files mapped).
+             *
+             * @param zero Zero the memory used so far, so blocks start out like fresh memory
+             */
+            void reset(bool zero = true);
+
+            // Bytes needed to allocate blocks of these sizes from an arena
+            static u64 footprint(u64 amount, u64 alignment = kAlignment) { return (amount + alignment - 1) & ~(alignment - 1); }
+
+            u64 capacity() { return length; }
+            u64 used() { return position; }
+            u8 flags() { return arena_flags; }
+            bool huge() { return huge_pages; } // True if backed by MAP_HUGETLB pages
+        private:
+            u8* memory = 0x0;
+            u64 length = 0;
+            u64 position = 0;
+            u8 arena_flags = 0;
+            bool huge_pages = false;
+            u64 file_start = 0; // Offsets mapped from files by map_file, empty if nothing is
+            u64 file_end = 0;
+
+            // Replace "amount" bytes at the page aligned offset with fresh zero pages
+            bool remap_zero(u64 offset, u64 amount);
+    };
+
+    /**
+     * @brief Thread-safe pool of released arenas
+     */
+    class MemoryArenaPool {
+        public:
+            /**
+             * @brief Get an arena with at least the requested capacity, reusing a released arena if possible
+             *
+             * @param capacity Minimum amount of bytes
+             * @param flags Backing options (MemoryArenaFlags), only arenas with the same options are reused
+             * @return std::unique_ptr<MemoryArena> Reset arena, empty if mapping failed
+             */
+            std::unique_ptr<MemoryArena> acquire(u64 capacity, u8 flags = 0);
+
+            /**
+             * @brief Give an arena back to the pool
+             *
+             * @param arena Arena, reset before it is handed out again
+             */
+            void release(std::unique_ptr<MemoryArena> arena);
+
+            // Amount of arenas waiting to be reused
+            u64 size();
+        private:
+            std::mutex mutex;
+            std::vector<std::unique_ptr<MemoryArena>> arenas;
+    };
+}
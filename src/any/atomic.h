@@ -0,0 +1,88 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file atomic.h
+ * @author lotuspar / par0-git
+ * @brief Lock-free atomic operations on host memory
+ *
+ * Thin wrappers around the compiler __atomic builtins, picking the operation and width
+ * at runtime. Every operation is sequentially consistent.
+ */
+
+#pragma once
+
+#include "number.h" // u*
+
+namespace sasm {
+    /**
+     * @brief Read-modify-write operations
+     */
+    enum AtomicOperation {
+        kAtomicExchange = 0, // "kAtomicExchange" Store operand
+        kAtomicCompareExchange = 1, // "kAtomicCompareExchange" Store operand if the value equals expected
+        kAtomicFetchAdd = 2, // "kAtomicFetchAdd" Add operand
+        kAtomicFetchAnd = 3, // "kAtomicFetchAnd" And with operand
+        kAtomicFetchOr = 4 // "kAtomicFetchOr" Or with operand
+    };
+
+    /**
+     * @brief Orderings for atomic_fence
+     */
+    enum AtomicOrder {
+        kOrderAcquire = 0, // "kOrderAcquire" Later loads / stores can't move before the fence
+        kOrderRelease = 1, // "kOrderRelease" Earlier loads / stores can't move after the fence
+        kOrderSequential = 2 // "kOrderSequential" Full fence
+    };
+
+    template <class T>
+    inline T atomic_apply_type(T* host, u8 operation, T operand, T expected) {
+        switch (operation) {
+            case kAtomicExchange:
+                return __atomic_exchange_n(host, operand, __ATOMIC_SEQ_CST);
+            case kAtomicCompareExchange:
+                // expected is replaced with the current value when the exchange fails
+                __atomic_compare_exchange_n(host, &expected, operand, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+                return expected;
+            case kAtomicFetchAdd:
+                return __atomic_fetch_add(host, operand, __ATOMIC_SEQ_CST);
+            case kAtomicFetchAnd:
+                return __atomic_fetch_and(host, operand, __ATOMIC_SEQ_CST);
+            default:
+                return __atomic_fetch_or(host, operand, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    /**
+     * @brief Run an atomic read-modify-write operation on host memory
+     *
+     * @param host Pointer to the value, has to be aligned to width
+     * @param width Size of the value (1, 2, 4 or 8)
+     * @param operation Operation to run (AtomicOperation)
+     * @param operand Value used by the operation, truncated to width
+     * @param expected Value compared against by kAtomicCompareExchange, truncated to width
+     * @param old_out [OUT] Value before the operation
+     * @return bool False if width isn't supported
+     */
+    inline bool atomic_apply(void* host, u64 width, u8 operation, u64 operand, u64 expected, u64* old_out) {
+        switch (width) {
+            case 1: *old_out = atomic_apply_type<u8>((u8*) host, operation, operand, expected); return true;
+            case 2: *old_out = atomic_apply_type<u16>((u16*) host, operation, operand, expected); return true;
+            case 4: *old_out = atomic_apply_type<u32>((u32*) host, operation, operand, expected); return true;
+            case 8: *old_out = atomic_apply_type<u64>((u64*) host, operation, operand, expected); return true;
+            default: return false;
+        }
+    }
+
+    /**
+     * @brief Memory fence
+     *
+     * @param order Ordering of the fence (AtomicOrder)
+     */
+    inline void atomic_fence(u8 order) {
+        if (order == kOrderAcquire)
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        else if (order == kOrderRelease)
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+        else
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+}
@@ -0,0 +1,169 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file compress.cpp
+ * @author lotuspar / par0-git
+ * @brief lz_compress / lz_decompress
+ */
+
+#include "compress.h"
+#include <string.h> // memcpy
+
+using namespace sasm;
+
+// Shortest match worth encoding
+static const u64 kMinMatch = 4;
+
+// Largest match offset, offsets are stored in 2 bytes
+static const u64 kMaxOffset = 65535;
+
+// Size of the match finder hash table, as a shift
+static const u64 kHashBits = 12;
+
+static inline u32 load32(const u8* pointer) {
+    u32 value;
+    memcpy(&value, pointer, sizeof(value));
+    return value;
+}
+
+static inline u32 hash32(u32 value) {
+    return (value * 2654435761u) >> (32 - kHashBits);
+}
+
+// Write the extra bytes of a length that didn't fit its nibble
+static inline bool write_length(u8*& out, u8* end, u64 length) {
+    for (; length >= 255; length -= 255) {
+        if (out == end)
+            return false;
+        *out++ = 255;
+    }
+    if (out == end)
+        return false;
+    *out++ = (u8) length;
+    return true;
+}
+
+/**
+ * Write one sequence, a match_length of 0 writes the last sequence (literals only)
+ */
+static bool write_sequence(u8*& out, u8* end, const u8* literals, u64 literal_length, u64 offset, u64 match_length) {
+    if (out == end)
+        return false;
+
+    u64 match_code = match_length != 0 ? match_length - kMinMatch : 0;
+    *out++ = (u8) (((literal_length < 15 ? literal_length : 15) << 4) | (match_code < 15 ? match_code : 15));
+    if (literal_length >= 15 && !write_length(out, end, literal_length - 15))
+        return false;
+
+    if (literal_length > (u64) (end - out))
+        return false;
+    memcpy(out, literals, literal_length);
+    out += literal_length;
+
+    if (match_length == 0)
+        return true;
+
+    if (end - out < 2)
+        return false;
+    *out++ = (u8) offset;
+    *out++ = (u8) (offset >> 8);
+    return match_code < 15 || write_length(out, end, match_code - 15);
+}
+
+u64 sasm::lz_compress(const u8* input, u64 size, u8* output, u64 capacity) {
+    u32 table[1 << kHashBits] = {};
+    u8* out = output;
+    u8* end = output + capacity;
+
+    u64 anchor = 0; // First byte not written yet
+    u64 position = 0;
+    u64 misses = 0;
+    while (size >= kMinMatch && position <= size - kMinMatch) {
+        u32 sequence = load32(input + position);
+        u32 hash = hash32(sequence);
+        u64 candidate = table[hash];
+        table[hash] = (u32) position;
+
+        if (candidate >= position || position - candidate > kMaxOffset || load32(input + candidate) != sequence) {
+            // Skip ahead faster through data that doesn't compress
+            position += 1 + (misses++ >> 6);
+            continue;
+        }
+        misses = 0;
+
+        u64 length = kMinMatch;
+        while (position + length < size && input[candidate + length] == input[position + length])
+            length++;
+
+        if (!write_sequence(out, end, input + anchor, position - anchor, position - candidate, length))
+            return 0;
+
+        position += length;
+        anchor = position;
+    }
+
+    if (!write_sequence(out, end, input + anchor, size - anchor, 0, 0))
+        return 0;
+    return out - output;
+}
+
+// Read the extra bytes of a length that didn't fit its nibble
+static inline bool read_length(const u8*& in, const u8* end, u64& length) {
+    u8 byte = 255;
+    while (byte == 255) {
+        if (in == end)
+            return false;
+        byte = *in++;
+        length += byte;
+    }
+    return true;
+}
+
+bool sasm::lz_decompress(const u8* input, u64 size, u8* output, u64 output_size) {
+    const u8* in = input;
+    const u8* in_end = input + size;
+    u64 position = 0;
+
+    while (in != in_end) {
+        u8 token = *in++;
+
+        u64 literal_length = token >> 4;
+        if (literal_length == 15 && !read_length(in, in_end, literal_length))
+            return false;
+        if (literal_length > (u64) (in_end - in) || literal_length > output_size - position)
+            return false;
+
+        memcpy(output + position, in, literal_length);
+        in += literal_length;
+        position += literal_length;
+
+        // Last sequence
+        if (in == in_end)
+            break;
+
+        if (in_end - in < 2)
+            return false;
+        u64 offset = in[0] | ((u64) in[1] << 8);
+        in += 2;
+
+        u64 match_length = token & 15;
+        if (match_length == 15 && !read_length(in, in_end, match_length))
+            return false;
+        match_length += kMinMatch;
+
+        if (offset == 0 || offset > position || match_length > output_size - position)
+            return false;
+
+        // Matches can overlap the bytes they produce
+        u8* destination = output + position;
+        const u8* source = destination - offset;
+        if (offset >= match_length)
+            memcpy(destination, source, match_length);
+        else {
+            for (u64 i = 0; i < match_length; i++)
+                destination[i] = source[i];
+        }
+        position += match_length;
+    }
+
+    return position == output_size;
+}
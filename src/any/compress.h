@@ -0,0 +1,50 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file compress.h
+ * @author lotuspar / par0-git
+ * @brief Fast byte-oriented LZ77 compression
+ *
+ * Made for speed over ratio, similar to LZ4 blocks: a sequence is a token byte (literal
+ * length in the high nibble, match length - 4 in the low nibble, 15 means more length
+ * bytes follow), the literals, then a 2-byte little-endian match offset and the extra
+ * match length bytes. The last sequence only has literals.
+ */
+
+#pragma once
+
+#include "number.h" // u*
+
+namespace sasm {
+    /**
+     * @brief Largest possible compressed size of an input
+     *
+     * @param size Size of the input
+     */
+    inline u64 lz_bound(u64 size) {
+        return size + size / 255 + 16;
+    }
+
+    /**
+     * @brief Compress bytes
+     *
+     * @param input Bytes to compress
+     * @param size Amount of bytes to compress
+     * @param output Buffer for the compressed bytes
+     * @param capacity Size of the output buffer, lz_bound(size) always fits
+     * @return u64 Compressed size, 0 if it didn't fit
+     */
+    u64 lz_compress(const u8* input, u64 size, u8* output, u64 capacity);
+
+    /**
+     * @brief Decompress bytes compressed by lz_compress
+     *
+     * Never reads / writes outside of the buffers, also for corrupted input.
+     *
+     * @param input Compressed bytes
+     * @param size Amount of compressed bytes
+     * @param output Buffer for the decompressed bytes
+     * @param output_size Expected decompressed size
+     * @return bool False if the input is corrupted or doesn't decompress to output_size bytes
+     */
+    bool lz_decompress(const u8* input, u64 size, u8* output, u64 output_size);
+}
@@ -3,16 +3,21 @@
  * @file debug.h
  * @author lotuspar / par0-git
  * @brief Debug functions
+ *
+ * sasm_debug_print only prints if SASM_DEBUG is defined, otherwise it compiles to nothing
+ * (arguments aren't evaluated). Use sasm_trace (trace.h) for events on hot paths.
  */
 
-#define SASM_DEBUG
+#pragma once
+
 #include <stdio.h> // printf
 
 #define __sasm_print_template "%s :: "
 #define __sasm_debug_print_template "%s :: "
 #define sasm_print(message, ...) printf(__sasm_print_template message "\n", __func__, ##__VA_ARGS__)
-#define sasm_debug_print(message, ...) printf(__sasm_debug_print_template message "\n", __func__, ##__VA_ARGS__)
 
-#ifndef SASM_DEBUG
-    #define sasm_debug_print ;
-#endif
\ No newline at end of file
+#ifdef SASM_DEBUG
+    #define sasm_debug_print(message, ...) printf(__sasm_debug_print_template message "\n", __func__, ##__VA_ARGS__)
+#else
+    #define sasm_debug_print(message, ...) ((void) 0)
+#endif
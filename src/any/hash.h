@@ -0,0 +1,54 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file hash.h
+ * @author lotuspar / par0-git
+ * @brief Fast non-cryptographic hashing
+ *
+ * Mixes 16 bytes per step with a 64x64 -> 128-bit multiply. Used to recognize inputs
+ * that didn't change (e.g. the assembler object cache), not safe against collisions
+ * made on purpose.
+ */
+
+#pragma once
+
+#include "number.h" // u*
+#include <string.h> // memcpy
+
+namespace sasm {
+    // Multiply two values, fold the 128-bit product into 64 bits
+    inline u64 hash_mix(u64 a, u64 b) {
+        __uint128_t product = (__uint128_t) a * b;
+        return (u64) product ^ (u64) (product >> 64);
+    }
+
+    /**
+     * @brief Hash bytes
+     *
+     * @param data Bytes to hash
+     * @param size Amount of bytes to hash
+     * @param seed Different seeds give unrelated hashes of the same bytes
+     * @return u64 Hash
+     */
+    inline u64 hash_bytes(const void* data, u64 size, u64 seed = 0) {
+        static const u64 k0 = 0xa0761d6478bd642full;
+        static const u64 k1 = 0xe7037ed1a0b428dbull;
+        static const u64 k2 = 0x8ebc6af09c88c6e3ull;
+
+        const u8* bytes = (const u8*) data;
+        u64 state = hash_mix(seed ^ k0, size ^ k1);
+
+        u64 i = 0;
+        for (; i + 16 <= size; i += 16) {
+            u64 a, b;
+            memcpy(&a, bytes + i, 8);
+            memcpy(&b, bytes + i + 8, 8);
+            state = hash_mix(a ^ k1, b ^ state);
+        }
+
+        // Rest is zero padded, the size is already part of the state
+        u64 tail[2] = { 0, 0 };
+        memcpy(tail, bytes + i, size - i);
+        state = hash_mix(tail[0] ^ k2, tail[1] ^ state);
+        return hash_mix(state ^ k0, k2);
+    }
+}
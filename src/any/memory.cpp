@@ -0,0 +1,163 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file memory.cpp
+ * @author lotuspar / par0-git
+ * @brief Bulk memory kernels (copy, move, fill, compare)
+ */
+
+#include "memory.h"
+#include <string.h> // memcpy, memmove, memset, memcmp
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define SASM_BULK_X86
+    #include <immintrin.h>
+#endif
+
+namespace sasm {
+namespace {
+    struct BulkKernels {
+        void (*copy)(void*, const void*, u64);
+        void (*move)(void*, const void*, u64);
+        void (*fill)(void*, u8, u64);
+        int (*compare)(const void*, const void*, u64);
+        const char* name;
+    };
+
+    // Below this size the libc routines are used directly, vector setup isn't worth it
+    const u64 kBulkThreshold = 64;
+
+    // Generic kernels: defer to the C library
+    void generic_copy(void* destination, const void* source, u64 amount) { memcpy(destination, source, amount); }
+    void generic_move(void* destination, const void* source, u64 amount) { memmove(destination, source, amount); }
+    void generic_fill(void* destination, u8 value, u64 amount) { memset(destination, value, amount); }
+    int generic_compare(const void* a, const void* b, u64 amount) {
+        // Normalise to the difference of the first differing bytes
+        const u8* a_u8p = (const u8*) a;
+        const u8* b_u8p = (const u8*) b;
+        for (u64 x = 0; x < amount; x++) {
+            if (a_u8p[x] != b_u8p[x])
+                return (int) a_u8p[x] - (int) b_u8p[x];
+        }
+        return 0;
+    }
+
+#ifdef SASM_BULK_X86
+    /**
+     * Kernel template: "Vector" provides load / store / broadcast / equality mask for one
+     * vector width. Each kernel handles the bulk with full vectors (4 per iteration) and
+     * handles the tail with a final vector overlapping the previous one.
+     */
+    #define SASM_BULK_KERNELS(prefix, isa, vec, width, loadu, storeu, set1, cmpeq, movemask, full_mask) \
+        __attribute__((target(isa))) \
+        void prefix##_copy(void* destination, const void* source, u64 amount) { \
+            if (amount < kBulkThreshold) { memcpy(destination, source, amount); return; } \
+            u8* d = (u8*) destination; \
+            const u8* s = (const u8*) source; \
+            u64 x = 0; \
+            for (; x + 4 * width <= amount; x += 4 * width) { \
+                vec v0 = loadu((const vec*) (s + x)); \
+                vec v1 = loadu((const vec*) (s + x + width)); \
+                vec v2 = loadu((const vec*) (s + x + 2 * width)); \
+                vec v3 = loadu((const vec*) (s + x + 3 * width)); \
+                storeu((vec*) (d + x), v0); \
+                storeu((vec*) (d + x + width), v1); \
+                storeu((vec*) (d + x + 2 * width), v2); \
+                storeu((vec*) (d + x + 3 * width), v3); \
+            } \
+            for (; x + width <= amount; x += width) \
+                storeu((vec*) (d + x), loadu((const vec*) (s + x))); \
+            if (x < amount) \
+                storeu((vec*) (d + amount - width), loadu((const vec*) (s + amount - width))); \
+        } \
+        __attribute__((target(isa))) \
+        void prefix##_move(void* destination, const void* source, u64 amount) { \
+            u8* d = (u8*) destination; \
+            const u8* s = (const u8*) source; \
+            /* Forward copy is safe when the destination isn't inside the source */ \
+            if (d <= s || d >= s + amount) { \
+                if (d + amount <= s || d >= s + amount) { prefix##_copy(d, s, amount); return; } \
+                if (amount < kBulkThreshold) { memmove(d, s, amount); return; } \
+                u64 x = 0; \
+                for (; x + width <= amount; x += width) \
+                    storeu((vec*) (d + x), loadu((const vec*) (s + x))); \
+                for (; x < amount; x++) \
+                    d[x] = s[x]; \
+                return; \
+            } \
+            /* Destination is after source and overlapping, copy backwards */ \
+            if (amount < kBulkThreshold) { memmove(d, s, amount); return; } \
+            u64 x = amount; \
+            for (; x >= width; x -= width) \
+                storeu((vec*) (d + x - width), loadu((const vec*) (s + x - width))); \
+            while (x > 0) { \
+                x--; \
+                d[x] = s[x]; \
+            } \
+        } \
+        __attribute__((target(isa))) \
+        void prefix##_fill(void* destination, u8 value, u64 amount) { \
+            if (amount < kBulkThreshold) { memset(destination, value, amount); return; } \
+            u8* d = (u8*) destination; \
+            vec v = set1((char) value); \
+            u64 x = 0; \
+            for (; x + 4 * width <= amount; x += 4 * width) { \
+                storeu((vec*) (d + x), v); \
+                storeu((vec*) (d + x + width), v); \
+                storeu((vec*) (d + x + 2 * width), v); \
+                storeu((vec*) (d + x + 3 * width), v); \
+            } \
+            for (; x + width <= amount; x += width) \
+                storeu((vec*) (d + x), v); \
+            if (x < amount) \
+                storeu((vec*) (d + amount - width), v); \
+        } \
+        __attribute__((target(isa))) \
+        int prefix##_compare(const void* a, const void* b, u64 amount) { \
+            const u8* a_u8p = (const u8*) a; \
+            const u8* b_u8p = (const u8*) b; \
+            u64 x = 0; \
+            for (; x + width <= amount; x += width) { \
+                vec va = loadu((const vec*) (a_u8p + x)); \
+                vec vb = loadu((const vec*) (b_u8p + x)); \
+                u32 equal = (u32) movemask(cmpeq(va, vb)); \
+                if (equal != full_mask) { \
+                    u64 first = x + __builtin_ctz(~equal); \
+                    return (int) a_u8p[first] - (int) b_u8p[first]; \
+                } \
+            } \
+            return generic_compare(a_u8p + x, b_u8p + x, amount - x); \
+        }
+
+    SASM_BULK_KERNELS(sse2, "sse2", __m128i, 16, _mm_loadu_si128, _mm_storeu_si128, _mm_set1_epi8, _mm_cmpeq_epi8, _mm_movemask_epi8, 0xFFFFu)
+    SASM_BULK_KERNELS(avx2, "avx2", __m256i, 32, _mm256_loadu_si256, _mm256_storeu_si256, _mm256_set1_epi8, _mm256_cmpeq_epi8, _mm256_movemask_epi8, 0xFFFFFFFFu)
+
+    #undef SASM_BULK_KERNELS
+#endif
+
+    /**
+     * @brief Pick the best kernels for the CPU the program is running on
+     */
+    BulkKernels select_kernels() {
+#ifdef SASM_BULK_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            return { avx2_copy, avx2_move, avx2_fill, avx2_compare, "avx2" };
+        if (__builtin_cpu_supports("sse2"))
+            return { sse2_copy, sse2_move, sse2_fill, sse2_compare, "sse2" };
+#endif
+        return { generic_copy, generic_move, generic_fill, generic_compare, "generic" };
+    }
+
+    // Selected once, on first use
+    const BulkKernels& kernels() {
+        static const BulkKernels selected = select_kernels();
+        return selected;
+    }
+}
+
+void bulk_copy(void* destination, const void* source, u64 amount) { kernels().copy(destination, source, amount); }
+void bulk_move(void* destination, const void* source, u64 amount) { kernels().move(destination, source, amount); }
+void bulk_fill(void* destination, u8 value, u64 amount) { kernels().fill(destination, value, amount); }
+int bulk_compare(const void* a, const void* b, u64 amount) { return kernels().compare(a, b, amount); }
+const char* bulk_kernel_name() { return kernels().name; }
+}
@@ -0,0 +1,57 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file memory.h
+ * @author lotuspar / par0-git
+ * @brief Bulk memory kernels (copy, move, fill, compare)
+ * 
+ * The kernels use the widest vector loads / stores the host CPU supports. The
+ * implementation is picked at runtime the first time a kernel is used.
+ */
+
+#pragma once
+
+#include "number.h" // u*
+
+namespace sasm {
+    /**
+     * @brief Copy bytes between two non-overlapping regions
+     * 
+     * @param destination Pointer to copy bytes to
+     * @param source Pointer to copy bytes from
+     * @param amount Amount of bytes to copy
+     */
+    void bulk_copy(void* destination, const void* source, u64 amount);
+
+    /**
+     * @brief Copy bytes between two regions that may overlap
+     * 
+     * @param destination Pointer to copy bytes to
+     * @param source Pointer to copy bytes from
+     * @param amount Amount of bytes to copy
+     */
+    void bulk_move(void* destination, const void* source, u64 amount);
+
+    /**
+     * @brief Set every byte of a region to a value
+     * 
+     * @param destination Pointer to region
+     * @param value Value to set bytes to
+     * @param amount Amount of bytes to set
+     */
+    void bulk_fill(void* destination, u8 value, u64 amount);
+
+    /**
+     * @brief Compare two regions byte by byte
+     * 
+     * @param a Pointer to first region
+     * @param b Pointer to second region
+     * @param amount Amount of bytes to compare
+     * @return int 0 if equal, otherwise the difference of the first differing bytes (a - b)
+     */
+    int bulk_compare(const void* a, const void* b, u64 amount);
+
+    /**
+     * @brief Name of the kernel implementation selected for this CPU ("avx2", "sse2", "generic")
+     */
+    const char* bulk_kernel_name();
+}
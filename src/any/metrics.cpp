@@ -0,0 +1,166 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file metrics.cpp
+ * @author lotuspar / par0-git
+ * @brief Metrics shards, aggregation and export
+ */
+
+#include "metrics.h"
+#include <memory> // std::unique_ptr
+#include <mutex> // std::mutex
+#include <stdio.h> // snprintf
+#include <string.h> // memset
+
+using namespace sasm;
+
+namespace {
+    struct MetricsRegistry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<MetricsShard>> shards; // Every shard ever created
+        std::vector<MetricsShard*> unused; // Shards of exited threads
+        u32 next_id = 0;
+    };
+
+    // Never destroyed, threads can exit after static destructors ran
+    MetricsRegistry& registry() {
+        static MetricsRegistry* instance = new MetricsRegistry();
+        return *instance;
+    }
+
+    // Gives the shard back when the thread exits, counts stay in it
+    struct MetricsShardOwner {
+        MetricsShard* shard = 0x0;
+        ~MetricsShardOwner() {
+            if (shard == 0x0)
+                return;
+
+            MetricsRegistry& metrics = registry();
+            std::lock_guard<std::mutex> lock(metrics.mutex);
+            metrics.unused.push_back(shard);
+            metrics_local = 0x0;
+        }
+    };
+
+    thread_local MetricsShardOwner shard_owner;
+
+    // Names of the counters, failures use the DeviceOperationResult names
+    const char* kCounterNames[kMetricCount] = {
+        "reads", "writes", "read_bytes", "written_bytes", "crossings", "cache_hits", "cache_misses",
+        "locked", "out_of_bounds", "unsupported", "misaligned"
+    };
+
+    // Escape a string for a Prometheus label / JSON string
+    std::string escape(const std::string& text) {
+        std::string result;
+        for (char c : text) {
+            if (c == '"' || c == '\\')
+                result += '\\';
+            if (c == '\n')
+                result += "\\n";
+            else if ((u8) c >= 0x20)
+                result += c;
+        }
+        return result;
+    }
+}
+
+MetricsBlock* MetricsShard::grow(u64 block) {
+    MetricsBlock* result = new MetricsBlock();
+    memset(result, 0, sizeof(MetricsBlock));
+
+    // metrics_collect may read the block as soon as it is visible
+    __atomic_store_n(&blocks[block], result, __ATOMIC_RELEASE);
+    return result;
+}
+
+u32 sasm::metrics_register() {
+    MetricsRegistry& metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    if (metrics.next_id >= kMetricsMaxIds)
+        return kMetricsNone;
+    return metrics.next_id++;
+}
+
+MetricsShard* sasm::metrics_shard() {
+    if (metrics_local != 0x0)
+        return metrics_local;
+
+    MetricsRegistry& metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    if (!metrics.unused.empty()) {
+        metrics_local = metrics.unused.back();
+        metrics.unused.pop_back();
+    } else {
+        metrics.shards.emplace_back(new MetricsShard());
+        metrics_local = metrics.shards.back().get();
+    }
+
+    shard_owner.shard = metrics_local;
+    return metrics_local;
+}
+
+MetricsSnapshot sasm::metrics_collect(u32 id) {
+    MetricsSnapshot snapshot = MetricsSnapshot();
+    if (id >= kMetricsMaxIds)
+        return snapshot;
+
+    MetricsRegistry& metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    for (std::unique_ptr<MetricsShard>& shard : metrics.shards) {
+        MetricsBlock* block = __atomic_load_n(&shard->blocks[id >> kMetricsBlockBits], __ATOMIC_ACQUIRE);
+        if (block == 0x0)
+            continue;
+
+        u64* counters = block->counters[id & ((((u64) 1) << kMetricsBlockBits) - 1)];
+        for (u64 i = 0; i < kMetricCount; i++)
+            snapshot.counters[i] += __atomic_load_n(&counters[i], __ATOMIC_RELAXED);
+    }
+    return snapshot;
+}
+
+std::string sasm::metrics_prometheus(const std::vector<MetricsSample>& samples, const char* prefix) {
+    std::string result;
+    char line[512];
+
+    for (u64 counter = 0; counter < kMetricCount; counter++) {
+        // Failures are one metric with a result label
+        bool failure = counter >= kMetricFailures;
+        if (counter <= kMetricFailures) {
+            const char* name = failure ? "failures" : kCounterNames[counter];
+            snprintf(line, sizeof(line), "# TYPE %s_%s_total counter\n", prefix, name);
+            result += line;
+        }
+
+        for (const MetricsSample& sample : samples) {
+            std::string device = escape(sample.name);
+            if (failure) {
+                snprintf(line, sizeof(line), "%s_failures_total{device=\"%s\",id=\"%u\",result=\"%s\"} %lu\n",
+                    prefix, device.c_str(), sample.id, kCounterNames[counter], (unsigned long) sample.snapshot.counters[counter]);
+            } else {
+                snprintf(line, sizeof(line), "%s_%s_total{device=\"%s\",id=\"%u\"} %lu\n",
+                    prefix, kCounterNames[counter], device.c_str(), sample.id, (unsigned long) sample.snapshot.counters[counter]);
+            }
+            result += line;
+        }
+    }
+    return result;
+}
+
+std::string sasm::metrics_json(const std::vector<MetricsSample>& samples) {
+    std::string result = "[";
+    char field[128];
+
+    for (u64 i = 0; i < samples.size(); i++) {
+        const MetricsSample& sample = samples[i];
+        result += i == 0 ? "\n" : ",\n";
+        result += "  {\"device\": \"" + escape(sample.name) + "\", \"id\": " + std::to_string(sample.id);
+        for (u64 counter = 0; counter < kMetricCount; counter++) {
+            snprintf(field, sizeof(field), ", \"%s\": %lu", kCounterNames[counter], (unsigned long) sample.snapshot.counters[counter]);
+            result += field;
+        }
+        result += "}";
+    }
+
+    result += samples.empty() ? "]\n" : "\n]\n";
+    return result;
+}
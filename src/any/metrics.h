@@ -0,0 +1,131 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file metrics.h
+ * @author lotuspar / par0-git
+ * @brief Access counters sharded per thread
+ *
+ * Every counted object (e.g. a MemoryDevice) gets an id from metrics_register. Each
+ * thread counts into its own shard, so counting is a plain load / add / store without
+ * atomic read-modify-write or shared cache lines. metrics_collect sums every shard.
+ *
+ * Counting only happens if SASM_METRICS is defined, otherwise sasm_metric compiles to
+ * nothing. Snapshots and exports still work but only contain zeros.
+ */
+
+#pragma once
+
+#include "number.h" // u*
+#include <string> // std::string
+#include <vector> // std::vector
+
+namespace sasm {
+    /**
+     * @brief Counters kept for every id
+     */
+    enum MetricCounter {
+        kMetricReads = 0, // "kMetricReads" Read operations
+        kMetricWrites = 1, // "kMetricWrites" Write operations
+        kMetricBytesRead = 2, // "kMetricBytesRead" Bytes read
+        kMetricBytesWritten = 3, // "kMetricBytesWritten" Bytes written
+        kMetricCrossings = 4, // "kMetricCrossings" Operations spanning more than one device
+        kMetricCacheHits = 5, // "kMetricCacheHits" Translation cache hits
+        kMetricCacheMisses = 6, // "kMetricCacheMisses" Translation cache misses
+        kMetricFailures = 7, // "kMetricFailures" First failure counter, kMetricFailures + result - 1 for every failing DeviceOperationResult
+        kMetricCount = 11
+    };
+
+    struct MetricsSnapshot {
+        u64 counters[kMetricCount];
+    };
+
+    struct MetricsSample {
+        std::string name;
+        u32 id;
+        MetricsSnapshot snapshot;
+    };
+
+    // Counters of one id are stored in blocks of 2^kMetricsBlockBits ids
+    static const u64 kMetricsBlockBits = 8;
+    static const u64 kMetricsBlocks = 4096;
+    static const u32 kMetricsMaxIds = kMetricsBlocks << kMetricsBlockBits;
+    static const u32 kMetricsNone = ~((u32) 0); // Id given out when every id is used, never counted
+
+    struct MetricsBlock {
+        u64 counters[((u64) 1) << kMetricsBlockBits][kMetricCount];
+    };
+
+    /**
+     * @brief Counters of one thread, blocks are allocated the first time the thread counts an id in them
+     */
+    struct MetricsShard {
+        MetricsBlock* blocks[kMetricsBlocks] = {};
+
+        // Allocate a block, only called by the thread owning the shard
+        MetricsBlock* grow(u64 block);
+    };
+
+    // Shard of the current thread, 0x0 until the thread counts something
+    inline thread_local MetricsShard* metrics_local = 0x0;
+
+    /**
+     * @brief Get a new id to count for
+     *
+     * @return u32 Id, kMetricsNone if every id is used
+     */
+    u32 metrics_register();
+
+    /**
+     * @brief Get the shard of the current thread, creating / reusing one if needed
+     */
+    MetricsShard* metrics_shard();
+
+    /**
+     * @brief Add to a counter of an id, use sasm_metric instead so it compiles out
+     *
+     * @param id Id from metrics_register
+     * @param counter Counter to add to (MetricCounter)
+     * @param amount Amount to add
+     */
+    inline void metrics_add(u32 id, u64 counter, u64 amount) {
+        if (id >= kMetricsMaxIds)
+            return;
+
+        MetricsShard* shard = metrics_local != 0x0 ? metrics_local : metrics_shard();
+        MetricsBlock* block = __atomic_load_n(&shard->blocks[id >> kMetricsBlockBits], __ATOMIC_RELAXED);
+        if (block == 0x0)
+            block = shard->grow(id >> kMetricsBlockBits);
+
+        // Only this thread writes the shard, relaxed load / store is enough for metrics_collect
+        u64* value = &block->counters[id & ((((u64) 1) << kMetricsBlockBits) - 1)][counter];
+        __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * @brief Sum the counters of an id over every shard
+     *
+     * @param id Id from metrics_register
+     * @return MetricsSnapshot Counters, zero for unknown ids
+     */
+    MetricsSnapshot metrics_collect(u32 id);
+
+    /**
+     * @brief Format samples in the Prometheus text exposition format
+     *
+     * @param samples Samples to format
+     * @param prefix Prefix of every metric name
+     */
+    std::string metrics_prometheus(const std::vector<MetricsSample>& samples, const char* prefix = "sasm_device");
+
+    /**
+     * @brief Format samples as a JSON array
+     *
+     * @param samples Samples to format
+     */
+    std::string metrics_json(const std::vector<MetricsSample>& samples);
+}
+
+#ifdef SASM_METRICS
+    #define sasm_metric(id, counter, amount) ::sasm::metrics_add(id, counter, amount)
+#else
+    #define sasm_metric(id, counter, amount) ((void) 0)
+#endif
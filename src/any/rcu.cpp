@@ -0,0 +1,117 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file rcu.cpp
+ * @author lotuspar / par0-git
+ * @brief Reader registry / grace periods
+ */
+
+#include "rcu.h"
+#include "debug.h" // sasm_print
+#include <memory> // std::unique_ptr
+#include <mutex> // std::mutex
+#include <thread> // std::this_thread
+#include <vector> // std::vector
+
+#if defined(__linux__)
+    #include <linux/membarrier.h> // MEMBARRIER_CMD_*
+    #include <sys/syscall.h> // __NR_membarrier
+    #include <unistd.h> // syscall
+#endif
+
+using namespace sasm;
+
+namespace {
+    struct RcuRegistry {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<RcuReader>> readers; // Never freed, other threads may scan them
+        bool membarrier = false; // True if rcu_synchronize fences with membarrier
+    };
+
+    // Decides how readers / writers fence before any thread uses it
+    RcuRegistry& registry() {
+        static RcuRegistry* instance = [] {
+            RcuRegistry* result = new RcuRegistry(); // Leaked, threads can exit after static destruction
+#if defined(__linux__) && defined(__NR_membarrier)
+            long supported = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+            result->membarrier = supported > 0 && (supported & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+                syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0;
+#endif
+            rcu_reader_fence = !result->membarrier;
+            return result;
+        }();
+        return *instance;
+    }
+
+    // Gives the record back when its thread exits
+    struct RcuReaderRelease {
+        ~RcuReaderRelease() {
+            if (rcu_reader == 0x0)
+                return;
+
+            std::lock_guard<std::mutex> lock(registry().mutex);
+            rcu_reader->used = false;
+            rcu_reader = 0x0;
+        }
+    };
+
+    thread_local RcuReaderRelease reader_release;
+}
+
+RcuReader* sasm::rcu_register() {
+    RcuRegistry& instance = registry();
+    RcuReader* reader = 0x0;
+    {
+        std::lock_guard<std::mutex> lock(instance.mutex);
+        for (std::unique_ptr<RcuReader>& candidate : instance.readers) {
+            if (!candidate->used) {
+                reader = candidate.get();
+                break;
+            }
+        }
+        if (reader == 0x0) {
+            instance.readers.emplace_back(new RcuReader());
+            reader = instance.readers.back().get();
+        }
+
+        // Depth is 0 in records given back, the count of finished sections is kept
+        reader->used = true;
+    }
+
+    (void) &reader_release; // Constructs the thread's release object
+    rcu_reader = reader;
+    return reader;
+}
+
+void sasm::rcu_synchronize() {
+    if (rcu_reading()) {
+        sasm_print("Tried waiting for readers inside of a read-side section");
+        return;
+    }
+
+    RcuRegistry& instance = registry();
+
+    // Sections entered after this see everything published before
+#if defined(__linux__) && defined(__NR_membarrier)
+    if (instance.membarrier)
+        syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+    else
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#else
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+#endif
+
+    // Wait for sections running now to end, later sections of the same reader don't matter
+    std::lock_guard<std::mutex> lock(instance.mutex);
+    for (std::unique_ptr<RcuReader>& reader : instance.readers) {
+        u64 state = __atomic_load_n(&reader->state, __ATOMIC_ACQUIRE);
+        if ((state & kRcuDepthMask) == 0)
+            continue;
+
+        // Nested sections change the depth, only the count of finished sections matters
+        u64 current = state;
+        while ((current & kRcuDepthMask) != 0 && (current >> 32) == (state >> 32)) {
+            std::this_thread::yield();
+            current = __atomic_load_n(&reader->state, __ATOMIC_ACQUIRE);
+        }
+    }
+}
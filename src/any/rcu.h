@@ -0,0 +1,91 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file rcu.h
+ * @author lotuspar / par0-git
+ * @brief Read-copy-update
+ *
+ * Lets readers use shared data while writers replace it. Readers wrap their accesses in
+ * rcu_read_lock / rcu_read_unlock, writers publish a new version with an atomic pointer
+ * store and call rcu_synchronize: once it returns, no reader can still use the old
+ * version, so it can be freed.
+ *
+ * Every thread has its own reader record, entering / leaving a section is a single store
+ * to it (sections nest). On Linux rcu_synchronize orders these stores with membarrier(2), so
+ * readers don't need a fence. Without membarrier, readers run a full fence on entering.
+ */
+
+#pragma once
+
+#include "number.h" // u*
+
+namespace sasm {
+    // Nesting of sections in the low bits of RcuReader::state, the high bits count finished sections
+    static const u64 kRcuDepthMask = 0xFFFFFFFF;
+
+    struct RcuReader {
+        u64 state; // Only written by the owning thread
+        bool used; // Owned by a thread, records of exited threads are reused
+    };
+
+    // Record of the calling thread, 0x0 until its first section
+    inline thread_local RcuReader* rcu_reader = 0x0;
+
+    // True if readers have to fence, decided by rcu_register before the first section of any thread
+    inline bool rcu_reader_fence = true;
+
+    /**
+     * @brief Give the calling thread a reader record
+     *
+     * @return RcuReader* Record of the thread
+     */
+    RcuReader* rcu_register();
+
+    /**
+     * @brief Start a read-side section, published data loaded until rcu_read_unlock stays valid
+     */
+    inline void rcu_read_lock() {
+        RcuReader* reader = rcu_reader;
+        if (reader == 0x0)
+            reader = rcu_register();
+
+        u64 state = reader->state;
+        __atomic_store_n(&reader->state, state + 1, __ATOMIC_RELAXED);
+        if ((state & kRcuDepthMask) == 0 && rcu_reader_fence)
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        else
+            __atomic_signal_fence(__ATOMIC_SEQ_CST); // rcu_synchronize fences for the reader
+    }
+
+    /**
+     * @brief End a read-side section
+     */
+    inline void rcu_read_unlock() {
+        RcuReader* reader = rcu_reader;
+        u64 state = reader->state;
+
+        // Leaving the outermost section starts the next one
+        u64 next = (state & kRcuDepthMask) == 1 ? (state | kRcuDepthMask) + 1 : state - 1;
+        __atomic_store_n(&reader->state, next, __ATOMIC_RELEASE);
+    }
+
+    // True if the calling thread is in a read-side section
+    inline bool rcu_reading() {
+        return rcu_reader != 0x0 && (rcu_reader->state & kRcuDepthMask) != 0;
+    }
+
+    /**
+     * @brief Wait until every read-side section running when called has ended
+     *
+     * Can't be called inside a read-side section (see rcu_reading), it would wait for itself.
+     */
+    void rcu_synchronize();
+
+    // Read-side section for the lifetime of the object
+    struct RcuReadGuard {
+        RcuReadGuard() { rcu_read_lock(); }
+        ~RcuReadGuard() { rcu_read_unlock(); }
+
+        RcuReadGuard(const RcuReadGuard&) = delete;
+        RcuReadGuard& operator=(const RcuReadGuard&) = delete;
+    };
+}
@@ -0,0 +1,311 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file trace.cpp
+ * @author lotuspar / par0-git
+ * @brief Trace rings, drain thread and trace file output
+ */
+
+#include "trace.h"
+#include <chrono> // std::chrono
+#include <condition_variable> // std::condition_variable
+#include <memory> // std::unique_ptr
+#include <mutex> // std::mutex
+#include <string> // std::string
+#include <thread> // std::thread
+#include <vector> // std::vector
+#include <stdio.h> // FILE, fwrite, fread
+#include <string.h> // memcpy, memcmp
+
+using namespace sasm;
+
+namespace {
+    struct TraceRegistry {
+        std::mutex mutex; // Guards everything except the ring contents
+        std::vector<std::unique_ptr<TraceRing>> rings; // Every ring ever created, drained in order
+        std::vector<TraceRing*> unused; // Rings of exited threads
+        std::vector<std::string> names; // Name of every id
+        std::vector<u32> renamed; // Ids named since the last drain
+        u64 ring_events = 1 << 16;
+
+        // Drain thread
+        FILE* file = 0x0;
+        std::thread drain;
+        std::condition_variable wake;
+        bool stopping = false;
+        u64 interval = 10;
+        std::vector<u64> reported; // Dropped events already written, per ring
+    };
+
+    // Clock value of trace_start, read by every recording thread
+    u64 trace_origin = 0;
+
+    u64 clock_now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // Never destroyed, threads can exit after static destructors ran
+    TraceRegistry& registry() {
+        static TraceRegistry* instance = new TraceRegistry();
+        return *instance;
+    }
+
+    // Gives the ring back when the thread exits
+    struct TraceRingOwner {
+        TraceRing* ring = 0x0;
+        ~TraceRingOwner() {
+            if (ring == 0x0)
+                return;
+
+            TraceRegistry& trace = registry();
+            std::lock_guard<std::mutex> lock(trace.mutex);
+            trace.unused.push_back(ring);
+            trace_local = 0x0;
+        }
+    };
+
+    thread_local TraceRingOwner ring_owner;
+
+    void write_name(TraceRegistry& trace, u32 id) {
+        const std::string& name = trace.names[id];
+        u8 kind = kTraceRecordName;
+        u16 length = name.size() > 0xFFFF ? 0xFFFF : (u16) name.size();
+        fwrite(&kind, 1, 1, trace.file);
+        fwrite(&id, sizeof(id), 1, trace.file);
+        fwrite(&length, sizeof(length), 1, trace.file);
+        fwrite(name.data(), 1, length, trace.file);
+    }
+
+    /**
+     * Empty every ring into the trace file, has to hold the registry mutex. Only the
+     * drain thread (or trace_stop once it joined) calls this, so it is the only consumer.
+     */
+    void drain_rings(TraceRegistry& trace) {
+        for (u32 id : trace.renamed)
+            write_name(trace, id);
+        trace.renamed.clear();
+
+        trace.reported.resize(trace.rings.size(), 0);
+        for (u64 i = 0; i < trace.rings.size(); i++) {
+            TraceRing& ring = *trace.rings[i];
+            u64 head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+            u64 tail = ring.tail;
+
+            if (head != tail) {
+                u8 kind = kTraceRecordEvents;
+                u32 count = head - tail;
+                fwrite(&kind, 1, 1, trace.file);
+                fwrite(&ring.thread, sizeof(ring.thread), 1, trace.file);
+                fwrite(&count, sizeof(count), 1, trace.file);
+
+                // Up to two parts, the ring can wrap around
+                u64 first = tail & ring.mask;
+                u64 first_count = ring.mask + 1 - first < count ? ring.mask + 1 - first : count;
+                fwrite(ring.events + first, sizeof(TraceEvent), first_count, trace.file);
+                fwrite(ring.events, sizeof(TraceEvent), count - first_count, trace.file);
+
+                // Recording thread can reuse the slots now
+                __atomic_store_n(&ring.tail, head, __ATOMIC_RELEASE);
+            }
+
+            u64 dropped = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+            if (dropped != trace.reported[i]) {
+                u8 kind = kTraceRecordDropped;
+                u64 amount = dropped - trace.reported[i];
+                fwrite(&kind, 1, 1, trace.file);
+                fwrite(&ring.thread, sizeof(ring.thread), 1, trace.file);
+                fwrite(&amount, sizeof(amount), 1, trace.file);
+                trace.reported[i] = dropped;
+            }
+        }
+    }
+
+    void drain_loop() {
+        TraceRegistry& trace = registry();
+        std::unique_lock<std::mutex> lock(trace.mutex);
+        while (!trace.stopping) {
+            trace.wake.wait_for(lock, std::chrono::milliseconds(trace.interval));
+            drain_rings(trace);
+        }
+    }
+}
+
+bool sasm::trace_start(const char* path, u64 ring_events, u64 interval_ms) {
+    TraceRegistry& trace = registry();
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    if (trace.file != 0x0)
+        return false;
+
+    trace.file = fopen(path, "wb");
+    if (trace.file == 0x0)
+        return false;
+
+    TraceFileHeader header = TraceFileHeader();
+    memcpy(header.magic, kTraceMagic, sizeof(header.magic));
+    header.event_size = sizeof(TraceEvent);
+    fwrite(&header, sizeof(header), 1, trace.file);
+
+    // Every name known so far
+    for (u32 id = 0; id < trace.names.size(); id++) {
+        if (!trace.names[id].empty())
+            write_name(trace, id);
+    }
+    trace.renamed.clear();
+
+    // Forget events left over from a previous trace
+    for (u64 i = 0; i < trace.rings.size(); i++) {
+        trace.rings[i]->tail = __atomic_load_n(&trace.rings[i]->head, __ATOMIC_ACQUIRE);
+        trace.reported[i] = __atomic_load_n(&trace.rings[i]->dropped, __ATOMIC_RELAXED);
+    }
+
+    u64 rounded = 2;
+    while (rounded < ring_events)
+        rounded <<= 1;
+    trace.ring_events = rounded;
+    trace.interval = interval_ms != 0 ? interval_ms : 1;
+    trace.stopping = false;
+    __atomic_store_n(&trace_origin, clock_now(), __ATOMIC_RELAXED);
+    trace.drain = std::thread(drain_loop);
+
+    __atomic_store_n(&trace_running, true, __ATOMIC_RELEASE);
+    return true;
+}
+
+void sasm::trace_stop() {
+    TraceRegistry& trace = registry();
+    {
+        std::lock_guard<std::mutex> lock(trace.mutex);
+        if (trace.file == 0x0)
+            return;
+
+        __atomic_store_n(&trace_running, false, __ATOMIC_RELEASE);
+        trace.stopping = true;
+        trace.wake.notify_all();
+    }
+    trace.drain.join();
+
+    // Events recorded while stopping
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    drain_rings(trace);
+    fclose(trace.file);
+    trace.file = 0x0;
+}
+
+u32 sasm::trace_register() {
+    TraceRegistry& trace = registry();
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    if (trace.names.size() >= kTraceNone)
+        return kTraceNone;
+
+    trace.names.emplace_back();
+    return trace.names.size() - 1;
+}
+
+void sasm::trace_name(u32 id, const char* name, u64 length) {
+    TraceRegistry& trace = registry();
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    if (id >= trace.names.size())
+        return;
+
+    trace.names[id].assign(name, length);
+    if (trace.file != 0x0)
+        trace.renamed.push_back(id);
+}
+
+TraceRing* sasm::trace_ring() {
+    if (trace_local != 0x0)
+        return trace_local;
+
+    TraceRegistry& trace = registry();
+    std::lock_guard<std::mutex> lock(trace.mutex);
+    if (!trace.unused.empty()) {
+        trace_local = trace.unused.back();
+        trace.unused.pop_back();
+    } else {
+        TraceRing* ring = new TraceRing();
+        ring->events = new TraceEvent[trace.ring_events];
+        ring->mask = trace.ring_events - 1;
+        ring->thread = trace.rings.size();
+        trace.rings.emplace_back(ring);
+        trace.reported.push_back(0);
+        trace_local = ring;
+    }
+
+    ring_owner.ring = trace_local;
+    return trace_local;
+}
+
+u64 sasm::trace_time() {
+    return clock_now() - __atomic_load_n(&trace_origin, __ATOMIC_RELAXED);
+}
+
+u8 sasm::trace_read(const char* path, TraceVisitor& visitor) {
+    FILE* file = fopen(path, "rb");
+    if (file == 0x0)
+        return kTraceReadOpenFailed;
+
+    TraceFileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, kTraceMagic, sizeof(kTraceMagic)) != 0 ||
+        header.event_size != sizeof(TraceEvent)) {
+        fclose(file);
+        return kTraceReadBadHeader;
+    }
+
+    u8 result = kTraceReadSuccess;
+    std::vector<TraceEvent> events;
+    u8 kind = 0;
+    while (result == kTraceReadSuccess && fread(&kind, 1, 1, file) == 1) {
+        switch (kind) {
+            case kTraceRecordEvents: {
+                u32 thread = 0, count = 0;
+                if (fread(&thread, sizeof(thread), 1, file) != 1 || fread(&count, sizeof(count), 1, file) != 1) {
+                    result = kTraceReadTruncated;
+                    break;
+                }
+
+                events.resize(count);
+                if (fread(events.data(), sizeof(TraceEvent), count, file) != count) {
+                    result = kTraceReadTruncated;
+                    break;
+                }
+
+                for (const TraceEvent& event : events)
+                    visitor.event(thread, event);
+                break;
+            }
+            case kTraceRecordName: {
+                u32 id = 0;
+                u16 length = 0;
+                if (fread(&id, sizeof(id), 1, file) != 1 || fread(&length, sizeof(length), 1, file) != 1) {
+                    result = kTraceReadTruncated;
+                    break;
+                }
+
+                std::string name(length, '\0');
+                if (length != 0 && fread(&name[0], 1, length, file) != length) {
+                    result = kTraceReadTruncated;
+                    break;
+                }
+
+                visitor.name(id, name);
+                break;
+            }
+            case kTraceRecordDropped: {
+                u32 thread = 0;
+                u64 amount = 0;
+                if (fread(&thread, sizeof(thread), 1, file) != 1 || fread(&amount, sizeof(amount), 1, file) != 1) {
+                    result = kTraceReadTruncated;
+                    break;
+                }
+
+                visitor.dropped(thread, amount);
+                break;
+            }
+            default:
+                result = kTraceReadUnknownRecord;
+                break;
+        }
+    }
+
+    fclose(file);
+    return result;
+}
@@ -0,0 +1,193 @@
+/**
+ * SemiAssembly / sasm shared code
+ * @file trace.h
+ * @author lotuspar / par0-git
+ * @brief Binary event tracing into per-thread ring buffers
+ *
+ * Every thread records fixed-size TraceEvents into its own single-producer ring, so
+ * recording is a few stores and never takes a lock or does I/O. A drain thread started
+ * by trace_start empties the rings into a trace file every few milliseconds. Events
+ * are dropped (and counted) if a ring is full.
+ *
+ * Recording only happens if SASM_TRACE is defined, otherwise sasm_trace compiles to
+ * nothing. trace_read parses trace files, tools/trace_decode turns them into text /
+ * Chrome trace JSON.
+ *
+ * File layout: a TraceFileHeader, then records starting with a u8 TraceRecordKind.
+ *  kTraceRecordEvents: u32 thread, u32 count, count * TraceEvent
+ *  kTraceRecordName: u32 id, u16 length, length bytes of the name
+ *  kTraceRecordDropped: u32 thread, u64 amount of events dropped
+ */
+
+#pragma once
+
+#include "number.h" // u*, vptr
+#include <string> // std::string
+
+namespace sasm {
+    /**
+     * @brief Traced operations
+     */
+    enum TraceOperation {
+        kTraceRead = 0,
+        kTraceWrite = 1,
+        kTraceFill = 2,
+        kTraceMove = 3,
+        kTraceCompare = 4,
+        kTraceAtomic = 5,
+        kTraceView = 6,
+        kTraceRemap = 7, // size is the amount of devices
+        kTraceOperationCount = 8
+    };
+
+    enum TraceRecordKind {
+        kTraceRecordEvents = 1,
+        kTraceRecordName = 2,
+        kTraceRecordDropped = 3
+    };
+
+    struct TraceEvent {
+        u64 timestamp; // Nanoseconds since trace_start
+        vptr address;
+        u32 size;
+        u32 device; // Id from trace_register
+        u8 operation; // TraceOperation
+        u8 result; // DeviceOperationResult
+        u8 reserved[6];
+    };
+    static_assert(sizeof(TraceEvent) == 32, "TraceEvent should stay 32 bytes");
+
+    struct TraceFileHeader {
+        char magic[8]; // "SASMTRC1"
+        u32 event_size; // sizeof(TraceEvent)
+        u32 reserved;
+    };
+
+    /**
+     * @brief Results of trace_read
+     */
+    enum TraceReadResult {
+        kTraceReadSuccess = 0,
+        kTraceReadOpenFailed = 1, // File couldn't be opened
+        kTraceReadBadHeader = 2, // Not a trace file, or one written with another TraceEvent layout
+        kTraceReadTruncated = 3, // File ends inside a record
+        kTraceReadUnknownRecord = 4 // Record kind isn't a TraceRecordKind
+    };
+
+    /**
+     * @brief Receives the records of a trace file from trace_read, in file order
+     */
+    struct TraceVisitor {
+        virtual ~TraceVisitor() {}
+        virtual void event(u32 /* thread */, const TraceEvent& /* event */) {}
+        virtual void name(u32 /* id */, const std::string& /* name */) {}
+        virtual void dropped(u32 /* thread */, u64 /* amount */) {}
+    };
+
+    static const char kTraceMagic[8] = { 'S', 'A', 'S', 'M', 'T', 'R', 'C', '1' };
+    static const u32 kTraceNone = ~((u32) 0); // Id of objects created while ids ran out
+
+    /**
+     * @brief Single-producer / single-consumer ring of events
+     */
+    struct TraceRing {
+        alignas(64) u64 head = 0; // Written by the recording thread
+        alignas(64) u64 tail = 0; // Written by the drain thread
+        u64 dropped = 0; // Written by the recording thread
+        u64 mask = 0;
+        TraceEvent* events = 0x0;
+        u32 thread = 0; // Index of the ring, used as thread id in the trace
+    };
+
+    // True while a trace is running, checked before recording
+    inline bool trace_running = false;
+
+    // Ring of the current thread, 0x0 until the thread records something
+    inline thread_local TraceRing* trace_local = 0x0;
+
+    /**
+     * @brief Start tracing into a file, the file is overwritten
+     *
+     * @param path Path of the trace file
+     * @param ring_events Events per thread ring (power of two) for rings created by this trace
+     * @param interval_ms Time between drains
+     * @return bool False if a trace is running or the file couldn't be opened
+     */
+    bool trace_start(const char* path, u64 ring_events = 1 << 16, u64 interval_ms = 10);
+
+    /**
+     * @brief Stop tracing, drain every ring and close the file
+     */
+    void trace_stop();
+
+    /**
+     * @brief Get an id for an object events are recorded for
+     *
+     * @return u32 Id, kTraceNone if ids ran out
+     */
+    u32 trace_register();
+
+    /**
+     * @brief Name an id in trace files, names are written when they change and at trace_start
+     *
+     * @param id Id from trace_register
+     * @param name Name, copied
+     * @param length Length of the name
+     */
+    void trace_name(u32 id, const char* name, u64 length);
+
+    /**
+     * @brief Get the ring of the current thread, creating / reusing one if needed
+     */
+    TraceRing* trace_ring();
+
+    // Nanoseconds since trace_start
+    u64 trace_time();
+
+    /**
+     * @brief Read a trace file written by trace_start
+     *
+     * Records before a failure are still passed to the visitor.
+     *
+     * @param path Path of the trace file
+     * @param visitor Visitor receiving every record
+     * @return u8 TraceReadResult
+     */
+    u8 trace_read(const char* path, TraceVisitor& visitor);
+
+    /**
+     * @brief Record an event, use sasm_trace instead so it compiles out
+     *
+     * @param device Id from trace_register
+     * @param operation Traced operation (TraceOperation)
+     * @param address Address of the operation
+     * @param size Size of the operation
+     * @param result Result of the operation (DeviceOperationResult)
+     */
+    inline void trace_record(u32 device, u8 operation, vptr address, u64 size, u8 result) {
+        TraceRing* ring = trace_local != 0x0 ? trace_local : trace_ring();
+        u64 head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+        // Full, the drain thread is behind
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask) {
+            __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+            return;
+        }
+
+        ring->events[head & ring->mask] = TraceEvent {
+            trace_time(), address, size > 0xFFFFFFFF ? 0xFFFFFFFF : (u32) size, device, operation, result, {}
+        };
+
+        // Event has to be visible before the drain thread sees the new head
+        __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+#ifdef SASM_TRACE
+    #define sasm_trace(device, operation, address, size, result) \
+        do { if (__atomic_load_n(&::sasm::trace_running, __ATOMIC_RELAXED)) ::sasm::trace_record(device, operation, address, size, result); } while (0)
+    #define sasm_trace_name(device, name, length) ::sasm::trace_name(device, name, length)
+#else
+    #define sasm_trace(device, operation, address, size, result) ((void) 0)
+    #define sasm_trace_name(device, name, length) ((void) 0)
+#endif
@@ -0,0 +1,373 @@
+/**
+ * SemiAssembly / sasm assembler code
+ * @file assembler.cpp
+ * @author lotuspar / par0-git
+ * @brief Assembler
+ */
+
+#include "assembler.h"
+#include "../any/hash.h" // hash_bytes
+#include <stdio.h> // FILE
+#include <string.h> // memcpy, memchr
+#include <thread> // std::thread
+
+using namespace sasm;
+using namespace sasm::as;
+
+namespace {
+    /**
+     * @brief Run body(0) ... body(count - 1) on up to "threads" threads
+     *
+     * @param threads Amount of threads, 0 for one per core
+     */
+    template <class F>
+    void parallel_for(u64 count, u32 threads, F body) {
+        u64 workers = threads != 0 ? threads : std::thread::hardware_concurrency();
+        workers = workers < count ? workers : count;
+
+        u64 next = 0;
+        auto run = [&] {
+            u64 index;
+            while ((index = __atomic_fetch_add(&next, 1, __ATOMIC_RELAXED)) < count)
+                body(index);
+        };
+
+        std::vector<std::thread> pool;
+        for (u64 i = 1; i < workers; i++)
+            pool.emplace_back(run);
+        run();
+        for (std::thread& thread : pool)
+            thread.join();
+    }
+
+    bool read_file(const std::string& path, std::string& output) {
+        FILE* file = fopen(path.c_str(), "rb");
+        if (file == 0x0)
+            return false;
+
+        bool ok = fseek(file, 0, SEEK_END) == 0;
+        long size = ok ? ftell(file) : -1;
+        ok = size >= 0 && fseek(file, 0, SEEK_SET) == 0;
+        if (ok) {
+            output.resize(size);
+            ok = size == 0 || fread(&output[0], 1, size, file) == (u64) size;
+        }
+        fclose(file);
+        return ok;
+    }
+
+    u64 align_up(u64 value, u64 alignment) {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+}
+
+void Assembler::add_file(const char* path) {
+    units.emplace_back();
+    units.back().name = path;
+    units.back().file = true;
+}
+
+void Assembler::add_source(const char* name, const std::string& text) {
+    units.emplace_back();
+    units.back().name = name;
+    units.back().file = false;
+    units.back().source = text;
+}
+
+bool Assembler::update_source(const char* name, const std::string& text) {
+    for (Unit& unit : units) {
+        if (!unit.file && unit.name == name) {
+            unit.source = text;
+            return true;
+        }
+    }
+    return false;
+}
+
+void Assembler::clear() {
+    units.clear();
+    globals.clear();
+    error_list.clear();
+    stats = AssemblerStats();
+}
+
+void Assembler::prepare(Unit& unit) {
+    unit.origin = kUnitFailed;
+    unit.errors.clear();
+    unit.ranges.clear();
+
+    if (unit.file && !read_file(unit.name, unit.source)) {
+        unit.assembled = false;
+        unit.errors.push_back(AssemblerError { unit.name, 0, "Failed to read file" });
+        return;
+    }
+
+    // Check if the current object is still valid, otherwise look for a cached one
+    u64 hash = hash_bytes(unit.source.data(), unit.source.size());
+    if (unit.assembled && hash == unit.hash && unit.source.size() == unit.size) {
+        unit.origin = kUnitReused;
+    } else {
+        unit.hash = hash;
+        unit.size = unit.source.size();
+        unit.assembled = cache.load(unit.hash, unit.size, unit.object);
+        if (unit.assembled)
+            unit.origin = kUnitCached;
+    }
+
+    if (unit.assembled) {
+        if (unit.file)
+            std::string().swap(unit.source);
+        return;
+    }
+
+    // Chunks end after a line break, so lines are never split
+    const char* text = unit.source.data();
+    u64 size = unit.source.size();
+    u64 begin = 0;
+    do {
+        u64 end = size;
+        if (size - begin > kChunkSize) {
+            const char* newline = (const char*) memchr(text + begin + kChunkSize, '\n', size - begin - kChunkSize);
+            end = newline != 0x0 ? newline - text + 1 : size;
+        }
+        unit.ranges.push_back(std::make_pair(begin, end - begin));
+        begin = end;
+    } while (begin < size);
+    unit.chunks.resize(unit.ranges.size());
+}
+
+void Assembler::merge(Unit& unit) {
+    ObjectFile& object = unit.object;
+    object = ObjectFile();
+
+    std::unordered_map<std::string, u32> names;
+    std::vector<u64> definitions; // Index into object.symbols + 1 by name, 0 if undefined
+    std::vector<ObjectSymbol> exports;
+    std::vector<u32> remap;
+    u64 first_line = 1;
+
+    for (ParsedChunk& chunk : unit.chunks) {
+        u64 line_offset = first_line - 1;
+
+        // Chunks have their own name indices
+        remap.resize(chunk.names.size());
+        for (u64 i = 0; i < chunk.names.size(); i++) {
+            auto inserted = names.emplace(chunk.names[i], (u32) object.names.size());
+            if (inserted.second) {
+                object.names.push_back(chunk.names[i]);
+                definitions.push_back(0);
+            }
+            remap[i] = inserted.first->second;
+        }
+
+        for (ParsedPiece& piece : chunk.pieces) {
+            object.alignment = object.alignment > piece.alignment ? object.alignment : piece.alignment;
+            u64 base = align_up(object.code.size(), piece.alignment);
+            object.code.resize(base, 0); // Padding runs as nop
+            object.code.insert(object.code.end(), piece.writer.bytes.begin(), piece.writer.bytes.end());
+
+            for (ObjectSymbol symbol : piece.symbols) {
+                symbol.name = remap[symbol.name];
+                symbol.offset += base;
+                symbol.line += line_offset;
+                if (definitions[symbol.name] != 0) {
+                    unit.errors.push_back(AssemblerError { unit.name, symbol.line, "Label \"" + object.names[symbol.name] + "\" is defined twice" });
+                    continue;
+                }
+                definitions[symbol.name] = object.symbols.size() + 1;
+                object.symbols.push_back(symbol);
+            }
+
+            for (ObjectRelocation relocation : piece.relocations) {
+                relocation.name = remap[relocation.name];
+                relocation.offset += base;
+                relocation.line += line_offset;
+                object.relocations.push_back(relocation);
+            }
+        }
+
+        for (ObjectSymbol symbol : chunk.exports) {
+            symbol.name = remap[symbol.name];
+            symbol.line += line_offset;
+            exports.push_back(symbol);
+        }
+
+        for (AssemblerError& error : chunk.errors) {
+            error.file = unit.name;
+            error.line += line_offset;
+            unit.errors.push_back(std::move(error));
+        }
+
+        first_line += chunk.lines;
+    }
+
+    for (const ObjectSymbol& symbol : exports) {
+        if (definitions[symbol.name] == 0)
+            unit.errors.push_back(AssemblerError { unit.name, symbol.line, "Exported symbol \"" + object.names[symbol.name] + "\" isn't defined" });
+        else
+            object.symbols[definitions[symbol.name] - 1].global = 1;
+    }
+
+    unit.chunks.clear();
+    unit.ranges.clear();
+    unit.assembled = unit.errors.empty();
+    if (unit.assembled) {
+        unit.origin = kUnitParsed;
+        cache.store(unit.hash, unit.size, object);
+    }
+    if (unit.file)
+        std::string().swap(unit.source);
+}
+
+bool Assembler::assemble() {
+    error_list.clear();
+    stats = AssemblerStats();
+    stats.units = units.size();
+
+    parallel_for(units.size(), threads, [this](u64 i) { prepare(units[i]); });
+
+    // Every chunk of every changed unit is one job
+    std::vector<std::pair<Unit*, u64>> jobs;
+    std::vector<Unit*> changed;
+    for (Unit& unit : units) {
+        if (!unit.chunks.empty())
+            changed.push_back(&unit);
+        for (u64 c = 0; c < unit.chunks.size(); c++)
+            jobs.push_back(std::make_pair(&unit, c));
+    }
+    stats.chunks = jobs.size();
+
+    parallel_for(jobs.size(), threads, [&jobs](u64 i) {
+        Unit& unit = *jobs[i].first;
+        const std::pair<u64, u64>& range = unit.ranges[jobs[i].second];
+        parse_chunk(unit.source.data() + range.first, range.second, unit.chunks[jobs[i].second]);
+    });
+
+    parallel_for(changed.size(), threads, [this, &changed](u64 i) { merge(*changed[i]); });
+
+    for (Unit& unit : units) {
+        stats.parsed += unit.origin == kUnitParsed;
+        stats.cached += unit.origin == kUnitCached;
+        stats.reused += unit.origin == kUnitReused;
+        error_list.insert(error_list.end(), unit.errors.begin(), unit.errors.end());
+    }
+    return error_list.empty();
+}
+
+void Assembler::relocate(Unit& unit, u8* output, vptr base) {
+    const ObjectFile& object = unit.object;
+    u8* code = output + unit.base;
+    if (!object.code.empty())
+        memcpy(code, object.code.data(), object.code.size());
+
+    // Offset into "user" of every name, own labels first
+    std::vector<u64> values(object.names.size());
+    std::vector<u8> found(object.names.size(), 0);
+    for (const ObjectSymbol& symbol : object.symbols) {
+        values[symbol.name] = unit.base + symbol.offset;
+        found[symbol.name] = 1;
+    }
+    for (u64 i = 0; i < object.names.size(); i++) {
+        if (found[i])
+            continue;
+        auto global = globals.find(object.names[i]);
+        if (global != globals.end()) {
+            values[i] = global->second.offset;
+            found[i] = 1;
+        }
+    }
+
+    for (const ObjectRelocation& relocation : object.relocations) {
+        if (!found[relocation.name]) {
+            unit.errors.push_back(AssemblerError { unit.name, relocation.line, "Undefined symbol \"" + object.names[relocation.name] + "\"" });
+            continue;
+        }
+
+        u64 value = values[relocation.name] + relocation.addend;
+        switch (relocation.kind) {
+            case kRelocationTarget32: {
+                if (value > 0xFFFFFFFF) {
+                    unit.errors.push_back(AssemblerError { unit.name, relocation.line, "Target outside of \"user\"" });
+                    break;
+                }
+                u32 target = value;
+                memcpy(code + relocation.offset, &target, 4);
+                break;
+            }
+            case kRelocationAddress32: {
+                i64 address = (i64) (value + base);
+                if (address < INT32_MIN || address > INT32_MAX) {
+                    unit.errors.push_back(AssemblerError { unit.name, relocation.line, "Address doesn't fit in 32 bits, use movq" });
+                    break;
+                }
+                i32 immediate = address;
+                memcpy(code + relocation.offset, &immediate, 4);
+                break;
+            }
+            case kRelocationAddress64: {
+                u64 address = value + base;
+                memcpy(code + relocation.offset, &address, 8);
+                break;
+            }
+        }
+    }
+}
+
+bool Assembler::link(std::vector<u8>& output, vptr base) {
+    error_list.clear();
+    globals.clear();
+    output.clear();
+
+    // Place every object at its alignment
+    u64 size = 0;
+    for (Unit& unit : units) {
+        unit.errors.clear();
+        if (!unit.assembled) {
+            error_list.push_back(AssemblerError { unit.name, 0, "File isn't assembled" });
+            continue;
+        }
+        unit.base = align_up(size, unit.object.alignment);
+        size = unit.base + unit.object.code.size();
+    }
+    if (!error_list.empty())
+        return false;
+
+    for (u64 i = 0; i < units.size(); i++) {
+        const ObjectFile& object = units[i].object;
+        for (const ObjectSymbol& symbol : object.symbols) {
+            if (!symbol.global)
+                continue;
+
+            auto inserted = globals.emplace(object.names[symbol.name], GlobalSymbol { units[i].base + symbol.offset, i });
+            if (!inserted.second) {
+                error_list.push_back(AssemblerError { units[i].name, symbol.line, "Symbol \"" + object.names[symbol.name] +
+                    "\" is already defined in " + units[inserted.first->second.unit].name });
+            }
+        }
+    }
+    if (!error_list.empty())
+        return false;
+
+    // Objects don't overlap, padding between them stays zero (nop)
+    output.resize(size, 0);
+    u8* code = output.data();
+    parallel_for(units.size(), threads, [this, code, base](u64 i) { relocate(units[i], code, base); });
+
+    for (Unit& unit : units)
+        error_list.insert(error_list.end(), unit.errors.begin(), unit.errors.end());
+    if (!error_list.empty()) {
+        output.clear();
+        return false;
+    }
+
+    stats.code_bytes = size;
+    return true;
+}
+
+bool Assembler::symbol(const char* name, u64& offset) {
+    auto found = globals.find(name);
+    if (found == globals.end())
+        return false;
+    offset = found->second.offset;
+    return true;
+}
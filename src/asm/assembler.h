@@ -0,0 +1,157 @@
+/**
+ * SemiAssembly / sasm assembler code
+ * @file assembler.h
+ * @author lotuspar / par0-git
+ * @brief Assembling / linking SemiAssembly programs
+ *
+ * Building is split in two steps:
+ *  - assemble() turns every source file into an ObjectFile (see parser.h). Files and
+ *    chunks of large files are parsed in parallel. Files that didn't change since the
+ *    previous assemble() are kept, others are looked up in the ObjectCache by the hash of
+ *    their contents before parsing them.
+ *  - link() places the objects after each other (in the order they were added, execution
+ *    starts at the first one), resolves symbols and patches the relocations, in parallel
+ *    per object. Labels are looked up in their own file first, then in the .global
+ *    symbols of every file.
+ *
+ * The linked code goes into "user" as is, BytecodeImage (vm/proc/image.h) writes it to a
+ * file that can be mapped into processors.
+ */
+
+#pragma once
+
+#include "object.h" // ObjectFile, AssemblerError
+#include "parser.h" // ParsedChunk
+#include "cache.h" // ObjectCache
+#include <unordered_map> // std::unordered_map
+
+namespace sasm {
+namespace as {
+    // Files larger than this are split at line boundaries and parsed in parallel
+    static const u64 kChunkSize = 256 << 10;
+
+    struct AssemblerStats {
+        u64 units; // Source files
+        u64 parsed; // Files parsed by the last assemble()
+        u64 cached; // Files taken from the ObjectCache by the last assemble()
+        u64 reused; // Files unchanged since the previous assemble()
+        u64 chunks; // Chunks parsed by the last assemble()
+        u64 code_bytes; // Size of the last linked code
+    };
+
+    class Assembler {
+    public:
+        /**
+         * @param _threads Amount of threads used, 0 for one per core
+         */
+        Assembler(u32 _threads = 0) : threads(_threads) {}
+
+        void set_threads(u32 _threads) { threads = _threads; }
+
+        /**
+         * @brief Cache objects in a directory, see ObjectCache
+         *
+         * @param directory Path of the directory, 0x0 / "" disables the cache
+         * @return true if the directory can be used
+         */
+        bool set_cache(const char* directory) { return cache.init(directory); }
+
+        /**
+         * @brief Add a source file, read on every assemble()
+         *
+         * @param path Path of the file
+         */
+        void add_file(const char* path);
+
+        /**
+         * @brief Add source held in memory
+         *
+         * @param name Name used in errors
+         * @param text Source
+         */
+        void add_source(const char* name, const std::string& text);
+
+        // Replace the source of a unit added by add_source
+        bool update_source(const char* name, const std::string& text);
+
+        // Forget every file / object
+        void clear();
+
+        /**
+         * @brief Assemble every file that changed
+         *
+         * @return true if every file assembled, see errors() otherwise
+         */
+        bool assemble();
+
+        /**
+         * @brief Link the assembled files
+         *
+         * @param output [OUT] Code for "user"
+         * @param base Container address of "user" (BaseProcessor::user_base), added to symbols used as addresses
+         * @return true on success, see errors() otherwise
+         */
+        bool link(std::vector<u8>& output, vptr base = 0);
+
+        // assemble() and link()
+        bool build(std::vector<u8>& output, vptr base = 0) { return assemble() && link(output, base); }
+
+        /**
+         * @brief Get the offset into "user" of a .global symbol, after link()
+         *
+         * @param name Name of the symbol
+         * @param offset [OUT] Offset of the symbol
+         * @return true if the symbol exists
+         */
+        bool symbol(const char* name, u64& offset);
+
+        // Errors of the last assemble() / link()
+        const std::vector<AssemblerError>& errors() { return error_list; }
+        AssemblerStats statistics() { return stats; }
+    private:
+        // Where the object of a unit came from
+        enum UnitOrigin {
+            kUnitFailed = 0,
+            kUnitParsed = 1,
+            kUnitCached = 2,
+            kUnitReused = 3
+        };
+
+        struct Unit {
+            std::string name; // Path, or name given to add_source
+            bool file;
+            std::string source; // Contents, files only keep them while assembling
+            u64 hash = 0;
+            u64 size = 0;
+            bool assembled = false; // True if object matches hash / size
+            u8 origin = 0; // UnitOrigin of the last assemble()
+            ObjectFile object;
+            std::vector<std::pair<u64, u64>> ranges; // Offset / size of every chunk to parse
+            std::vector<ParsedChunk> chunks;
+            std::vector<AssemblerError> errors;
+            u64 base = 0; // Offset into "user" after link()
+        };
+
+        struct GlobalSymbol {
+            u64 offset;
+            u64 unit;
+        };
+
+        std::vector<Unit> units;
+        ObjectCache cache;
+        u32 threads;
+        std::unordered_map<std::string, GlobalSymbol> globals; // Filled by link()
+        std::vector<AssemblerError> error_list;
+        AssemblerStats stats = {};
+
+        // Read / hash a unit, keep or load its object if possible, otherwise split it into chunks
+        void prepare(Unit& unit);
+
+        // Put the chunks of a unit together into its object
+        void merge(Unit& unit);
+
+        // Copy a unit into the linked code and patch its relocations
+        void relocate(Unit& unit, u8* output, vptr base);
+    };
+}
+}
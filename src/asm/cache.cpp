@@ -0,0 +1,82 @@
+/**
+ * SemiAssembly / sasm assembler code
+ * @file cache.cpp
+ * @author lotuspar / par0-git
+ * @brief ObjectCache
+ */
+
+#include "cache.h"
+#include "../any/debug.h" // sasm_*
+#include <stdio.h> // FILE, rename, snprintf
+#include <errno.h> // errno
+#include <sys/stat.h> // mkdir, stat
+#include <unistd.h> // getpid
+#include <thread> // std::this_thread
+
+using namespace sasm;
+using namespace sasm::as;
+
+bool ObjectCache::init(const char* _directory) {
+    directory.clear();
+    if (_directory == 0x0 || _directory[0] == 0)
+        return false;
+
+    struct stat info;
+    if (mkdir(_directory, 0755) != 0 && (errno != EEXIST || stat(_directory, &info) != 0 || !S_ISDIR(info.st_mode))) {
+        sasm_print("Failed to use object cache directory %s", _directory);
+        return false;
+    }
+
+    directory = _directory;
+    return true;
+}
+
+std::string ObjectCache::path(u64 source_hash) {
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.sobj", (unsigned long long) source_hash);
+    return directory + name;
+}
+
+bool ObjectCache::load(u64 source_hash, u64 source_size, ObjectFile& output) {
+    if (directory.empty())
+        return false;
+
+    FILE* file = fopen(path(source_hash).c_str(), "rb");
+    if (file == 0x0)
+        return false;
+
+    std::vector<u8> data;
+    u8 buffer[1 << 16];
+    u64 amount;
+    while ((amount = fread(buffer, 1, sizeof(buffer), file)) != 0)
+        data.insert(data.end(), buffer, buffer + amount);
+    fclose(file);
+
+    return output.deserialize(data.data(), data.size(), source_hash, source_size);
+}
+
+bool ObjectCache::store(u64 source_hash, u64 source_size, const ObjectFile& object) {
+    if (directory.empty())
+        return false;
+
+    std::vector<u8> data;
+    object.serialize(source_hash, source_size, data);
+
+    // Unique per process / thread, readers only ever see complete files
+    std::string final_path = path(source_hash);
+    std::string temporary = final_path + "." + std::to_string(getpid()) + "." +
+        std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id())) + ".tmp";
+
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == 0x0)
+        return false;
+
+    bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), final_path.c_str()) != 0) {
+        remove(temporary.c_str());
+        sasm_debug_print("Failed to store object %s", final_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,60 @@
+/**
+ * SemiAssembly / sasm assembler code
+ * @file cache.h
+ * @author lotuspar / par0-git
+ * @brief On-disk cache of assembled objects
+ *
+ * Objects are stored in a directory, one file per source keyed by the hash of its
+ * contents ("<hash>.sobj"). The object header repeats the hash and size of the source,
+ * so mismatching files are misses. Files are written next to their final name and
+ * renamed, several assemblers can share a directory.
+ */
+
+#pragma once
+
+#include "object.h" // ObjectFile
+#include <string> // std::string
+
+namespace sasm {
+namespace as {
+    class ObjectCache {
+    public:
+        ObjectCache() {}
+        ObjectCache(const char* _directory) { init(_directory); }
+
+        /**
+         * @brief Use a directory for the cache, it is created if missing
+         *
+         * @param _directory Path of the directory, 0x0 / "" disables the cache
+         * @return true if the directory can be used
+         */
+        bool init(const char* _directory);
+
+        /**
+         * @brief Find the object of a source
+         *
+         * @param source_hash hash_bytes of the source
+         * @param source_size Size of the source
+         * @param output [OUT] Cached object
+         * @return true on a cache hit
+         */
+        bool load(u64 source_hash, u64 source_size, ObjectFile& output);
+
+        /**
+         * @brief Store the object of a source
+         *
+         * @param source_hash hash_bytes of the source
+         * @param source_size Size of the source
+         * @param object Object to store
+         * @return true on success
+         */
+        bool store(u64 source_hash, u64 source_size, const ObjectFile& object);
+
+        bool enabled() { return !directory.empty(); }
+    private:
+        std::string directory;
+
+        std::string path(u64 source_hash);
+    };
+}
+}
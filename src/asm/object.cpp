@@ -0,0 +1,100 @@
+/**
+ * SemiAssembly / sasm assembler code
+ * @file object.cpp
+ * @author lotuspar / par0-git
+ * @brief ObjectFile serialization
+ */
+
+#include "object.h"
+#include <string.h> // memcpy
+
+using namespace sasm;
+using namespace sasm::as;
+
+namespace {
+    void append(std::vector<u8>& output, const void* data, u64 amount) {
+        output.insert(output.end(), (const u8*) data, (const u8*) data + amount);
+    }
+
+    struct ObjectReader {
+        const u8* data;
+        u64 size;
+        u64 position = 0;
+
+        bool read(void* output, u64 amount) {
+            if (amount > size - position)
+                return false;
+            memcpy(output, data + position, amount);
+            position += amount;
+            return true;
+        }
+    };
+}
+
+void ObjectFile::serialize(u64 source_hash, u64 source_size, std::vector<u8>& output) const {
+    ObjectHeader header = {};
+    memcpy(header.magic, kObjectMagic, sizeof(header.magic));
+    header.source_hash = source_hash;
+    header.source_size = source_size;
+    header.alignment = alignment;
+    header.name_count = names.size();
+    header.symbol_count = symbols.size();
+    header.relocation_count = relocations.size();
+    header.code_size = code.size();
+
+    output.clear();
+    append(output, &header, sizeof(header));
+    for (const std::string& name : names) {
+        u32 length = name.size();
+        append(output, &length, sizeof(length));
+        append(output, name.data(), length);
+    }
+    append(output, symbols.data(), symbols.size() * sizeof(ObjectSymbol));
+    append(output, relocations.data(), relocations.size() * sizeof(ObjectRelocation));
+    append(output, code.data(), code.size());
+}
+
+bool ObjectFile::deserialize(const u8* data, u64 size, u64 source_hash, u64 source_size) {
+    ObjectReader reader = { data, size };
+    ObjectHeader header;
+    if (!reader.read(&header, sizeof(header)) || memcmp(header.magic, kObjectMagic, sizeof(header.magic)) != 0 ||
+        header.source_hash != source_hash || header.source_size != source_size)
+        return false;
+
+    // Check if the counts fit the data before allocating
+    if (header.name_count > size / sizeof(u32) || header.symbol_count > size / sizeof(ObjectSymbol) ||
+        header.relocation_count > size / sizeof(ObjectRelocation) || header.code_size > size)
+        return false;
+
+    names.resize(header.name_count);
+    for (std::string& name : names) {
+        u32 length;
+        if (!reader.read(&length, sizeof(length)) || length > size - reader.position)
+            return false;
+        name.assign((const char*) data + reader.position, length);
+        reader.position += length;
+    }
+
+    symbols.resize(header.symbol_count);
+    relocations.resize(header.relocation_count);
+    code.resize(header.code_size);
+    if (!reader.read(symbols.data(), symbols.size() * sizeof(ObjectSymbol)) ||
+        !reader.read(relocations.data(), relocations.size() * sizeof(ObjectRelocation)) ||
+        !reader.read(code.data(), code.size()))
+        return false;
+
+    // Indices / offsets are used without checks when linking
+    for (const ObjectSymbol& symbol : symbols) {
+        if (symbol.name >= names.size() || symbol.offset > code.size())
+            return false;
+    }
+    for (const ObjectRelocation& relocation : relocations) {
+        u64 width = relocation.kind == kRelocationAddress64 ? 8 : 4;
+        if (relocation.name >= names.size() || relocation.kind > kRelocationAddress64 ||
+            relocation.offset > code.size() || width > code.size() - relocation.offset)
+            return false;
+    }
+
+    alignment = header.alignment;
+    return alignment != 0 && (alignment & (alignment - 1)) == 0;
+}
@@ -0,0 +1,95 @@
+/**
+ * SemiAssembly / sasm assembler code
+ * @file object.h
+ * @author lotuspar / par0-git
+ * @brief Assembled but unlinked translation units
+ *
+ * An ObjectFile is the bytecode of one source file with its labels and the places that
+ * still need a symbol value (relocations). Objects don't depend on other files or on
+ * where they end up, so they can be assembled in any order and cached.
+ *
+ * Serialized layout (little-endian): ObjectHeader, then names (u32 length + bytes),
+ * ObjectSymbol[symbol_count], ObjectRelocation[relocation_count] and the code.
+ */
+
+#pragma once
+
+#include "../any/number.h" // u*
+#include <string> // std::string
+#include <vector> // std::vector
+
+namespace sasm {
+namespace as {
+    /**
+     * @brief What a relocation writes
+     */
+    enum RelocationKind : u8 {
+        kRelocationTarget32 = 0, // "kRelocationTarget32" u32 offset into "user" (jump / call targets)
+        kRelocationAddress32 = 1, // "kRelocationAddress32" i32 container address (base + offset), sign extended by the instruction
+        kRelocationAddress64 = 2 // "kRelocationAddress64" u64 container address (base + offset)
+    };
+
+    struct ObjectSymbol {
+        u32 name; // Index into ObjectFile::names
+        u32 global; // 1 if other files can use the symbol (.global)
+        u64 offset; // Offset into the object code
+        u64 line; // Line of the definition
+    };
+
+    struct ObjectRelocation {
+        u64 offset; // Offset into the object code
+        i64 addend; // Added to the symbol value
+        u64 line; // Line of the reference
+        u32 name; // Index into ObjectFile::names
+        u8 kind; // RelocationKind
+        u8 reserved[3];
+    };
+
+    struct ObjectHeader {
+        char magic[8]; // "SASMOBJ1"
+        u64 source_hash; // hash_bytes of the source
+        u64 source_size;
+        u64 alignment;
+        u64 name_count;
+        u64 symbol_count;
+        u64 relocation_count;
+        u64 code_size;
+    };
+
+    static const char kObjectMagic[8] = { 'S', 'A', 'S', 'M', 'O', 'B', 'J', '1' };
+
+    struct AssemblerError {
+        std::string file;
+        u64 line; // 0 if the error isn't about a line
+        std::string message;
+    };
+
+    struct ObjectFile {
+        std::vector<u8> code;
+        std::vector<std::string> names; // Every symbol name defined / used, without duplicates
+        std::vector<ObjectSymbol> symbols;
+        std::vector<ObjectRelocation> relocations;
+        u64 alignment = 1; // The code has to start at a multiple of this (largest .align)
+
+        /**
+         * @brief Serialize the object
+         *
+         * @param source_hash Hash of the source, stored to check cache hits
+         * @param source_size Size of the source
+         * @param output [OUT] Serialized object
+         */
+        void serialize(u64 source_hash, u64 source_size, std::vector<u8>& output) const;
+
+        /**
+         * @brief Replace the object with a serialized one
+         *
+         * @param data Serialized object
+         * @param size Size of the serialized object
+         * @param source_hash Expected hash of the source
+         * @param source_size Expected size of the source
+         * @return true on success, false if the data is invalid or for another source
+         */
+        bool deserialize(const u8* data, u64 size, u64 source_hash, u64 source_size);
+    };
+}
+}
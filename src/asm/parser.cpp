@@ -0,0 +1,541 @@
+/**
+ * SemiAssembly / sasm assembler code
+ * @file parser.cpp
+ * @author lotuspar / par0-git
+ * @brief SemiAssembly parser / encoder
+ */
+
+#include "parser.h"
+#include <string_view> // std::string_view
+#include <unordered_map> // std::unordered_map
+
+using namespace sasm;
+using namespace sasm::as;
+using namespace sasm::vm;
+
+namespace {
+    typedef std::string_view Token;
+
+    // Mnemonic -> opcode, built on first use
+    const std::unordered_map<Token, u8>& mnemonics() {
+        static const std::unordered_map<Token, u8> table = [] {
+            std::unordered_map<Token, u8> result;
+            for (u8 opcode = 0; opcode < kOpcodeCount; opcode++)
+                result.emplace(opcode_mnemonic(opcode), opcode);
+            return result;
+        }();
+        return table;
+    }
+
+    bool identifier_start(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.' || c == '$'; }
+    bool identifier_char(char c) { return identifier_start(c) || (c >= '0' && c <= '9'); }
+
+    // Register name (r0 - r15) -> index, -1 if it isn't one
+    int register_index(Token name) {
+        if (name.size() < 2 || name.size() > 3 || name[0] != 'r')
+            return -1;
+
+        int index = 0;
+        for (u64 i = 1; i < name.size(); i++) {
+            if (name[i] < '0' || name[i] > '9')
+                return -1;
+            index = index * 10 + (name[i] - '0');
+        }
+        return (name.size() == 3 && name[1] == '0') || index >= kRegisterCount ? -1 : index;
+    }
+
+    /**
+     * @brief Value of an operand: a number plus at most one symbol
+     */
+    struct Expression {
+        i64 value = 0;
+        bool symbol = false;
+        Token name;
+    };
+
+    class ChunkParser {
+    public:
+        ChunkParser(ParsedChunk& _output) : output(_output) {
+            output.pieces.emplace_back();
+            piece = &output.pieces.back();
+        }
+
+        // Parse one line without its line break
+        void line(const char* begin, const char* _end, u64 _number) {
+            cursor = begin;
+            end = _end;
+            number = _number;
+            failed = false;
+
+            // Labels, then an instruction / directive
+            while (true) {
+                skip_space();
+                if (at_end())
+                    return;
+
+                Token name;
+                if (!identifier(name)) {
+                    error("Expected label, instruction or directive");
+                    return;
+                }
+
+                skip_space();
+                if (cursor < end && *cursor == ':') {
+                    cursor++;
+                    define(name);
+                    if (failed)
+                        return;
+                    continue;
+                }
+
+                if (name[0] == '.')
+                    directive(name);
+                else
+                    instruction(name);
+                break;
+            }
+
+            // Check if anything follows the operands
+            if (!failed) {
+                skip_space();
+                if (!at_end())
+                    error("Unexpected \"" + std::string(cursor, end - cursor) + "\"");
+            }
+        }
+    private:
+        ParsedChunk& output;
+        ParsedPiece* piece;
+        std::unordered_map<Token, u32> name_index; // Views into the source
+        std::vector<u8> defined; // 1 for names defined in this chunk, by name index
+
+        const char* cursor = 0x0;
+        const char* end = 0x0;
+        u64 number = 0;
+        bool failed = false;
+
+        void error(const std::string& message) {
+            if (!failed)
+                output.errors.push_back(AssemblerError { std::string(), number, message });
+            failed = true;
+        }
+
+        void skip_space() {
+            while (cursor < end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r'))
+                cursor++;
+        }
+
+        // End of the line or start of a comment
+        bool at_end() { return cursor == end || *cursor == ';'; }
+
+        bool accept(char c) {
+            skip_space();
+            if (cursor < end && *cursor == c) {
+                cursor++;
+                return true;
+            }
+            return false;
+        }
+
+        bool expect(char c) {
+            if (accept(c))
+                return true;
+            error(std::string("Expected '") + c + "'");
+            return false;
+        }
+
+        bool identifier(Token& name) {
+            skip_space();
+            if (cursor == end || !identifier_start(*cursor))
+                return false;
+
+            const char* start = cursor;
+            while (cursor < end && identifier_char(*cursor))
+                cursor++;
+            name = Token(start, cursor - start);
+            return true;
+        }
+
+        u32 intern(Token name) {
+            auto found = name_index.find(name);
+            if (found != name_index.end())
+                return found->second;
+
+            u32 index = output.names.size();
+            output.names.emplace_back(name);
+            defined.push_back(0);
+            name_index.emplace(name, index);
+            return index;
+        }
+
+        void define(Token name) {
+            if (register_index(name) >= 0) {
+                error("Register name \"" + std::string(name) + "\" used as label");
+                return;
+            }
+
+            u32 index = intern(name);
+            if (defined[index]) {
+                error("Label \"" + std::string(name) + "\" is defined twice");
+                return;
+            }
+            defined[index] = 1;
+            piece->symbols.push_back(ObjectSymbol { index, 0, piece->writer.position(), number });
+        }
+
+        void relocate(u64 offset, RelocationKind kind, const Expression& expression) {
+            piece->relocations.push_back(ObjectRelocation { offset, expression.value, number, intern(expression.name), kind, {} });
+        }
+
+        bool parse_register(u8& index) {
+            Token name;
+            int value = identifier(name) ? register_index(name) : -1;
+            if (value < 0) {
+                error("Expected register");
+                return false;
+            }
+            index = value;
+            return true;
+        }
+
+        // Character of a character / string literal, cursor is after the opening quote
+        bool literal_char(char quote, u8& value) {
+            if (cursor == end || *cursor == quote) {
+                error("Unterminated literal");
+                return false;
+            }
+
+            char c = *cursor++;
+            if (c != '\\') {
+                value = c;
+                return true;
+            }
+            if (cursor == end) {
+                error("Unterminated literal");
+                return false;
+            }
+
+            c = *cursor++;
+            switch (c) {
+                case 'n': value = '\n'; return true;
+                case 't': value = '\t'; return true;
+                case 'r': value = '\r'; return true;
+                case '0': value = 0; return true;
+                case '\\': case '\'': case '"': value = c; return true;
+                case 'x': {
+                    u8 result = 0;
+                    for (int i = 0; i < 2; i++) {
+                        char digit = cursor < end ? *cursor : 0;
+                        if (digit >= '0' && digit <= '9') result = result * 16 + (digit - '0');
+                        else if (digit >= 'a' && digit <= 'f') result = result * 16 + (digit - 'a' + 10);
+                        else if (digit >= 'A' && digit <= 'F') result = result * 16 + (digit - 'A' + 10);
+                        else {
+                            error("Expected two hex digits after \\x");
+                            return false;
+                        }
+                        cursor++;
+                    }
+                    value = result;
+                    return true;
+                }
+                default:
+                    error(std::string("Unknown escape \\") + c);
+                    return false;
+            }
+        }
+
+        bool parse_number(u64& value) {
+            if (*cursor == '\'') {
+                cursor++;
+                u8 c;
+                if (!literal_char('\'', c))
+                    return false;
+                if (cursor == end || *cursor != '\'') {
+                    error("Unterminated character literal");
+                    return false;
+                }
+                cursor++;
+                value = c;
+                return true;
+            }
+
+            u64 base = 10;
+            if (end - cursor > 2 && cursor[0] == '0' && (cursor[1] == 'x' || cursor[1] == 'X')) {
+                base = 16;
+                cursor += 2;
+            } else if (end - cursor > 2 && cursor[0] == '0' && (cursor[1] == 'b' || cursor[1] == 'B')) {
+                base = 2;
+                cursor += 2;
+            }
+
+            const char* start = cursor;
+            value = 0;
+            while (cursor < end) {
+                char c = *cursor;
+                u64 digit;
+                if (c >= '0' && c <= '9') digit = c - '0';
+                else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+                else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+                else if (c == '_') { cursor++; continue; }
+                else break;
+
+                if (digit >= base)
+                    break;
+                if (value > (~((u64) 0) - digit) / base) {
+                    error("Number doesn't fit in 64 bits");
+                    return false;
+                }
+                value = value * base + digit;
+                cursor++;
+            }
+
+            if (cursor == start || (cursor < end && identifier_char(*cursor))) {
+                error("Invalid number");
+                return false;
+            }
+            return true;
+        }
+
+        // number / symbol (+|- number / symbol)*, only one symbol which has to be added
+        bool parse_expression(Expression& expression) {
+            expression = Expression();
+            bool negative = false;
+            skip_space();
+            if (cursor < end && *cursor == '-') {
+                negative = true;
+                cursor++;
+            }
+
+            while (true) {
+                skip_space();
+                if (cursor == end) {
+                    error("Expected value");
+                    return false;
+                }
+
+                Token name;
+                if (identifier_start(*cursor) && identifier(name)) {
+                    if (register_index(name) >= 0) {
+                        error("Expected value instead of register");
+                        return false;
+                    }
+                    if (negative || expression.symbol) {
+                        error("Only one symbol can be added to a value");
+                        return false;
+                    }
+                    expression.symbol = true;
+                    expression.name = name;
+                } else {
+                    u64 value;
+                    if (!parse_number(value))
+                        return false;
+                    // Wraps like the 64-bit registers
+                    expression.value = (i64) ((u64) expression.value + (negative ? -value : value));
+                }
+
+                if (accept('+'))
+                    negative = false;
+                else if (accept('-'))
+                    negative = true;
+                else
+                    return true;
+            }
+        }
+
+        // Check if a constant fits into a field of "bits" bits, signed or unsigned
+        bool fits(const Expression& expression, u32 bits, bool allow_unsigned) {
+            if (bits == 64)
+                return true;
+
+            i64 low = -((i64) 1 << (bits - 1));
+            i64 high = allow_unsigned ? (i64) (((u64) 1 << bits) - 1) : ((i64) 1 << (bits - 1)) - 1;
+            if (expression.value >= low && expression.value <= high)
+                return true;
+
+            error("Value " + std::to_string(expression.value) + " doesn't fit in " + std::to_string(bits) + " bits");
+            return false;
+        }
+
+        void append(u64 value, u8 amount) {
+            for (u8 i = 0; i < amount; i++)
+                piece->writer.bytes.push_back((u8) (value >> (i * 8)));
+        }
+
+        // [base +/- offset]
+        bool parse_memory(u8& base, Expression& offset) {
+            if (!expect('[') || !parse_register(base))
+                return false;
+
+            offset = Expression();
+            if (accept('+')) {
+                if (!parse_expression(offset))
+                    return false;
+            } else if (accept('-')) {
+                if (!parse_expression(offset))
+                    return false;
+                if (offset.symbol) {
+                    error("Symbols can't be subtracted");
+                    return false;
+                }
+                offset.value = -offset.value;
+            }
+            return expect(']');
+        }
+
+        void instruction(Token mnemonic) {
+            auto found = mnemonics().find(mnemonic);
+            if (found == mnemonics().end()) {
+                error("Unknown instruction \"" + std::string(mnemonic) + "\"");
+                return;
+            }
+
+            u8 opcode = found->second;
+            u64 at = piece->writer.position();
+            u8 a = 0, b = 0;
+            Expression immediate;
+
+            switch (opcode_format(opcode)) {
+                case kFormatNone:
+                    break;
+                case kFormatR:
+                    if (!parse_register(a))
+                        return;
+                    break;
+                case kFormatRR:
+                    if (!parse_register(a) || !expect(',') || !parse_register(b))
+                        return;
+                    break;
+                case kFormatRI32:
+                    if (!parse_register(a) || !expect(',') || !parse_expression(immediate))
+                        return;
+                    if (immediate.symbol)
+                        relocate(at + 2, kRelocationAddress32, immediate);
+                    else if (!fits(immediate, 32, false))
+                        return;
+                    break;
+                case kFormatRI64:
+                    if (!parse_register(a) || !expect(',') || !parse_expression(immediate))
+                        return;
+                    if (immediate.symbol)
+                        relocate(at + 2, kRelocationAddress64, immediate);
+                    break;
+                case kFormatT32:
+                    if (!parse_expression(immediate))
+                        return;
+                    if (immediate.symbol)
+                        relocate(at + 1, kRelocationTarget32, immediate);
+                    else if (immediate.value < 0 || immediate.value > (i64) 0xFFFFFFFF) {
+                        error("Target " + std::to_string(immediate.value) + " is outside of \"user\"");
+                        return;
+                    }
+                    break;
+                case kFormatRRI32: {
+                    // Loads: a = destination, b = base. Stores: a = base, b = source
+                    bool store = opcode >= kOpSt8 && opcode <= kOpSt64;
+                    if (store ? !parse_memory(a, immediate) || !expect(',') || !parse_register(b) :
+                        !parse_register(a) || !expect(',') || !parse_memory(b, immediate))
+                        return;
+                    if (immediate.symbol)
+                        relocate(at + 2, kRelocationAddress32, immediate);
+                    else if (!fits(immediate, 32, false))
+                        return;
+                    break;
+                }
+            }
+
+            // Relocated fields are written when linking
+            piece->writer.emit(opcode, a, b, immediate.symbol ? 0 : (u64) immediate.value);
+        }
+
+        void directive(Token name) {
+            if (name == ".global") {
+                do {
+                    Token exported;
+                    if (!identifier(exported)) {
+                        error("Expected symbol name");
+                        return;
+                    }
+                    output.exports.push_back(ObjectSymbol { intern(exported), 1, 0, number });
+                } while (accept(','));
+            } else if (name == ".align") {
+                Expression alignment;
+                if (!parse_expression(alignment))
+                    return;
+                if (alignment.symbol || alignment.value <= 0 || alignment.value > (i64) kMaxAlignment ||
+                    (alignment.value & (alignment.value - 1)) != 0) {
+                    error("Alignment has to be a power of two up to " + std::to_string(kMaxAlignment));
+                    return;
+                }
+
+                // Padding depends on where the piece ends up, start a new one
+                if (piece->writer.bytes.empty() && piece->symbols.empty()) {
+                    piece->alignment = piece->alignment > (u64) alignment.value ? piece->alignment : alignment.value;
+                } else {
+                    output.pieces.emplace_back();
+                    piece = &output.pieces.back();
+                    piece->alignment = alignment.value;
+                }
+            } else if (name == ".byte" || name == ".u16" || name == ".u32" || name == ".u64") {
+                u8 width = name == ".byte" ? 1 : name == ".u16" ? 2 : name == ".u32" ? 4 : 8;
+                do {
+                    Expression value;
+                    if (!parse_expression(value))
+                        return;
+                    if (value.symbol) {
+                        if (width < 4) {
+                            error("Symbols need .u32 / .u64");
+                            return;
+                        }
+                        relocate(piece->writer.position(), width == 4 ? kRelocationAddress32 : kRelocationAddress64, value);
+                        append(0, width);
+                    } else {
+                        if (!fits(value, width * 8, true))
+                            return;
+                        append((u64) value.value, width);
+                    }
+                } while (accept(','));
+            } else if (name == ".zero") {
+                Expression amount;
+                if (!parse_expression(amount))
+                    return;
+                if (amount.symbol || amount.value < 0 || amount.value > ((i64) 1 << 32)) {
+                    error("Invalid .zero size");
+                    return;
+                }
+                piece->writer.bytes.resize(piece->writer.bytes.size() + amount.value, 0);
+            } else if (name == ".ascii" || name == ".asciz") {
+                if (!expect('"'))
+                    return;
+                while (cursor < end && *cursor != '"') {
+                    u8 c;
+                    if (!literal_char('"', c))
+                        return;
+                    piece->writer.bytes.push_back(c);
+                }
+                if (!expect('"'))
+                    return;
+                if (name == ".asciz")
+                    piece->writer.bytes.push_back(0);
+            } else {
+                error("Unknown directive \"" + std::string(name) + "\"");
+            }
+        }
+    };
+}
+
+void sasm::as::parse_chunk(const char* text, u64 size, ParsedChunk& output) {
+    output = ParsedChunk();
+    ChunkParser parser(output);
+
+    const char* end = text + size;
+    u64 line = 1;
+    for (const char* begin = text; begin < end; line++) {
+        const char* newline = (const char*) memchr(begin, '\n', end - begin);
+        const char* line_end = newline != 0x0 ? newline : end;
+        parser.line(begin, line_end, line);
+
+        if (newline == 0x0)
+            break;
+        begin = newline + 1;
+        output.lines++;
+    }
+}
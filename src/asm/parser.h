@@ -0,0 +1,64 @@
+/**
+ * SemiAssembly / sasm assembler code
+ * @file parser.h
+ * @author lotuspar / par0-git
+ * @brief Parsing / encoding SemiAssembly source
+ *
+ * Source is line based, ';' starts a comment:
+ *
+ *   loop:                     label, local to the file unless exported with .global
+ *       movi r1, 10           register, immediate (decimal, 0x hex, 0b binary, 'c')
+ *       ld64 r2, [r3 + 8]     loads: destination, [base +/- offset]
+ *       st64 [r3 - 8], r2     stores: [base +/- offset], source
+ *       jnz loop              targets are offsets into "user"
+ *       movq r4, table + 8    symbols in immediates are container addresses (link base + offset)
+ *
+ * Directives: .global name[, name], .align n (power of two), .byte / .u16 / .u32 / .u64
+ * values (symbols in .u32 / .u64 only), .zero n, .ascii "text", .asciz "text".
+ *
+ * Every instruction has a fixed length, so a chunk of a file can be encoded without
+ * knowing where it ends up: large files are split at line boundaries and their chunks
+ * are parsed in parallel, .align splits a chunk into pieces that are put together later.
+ */
+
+#pragma once
+
+#include "object.h" // ObjectSymbol, ObjectRelocation, AssemblerError
+#include "../vm/proc/bytecode.h" // BytecodeWriter
+
+namespace sasm {
+namespace as {
+    // Largest .align accepted, objects are placed at a multiple of their alignment
+    static const u64 kMaxAlignment = 1 << 16;
+
+    /**
+     * @brief Code between two .align directives, offsets are relative to the piece
+     */
+    struct ParsedPiece {
+        u64 alignment = 1; // Alignment of the first byte
+        vm::BytecodeWriter writer;
+        std::vector<ObjectSymbol> symbols;
+        std::vector<ObjectRelocation> relocations;
+    };
+
+    /**
+     * @brief Result of parsing a chunk of a file, lines are counted from 1 at the start of the chunk
+     */
+    struct ParsedChunk {
+        std::vector<std::string> names; // Indexed by ObjectSymbol::name / ObjectRelocation::name
+        std::vector<ParsedPiece> pieces;
+        std::vector<ObjectSymbol> exports; // .global names, offset unused
+        std::vector<AssemblerError> errors; // File not set yet
+        u64 lines = 0; // Amount of lines in the chunk
+    };
+
+    /**
+     * @brief Parse / encode source
+     *
+     * @param text Source, doesn't need to be null terminated
+     * @param size Size of the source
+     * @param output [OUT] Parsed chunk
+     */
+    void parse_chunk(const char* text, u64 size, ParsedChunk& output);
+}
+}
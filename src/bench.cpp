@@ -0,0 +1,389 @@
+/**
+ * SemiAssembly / sasm benchmarks
+ * @file bench.cpp
+ * @author lotuspar / par0-git
+ * @brief Micro-benchmarks for the memory subsystem hot paths
+ *
+ * Usage: bench [--json <file>] [--baseline <file>] [--threshold <percent>] [--filter <text>] [--time <ms>]
+ *
+ * Results are written as JSON (to stdout if no file is given). With --baseline the results
+ * are compared against a previous JSON file and the exit code is 1 if a benchmark got
+ * slower by more than the threshold (default 10%).
+ */
+
+#include "vm/device/types/pure.h"
+#include "vm/device/container.h"
+#include <chrono> // std::chrono
+#include <memory> // std::unique_ptr
+#include <string> // std::string
+#include <vector> // std::vector
+#include <stdio.h> // fprintf
+#include <stdlib.h> // strtod
+#include <string.h> // strcmp, strstr
+
+using namespace sasm::vm;
+
+struct BenchResult {
+    std::string name;
+    u64 iterations; // Iterations of the fastest run
+    double ns_per_op;
+    u64 bytes_per_op; // 0 if throughput doesn't make sense
+};
+
+struct BenchOptions {
+    const char* json = 0x0;
+    const char* baseline = 0x0;
+    const char* filter = 0x0;
+    double threshold = 10.0; // Percent
+    double time = 50.0; // Milliseconds per run
+};
+
+static BenchOptions options;
+static std::vector<BenchResult> results;
+
+// Keep the compiler from optimizing a value / memory away
+template <class T>
+static inline void keep(T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+/**
+ * @brief Time a benchmark body, the body runs the operation "iterations" times
+ *
+ * Iterations are doubled until a run takes long enough, then the fastest of three runs is kept.
+ *
+ * @param name Name of the benchmark
+ * @param bytes_per_op Bytes moved by one operation, 0 for none
+ * @param body Callable taking the amount of iterations to run
+ */
+template <class F>
+static void bench(const std::string& name, u64 bytes_per_op, F body) {
+    if (options.filter != 0x0 && strstr(name.c_str(), options.filter) == 0x0)
+        return;
+
+    using clock = std::chrono::steady_clock;
+    double target = options.time * 1e6;
+
+    // Calibrate
+    u64 iterations = 1;
+    double elapsed = 0;
+    while (true) {
+        clock::time_point start = clock::now();
+        body(iterations);
+        elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        if (elapsed >= target || iterations >= (((u64) 1) << 40))
+            break;
+
+        // Jump close to the target, at most 16x at once
+        double factor = elapsed > 0 ? target * 1.2 / elapsed : 16;
+        iterations = (u64) (iterations * (factor > 16 ? 16 : (factor < 2 ? 2 : factor)));
+    }
+
+    double best = elapsed / iterations;
+    for (int run = 0; run < 2; run++) {
+        clock::time_point start = clock::now();
+        body(iterations);
+        double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count() / iterations;
+        if (ns < best)
+            best = ns;
+    }
+
+    results.push_back({ name, iterations, best, bytes_per_op });
+    fprintf(stderr, "%-40s %12.2f ns/op", name.c_str(), best);
+    if (bytes_per_op != 0)
+        fprintf(stderr, " %10.2f MB/s", bytes_per_op / best * 1e3);
+    fprintf(stderr, "\n");
+}
+
+static void bench_pure() {
+    const u64 kMaxSize = 8 << 20;
+    PureMemoryDevice device("bench", kMaxSize);
+    std::vector<u8> buffer(kMaxSize, 0x5A);
+
+    for (u64 size = 1; size <= kMaxSize; size *= 8) {
+        bench("pure/read/" + std::to_string(size), size, [&](u64 n) {
+            for (u64 i = 0; i < n; i++) {
+                device.read(0, size, buffer.data());
+                keep(buffer[0]);
+            }
+        });
+        bench("pure/write/" + std::to_string(size), size, [&](u64 n) {
+            for (u64 i = 0; i < n; i++) {
+                device.write(0, size, buffer.data());
+                keep(buffer[0]);
+            }
+        });
+    }
+}
+
+template <class T>
+static void bench_types(MemoryDevice& device, const std::string& prefix) {
+    // Walk the first 4 KiB so accesses aren't all to the same address
+    const u64 kMask = 4096 - sizeof(T);
+    std::string width = std::to_string(sizeof(T) * 8);
+
+    bench(prefix + "/read_type/u" + width, sizeof(T), [&](u64 n) {
+        T sum = 0;
+        for (u64 i = 0; i < n; i++)
+            sum += device.read_type<T>((i * sizeof(T)) & kMask);
+        keep(sum);
+    });
+    bench(prefix + "/write_type/u" + width, sizeof(T), [&](u64 n) {
+        for (u64 i = 0; i < n; i++)
+            device.write_type<T>((i * sizeof(T)) & kMask, (T) i);
+    });
+}
+
+static void bench_typed() {
+    PureMemoryDevice device("bench", 4096);
+    bench_types<u8>(device, "pure");
+    bench_types<u16>(device, "pure");
+    bench_types<u32>(device, "pure");
+    bench_types<u64>(device, "pure");
+
+    // Same accesses through a container, served by the translation cache
+    MemoryContainer container;
+    container.handle(&device);
+    bench_types<u8>(container, "container");
+    bench_types<u16>(container, "container");
+    bench_types<u32>(container, "container");
+    bench_types<u64>(container, "container");
+}
+
+static void bench_spanning() {
+    const u64 kDevices = 64;
+    const u64 kDeviceSize = 64;
+    std::vector<std::unique_ptr<PureMemoryDevice>> devices;
+    MemoryContainer container;
+    for (u64 i = 0; i < kDevices; i++) {
+        devices.emplace_back(new PureMemoryDevice("span", kDeviceSize));
+        container.handle(devices.back().get());
+    }
+
+    // 8 bytes, 4 in each of two devices
+    bench("container/cross/u64", 8, [&](u64 n) {
+        u64 sum = 0;
+        for (u64 i = 0; i < n; i++)
+            sum += container.read_type<u64>((i % (kDevices - 1)) * kDeviceSize + kDeviceSize - 4);
+        keep(sum);
+    });
+
+    // 256 bytes over five devices
+    u8 buffer[256];
+    bench("container/cross/read/256", sizeof(buffer), [&](u64 n) {
+        for (u64 i = 0; i < n; i++) {
+            container.read((i % (kDevices - 5)) * kDeviceSize + 32, sizeof(buffer), buffer);
+            keep(buffer[0]);
+        }
+    });
+    bench("container/cross/write/256", sizeof(buffer), [&](u64 n) {
+        for (u64 i = 0; i < n; i++) {
+            container.write((i % (kDevices - 5)) * kDeviceSize + 32, sizeof(buffer), buffer);
+            keep(buffer[0]);
+        }
+    });
+}
+
+static void bench_scaling() {
+    const u64 kDeviceSize = 256;
+    const u64 kAddresses = 4096;
+
+    for (u64 count = 1; count <= 10000; count *= 10) {
+        std::vector<std::unique_ptr<PureMemoryDevice>> devices;
+        MemoryContainer container;
+        for (u64 i = 0; i < count; i++) {
+            devices.emplace_back(new PureMemoryDevice("scale", kDeviceSize));
+            container.handle(devices.back().get());
+        }
+
+        // Pseudo-random aligned addresses over the whole container
+        std::vector<vptr> addresses(kAddresses);
+        u64 random = 0x9E3779B97F4A7C15ull;
+        for (u64 i = 0; i < kAddresses; i++) {
+            random ^= random << 13;
+            random ^= random >> 7;
+            random ^= random << 17;
+            addresses[i] = (random % (container.size / 8)) * 8;
+        }
+
+        // Same device for every access
+        bench("scaling/" + std::to_string(count) + "/sequential", 8, [&](u64 n) {
+            u64 sum = 0;
+            for (u64 i = 0; i < n; i++)
+                sum += container.read_type<u64>((i * 8) % kDeviceSize);
+            keep(sum);
+        });
+
+        // Random device for every access
+        bench("scaling/" + std::to_string(count) + "/random", 8, [&](u64 n) {
+            u64 sum = 0;
+            for (u64 i = 0; i < n; i++)
+                sum += container.read_type<u64>(addresses[i % kAddresses]);
+            keep(sum);
+        });
+    }
+}
+
+static void bench_checks() {
+    PureMemoryDevice device("bench", 4096);
+    u64 value = 0;
+
+    // No lock / bounds checks at all
+    bench("checks/bare", 8, [&](u64 n) {
+        for (u64 i = 0; i < n; i++) {
+            device.bare_read((i * 8) & 4088, 8, &value);
+            keep(value);
+        }
+    });
+
+    // Lock check + bounds check (kSafe is on by default)
+    bench("checks/safe", 8, [&](u64 n) {
+        for (u64 i = 0; i < n; i++) {
+            device.read((i * 8) & 4088, 8, &value);
+            keep(value);
+        }
+    });
+
+    // Lock check only
+    device.unset(MemoryDeviceStatus::kSafe);
+    bench("checks/unsafe", 8, [&](u64 n) {
+        for (u64 i = 0; i < n; i++) {
+            device.read((i * 8) & 4088, 8, &value);
+            keep(value);
+        }
+    });
+    device.set(MemoryDeviceStatus::kSafe);
+
+    // Status flag load on its own
+    bench("checks/status", 0, [&](u64 n) {
+        u64 locked = 0;
+        for (u64 i = 0; i < n; i++)
+            locked += device.check(MemoryDeviceStatus::kReadLocked);
+        keep(locked);
+    });
+}
+
+/**
+ * @brief Write results as JSON
+ *
+ * @param file File to write to
+ */
+static void write_json(FILE* file) {
+    fprintf(file, "{\n  \"benchmarks\": [\n");
+    for (u64 i = 0; i < results.size(); i++) {
+        BenchResult& result = results[i];
+        fprintf(file, "    {\"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.4f",
+            result.name.c_str(), (unsigned long) result.iterations, result.ns_per_op);
+        if (result.bytes_per_op != 0)
+            fprintf(file, ", \"bytes_per_second\": %.0f", result.bytes_per_op / result.ns_per_op * 1e9);
+        fprintf(file, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+/**
+ * @brief Read name / ns_per_op pairs of a JSON file written by write_json
+ *
+ * @param path Path of the file
+ * @param baseline_out [OUT] Results found in the file
+ * @return bool False if the file couldn't be read
+ */
+static bool read_json(const char* path, std::vector<BenchResult>* baseline_out) {
+    FILE* file = fopen(path, "rb");
+    if (file == 0x0)
+        return false;
+
+    std::string text;
+    char chunk[4096];
+    for (size_t read = 0; (read = fread(chunk, 1, sizeof(chunk), file)) != 0;)
+        text.append(chunk, read);
+    fclose(file);
+
+    // Every benchmark is one object with a name and a ns_per_op field
+    size_t position = 0;
+    while ((position = text.find("\"name\"", position)) != std::string::npos) {
+        size_t start = text.find('"', text.find(':', position) + 1);
+        size_t end = start == std::string::npos ? start : text.find('"', start + 1);
+        size_t time = text.find("\"ns_per_op\"", position);
+        if (end == std::string::npos || time == std::string::npos)
+            break;
+
+        BenchResult result = BenchResult();
+        result.name = text.substr(start + 1, end - start - 1);
+        result.ns_per_op = strtod(text.c_str() + text.find(':', time) + 1, 0x0);
+        baseline_out->push_back(result);
+        position = end;
+    }
+    return true;
+}
+
+/**
+ * @brief Compare results against a baseline
+ *
+ * @return int Amount of benchmarks slower than the threshold allows
+ */
+static int compare_baseline() {
+    std::vector<BenchResult> baseline;
+    if (!read_json(options.baseline, &baseline)) {
+        fprintf(stderr, "Failed to read baseline %s\n", options.baseline);
+        return 1;
+    }
+
+    int regressions = 0;
+    fprintf(stderr, "\n%-40s %12s %12s %9s\n", "benchmark", "baseline", "current", "change");
+    for (BenchResult& result : results) {
+        for (BenchResult& base : baseline) {
+            if (base.name != result.name || base.ns_per_op <= 0)
+                continue;
+
+            double change = (result.ns_per_op - base.ns_per_op) / base.ns_per_op * 100.0;
+            bool regressed = change > options.threshold;
+            regressions += regressed;
+            fprintf(stderr, "%-40s %12.2f %12.2f %+8.1f%%%s\n", result.name.c_str(),
+                base.ns_per_op, result.ns_per_op, change, regressed ? "  REGRESSION" : "");
+            break;
+        }
+    }
+
+    fprintf(stderr, "%d regression(s) over %.1f%%\n", regressions, options.threshold);
+    return regressions;
+}
+
+int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--json") && has_value)
+            options.json = argv[++i];
+        else if (!strcmp(argv[i], "--baseline") && has_value)
+            options.baseline = argv[++i];
+        else if (!strcmp(argv[i], "--filter") && has_value)
+            options.filter = argv[++i];
+        else if (!strcmp(argv[i], "--threshold") && has_value)
+            options.threshold = strtod(argv[++i], 0x0);
+        else if (!strcmp(argv[i], "--time") && has_value)
+            options.time = strtod(argv[++i], 0x0);
+        else {
+            fprintf(stderr, "Usage: %s [--json <file>] [--baseline <file>] [--threshold <percent>] [--filter <text>] [--time <ms>]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    bench_pure();
+    bench_typed();
+    bench_spanning();
+    bench_scaling();
+    bench_checks();
+
+    FILE* file = options.json != 0x0 ? fopen(options.json, "wb") : stdout;
+    if (file == 0x0) {
+        fprintf(stderr, "Failed to open %s\n", options.json);
+        return 2;
+    }
+    write_json(file);
+    if (file != stdout)
+        fclose(file);
+
+    if (options.baseline != 0x0 && compare_baseline() != 0)
+        return 1;
+    return 0;
+}
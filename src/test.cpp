@@ -1,8 +1,1721 @@
 #include "vm/device/types/pure.h"
 #include "vm/device/container.h"
+#include "vm/device/static.h"
+#include "vm/device/types/mapped.h"
+#include "vm/device/types/shared.h"
+#include "vm/device/types/paged.h"
+#include "vm/device/types/mmio.h"
+#include "vm/device/types/doorbell.h"
 #include "vm/proc/processor.h"
+#include "vm/proc/jit.h"
+#include "vm/proc/lockstep.h"
+#include "vm/proc/scheduler.h"
+#include "vm/proc/checkpoint.h"
+#include "vm/proc/image.h"
+#include "asm/assembler.h"
+#include "any/arena.h"
+#include "any/trace.h"
+#include "any/memory.h"
+#include <atomic> // std::atomic
+#include <chrono> // std::chrono
+#include <dirent.h> // opendir, readdir
+#include <memory> // std::unique_ptr
+#include <stdio.h> // fprintf
+#include <string.h> // memset, memmove, memcmp
+#include <stdlib.h> // mkstemp, mkdtemp
+#include <sys/mman.h> // mincore
+#include <sys/stat.h> // stat
+#include <thread> // std::thread, std::this_thread
+#include <unistd.h> // write, close, unlink, sysconf
+#include <vector> // std::vector
+
+using namespace sasm;
+using namespace sasm::vm;
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+// True if every byte of a range is zero
+static bool all_zero(const u8* memory, u64 amount) {
+    for (u64 i = 0; i < amount; i++) {
+        if (memory[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+// Translation across many devices and at device boundaries
+static void test_container_translation() {
+    const u64 count = 300; // More than fit in the old u8 loop counters
+    std::vector<std::unique_ptr<PureMemoryDevice>> devices;
+    MemoryContainer container;
+    for (u64 i = 0; i < count; i++) {
+        devices.emplace_back(new PureMemoryDevice("device", 16));
+        devices.back()->fill(0, 16, (u8) i);
+        container.handle(devices.back().get());
+    }
+    CHECK(container.size == count * 16);
+
+    // Every device is found at its own offset, not one past it
+    for (u64 i = 0; i < count; i++) {
+        u64 offset = ~(u64) 0;
+        CHECK(container.find(i * 16, &offset) == devices[i].get() && offset == i * 16);
+        CHECK(container.find(i * 16 + 15) == devices[i].get());
+        CHECK(container.read_type<u8>(i * 16 + 7) == (u8) i);
+    }
+    CHECK(container.find(count * 16) == 0x0);
+
+    // Operations crossing boundaries are split between the devices
+    u8 buffer[48];
+    container.read(280 * 16 + 8, 48, buffer);
+    for (u64 i = 0; i < 48; i++)
+        CHECK(buffer[i] == (u8) (280 + (8 + i) / 16));
+
+    for (u64 i = 0; i < 48; i++)
+        buffer[i] = (u8) (0xA0 + i);
+    container.write(270 * 16 - 1, 48, buffer);
+    CHECK(devices[269]->read_type<u8>(15) == 0xA0);
+    CHECK(devices[270]->read_type<u8>(0) == 0xA1);
+    CHECK(devices[272]->read_type<u8>(14) == 0xA0 + 47);
+    CHECK(devices[272]->read_type<u8>(15) == (u8) 272);
+
+    // Operations ending at the top of the address space don't wrap
+    MemoryContainer top;
+    PureMemoryDevice high("high", 256);
+    high.fill(0, 256, 0x5A);
+    vptr base = ~(u64) 0 - 0x1FF;
+    CHECK(top.map_at(base, &high));
+    u8 tail[512];
+    memset(tail, 0xFF, sizeof(tail));
+    top.read(base, 512, tail);
+    CHECK(tail[0] == 0x5A && tail[255] == 0x5A && tail[256] == 0 && tail[511] == 0);
+    memset(tail, 0xFF, sizeof(tail));
+    top.read(~(u64) 0 - 15, 16, tail);
+    CHECK(tail[0] == 0 && tail[15] == 0);
+    CHECK(top.read_type<u64>(base + 248) == 0x5A5A5A5A5A5A5A5Aull);
+}
+
+// Cached translations follow the lock state of their device only
+static void test_translation_cache() {
+    PureMemoryDevice first("first", 8192);
+    PureMemoryDevice second("second", 4096);
+    MemoryContainer container;
+    container.handle(&first).handle(&second);
+
+    container.write_type<u32>(16, 0x11223344);
+    CHECK(container.read_type<u32>(16) == 0x11223344); // Caches the page
+
+    u32 value = 0;
+    first.set(MemoryDeviceStatus::kReadLocked);
+    container.read(16, 4, &value);
+    CHECK(value == 0);
+    first.unset(MemoryDeviceStatus::kReadLocked);
+    container.read(16, 4, &value);
+    CHECK(value == 0x11223344);
+
+    first.set(MemoryDeviceStatus::kWriteLocked);
+    container.write_type<u32>(16, 0x55);
+    first.unset(MemoryDeviceStatus::kWriteLocked);
+    CHECK(container.read_type<u32>(16) == 0x11223344);
+    container.write_type<u32>(16, 0x55);
+    CHECK(first.read_type<u32>(16) == 0x55);
+
+    // Toggling a device elsewhere keeps the cache
+    PureMemoryDevice other("other", 4096);
+    MemoryContainer elsewhere;
+    elsewhere.handle(&other);
+    container.read_type<u32>(16);
+    TranslationCacheStats before = container.read_translation_stats();
+    other.set(MemoryDeviceStatus::kReadLocked);
+    other.unset(MemoryDeviceStatus::kReadLocked);
+    CHECK(container.read_type<u32>(16) == 0x55);
+    TranslationCacheStats after = container.read_translation_stats();
+    CHECK(after.hits == before.hits + 1 && after.flushes == before.flushes);
+}
+
+// Small deterministic generator for test data
+static u64 test_random(u64& state) {
+    state = state * 6364136223846793005ull + 1442695040888963407ull;
+    return state >> 33;
+}
+
+// Size of a file, 0 if it doesn't exist
+static u64 file_size(const char* path) {
+    struct stat info;
+    return stat(path, &info) == 0 ? (u64) info.st_size : 0;
+}
+
+// Bulk kernels and device fill / move / compare against memset / memmove / memcmp
+static void test_bulk_operations() {
+    const u64 size = 1024;
+    u8 expected[size];
+    u8 actual[size];
+    u64 state = 1;
+    for (u64 i = 0; i < size; i++)
+        expected[i] = actual[i] = (u8) test_random(state);
+
+    // Unaligned starts / sizes around the vector widths, overlapping both ways
+    const u64 amounts[] = { 0, 1, 3, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 200, 511 };
+    for (u64 amount : amounts) {
+        for (u64 start = 0; start < 40; start += 3) {
+            u64 value = test_random(state);
+            memset(expected + start, (u8) value, amount);
+            bulk_fill(actual + start, (u8) value, amount);
+            CHECK(memcmp(expected, actual, size) == 0);
+
+            for (u64 shift : { (u64) 1, (u64) 7, (u64) 33 }) {
+                memmove(expected + start + shift, expected + start, amount);
+                bulk_move(actual + start + shift, actual + start, amount);
+                CHECK(memcmp(expected, actual, size) == 0);
+                memmove(expected + start, expected + start + shift, amount);
+                bulk_move(actual + start, actual + start + shift, amount);
+                CHECK(memcmp(expected, actual, size) == 0);
+            }
+
+            // Sign of the first difference, wherever it is
+            u8 other[size];
+            memcpy(other, actual, size);
+            if (amount != 0)
+                other[start + test_random(state) % amount] ^= 0x80;
+            int reference = memcmp(actual + start, other + start, amount);
+            int result = bulk_compare(actual + start, other + start, amount);
+            CHECK((reference < 0) == (result < 0) && (reference > 0) == (result > 0));
+        }
+    }
+
+    // Same through a container, operations cross between its devices
+    PureMemoryDevice first("first", 300);
+    PureMemoryDevice second("second", 300);
+    PureMemoryDevice third("third", size - 600);
+    MemoryContainer container;
+    container.handle(&first).handle(&second).handle(&third);
+    container.write(0, size, expected);
+    for (u64 amount : amounts) {
+        for (u64 start = 250; start < 320; start += 23) {
+            u64 value = test_random(state);
+            memset(expected + start, (u8) value, amount);
+            container.fill(start, amount, (u8) value);
+
+            memmove(expected + start + 9, expected + start, amount);
+            container.move(start + 9, start, amount);
+            memmove(expected + start, expected + start + 40, amount);
+            container.move(start, start + 40, amount);
+
+            container.read(0, size, actual);
+            CHECK(memcmp(expected, actual, size) == 0);
+
+            int result = 1;
+            container.compare(start, amount, expected + start, &result);
+            CHECK(result == 0);
+            if (amount != 0) {
+                u8 other[size];
+                memcpy(other, expected, size);
+                other[start + amount - 1] ^= 0x80;
+                container.compare(start, amount, other + start, &result);
+                CHECK(result != 0 && (result < 0) == (memcmp(expected + start, other + start, amount) < 0));
+            }
+        }
+    }
+}
+
+// Borrowed and bounce buffer views, access modes and write tracking through containers
+static void test_memory_view() {
+    PureMemoryDevice first("first", 64);
+    PureMemoryDevice second("second", 64);
+    MemoryContainer container;
+    container.handle(&first).handle(&second);
+    first.fill(0, 64, 0x11);
+    second.fill(0, 64, 0x22);
+
+    // Read views can't be written
+    {
+        MemoryView view = first.view(8, 16, MemoryViewAccess::kViewRead);
+        CHECK(view && view.borrowed() && view.size() == 16 && view[0] == 0x11);
+        CHECK(view.writable() == 0x0);
+        u8 value = 0x33;
+        CHECK(view.write(0, 1, &value) == DeviceOperationResult::kLocked);
+        CHECK(view.read(15, 2, &value) == DeviceOperationResult::kOutOfBounds);
+    }
+    CHECK(first.read_type<u8>(8) == 0x11);
+
+    // Borrowed write views change the device right away
+    {
+        MemoryView view = container.view(4, 8, MemoryViewAccess::kViewReadWrite);
+        CHECK(view.borrowed() && view.writable() != 0x0);
+        view.writable()[0] = 0x44;
+        CHECK(first.read_type<u8>(4) == 0x44);
+    }
+
+    // Views across devices use a bounce buffer written back once committed
+    {
+        MemoryView view = container.view(60, 8, MemoryViewAccess::kViewReadWrite);
+        CHECK(view && !view.borrowed() && view[3] == 0x11 && view[4] == 0x22);
+        memset(view.writable(), 0x55, 8);
+        CHECK(first.read_type<u8>(63) == 0x11);
+        CHECK(view.commit() == DeviceOperationResult::kSuccess && !view);
+    }
+    CHECK(first.read_type<u8>(60) == 0x55 && second.read_type<u8>(3) == 0x55 && second.read_type<u8>(4) == 0x22);
+
+    // Only write views count as writes of the device behind a container
+    std::vector<DirtyRange> ranges;
+    second.track_writes();
+    {
+        MemoryView view = container.view(64, 16, MemoryViewAccess::kViewRead);
+        CHECK(view.borrowed());
+    }
+    CHECK(second.dirty_ranges(&ranges) == 0);
+    {
+        MemoryView view = container.view(64, 16, MemoryViewAccess::kViewWrite);
+        CHECK(view.borrowed());
+    }
+    CHECK(second.dirty_ranges(&ranges) != 0 && ranges.size() == 1 && ranges[0].offset == 0);
+    second.untrack_writes();
+}
+
+// StaticMemoryContainer (nested) against a MemoryContainer with the same layout, and
+// handled by the memory of a processor
+static void test_static_container() {
+    typedef StaticMemoryContainer<FixedMemoryDevice<8>, FixedMemoryDevice<8>> Inner;
+    typedef StaticMemoryContainer<FixedMemoryDevice<16>, FixedMemoryDevice<24>, Inner> Outer;
+    static_assert(Outer::kSize == 56 && Outer::offset_of(2) == 40 && Outer::offset_of(Outer::kCount) == 56, "layout");
+    static_assert(Outer::index_of(15) == 0 && Outer::index_of(16) == 1 && Outer::index_of(55) == 2 && Outer::index_of(56) == 3, "layout");
+
+    Outer fixed;
+    MemoryContainer dynamic;
+    PureMemoryDevice parts[] = { { "a", 16 }, { "b", 24 }, { "c", 8 }, { "d", 8 } };
+    for (PureMemoryDevice& part : parts) {
+        part.fill(0, part.size, 0);
+        dynamic.handle(&part);
+    }
+    CHECK(fixed.size == dynamic.size && all_zero(fixed.device<1>().bare_direct(0, 24), 24));
+
+    auto same = [&]() {
+        u8 a[56], b[56];
+        CHECK(fixed.read(0, 56, a) == DeviceOperationResult::kSuccess);
+        CHECK(dynamic.read(0, 56, b) == DeviceOperationResult::kSuccess);
+        return memcmp(a, b, 56) == 0;
+    };
+
+    // Fixed offsets spanning devices, including into the nested container
+    fixed.write_at<12, u64>(0x1122334455667788ull);
+    dynamic.write_type<u64>(12, 0x1122334455667788ull);
+    fixed.write_at<36, u64>(0x99AABBCCDDEEFF00ull);
+    dynamic.write_type<u64>(36, 0x99AABBCCDDEEFF00ull);
+    fixed.write_at<46, u32>(0xCAFEF00D);
+    dynamic.write_type<u32>(46, 0xCAFEF00D);
+    CHECK(same());
+    CHECK((fixed.read_at<12, u64>() == 0x1122334455667788ull));
+    CHECK((fixed.read_at<36, u64>() == dynamic.read_type<u64>(36)));
+    CHECK((fixed.read_at<46, u32>() == 0xCAFEF00D));
+    CHECK(fixed.device<0>().read_type<u32>(12) == 0x55667788 && fixed.device<1>().read_type<u32>(0) == 0x11223344);
+    CHECK(fixed.device<2>().device<1>().read_type<u16>(0) == 0xCAFE);
+
+    // Random operations of every kind give the same memory and results
+    u64 state = 13;
+    for (int round = 0; round < 2000; round++) {
+        u64 kind = test_random(state) % 6;
+        u64 offset = test_random(state) % 56;
+        u64 amount = 1 + test_random(state) % (56 - offset);
+        u8 buffer[56], other[56];
+
+        if (kind == 0) {
+            for (u64 i = 0; i < amount; i++)
+                buffer[i] = (u8) test_random(state);
+            CHECK(fixed.write(offset, amount, buffer) == dynamic.write(offset, amount, buffer));
+        } else if (kind == 1) {
+            u64 value = test_random(state) << 32 | test_random(state);
+            if (offset <= 48) {
+                fixed.write_type<u64>(offset, value);
+                dynamic.write_type<u64>(offset, value);
+            } else {
+                fixed.write_type<u16>(offset & ~(u64) 1, (u16) value);
+                dynamic.write_type<u16>(offset & ~(u64) 1, (u16) value);
+            }
+        } else if (kind == 2) {
+            u8 value = (u8) test_random(state);
+            CHECK(fixed.fill(offset, amount, value) == dynamic.fill(offset, amount, value));
+        } else if (kind == 3) {
+            u64 destination = test_random(state) % (56 - amount + 1);
+            CHECK(fixed.move(destination, offset, amount) == dynamic.move(destination, offset, amount));
+        } else if (kind == 4) {
+            CHECK(dynamic.read(offset, amount, buffer) == DeviceOperationResult::kSuccess);
+            if (test_random(state) & 1)
+                buffer[test_random(state) % amount] ^= 1;
+            int a = 0, b = 0;
+            CHECK(fixed.compare(offset, amount, buffer, &a) == dynamic.compare(offset, amount, buffer, &b));
+            CHECK((a == 0) == (b == 0));
+        } else {
+            CHECK(fixed.read(offset, amount, buffer) == DeviceOperationResult::kSuccess);
+            CHECK(dynamic.read(offset, amount, other) == DeviceOperationResult::kSuccess);
+            CHECK(memcmp(buffer, other, amount) == 0);
+            if (offset <= 48)
+                CHECK(fixed.read_type<u64>(offset) == dynamic.read_type<u64>(offset));
+            CHECK(fixed.read_type<u8>(offset) == dynamic.read_type<u8>(offset));
+        }
+    }
+    CHECK(same());
+
+    // Out of bounds and locked accesses do nothing
+    u8 before[56];
+    fixed.read(0, 56, before);
+    fixed.write_type<u64>(50, ~(u64) 0);
+    fixed.write_type<u64>(~(u64) 0 - 2, ~(u64) 0);
+    CHECK(fixed.read_type<u64>(49) == 0 && fixed.read_type<u64>(~(u64) 0 - 2) == 0);
+    CHECK(fixed.write(50, 8, before) == DeviceOperationResult::kOutOfBounds);
+    fixed.set(MemoryDeviceStatus::kReadLocked);
+    CHECK(fixed.read_type<u64>(0) == 0 && (fixed.read_at<8, u64>() == 0));
+    fixed.unset(MemoryDeviceStatus::kReadLocked);
+    fixed.set(MemoryDeviceStatus::kWriteLocked);
+    fixed.write_type<u64>(0, ~(u64) 0);
+    fixed.write_at<40, u64>(~(u64) 0);
+    fixed.unset(MemoryDeviceStatus::kWriteLocked);
+    int difference = 1;
+    CHECK(fixed.compare(0, 56, before, &difference) == DeviceOperationResult::kSuccess && difference == 0 && same());
+
+    // Views inside one device point into it, views across devices are bounced
+    CHECK(fixed.bare_direct(40, 8) == fixed.device<2>().device<0>().bare_direct(0, 8));
+    CHECK(fixed.bare_direct(36, 8) == 0x0);
+
+    // Handled by the memory of a processor, behind "flags", "registers", "stack" and "user"
+    BasicInterpretedProcessor processor(256, 1024);
+    vptr base = processor.memory().size;
+    processor.memory().handle(&fixed);
+    CHECK(processor.memory().find(base + 44) == &fixed);
+    CHECK(processor.memory().read_type<u64>(base + 36) == fixed.read_type<u64>(36));
+    processor.memory().write_type<u64>(base + 44, 0x0102030405060708ull);
+    CHECK(fixed.read_type<u64>(44) == 0x0102030405060708ull && fixed.device<2>().device<1>().read_type<u32>(0) == 0x01020304);
+
+    // Guest loads and stores across the devices of the nested container
+    BytecodeWriter writer;
+    writer.emit(kOpMovq, 1, 0, base);
+    writer.emit(kOpLd64, 2, 1, 12); // Spans the first two devices
+    writer.emit(kOpSt64, 1, 2, 44); // Spans the nested devices
+    writer.emit(kOpMovi, 3, 0, 0x5A5A);
+    writer.emit(kOpSt16, 1, 3, 39); // Spans into the nested container
+    writer.emit(kOpLd32, 4, 1, 38);
+    writer.emit(kOpHalt);
+    processor.load(writer.bytes.data(), writer.bytes.size());
+    processor.reset();
+    u64 spanning = fixed.read_type<u64>(12);
+    CHECK(processor.run(100) == kExecutionHalted);
+    CHECK(processor.state.registers[2] == spanning && fixed.read_type<u64>(44) == spanning);
+    CHECK(fixed.read_type<u16>(39) == 0x5A5A && fixed.device<2>().device<0>().read_type<u8>(0) == 0x5A);
+    CHECK(processor.state.registers[4] == fixed.read_type<u32>(38));
+}
+
+
+// Lazily allocated pages and copy-on-write forks
+static void test_paged_device() {
+    const u64 page = PagedMemoryDevice::kPageSize;
+    PagedMemoryDevice device("paged", 4 * page);
+
+    // Pages that were never written read as zero without being allocated
+    std::vector<u8> buffer(4 * page, 0xFF);
+    CHECK(device.read(0, 4 * page, buffer.data()) == DeviceOperationResult::kSuccess);
+    CHECK(all_zero(buffer.data(), buffer.size()) && device.allocated_pages() == 0);
+    {
+        MemoryView view = device.view(page, 16, MemoryViewAccess::kViewRead);
+        CHECK(view && view[0] == 0 && device.allocated_pages() == 0);
+    }
+
+    // Atomics allocate the page first
+    u64 old = 1;
+    CHECK(device.atomic(8, 8, kAtomicFetchAdd, 5, &old) == DeviceOperationResult::kSuccess && old == 0);
+    CHECK(device.read_type<u64>(8) == 5 && device.allocated_pages() == 1);
+    device.write_type<u64>(2 * page, 7);
+
+    // Forks share pages until one of the devices writes to them. The page handed out to the
+    // atomic is copied right away
+    std::unique_ptr<PagedMemoryDevice> copy = device.fork("copy");
+    CHECK(copy->allocated_pages() == 2 && copy->private_pages() == 1 && device.private_pages() == 1);
+    CHECK(copy->read_type<u64>(2 * page) == 7 && copy->read_type<u64>(8) == 5);
+    copy->write_type<u64>(2 * page, 9);
+    CHECK(copy->read_type<u64>(2 * page) == 9 && device.read_type<u64>(2 * page) == 7);
+    CHECK(copy->private_pages() == 2 && device.private_pages() == 2);
+    device.write_type<u64>(2 * page + 8, 3);
+    CHECK(copy->read_type<u64>(2 * page + 8) == 0);
+    device.write_type<u64>(3 * page, 4);
+    CHECK(copy->read_type<u64>(3 * page) == 0 && copy->allocated_pages() == 2);
+
+    // Pointers handed out before forking only write to their own device
+    MemoryView view = device.view(16, 8, MemoryViewAccess::kViewReadWrite);
+    CHECK(view.borrowed());
+    std::unique_ptr<PagedMemoryDevice> second = device.fork();
+    view.writable()[0] = 0x42;
+    CHECK(device.read_type<u8>(16) == 0x42 && second->read_type<u8>(16) == 0);
+    CHECK(second->atomic(8, 8, kAtomicFetchAdd, 1, &old) == DeviceOperationResult::kSuccess && old == 5);
+    CHECK(device.read_type<u64>(8) == 5 && second->read_type<u64>(8) == 6);
+}
+
+// Device mirroring every write into a container with a nested batch
+class MirrorMemoryDevice : public MemoryDevice {
+public:
+    MirrorMemoryDevice(MemoryContainer* _target, vptr _mirror) : target(_target), mirror(_mirror) {
+        set_uid("mirror");
+        size = sizeof(memory);
+    }
+
+    void bare_read(vptr offset, u64 amount, void* output) { memcpy(output, memory + offset, amount); }
+    void bare_write(vptr offset, u64 amount, void* input) {
+        memcpy(memory + offset, input, amount);
+        MemorySegment segments[2] = { { mirror + offset, amount, input }, { probe, 4, scratch } };
+        target->writev(segments, 1);
+        target->readv(segments + 1, 1);
+    }
+
+    vptr probe = 0; // Also read from here with a nested batch
+private:
+    MemoryContainer* target;
+    vptr mirror;
+    u8 memory[64] = {};
+    u8 scratch[4];
+};
+
+// Batched reads and writes against the equivalent single operations
+static void test_batched_operations() {
+    PureMemoryDevice a("a", 64), b("b", 64), c("c", 64);
+    PureMemoryDevice single_a("a", 64), single_b("b", 64), single_c("c", 64);
+    MemoryContainer batched, single;
+    batched.handle(&a).handle(&b).handle(&c);
+    single.handle(&single_a).handle(&single_b).handle(&single_c);
+
+    // Every segment gets its own result, segments may cross device boundaries
+    u8 input[32], output[3][32];
+    for (u64 i = 0; i < sizeof(input); i++)
+        input[i] = (u8) (i + 1);
+    MemorySegment writes[3] = { { 50, 32, input }, { 10, 4, input }, { 190, 4, input } };
+    CHECK(batched.writev(writes, 3) == DeviceOperationResult::kOutOfBounds);
+    CHECK(writes[0].result == DeviceOperationResult::kSuccess && writes[1].result == DeviceOperationResult::kSuccess);
+    CHECK(writes[2].result == DeviceOperationResult::kOutOfBounds);
+    CHECK(a.read_type<u8>(63) == 14 && b.read_type<u8>(0) == 15 && b.read_type<u8>(17) == 32 && a.read_type<u8>(13) == 4);
+
+    // A locked device only fails its own segments
+    b.set(MemoryDeviceStatus::kReadLocked);
+    MemorySegment reads[3] = { { 0, 32, output[0] }, { 64, 8, output[1] }, { 60, 8, output[2] } };
+    CHECK(batched.readv(reads, 3) == DeviceOperationResult::kLocked);
+    CHECK(reads[0].result == DeviceOperationResult::kSuccess && reads[1].result == DeviceOperationResult::kLocked);
+    CHECK(reads[2].result == DeviceOperationResult::kLocked && output[0][10] == 1 && output[0][13] == 4);
+    b.unset(MemoryDeviceStatus::kReadLocked);
+
+    // Random batches of non-overlapping segments match the same operations done one by one
+    PureMemoryDevice* devices[] = { &a, &b, &c, &single_a, &single_b, &single_c };
+    for (PureMemoryDevice* device : devices)
+        device->fill(0, 64, 0);
+    u64 seed = 42;
+    for (int round = 0; round < 200; round++) {
+        MemorySegment segments[8];
+        u8 buffers[8][24], single_buffers[8][24];
+        for (u64 i = 0; i < 8; i++) {
+            u64 offset = i * 24 + test_random(seed) % 8;
+            u64 amount = 1 + test_random(seed) % 16;
+            for (u64 j = 0; j < amount; j++)
+                buffers[i][j] = single_buffers[i][j] = (u8) test_random(seed);
+            u8 kind = test_random(seed) % 2 ? MemorySegmentKind::kSegmentWrite : MemorySegmentKind::kSegmentRead;
+            segments[i] = MemorySegment { offset, amount, buffers[i], kind };
+        }
+        batched.submit(segments, 8);
+
+        for (u64 i = 0; i < 8; i++) {
+            CHECK(segments[i].result == DeviceOperationResult::kSuccess);
+            if (segments[i].kind == MemorySegmentKind::kSegmentWrite)
+                single.write(segments[i].offset, segments[i].amount, single_buffers[i]);
+            else
+                single.read(segments[i].offset, segments[i].amount, single_buffers[i]);
+            CHECK(memcmp(buffers[i], single_buffers[i], segments[i].amount) == 0);
+        }
+    }
+    u8 left[192], right[192];
+    batched.read(0, 192, left);
+    single.read(0, 192, right);
+    CHECK(memcmp(left, right, sizeof(left)) == 0);
+
+    // Devices may submit to the container again while handling a batch, failures of the
+    // nested batches don't show up in the outer one
+    MemoryContainer nested;
+    PureMemoryDevice target("target", 128), locked("locked", 8);
+    MirrorMemoryDevice mirror(&nested, 0);
+    nested.handle(&target).handle(&mirror).handle(&locked);
+    mirror.probe = 192;
+    locked.set(MemoryDeviceStatus::kReadLocked);
+    MemorySegment outer[3] = { { 100, 4, input + 4 }, { 128, 4, input }, { 140, 4, input + 8 } };
+    CHECK(nested.writev(outer, 3) == DeviceOperationResult::kSuccess);
+    CHECK(target.read_type<u8>(100) == 5 && target.read_type<u8>(0) == 1 && mirror.read_type<u8>(0) == 1);
+    CHECK(target.read_type<u8>(12) == 9 && mirror.read_type<u8>(12) == 9);
+}
+
+static void test_concurrent_mapping() {
+    PureMemoryDevice stable("stable", 4096);
+    MemoryContainer container;
+    container.handle(&stable);
+    container.fill(0, 4096, 0x11);
+
+    // Only the reader runs operations, the main thread changes the mapping underneath it
+    std::atomic<bool> done(false);
+    u64 wrong = 0;
+    std::thread reader([&] {
+        while (!done.load()) {
+            u64 fixed = container.read_type<u64>(1024);
+            u64 low = container.read_type<u64>(0x10000 + 16);
+            u64 high = container.read_type<u64>(0x10000 + 3000);
+            u64 middle = container.read_type<u64>(0x8000);
+            wrong += fixed != 0x1111111111111111ull;
+            wrong += (low != 0 && low != 0x2222222222222222ull) + (high != 0 && high != 0x2222222222222222ull);
+            wrong += middle != 0 && middle != 0x3333333333333333ull;
+        }
+    });
+
+    // Devices are destroyed right after unmapping, unmap has to wait for the reader
+    for (int i = 0; i < 2000; i++) {
+        std::unique_ptr<PureMemoryDevice> last(new PureMemoryDevice("last", 4096));
+        std::unique_ptr<PureMemoryDevice> between(new PureMemoryDevice("between", 256));
+        last->fill(0, 4096, 0x22);
+        between->fill(0, 256, 0x33);
+
+        CHECK(container.map_at(0x10000, last.get()));
+        CHECK(container.map_at(0x8000, between.get()));
+        CHECK(container.resize(last.get(), 2048) && container.size == 0x10000 + 2048);
+        CHECK(container.resize(last.get(), 4096));
+        CHECK(container.unmap(between.get()));
+        between.reset();
+        CHECK(container.unmap(last.get()) && container.size == 4096);
+        last.reset();
+    }
+    done.store(true);
+    reader.join();
+
+    CHECK(wrong == 0);
+    CHECK(container.read_type<u64>(0x10000) == 0 && container.read_type<u8>(4095) == 0x11);
+}
+
+// Counters of devices accessed from two threads, and the Prometheus / JSON export
+static void test_metrics() {
+    // Export of known samples, also without SASM_METRICS
+    MetricsSample known;
+    known.name = "say \"hi\"\n";
+    known.id = 7;
+    for (u64 i = 0; i < kMetricCount; i++)
+        known.snapshot.counters[i] = 100 + i;
+
+    std::string prometheus = metrics_prometheus({ known }, "vm");
+    CHECK(prometheus.find("# TYPE vm_reads_total counter\nvm_reads_total{device=\"say \\\"hi\\\"\\n\",id=\"7\"} 100\n") == 0);
+    CHECK(prometheus.find("vm_cache_misses_total{device=\"say \\\"hi\\\"\\n\",id=\"7\"} 106\n") != std::string::npos);
+    CHECK(prometheus.find("# TYPE vm_failures_total counter\nvm_failures_total{device=\"say \\\"hi\\\"\\n\",id=\"7\",result=\"locked\"} 107\n") != std::string::npos);
+    CHECK(prometheus.find("result=\"misaligned\"} 110\n") != std::string::npos);
+    u64 types = 0;
+    for (u64 at = prometheus.find("# TYPE"); at != std::string::npos; at = prometheus.find("# TYPE", at + 1))
+        types++;
+    CHECK(types == kMetricFailures + 1);
+
+    CHECK(metrics_json({}) == "[]\n");
+    CHECK(metrics_json({ known }) == "[\n  {\"device\": \"say \\\"hi\\\"\\n\", \"id\": 7, \"reads\": 100, \"writes\": 101, "
+        "\"read_bytes\": 102, \"written_bytes\": 103, \"crossings\": 104, \"cache_hits\": 105, \"cache_misses\": 106, "
+        "\"locked\": 107, \"out_of_bounds\": 108, \"unsupported\": 109, \"misaligned\": 110}\n]\n");
+
+#ifdef SASM_METRICS
+    // Containers run operations on one thread at a time, each thread gets its own over the same devices
+    const u64 threads = 2, count = 1000, tenth = count / 10;
+    PureMemoryDevice a("a", 64), b("b", 64);
+    a.fill(0, 64, 0);
+    b.fill(0, 64, 0);
+    MetricsSnapshot a_before = a.metrics(), b_before = b.metrics(); // The fills count as writes
+    std::vector<std::unique_ptr<MemoryContainer>> containers;
+    for (u64 i = 0; i < threads; i++) {
+        containers.emplace_back(new MemoryContainer());
+        containers.back()->set_uid("container");
+        containers.back()->handle(&a).handle(&b);
+    }
+
+    auto work = [&](u64 thread) {
+        MemoryContainer& container = *containers[thread];
+        u8 buffer[8] = {};
+        for (u64 i = 0; i < count; i++) {
+            container.read(8 * (i % 8), 8, buffer); // a, cached after the first time
+            container.write(72 + 24 * thread + 4 * (i % 6), 4, buffer); // b, every thread writes its own range
+            if (i % 10 == 0) {
+                container.read(60, 8, buffer); // Crosses from a into b
+                container.read(200, 8, buffer); // Unmapped, reads as zero
+                a.write(60, 8, buffer); // Outside of a
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (u64 i = 0; i < threads; i++)
+        workers.emplace_back(work, i);
+    for (std::thread& worker : workers)
+        worker.join();
+
+    b.set(MemoryDeviceStatus::kWriteLocked);
+    u8 value = 1;
+    for (int i = 0; i < 3; i++)
+        CHECK(b.write(0, 1, &value) == DeviceOperationResult::kLocked);
+    b.unset(MemoryDeviceStatus::kWriteLocked);
+
+    // Device counts are summed over the shards of both (exited) threads
+    MetricsSnapshot ma = a.metrics(), mb = b.metrics();
+    CHECK(ma.counters[kMetricReads] - a_before.counters[kMetricReads] == threads * (count + tenth));
+    CHECK(ma.counters[kMetricBytesRead] - a_before.counters[kMetricBytesRead] == threads * (8 * count + 4 * tenth));
+    CHECK(ma.counters[kMetricWrites] == a_before.counters[kMetricWrites]);
+    CHECK(ma.counters[kMetricFailures + DeviceOperationResult::kOutOfBounds - 1] == threads * tenth);
+    CHECK(mb.counters[kMetricReads] == threads * tenth && mb.counters[kMetricBytesRead] == threads * 4 * tenth);
+    CHECK(mb.counters[kMetricWrites] - b_before.counters[kMetricWrites] == threads * count);
+    CHECK(mb.counters[kMetricBytesWritten] - b_before.counters[kMetricBytesWritten] == threads * 4 * count);
+    CHECK(mb.counters[kMetricFailures + DeviceOperationResult::kLocked - 1] == 3);
+    CHECK(mb.counters[kMetricFailures + DeviceOperationResult::kOutOfBounds - 1] == 0);
+
+    for (u64 i = 0; i < threads; i++) {
+        MetricsSnapshot mc = containers[i]->metrics();
+        CHECK(mc.counters[kMetricReads] == count + 2 * tenth && mc.counters[kMetricWrites] == count);
+        CHECK(mc.counters[kMetricBytesRead] == 8 * (count + 2 * tenth) && mc.counters[kMetricBytesWritten] == 4 * count);
+        CHECK(mc.counters[kMetricCrossings] == tenth);
+        CHECK(mc.counters[kMetricCacheHits] + mc.counters[kMetricCacheMisses] == 2 * count + 2 * tenth);
+        CHECK(mc.counters[kMetricCacheHits] >= 2 * count - 14); // Each of the 14 cached ranges misses at most once
+        CHECK(mc.counters[kMetricCacheMisses] >= 2 * tenth); // Crossings and unmapped reads aren't cached
+    }
+
+    // Exports of a container list every device with its counts
+    MemoryContainer& container = *containers[0];
+    std::vector<MetricsSample> samples;
+    container.metrics_samples(&samples);
+    CHECK(samples.size() == 3 && samples[1].name == "a" && samples[2].name == "b");
+    CHECK(samples[2].id == b.metrics_id && samples[2].snapshot.counters[kMetricWrites] == mb.counters[kMetricWrites]);
+
+    char line[256];
+    prometheus = metrics_prometheus(samples);
+    snprintf(line, sizeof(line), "sasm_device_crossings_total{device=\"container\",id=\"%u\"} %lu\n", container.metrics_id, (unsigned long) tenth);
+    CHECK(prometheus.find(line) != std::string::npos);
+    snprintf(line, sizeof(line), "sasm_device_failures_total{device=\"b\",id=\"%u\",result=\"locked\"} 3\n", b.metrics_id);
+    CHECK(prometheus.find(line) != std::string::npos);
+
+    std::string json = metrics_json(samples);
+    snprintf(line, sizeof(line), "{\"device\": \"a\", \"id\": %u, \"reads\": %lu,", a.metrics_id, (unsigned long) ma.counters[kMetricReads]);
+    CHECK(json.find(line) != std::string::npos);
+#endif
+}
+
+
+// Records of a trace file, collected by trace_read
+struct TraceLog : TraceVisitor {
+    struct Event {
+        u32 thread;
+        TraceEvent event;
+    };
+    std::vector<Event> events;
+    std::vector<std::string> names;
+    std::vector<std::pair<u32, u64>> drops; // Thread, amount of events
+
+    void event(u32 thread, const TraceEvent& event) override { events.push_back(Event { thread, event }); }
+    void dropped(u32 thread, u64 amount) override { drops.emplace_back(thread, amount); }
+
+    void name(u32 id, const std::string& name) override {
+        if (id >= names.size())
+            names.resize(id + 1);
+        names[id] = name;
+    }
+};
+
+// Events recorded on two threads, drained into a trace file and read back, including full rings
+static void test_trace() {
+    char path[] = "/tmp/sasm_test_traceXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    close(fd);
+
+    u32 alpha = trace_register(), beta = trace_register();
+    trace_name(alpha, "alpha", 5);
+
+    // Only trace_stop drains, so the first thread fills its ring
+    CHECK(trace_start(path, 16, 1000000));
+    CHECK(!trace_start(path));
+    trace_name(beta, "beta", 4); // Named while running
+
+#ifdef SASM_TRACE
+    PureMemoryDevice traced("traced", 16);
+    u8 buffer[16];
+    CHECK(traced.read(4, 8, buffer) == DeviceOperationResult::kSuccess);
+    CHECK(traced.write(12, 8, buffer) == DeviceOperationResult::kOutOfBounds);
+    u32 main_thread = trace_ring()->thread;
+#endif
+
+    // Rings of exited threads are reused, the first thread waits for the second to get its own
+    u32 threads[2] = {};
+    u64 capacity = 0;
+    std::atomic<bool> recorded(false), finished(false);
+    std::thread first([&] {
+        TraceRing* ring = trace_ring();
+        threads[0] = ring->thread;
+        capacity = ring->mask + 1; // Reused rings keep their size
+        for (u64 i = 0; i < capacity + 5; i++)
+            trace_record(alpha, i % kTraceOperationCount, 0x1000 + i * 8, i == 3 ? ~(u64) 0 : i + 1, i % 5);
+        recorded.store(true);
+        while (!finished.load())
+            std::this_thread::yield();
+    });
+    while (!recorded.load())
+        std::this_thread::yield();
+    std::thread second([&] {
+        threads[1] = trace_ring()->thread;
+        for (u64 i = 0; i < 3; i++)
+            trace_record(beta, kTraceWrite, ~(u64) 0 - i, 8, 0);
+    });
+    second.join();
+    finished.store(true);
+    first.join();
+    CHECK(threads[0] != threads[1]);
+
+    trace_stop();
+    trace_record(alpha, kTraceRead, 0, 1, 0); // Not running anymore, stays in the ring until the next trace_start
+
+    TraceLog log;
+    CHECK(trace_read(path, log) == kTraceReadSuccess);
+    CHECK(log.names.size() > beta && log.names[alpha] == "alpha" && log.names[beta] == "beta");
+
+    // Every event of the first thread up to the full ring, in order, then the dropped ones
+    u64 index = 0, last_time = 0;
+    bool ordered = true;
+    for (const TraceLog::Event& entry : log.events) {
+        if (entry.thread != threads[0])
+            continue;
+        const TraceEvent& event = entry.event;
+        CHECK(event.device == alpha && event.operation == index % kTraceOperationCount);
+        CHECK(event.address == 0x1000 + index * 8 && event.result == index % 5);
+        CHECK(event.size == (index == 3 ? 0xFFFFFFFF : index + 1));
+        CHECK(all_zero(event.reserved, sizeof(event.reserved)));
+        ordered &= event.timestamp >= last_time;
+        last_time = event.timestamp;
+        index++;
+    }
+    CHECK(index == capacity && ordered);
+    CHECK(log.drops.size() == 1 && log.drops[0].first == threads[0] && log.drops[0].second == 5);
+
+    u64 second_events = 0;
+    for (const TraceLog::Event& entry : log.events) {
+        if (entry.thread != threads[1])
+            continue;
+        CHECK(entry.event.device == beta && entry.event.operation == kTraceWrite && entry.event.size == 8);
+        CHECK(entry.event.address == ~(u64) 0 - second_events && entry.event.result == 0);
+        second_events++;
+    }
+    CHECK(second_events == 3);
+
+#ifdef SASM_TRACE
+    CHECK(log.names.size() > traced.trace_id && log.names[traced.trace_id] == "traced");
+    std::vector<TraceEvent> device_events;
+    for (const TraceLog::Event& entry : log.events) {
+        if (entry.event.device == traced.trace_id) {
+            CHECK(entry.thread == main_thread);
+            device_events.push_back(entry.event);
+        }
+    }
+    CHECK(device_events.size() == 2);
+    if (device_events.size() == 2) {
+        CHECK(device_events[0].operation == kTraceRead && device_events[0].address == 4 && device_events[0].size == 8);
+        CHECK(device_events[0].result == DeviceOperationResult::kSuccess);
+        CHECK(device_events[1].operation == kTraceWrite && device_events[1].address == 12 && device_events[1].size == 8);
+        CHECK(device_events[1].result == DeviceOperationResult::kOutOfBounds);
+    }
+#else
+    CHECK(log.events.size() == capacity + 3);
+#endif
+
+    // The next trace starts empty, events recorded after trace_stop are forgotten
+    CHECK(trace_start(path, 16, 1000000));
+    trace_stop();
+    TraceLog empty;
+    CHECK(trace_read(path, empty) == kTraceReadSuccess && empty.events.empty() && empty.drops.empty());
+    CHECK(empty.names.size() > beta && empty.names[beta] == "beta");
+
+    // Files ending inside a record, other files and missing files
+    CHECK(trace_start(path, 16, 1000000));
+    trace_record(alpha, kTraceFill, 0, 1, 0);
+    trace_stop();
+    u64 size = file_size(path);
+    CHECK(truncate(path, size - 1) == 0);
+    TraceLog truncated;
+    CHECK(trace_read(path, truncated) == kTraceReadTruncated && truncated.events.empty());
+
+    u8 garbage[64];
+    memset(garbage, 0x5A, sizeof(garbage));
+    FILE* file = fopen(path, "wb");
+    CHECK(file != 0x0 && fwrite(garbage, sizeof(garbage), 1, file) == 1);
+    fclose(file);
+    CHECK(trace_read(path, truncated) == kTraceReadBadHeader);
+
+    unlink(path);
+    CHECK(trace_read(path, truncated) == kTraceReadOpenFailed);
+}
+
+
+static void test_shared_memory() {
+    // One container per thread, both translation caches keep hitting the same device
+    SharedMemoryDevice shared("shared", 64);
+    std::unique_ptr<SharedMemoryDevice> other = shared.share();
+    MemoryContainer writer_memory;
+    MemoryContainer reader_memory;
+    writer_memory.handle(&shared);
+    reader_memory.handle(other.get());
+
+    std::atomic<bool> done(false);
+    std::thread writer([&] {
+        for (u64 i = 0; i < 2000000; i++) {
+            writer_memory.write_type<u64>(8, i & 1 ? ~(u64) 0 : 0);
+            writer_memory.write_type<u32>(20, i & 1 ? ~(u32) 0 : 0);
+            writer_memory.write_type<u16>(34, i & 1 ? (u16) ~0 : 0);
+        }
+        done.store(true);
+    });
+
+    // Aligned stores are never seen half done
+    u64 torn = 0;
+    while (!done.load()) {
+        u64 wide = reader_memory.read_type<u64>(8);
+        u32 medium = reader_memory.read_type<u32>(20);
+        u16 narrow = reader_memory.read_type<u16>(34);
+        torn += (wide != 0 && wide != ~(u64) 0) + (medium != 0 && medium != ~(u32) 0) + (narrow != 0 && narrow != (u16) ~0);
+    }
+    writer.join();
+    CHECK(torn == 0);
+    CHECK(reader_memory.read_type<u64>(8) == ~(u64) 0 && reader_memory.read_type<u16>(34) == (u16) ~0);
+    CHECK(reader_memory.read_translation_stats().hits > 0);
+}
+
+// Mapped files can't be mapped past their end
+static void test_mapped_length() {
+    char path[] = "/tmp/sasm_test_mappedXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    u8 contents[100];
+    for (u64 i = 0; i < sizeof(contents); i++)
+        contents[i] = (u8) i;
+    CHECK(write(fd, contents, sizeof(contents)) == (ssize_t) sizeof(contents));
+    close(fd);
+
+    MappedMemoryDevice device;
+    CHECK(device.init("mapped", path, kMappedReadOnly, 0, 100));
+    CHECK(device.size == 100 && device.read_type<u8>(99) == 99);
+    CHECK(device.init("mapped", path, kMappedReadOnly, 10, 0));
+    CHECK(device.size == 90 && device.read_type<u8>(0) == 10);
+    CHECK(!device.init("mapped", path, kMappedReadOnly, 0, 4096));
+    CHECK(!device.init("mapped", path, kMappedReadOnly, 60, 41));
+    CHECK(device.size == 0);
+    unlink(path);
+}
+
+// Every mapping mode and access hints
+static void test_mapped_modes() {
+    char path[] = "/tmp/sasm_test_modesXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    u64 length = 2 * (u64) sysconf(_SC_PAGESIZE);
+    std::vector<u8> contents(length);
+    for (u64 i = 0; i < length; i++)
+        contents[i] = (u8) (i * 7);
+    CHECK(write(fd, contents.data(), length) == (ssize_t) length);
+
+    // Byte of the file itself
+    auto file_byte = [&](u64 offset) {
+        u8 value = 0;
+        CHECK(pread(fd, &value, 1, (off_t) offset) == 1);
+        return value;
+    };
+
+    // Read-only: writes are refused
+    MappedMemoryDevice device;
+    CHECK(device.init("mapped", path, kMappedReadOnly));
+    CHECK(device.size == length && device.read_type<u8>(100) == (u8) 700);
+    u8 value = 0xEE;
+    CHECK(device.write(100, 1, &value) == DeviceOperationResult::kLocked);
+    CHECK(device.advise(kAdviceDontNeed) && device.read_type<u8>(100) == (u8) 700);
+
+    // Private: writes stay in the device, other mappings and the file don't see them
+    CHECK(device.init("mapped", path, kMappedPrivate));
+    MappedMemoryDevice other("other", path, kMappedPrivate);
+    CHECK(device.write(100, 1, &value) == DeviceOperationResult::kSuccess);
+    CHECK(device.read_type<u8>(100) == 0xEE && other.read_type<u8>(100) == (u8) 700 && file_byte(100) == (u8) 700);
+    CHECK(!device.advise(kAdviceDontNeed));
+    CHECK(device.read_type<u8>(100) == 0xEE);
+
+    // Shared: writes reach the file
+    CHECK(device.init("mapped", path, kMappedShared, 100, 200));
+    CHECK(device.size == 200 && device.read_type<u8>(0) == (u8) 700);
+    CHECK(device.write(1, 1, &value) == DeviceOperationResult::kSuccess && device.sync());
+    CHECK(file_byte(101) == 0xEE);
+    CHECK(device.advise(kAdviceDontNeed) && device.read_type<u8>(1) == 0xEE);
+
+    // Every other hint is accepted, ranges have to start inside the device
+    MappedMemoryAdvice hints[] = { kAdviceNormal, kAdviceSequential, kAdviceRandom, kAdviceWillNeed };
+    for (MappedMemoryAdvice hint : hints) {
+        CHECK(device.advise(hint, 10, 50) && other.advise(hint));
+        CHECK(!device.advise(hint, 201));
+    }
+    device.release();
+    CHECK(!device.mapped() && !device.advise(kAdviceNormal));
+
+    close(fd);
+    unlink(path);
+}
+
+// Load a program into a fresh interpreted processor
+static void load_program(BaseProcessor& processor, const BytecodeWriter& writer) {
+    processor.load(writer.bytes.data(), writer.bytes.size());
+    processor.reset();
+}
+
+// Run a program that should fault, check the reason
+static void check_fault(BytecodeWriter& writer, u8 fault) {
+    BasicInterpretedProcessor processor(256, 1024);
+    load_program(processor, writer);
+    CHECK(processor.run(1000) == kExecutionFault && processor.state.fault == fault);
+}
+
+// Interpreter opcodes, control flow, memory and faults
+static void test_interpreter() {
+    BasicInterpretedProcessor processor(256, 1024);
+    vptr data = processor.user_base() + 512;
+
+    // Sum 1..10 with a loop, call / ret and the stack
+    BytecodeWriter writer;
+    writer.emit(kOpMovi, 0, 0, 0).emit(kOpMovi, 1, 0, 10);
+    u64 loop = writer.position();
+    writer.emit(kOpAdd, 0, 1).emit(kOpAddi, 1, 0, (u64) -1).emit(kOpCmpi, 1, 0, 0).emit(kOpJnz, 0, 0, loop);
+    u64 call = writer.position();
+    writer.emit(kOpCall);
+    writer.emit(kOpMovq, 2, 0, data);
+    writer.emit(kOpSt64, 2, 0, 0).emit(kOpSt8, 2, 3, 9).emit(kOpLd32, 4, 2, 0).emit(kOpLd8, 5, 2, 9);
+    writer.emit(kOpMovi, 6, 0, 5).emit(kOpPush, 6).emit(kOpPop, 7);
+    writer.emit(kOpHalt);
+    writer.patch_target(call, (u32) writer.position());
+    writer.emit(kOpMovi, 3, 0, (u64) -2).emit(kOpMovi, 8, 0, 7).emit(kOpMul, 3, 8).emit(kOpNeg, 3).emit(kOpRet);
+
+    load_program(processor, writer);
+    CHECK(processor.run(1000) == kExecutionHalted);
+    CHECK(processor.state.registers[0] == 55 && processor.state.registers[1] == 0);
+    CHECK(processor.state.registers[3] == 14 && processor.state.registers[4] == 55 && processor.state.registers[5] == 14);
+    CHECK(processor.state.registers[7] == 5 && processor.state.sp == processor.stack_base() + 256);
+    CHECK(processor.memory().read_type<u64>(data) == 55);
+
+    // Arithmetic / logic / shifts / compares
+    writer = BytecodeWriter();
+    writer.emit(kOpMovi, 0, 0, 100).emit(kOpMovi, 1, 0, 7).emit(kOpMov, 2, 0).emit(kOpDivu, 2, 1);
+    writer.emit(kOpMov, 3, 0).emit(kOpRemu, 3, 1).emit(kOpMovi, 4, 0, (u64) -16).emit(kOpMovi, 5, 0, 2);
+    writer.emit(kOpMov, 6, 4).emit(kOpSar, 6, 5).emit(kOpMov, 7, 4).emit(kOpShr, 7, 5).emit(kOpShli, 5, 0, 4);
+    writer.emit(kOpMovi, 8, 0, 0xF0).emit(kOpAndi, 8, 0, 0x3C).emit(kOpMovi, 9, 0, 0x0F).emit(kOpOr, 9, 8).emit(kOpXor, 9, 0);
+    writer.emit(kOpNot, 1).emit(kOpCmp, 4, 0).emit(kOpMovi, 10, 0, 0);
+    u64 skip = writer.position();
+    writer.emit(kOpJge).emit(kOpMovi, 10, 0, 1);
+    writer.patch_target(skip, (u32) writer.position());
+    writer.emit(kOpHalt);
+    load_program(processor, writer);
+    CHECK(processor.run(1000) == kExecutionHalted);
+    u64* r = processor.state.registers;
+    CHECK(r[2] == 14 && r[3] == 2 && r[6] == (u64) -4 && r[7] == ((u64) -16) >> 2 && r[5] == 32);
+    CHECK(r[9] == ((0x30 | 0x0F) ^ 100) && r[1] == ~(u64) 7 && r[10] == 1);
+    CHECK((processor.state.flags & (kFlagLess | kFlagBelow)) == kFlagLess);
+
+    // Budgets and single steps resume where execution stopped
+    load_program(processor, writer);
+    CHECK(processor.step() == kExecutionBudget && processor.state.ip == 6);
+    CHECK(processor.run(3) == kExecutionBudget);
+    CHECK(processor.run(1000) == kExecutionHalted && processor.state.registers[2] == 14);
+
+    // wait blocks until woken
+    writer = BytecodeWriter();
+    writer.emit(kOpWait).emit(kOpMovi, 0, 0, 1).emit(kOpHalt);
+    load_program(processor, writer);
+    CHECK(processor.run(1000) == kExecutionBlocked && processor.run(1000) == kExecutionBlocked);
+    processor.wake();
+    CHECK(processor.run(1000) == kExecutionHalted && processor.state.registers[0] == 1);
+
+    // Faults
+    writer = BytecodeWriter();
+    writer.emit(kOpMovi, 0, 0, 1).emit(kOpMovi, 1, 0, 0).emit(kOpDivu, 0, 1);
+    check_fault(writer, kFaultDivideByZero);
+    writer = BytecodeWriter();
+    writer.emit(kOpMovq, 0, 0, ~(u64) 3).emit(kOpLd64, 1, 0, 0);
+    check_fault(writer, kFaultMemory);
+    writer = BytecodeWriter();
+    writer.emit(kOpNop);
+    writer.bytes.push_back(0xFF);
+    check_fault(writer, kFaultInvalidInstruction);
+    writer = BytecodeWriter();
+    writer.emit(kOpJmp, 0, 0, 4096);
+    check_fault(writer, kFaultInvalidInstruction);
+    writer = BytecodeWriter();
+    writer.emit(kOpRet);
+    check_fault(writer, kFaultStackUnderflow);
+    writer = BytecodeWriter();
+    writer.emit(kOpPush, 0).emit(kOpJmp, 0, 0, 0);
+    check_fault(writer, kFaultStackOverflow);
+    writer = BytecodeWriter();
+    writer.emit(kOpMovq, 0, 0, data + 1).emit(kOpFadd64, 0, 1);
+    check_fault(writer, kFaultAtomic);
+
+    // Memory operations refused by a device fault without changing sp
+    MemoryDevice* stack = processor.memory().find(processor.stack_base());
+    u64 sp = processor.stack_base() + 256;
+    BytecodeWriter stores[3];
+    stores[0].emit(kOpMovq, 0, 0, processor.stack_base()).emit(kOpSt64, 0, 1, 0);
+    stores[1].emit(kOpPush, 1);
+    stores[2].emit(kOpCall, 0, 0, 0);
+    for (BytecodeWriter& program : stores) {
+        load_program(processor, program);
+        stack->set(MemoryDeviceStatus::kWriteLocked);
+        CHECK(processor.run(1000) == kExecutionFault && processor.state.fault == kFaultMemory);
+        CHECK(processor.state.sp == sp);
+        stack->unset(MemoryDeviceStatus::kWriteLocked);
+    }
+    BytecodeWriter loads[3];
+    loads[0].emit(kOpMovq, 0, 0, processor.stack_base()).emit(kOpLd64, 1, 0, 0);
+    loads[1].emit(kOpPush, 0).emit(kOpPop, 1);
+    loads[2].emit(kOpPush, 0).emit(kOpRet);
+    for (BytecodeWriter& program : loads) {
+        load_program(processor, program);
+        CHECK(processor.step() == kExecutionBudget);
+        stack->set(MemoryDeviceStatus::kReadLocked);
+        CHECK(processor.run(1000) == kExecutionFault && processor.state.fault == kFaultMemory);
+        CHECK(processor.state.sp == sp - (program.bytes[0] == kOpPush ? 8 : 0));
+        stack->unset(MemoryDeviceStatus::kReadLocked);
+    }
+}
+
+// Handler calls seen by an MMIO range
+struct MmioLog {
+    std::vector<std::pair<vptr, u64>> reads, writes;
+    u64 last_value = 0;
+};
+
+static void mmio_test_read(void* context, vptr offset, u64 amount, void* output) {
+    ((MmioLog*) context)->reads.push_back({ offset, amount });
+    for (u64 i = 0; i < amount; i++)
+        ((u8*) output)[i] = (u8) (0x10 + offset + i);
+}
+
+static void mmio_test_write(void* context, vptr offset, u64 amount, const void* input) {
+    MmioLog* log = (MmioLog*) context;
+    log->writes.push_back({ offset, amount });
+    log->last_value = 0;
+    memcpy(&log->last_value, input, amount);
+}
+
+static u64 doorbell_test_handler(void* /* context */, const DoorbellRequest& request) {
+    return request.argument * request.opcode;
+}
+
+// Guest accesses reaching MMIO handlers and doorbell requests completed by workers
+static void test_io_devices() {
+    MmioLog first, second;
+    MmioMemoryDevice mmio("mmio", 64);
+    CHECK(mmio.map(16, 16, &mmio_test_read, &mmio_test_write, &first));
+    CHECK(mmio.map(40, 8, &mmio_test_read, &mmio_test_write, &second));
+    CHECK(!mmio.map(44, 8, &mmio_test_read, &mmio_test_write, &first));
+
+    // One handler call per range an operation touches, unmapped bytes read as zero
+    u8 buffer[40];
+    memset(buffer, 0xFF, sizeof(buffer));
+    CHECK(mmio.read(10, 40, buffer) == DeviceOperationResult::kSuccess);
+    CHECK(first.reads.size() == 1 && first.reads[0] == std::make_pair((vptr) 0, (u64) 16));
+    CHECK(second.reads.size() == 1 && second.reads[0] == std::make_pair((vptr) 0, (u64) 8));
+    CHECK(buffer[0] == 0 && buffer[6] == 0x10 && buffer[21] == 0x1F && buffer[22] == 0 && buffer[30] == 0x10 && buffer[39] == 0);
+    mmio.write_type<u64>(0, 5);
+    CHECK(first.writes.empty() && second.writes.empty());
+
+    // Guest loads and stores arrive with their offset and width
+    BasicInterpretedProcessor processor(256, 1024);
+    vptr base = processor.memory().size;
+    processor.memory().handle(&mmio);
+    BytecodeWriter writer;
+    writer.emit(kOpMovq, 0, 0, base).emit(kOpMovi, 1, 0, 0x1234);
+    writer.emit(kOpSt16, 0, 1, 20).emit(kOpSt64, 0, 1, 40).emit(kOpLd32, 2, 0, 24).emit(kOpLd8, 3, 0, 47).emit(kOpHalt);
+    load_program(processor, writer);
+    first.reads.clear();
+    second.reads.clear();
+    CHECK(processor.run(1000) == kExecutionHalted);
+    CHECK(first.writes.size() == 1 && first.writes[0] == std::make_pair((vptr) 4, (u64) 2));
+    CHECK(second.writes.size() == 1 && second.writes[0] == std::make_pair((vptr) 0, (u64) 8) && second.last_value == 0x1234);
+    CHECK(first.reads.size() == 1 && first.reads[0] == std::make_pair((vptr) 8, (u64) 4));
+    CHECK(second.reads.size() == 1 && second.reads[0] == std::make_pair((vptr) 7, (u64) 1));
+    CHECK(processor.state.registers[2] == 0x1B1A1918 && processor.state.registers[3] == 0x17);
+
+    // The guest fills request slots, rings the doorbell and waits for the workers
+    const u64 count = 6;
+    DoorbellMemoryDevice doorbell("doorbell", 8, &doorbell_test_handler, 0x0, 2);
+    BasicInterpretedProcessor guest(256, 4096);
+    vptr rings = guest.memory().size;
+    guest.memory().handle(&doorbell);
+    writer = BytecodeWriter();
+    writer.emit(kOpMovq, 0, 0, rings);
+    for (u64 i = 0; i < count; i++) {
+        vptr slot = rings + kDoorbellRequests + i * sizeof(DoorbellRequest);
+        writer.emit(kOpMovq, 1, 0, slot).emit(kOpMovi, 2, 0, 100 + i).emit(kOpSt64, 1, 2, offsetof(DoorbellRequest, tag));
+        writer.emit(kOpMovi, 2, 0, 3).emit(kOpSt32, 1, 2, offsetof(DoorbellRequest, opcode));
+        writer.emit(kOpMovi, 2, 0, i + 1).emit(kOpSt64, 1, 2, offsetof(DoorbellRequest, argument));
+    }
+    writer.emit(kOpMovi, 2, 0, count).emit(kOpSt32, 0, 2, kDoorbellSubmitted);
+    u64 wait = writer.position();
+    writer.emit(kOpLd32, 3, 0, kDoorbellCompleted).emit(kOpCmpi, 3, 0, count).emit(kOpJnz, 0, 0, wait);
+
+    // Sum of tags and results of every completion
+    writer.emit(kOpMovq, 1, 0, rings + doorbell.completion_base()).emit(kOpMovi, 4, 0, 0).emit(kOpMovi, 5, 0, 0);
+    for (u64 i = 0; i < count; i++) {
+        writer.emit(kOpLd64, 6, 1, i * sizeof(DoorbellCompletion) + offsetof(DoorbellCompletion, tag)).emit(kOpAdd, 4, 6);
+        writer.emit(kOpLd64, 6, 1, i * sizeof(DoorbellCompletion) + offsetof(DoorbellCompletion, result)).emit(kOpAdd, 5, 6);
+    }
+    writer.emit(kOpHalt);
+    load_program(guest, writer);
+
+    ExecutionResult result = kExecutionBudget;
+    for (int i = 0; i < 10000 && result == kExecutionBudget; i++)
+        result = guest.run(100000);
+    CHECK(result == kExecutionHalted && doorbell.pending() == 0);
+    CHECK(guest.state.registers[4] == 100 * count + count * (count - 1) / 2);
+    CHECK(guest.state.registers[5] == 3 * count * (count + 1) / 2);
+}
+
+// Counting loop adding step to r0 count times
+static BytecodeWriter counting_loop(u64 step, u64 count) {
+    BytecodeWriter writer;
+    writer.emit(kOpMovi, 0, 0, 0).emit(kOpMovi, 1, 0, count);
+    u64 loop = writer.position();
+    writer.emit(kOpAddi, 0, 0, step).emit(kOpAddi, 1, 0, (u64) -1).emit(kOpCmpi, 1, 0, 0).emit(kOpJnz, 0, 0, loop);
+    writer.emit(kOpHalt);
+    return writer;
+}
+
+static void test_jit() {
+    JitProcessor jit(256, 1024);
+    BasicInterpretedProcessor interpreter(256, 1024);
+
+    // Reloading code drops compiled blocks
+    load_program(jit, counting_loop(1, 1000));
+    CHECK(jit.run(100000) == kExecutionHalted && jit.state.registers[0] == 1000);
+    CHECK(!JitProcessor::supported() || jit.statistics().compiled_blocks > 0);
+    load_program(jit, counting_loop(7, 1000));
+    CHECK(jit.run(100000) == kExecutionHalted && jit.state.registers[0] == 7000);
+
+    // Guest stores into code, from interpreted and (once the outer loop is hot) compiled blocks.
+    // Every pass patches the immediate of the inner addi with the pass number
+    BytecodeWriter writer;
+    writer.emit(kOpMovi, 0, 0, 0).emit(kOpMovi, 2, 0, 0);
+    u64 pass = writer.position();
+    writer.emit(kOpMovi, 1, 0, 100);
+    u64 loop = writer.position();
+    writer.emit(kOpAddi, 0, 0, 1).emit(kOpAddi, 1, 0, (u64) -1).emit(kOpCmpi, 1, 0, 0).emit(kOpJnz, 0, 0, loop);
+    writer.emit(kOpAddi, 2, 0, 1).emit(kOpMovq, 3, 0, jit.user_base() + loop + 2).emit(kOpSt32, 3, 2, 0);
+    writer.emit(kOpCmpi, 2, 0, 200).emit(kOpJnz, 0, 0, pass).emit(kOpHalt);
+
+    load_program(interpreter, writer);
+    CHECK(interpreter.run(1000000) == kExecutionHalted);
+    CHECK(interpreter.state.registers[0] == 100 * (1 + 199 * 200 / 2));
+
+    for (int verify = 0; verify < 2; verify++) {
+        jit.set_verify(verify != 0);
+        load_program(jit, writer);
+        CHECK(jit.run(1000000) == kExecutionHalted);
+        CHECK(memcmp(jit.state.registers, interpreter.state.registers, sizeof(jit.state.registers)) == 0);
+        CHECK(jit.memory().read_type<u32>(jit.user_base() + loop + 2) == 200);
+        CHECK(jit.statistics().mismatches == 0);
+    }
+
+    // Budgets end at the same instruction as in the interpreter, with and without verification.
+    // Blocks are dropped on every pass, so compile them right away to store from compiled code
+    jit.set_threshold(1);
+    for (int verify = 0; verify < 2; verify++) {
+        jit.set_verify(verify != 0);
+        load_program(jit, writer);
+        load_program(interpreter, writer);
+        for (int i = 0; i < 50; i++) {
+            CHECK(jit.run(997) == interpreter.run(997));
+            CHECK(jit.state.ip == interpreter.state.ip && jit.state.registers[0] == interpreter.state.registers[0]);
+        }
+    }
+    jit.set_verify(false);
+
+    // Stack accesses refused by the device fault in compiled code like in the interpreter
+    MemoryDevice* stack = jit.memory().find(jit.stack_base());
+    BytecodeWriter refused[3];
+    refused[0].emit(kOpMovq, 0, 0, jit.stack_base()).emit(kOpSt64, 0, 1, 0).emit(kOpHalt);
+    refused[1].emit(kOpPush, 1).emit(kOpHalt);
+    refused[2].emit(kOpMovq, 0, 0, jit.stack_base()).emit(kOpLd64, 1, 0, 0).emit(kOpHalt);
+    for (int verify = 0; verify < 2; verify++) {
+        jit.set_verify(verify != 0);
+        for (BytecodeWriter& program : refused) {
+            load_program(jit, program);
+            stack->set(MemoryDeviceStatus::kWriteLocked);
+            stack->set(MemoryDeviceStatus::kReadLocked);
+            CHECK(jit.run(1000) == kExecutionFault && jit.state.fault == kFaultMemory);
+            CHECK(jit.state.sp == jit.stack_base() + 256);
+            stack->unset(MemoryDeviceStatus::kWriteLocked);
+            stack->unset(MemoryDeviceStatus::kReadLocked);
+        }
+    }
+    jit.set_verify(false);
+    jit.set_threshold(64);
+}
+
+// Lanes of a LockstepProcessor against one BasicInterpretedProcessor per lane
+static void test_lockstep() {
+    const u64 lanes = 13; // Not a multiple of the vector width
+    LockstepProcessor lockstep(lanes, 256, 1024);
+    vptr data = lockstep.user_base() + 512;
+
+    // r0 = input. Loops input times, branches on the parity of the sum, calls and uses the
+    // stack, stores results, then divides by input - 5 (lane 5 faults, the others go on)
+    BytecodeWriter writer;
+    writer.emit(kOpMov, 5, 0).emit(kOpMovi, 1, 0, 0);
+    u64 loop = writer.position();
+    writer.emit(kOpAdd, 1, 0).emit(kOpAddi, 0, 0, (u64) -1).emit(kOpCmpi, 0, 0, 0).emit(kOpJnz, 0, 0, loop);
+    writer.emit(kOpMov, 3, 1).emit(kOpAndi, 3, 0, 1).emit(kOpCmpi, 3, 0, 0);
+    u64 even = writer.position();
+    writer.emit(kOpJz).emit(kOpMovi, 2, 0, 7);
+    u64 join = writer.position();
+    writer.emit(kOpJmp);
+    writer.patch_target(even, (u32) writer.position());
+    writer.emit(kOpMovi, 2, 0, 9);
+    writer.patch_target(join, (u32) writer.position());
+    u64 call = writer.position();
+    writer.emit(kOpCall).emit(kOpPush, 2).emit(kOpPop, 4);
+    writer.emit(kOpMovq, 6, 0, data).emit(kOpMov, 7, 5).emit(kOpShli, 7, 0, 3).emit(kOpAdd, 6, 7);
+    writer.emit(kOpSt64, 6, 1, 0).emit(kOpSt8, 6, 4, 200).emit(kOpLd32, 8, 6, 0);
+    writer.emit(kOpMov, 9, 5).emit(kOpAddi, 9, 0, (u64) -5).emit(kOpMovi, 10, 0, 1000).emit(kOpDivu, 10, 9);
+    writer.emit(kOpHalt);
+    writer.patch_target(call, (u32) writer.position());
+    writer.emit(kOpMul, 1, 1).emit(kOpRet);
+
+    CHECK(lockstep.load(writer.bytes.data(), writer.bytes.size()) == DeviceOperationResult::kSuccess);
+    lockstep.reset();
+    for (u64 l = 0; l < lanes; l++)
+        lockstep.lane_register(l, 0) = l + 1;
+    CHECK(lockstep.run(100000) == kExecutionFault);
+
+    for (u64 l = 0; l < lanes; l++) {
+        BasicInterpretedProcessor reference(256, 1024);
+        load_program(reference, writer);
+        reference.state.registers[0] = l + 1;
+        CHECK(reference.run(100000) == (l + 1 == 5 ? kExecutionFault : kExecutionHalted));
+
+        ProcessorState state = lockstep.lane_state(l);
+        CHECK(lockstep.lane_status(l) == (l + 1 == 5 ? kLaneFault : kLaneHalted));
+        CHECK(memcmp(state.registers, reference.state.registers, sizeof(state.registers)) == 0);
+        CHECK(state.ip == reference.state.ip && state.sp == reference.state.sp && state.flags == reference.state.flags);
+        CHECK(state.fault == reference.state.fault && state.halted == reference.state.halted);
+
+        std::vector<u8> memory(lockstep.memory_size());
+        CHECK(reference.memory().size == memory.size());
+        reference.memory().read(0, memory.size(), memory.data());
+        CHECK(memcmp(memory.data(), lockstep.lane_memory(l), memory.size()) == 0);
+    }
+    CHECK(lockstep.lane_state(4).fault == kFaultDivideByZero && lockstep.lane_register(6, 10) == 500);
+}
+
+// Two files referencing each other's labels, the encoding of the assembler, errors,
+// the object cache and bytecode images
+static void test_assembler() {
+    // main.s calls into math.s, math.s reads a table from main.s. "next" is local to each file
+    const char* main_source =
+        ".global table\n"
+        "    movi r0, 7\n"
+        "    call square          ; r0 = 49\n"
+        "    movq r2, table + 8\n"
+        "    ld64 r3, [r2 + 0]    ; r3 = 22\n"
+        "    jmp next\n"
+        "    movi r4, 1           ; skipped\n"
+        "next:\n"
+        "    call sum_table       ; r5 = 66\n"
+        "    halt\n"
+        ".align 8\n"
+        "table:\n"
+        "    .u64 11, 22, 33\n";
+    const char* math_source =
+        ".global square, sum_table\n"
+        "square:\n"
+        "    mul r0, r0\n"
+        "    ret\n"
+        "sum_table:\n"
+        "    movq r6, table\n"
+        "    movi r5, 0\n"
+        "    movi r7, 3\n"
+        "next:\n"
+        "    ld64 r8, [r6 + 0]\n"
+        "    add r5, r8\n"
+        "    addi r6, 8\n"
+        "    addi r7, -1\n"
+        "    cmpi r7, 0\n"
+        "    jnz next\n"
+        "    ret\n";
+
+    char cache_path[] = "/tmp/sasm_test_cacheXXXXXX";
+    CHECK(mkdtemp(cache_path) != 0x0);
+
+    BasicInterpretedProcessor processor(256, 1024);
+    std::vector<u8> code;
+    {
+        as::Assembler assembler(2);
+        CHECK(assembler.set_cache(cache_path));
+        assembler.add_source("main.s", main_source);
+        assembler.add_source("math.s", math_source);
+        CHECK(assembler.build(code, processor.user_base()));
+        CHECK(assembler.errors().empty());
+
+        as::AssemblerStats stats = assembler.statistics();
+        CHECK(stats.units == 2 && stats.parsed == 2 && stats.cached == 0 && stats.reused == 0);
+        CHECK(stats.code_bytes == code.size());
+
+        u64 offset = 0;
+        CHECK(assembler.symbol("table", offset) && offset % 8 == 0 && offset + 24 <= code.size());
+        CHECK(!assembler.symbol("next", offset));
+
+        // Unchanged input is reused on the next build, changed input is parsed again
+        std::vector<u8> again;
+        CHECK(assembler.build(again, processor.user_base()) && again == code);
+        stats = assembler.statistics();
+        CHECK(stats.reused == 2 && stats.parsed == 0 && stats.cached == 0);
+
+        CHECK(assembler.update_source("math.s", std::string(math_source) + "    nop\n"));
+        CHECK(assembler.build(again, processor.user_base()) && again.size() > code.size());
+        stats = assembler.statistics();
+        CHECK(stats.reused == 1 && stats.parsed == 1);
+    }
+
+    processor.load(code.data(), code.size());
+    processor.reset();
+    CHECK(processor.run(1000) == kExecutionHalted);
+    CHECK(processor.state.registers[0] == 49 && processor.state.registers[3] == 22);
+    CHECK(processor.state.registers[4] == 0 && processor.state.registers[5] == 66);
+
+    // A fresh assembler sharing the cache directory doesn't parse anything
+    {
+        as::Assembler assembler(2);
+        CHECK(assembler.set_cache(cache_path));
+        assembler.add_source("main.s", main_source);
+        assembler.add_source("math.s", math_source);
+        std::vector<u8> cached;
+        CHECK(assembler.build(cached, processor.user_base()) && cached == code);
+        as::AssemblerStats stats = assembler.statistics();
+        CHECK(stats.cached == 2 && stats.parsed == 0);
+    }
+
+    // Every format encodes like BytecodeWriter
+    {
+        as::Assembler assembler(1);
+        assembler.add_source("encoding.s",
+            "start:\n"
+            "    nop\n"
+            "    not r3\n"
+            "    mov r1, r15\n"
+            "    movi r2, -5\n"
+            "    movq r3, 0x123456789abcdef0\n"
+            "    addi r4, 100\n"
+            "    jz start\n"
+            "    call 16\n"
+            "    ld32 r5, [r6 + 12]\n"
+            "    st16 [r7 - 4], r8\n"
+            "    cas64 r9, r10\n"
+            "    fence\n");
+        std::vector<u8> assembled;
+        CHECK(assembler.build(assembled));
+
+        BytecodeWriter writer;
+        writer.emit(kOpNop).emit(kOpNot, 3).emit(kOpMov, 1, 15).emit(kOpMovi, 2, 0, (u64) -5);
+        writer.emit(kOpMovq, 3, 0, 0x123456789abcdef0ull).emit(kOpAddi, 4, 0, 100);
+        writer.emit(kOpJz, 0, 0, 0).emit(kOpCall, 0, 0, 16);
+        writer.emit(kOpLd32, 5, 6, 12).emit(kOpSt16, 7, 8, (u64) -4);
+        writer.emit(kOpCas64, 9, 10).emit(kOpFence);
+        CHECK(assembled == writer.bytes);
+    }
+
+    // Undefined symbols fail linking and name the file
+    {
+        as::Assembler assembler(1);
+        assembler.add_source("main.s", "    call missing\n    halt\n");
+        std::vector<u8> output;
+        CHECK(!assembler.build(output));
+        CHECK(!assembler.errors().empty() && assembler.errors()[0].file == "main.s" && assembler.errors()[0].line == 1);
+        CHECK(assembler.errors()[0].message.find("missing") != std::string::npos);
+    }
+
+    // Labels of another file aren't visible without .global
+    {
+        as::Assembler assembler(1);
+        assembler.add_source("main.s", "    jmp hidden\n");
+        assembler.add_source("other.s", "hidden:\n    halt\n");
+        std::vector<u8> output;
+        CHECK(!assembler.build(output) && !assembler.errors().empty());
+    }
+
+    // Images hold the linked code and load into processors
+    char image_path[] = "/tmp/sasm_test_imageXXXXXX";
+    int fd = mkstemp(image_path);
+    CHECK(fd != -1);
+    close(fd);
+    CHECK(BytecodeImage::write(image_path, code.data(), code.size()));
+    {
+        BytecodeImage image;
+        CHECK(image.open(image_path, true));
+        CHECK(image.size() == code.size() && memcmp(image.code(), code.data(), code.size()) == 0);
+
+        JitProcessor loaded(256, 1024);
+        CHECK(image.load(loaded) == DeviceOperationResult::kSuccess);
+        loaded.invalidate();
+        loaded.reset();
+        CHECK(loaded.run(1000) == kExecutionHalted);
+        CHECK(loaded.state.registers[0] == 49 && loaded.state.registers[5] == 66);
+
+        BasicInterpretedProcessor small(256, 16);
+        CHECK(image.load(small) == DeviceOperationResult::kOutOfBounds);
+    }
+    unlink(image_path);
+
+    DIR* directory = opendir(cache_path);
+    CHECK(directory != 0x0);
+    if (directory != 0x0) {
+        while (dirent* entry = readdir(directory))
+            if (entry->d_name[0] != '.')
+                unlink((std::string(cache_path) + "/" + entry->d_name).c_str());
+        closedir(directory);
+    }
+    rmdir(cache_path);
+}
+
+
+static std::unique_ptr<BasicInterpretedProcessor> runtime_processor(const BytecodeWriter& writer) {
+    std::unique_ptr<BasicInterpretedProcessor> processor(new BasicInterpretedProcessor(256, 1024));
+    load_program(*processor, writer);
+    return processor;
+}
+
+// Wait (up to 10 seconds) until a processor of a running runtime reaches a schedule state
+static bool reaches_state(ProcessorRuntime& runtime, u64 id, u8 state) {
+    for (int i = 0; i < 10000; i++) {
+        if (runtime.schedule_state(id) == state)
+            return true;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+static void test_scheduler() {
+    BytecodeWriter spin;
+    spin.emit(kOpJmp, 0, 0, 0);
+    BytecodeWriter waiting;
+    waiting.emit(kOpWait).emit(kOpMovi, 0, 0, 1).emit(kOpHalt);
+
+    // A spinning processor doesn't keep a short one from finishing on the same worker
+    {
+        ProcessorRuntime runtime(1, 1000);
+        u64 short_id = runtime.add(runtime_processor(counting_loop(1, 100)));
+        runtime.add(runtime_processor(spin));
+        runtime.start();
+        CHECK(reaches_state(runtime, short_id, kScheduleFinished));
+        CHECK(runtime.processor(short_id)->state.registers[0] == 100);
+        runtime.stop();
+    }
+
+    // Processors woken from outside get a turn next to spinning ones
+    {
+        ProcessorRuntime runtime(1, 1000);
+        u64 waiting_id = runtime.add(runtime_processor(waiting));
+        runtime.add(runtime_processor(spin));
+        runtime.start();
+        CHECK(reaches_state(runtime, waiting_id, kScheduleBlocked));
+        runtime.wake(waiting_id);
+        CHECK(reaches_state(runtime, waiting_id, kScheduleFinished));
+        CHECK(runtime.processor(waiting_id)->state.registers[0] == 1);
+        runtime.stop();
+    }
+
+    // Many processors on several workers all finish, wakes before "wait" aren't lost
+    {
+        ProcessorRuntime runtime(4, 100);
+        std::vector<u64> ids;
+        for (int i = 0; i < 32; i++)
+            ids.push_back(runtime.add(runtime_processor(i % 2 ? waiting : counting_loop(3, 500))));
+        runtime.start();
+        for (int i = 1; i < 32; i += 2)
+            runtime.wake(ids[i]);
+        runtime.wait();
+        for (int i = 0; i < 32; i++) {
+            CHECK(runtime.schedule_state(ids[i]) == kScheduleFinished);
+            CHECK(runtime.processor(ids[i])->state.registers[0] == (i % 2 ? 1 : 1500));
+        }
+        CHECK(runtime.statistics().finished == 32);
+        runtime.stop();
+    }
+}
+
+static void test_arena() {
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    u64 amount = 2 << 20;
+    MemoryArena arena(4 << 20);
+    u8* block = arena.allocate(amount);
+    CHECK(block != 0x0);
+    if (block == 0x0)
+        return;
+
+    // Anonymous memory is cleared in place, its pages stay resident
+    memset(block, 0xAB, amount);
+    arena.reset();
+    std::vector<unsigned char> resident(amount / page_size);
+    CHECK(mincore(block, amount, resident.data()) == 0);
+    CHECK(resident[0] & 1 && resident[resident.size() - 1] & 1);
+    CHECK(arena.used() == 0 && arena.allocate(amount) == block && all_zero(block, amount));
+
+    // File pages are replaced with zero pages
+    char path[] = "/tmp/sasm_test_arenaXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    std::vector<u8> contents(2 * page_size, 0xCD);
+    CHECK(write(fd, contents.data(), contents.size()) == (ssize_t) contents.size());
+    CHECK(arena.map_file(block + page_size, fd, 0, contents.size()));
+    close(fd);
+    unlink(path);
+
+    CHECK(block[page_size] == 0xCD && block[3 * page_size - 1] == 0xCD);
+    block[0] = 1;
+    block[3 * page_size] = 2;
+    block[amount - 1] = 3;
+    arena.reset();
+    CHECK(arena.allocate(amount) == block && all_zero(block, amount));
+}
+
+// Processor state and container memory match
+static bool same_processor(BaseProcessor& a, BaseProcessor& b) {
+    if (memcmp(a.state.registers, b.state.registers, sizeof(a.state.registers)) != 0 || a.state.ip != b.state.ip ||
+        a.state.sp != b.state.sp || a.state.flags != b.state.flags || a.memory().size != b.memory().size)
+        return false;
+
+    std::vector<u8> first(a.memory().size);
+    std::vector<u8> second(b.memory().size);
+    a.memory().read(0, first.size(), first.data());
+    b.memory().read(0, second.size(), second.data());
+    return first == second;
+}
+
+static void test_checkpoint() {
+    char path[] = "/tmp/sasm_test_checkpointXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    close(fd);
+
+    // Data scattered over part of "user", the rest stays zero
+    BasicInterpretedProcessor processor(4096, 64 << 10);
+    load_program(processor, counting_loop(3, 1000));
+    u64 seed = 17;
+    for (u64 i = 0; i < 1000; i++)
+        processor.memory().write_type<u8>(processor.user_base() + 8192 + test_random(seed) % (24 << 10), (u8) (test_random(seed) | 1));
+    CHECK(processor.run(500) == kExecutionBudget);
+
+    u8 options[] = { 0, kCheckpointCompress };
+    for (u8 flags : options) {
+        CHECK(ProcessorCheckpoint::save(processor, path, flags) == kCheckpointSuccess);
+        BasicInterpretedProcessor restored(16, 16);
+        CHECK(ProcessorCheckpoint::restore(restored, path) == kCheckpointSuccess);
+        CHECK(same_processor(processor, restored));
+        CHECK(restored.run(100000) == kExecutionHalted && restored.state.registers[0] == 3000);
+    }
+
+    // Restoring replaces compiled code of a JitProcessor
+    JitProcessor jit(4096, 64 << 10);
+    load_program(jit, counting_loop(7, 1000));
+    CHECK(jit.run(100000) == kExecutionHalted);
+    CHECK(ProcessorCheckpoint::restore(jit, path) == kCheckpointSuccess);
+    CHECK(jit.run(100000) == kExecutionHalted && jit.state.registers[0] == 3000);
+
+    // Truncated files are rejected, the processor keeps its device sizes
+    CHECK(truncate(path, sizeof(CheckpointHeader) / 2) == 0);
+    BasicInterpretedProcessor broken(256, 1024);
+    CHECK(ProcessorCheckpoint::restore(broken, path) != kCheckpointSuccess);
+    CHECK(broken.stack_base() + 256 == broken.user_base() && broken.user_base() + 1024 == broken.memory().size);
+    unlink(path);
+}
+
+static void test_delta_checkpoint() {
+    char base_path[] = "/tmp/sasm_test_baseXXXXXX";
+    char delta_path[] = "/tmp/sasm_test_deltaXXXXXX";
+    int base_fd = mkstemp(base_path);
+    int delta_fd = mkstemp(delta_path);
+    CHECK(base_fd >= 0 && delta_fd >= 0);
+    if (base_fd < 0 || delta_fd < 0)
+        return;
+    close(base_fd);
+    close(delta_fd);
+
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    BasicInterpretedProcessor processor(4096, 16 * page_size);
+    processor.track_writes(true);
+    load_program(processor, counting_loop(3, 1000));
+    vptr pages = processor.user_base() + 4 * page_size;
+    processor.memory().fill(pages, 8 * page_size, 0x5A);
+    CHECK(ProcessorCheckpoint::save(processor, base_path) == kCheckpointSuccess);
+
+    // Run a bit, change one word and clear a whole page
+    CHECK(processor.run(500) == kExecutionBudget);
+    processor.memory().write_type<u64>(pages + page_size + 8, 0x123456789);
+    processor.memory().fill(pages + 3 * page_size, page_size, 0);
+    CHECK(ProcessorCheckpoint::save(processor, delta_path, kCheckpointDelta) == kCheckpointSuccess);
+    CHECK(file_size(delta_path) != 0 && file_size(delta_path) < file_size(base_path));
+
+    // Base then delta gives the current processor
+    BasicInterpretedProcessor restored(16, 16);
+    CHECK(ProcessorCheckpoint::restore(restored, base_path) == kCheckpointSuccess);
+    CHECK(restored.state.ip == 0 && restored.memory().read_type<u8>(pages + 3 * page_size) == 0x5A);
+    CHECK(ProcessorCheckpoint::restore(restored, delta_path) == kCheckpointSuccess);
+    CHECK(same_processor(processor, restored));
+    CHECK(restored.run(100000) == kExecutionHalted && restored.state.registers[0] == 3000);
+
+    // Nothing written since the last save: the delta only holds the state, memory stays as restored
+    CHECK(ProcessorCheckpoint::save(processor, delta_path, kCheckpointDelta) == kCheckpointSuccess);
+    BasicInterpretedProcessor again(16, 16);
+    CHECK(ProcessorCheckpoint::restore(again, base_path) == kCheckpointSuccess);
+    CHECK(ProcessorCheckpoint::restore(again, delta_path) == kCheckpointSuccess);
+    CHECK(again.state.ip == processor.state.ip && again.memory().read_type<u8>(pages + 3 * page_size) == 0x5A);
+
+    // Deltas only apply on top of processors with the same layout
+    BasicInterpretedProcessor other(4096, 8 * page_size);
+    CHECK(ProcessorCheckpoint::restore(other, delta_path) == kCheckpointLayout);
+    unlink(base_path);
+    unlink(delta_path);
+}
 
 int main() {
     sasm::vm::BaseProcessor processor(1024, 1024);
-    return 0;
-}
\ No newline at end of file
+
+    test_container_translation();
+    test_translation_cache();
+    test_bulk_operations();
+    test_memory_view();
+    test_static_container();
+    test_paged_device();
+    test_batched_operations();
+    test_concurrent_mapping();
+    test_metrics();
+    test_trace();
+    test_shared_memory();
+    test_mapped_length();
+    test_mapped_modes();
+    test_interpreter();
+    test_io_devices();
+    test_jit();
+    test_lockstep();
+    test_assembler();
+    test_scheduler();
+    test_arena();
+    test_checkpoint();
+    test_delta_checkpoint();
+
+    if (failures != 0)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures != 0;
+}
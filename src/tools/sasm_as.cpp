@@ -0,0 +1,88 @@
+/**
+ * SemiAssembly / sasm tools
+ * @file sasm_as.cpp
+ * @author lotuspar / par0-git
+ * @brief Assemble SemiAssembly files into a bytecode image (asm/assembler.h)
+ *
+ * Usage: sasm_as [-o image] [-j threads] [--cache directory] [--base address] [--stats] <files...>
+ *
+ * Files are linked in the order given, execution starts at the first one. --base is the
+ * container address of "user" (BaseProcessor::user_base), default 0.
+ */
+
+#include "../asm/assembler.h"
+#include "../vm/proc/image.h"
+#include <chrono> // std::chrono
+#include <stdio.h> // fprintf
+#include <stdlib.h> // strtoull
+#include <string.h> // strcmp
+
+using namespace sasm;
+
+static void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-o image] [-j threads] [--cache directory] [--base address] [--stats] <files...>\n", program);
+}
+
+int main(int argc, char** argv) {
+    const char* output_path = "a.sasm";
+    const char* cache_directory = 0x0;
+    u32 threads = 0;
+    vptr base = 0;
+    bool print_stats = false;
+    as::Assembler assembler;
+    u64 files = 0;
+
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "-o") == 0 && has_value)
+            output_path = argv[++i];
+        else if (strcmp(argv[i], "-j") == 0 && has_value)
+            threads = strtoul(argv[++i], 0x0, 0);
+        else if (strcmp(argv[i], "--cache") == 0 && has_value)
+            cache_directory = argv[++i];
+        else if (strcmp(argv[i], "--base") == 0 && has_value)
+            base = strtoull(argv[++i], 0x0, 0);
+        else if (strcmp(argv[i], "--stats") == 0)
+            print_stats = true;
+        else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 2;
+        } else {
+            assembler.add_file(argv[i]);
+            files++;
+        }
+    }
+
+    if (files == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    assembler.set_threads(threads);
+    if (cache_directory != 0x0 && !assembler.set_cache(cache_directory))
+        return 1;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<u8> code;
+    if (!assembler.build(code, base)) {
+        for (const as::AssemblerError& error : assembler.errors()) {
+            if (error.line != 0)
+                fprintf(stderr, "%s:%llu: %s\n", error.file.c_str(), (unsigned long long) error.line, error.message.c_str());
+            else
+                fprintf(stderr, "%s: %s\n", error.file.c_str(), error.message.c_str());
+        }
+        return 1;
+    }
+
+    if (!vm::BytecodeImage::write(output_path, code.data(), code.size()))
+        return 1;
+
+    if (print_stats) {
+        double elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        as::AssemblerStats stats = assembler.statistics();
+        fprintf(stderr, "%llu files (%llu parsed in %llu chunks, %llu cached), %llu bytes, %.2f ms\n",
+            (unsigned long long) stats.units, (unsigned long long) stats.parsed, (unsigned long long) stats.chunks,
+            (unsigned long long) stats.cached, (unsigned long long) stats.code_bytes, elapsed);
+    }
+    return 0;
+}
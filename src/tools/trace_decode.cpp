@@ -0,0 +1,137 @@
+/**
+ * SemiAssembly / sasm tools
+ * @file trace_decode.cpp
+ * @author lotuspar / par0-git
+ * @brief Decode trace files written by trace_start (any/trace.h)
+ *
+ * Usage: trace_decode <trace file> [--chrome]
+ *
+ * Prints one line per event, or Chrome trace JSON (chrome://tracing, Perfetto) with --chrome.
+ */
+
+#include "../any/trace.h"
+#include <string> // std::string
+#include <vector> // std::vector
+#include <stdio.h> // printf
+#include <string.h> // strcmp
+
+using namespace sasm;
+
+static const char* kOperationNames[kTraceOperationCount] = {
+    "read", "write", "fill", "move", "compare", "atomic", "view", "remap"
+};
+
+static const char* kResultNames[] = {
+    "success", "locked", "out_of_bounds", "unsupported", "misaligned"
+};
+
+static std::vector<std::string> names;
+static bool chrome = false;
+static bool first_event = true;
+static bool started = false;
+
+static const char* operation_name(u8 operation) {
+    return operation < kTraceOperationCount ? kOperationNames[operation] : "unknown";
+}
+
+static const char* result_name(u8 result) {
+    return result < sizeof(kResultNames) / sizeof(kResultNames[0]) ? kResultNames[result] : "unknown";
+}
+
+static std::string device_name(u32 id) {
+    if (id < names.size() && !names[id].empty())
+        return names[id];
+    return "device" + std::to_string(id);
+}
+
+// Escape a string for JSON
+static std::string escape(const std::string& text) {
+    std::string result;
+    for (char c : text) {
+        if (c == '"' || c == '\\')
+            result += '\\';
+        if ((u8) c >= 0x20)
+            result += c;
+    }
+    return result;
+}
+
+// Print the start of the Chrome trace JSON once, after the header was checked
+static void start_output() {
+    if (chrome && !started)
+        printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    started = true;
+}
+
+static void print_event(u32 thread, const TraceEvent& event) {
+    start_output();
+    std::string device = device_name(event.device);
+    if (!chrome) {
+        printf("%14.3f T%-3u %-20s %-8s 0x%016llx %10u %s\n", event.timestamp / 1000.0, thread, device.c_str(),
+            operation_name(event.operation), (unsigned long long) event.address, event.size, result_name(event.result));
+        return;
+    }
+
+    printf("%s\n    {\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"ts\": %.3f, \"pid\": 1, \"tid\": %u, "
+        "\"args\": {\"device\": %u, \"address\": \"0x%llx\", \"size\": %u, \"result\": \"%s\"}}",
+        first_event ? "" : ",", operation_name(event.operation), escape(device).c_str(), event.timestamp / 1000.0, thread,
+        event.device, (unsigned long long) event.address, event.size, result_name(event.result));
+    first_event = false;
+}
+
+static void print_dropped(u32 thread, u64 amount) {
+    start_output();
+    if (!chrome) {
+        printf("# T%u dropped %llu events\n", thread, (unsigned long long) amount);
+        return;
+    }
+
+    printf("%s\n    {\"name\": \"dropped\", \"ph\": \"i\", \"s\": \"t\", \"ts\": 0, \"pid\": 1, \"tid\": %u, \"args\": {\"events\": %llu}}",
+        first_event ? "" : ",", thread, (unsigned long long) amount);
+    first_event = false;
+}
+
+// Prints records as trace_read finds them
+struct Printer : TraceVisitor {
+    void event(u32 thread, const TraceEvent& event) override { print_event(thread, event); }
+    void dropped(u32 thread, u64 amount) override { print_dropped(thread, amount); }
+
+    void name(u32 id, const std::string& name) override {
+        if (id >= names.size())
+            names.resize(id + 1);
+        names[id] = name;
+    }
+};
+
+int main(int argc, char** argv) {
+    if (argc < 2 || (argc > 2 && strcmp(argv[2], "--chrome") != 0)) {
+        fprintf(stderr, "Usage: %s <trace file> [--chrome]\n", argv[0]);
+        return 2;
+    }
+    chrome = argc > 2;
+
+    Printer printer;
+    u8 result = trace_read(argv[1], printer);
+
+    if (result != kTraceReadOpenFailed && result != kTraceReadBadHeader) {
+        start_output();
+        if (chrome)
+            printf("\n]}\n");
+    }
+
+    switch (result) {
+        case kTraceReadOpenFailed:
+            fprintf(stderr, "Failed to open %s\n", argv[1]);
+            return 1;
+        case kTraceReadBadHeader:
+            fprintf(stderr, "%s isn't a trace file of this version\n", argv[1]);
+            return 1;
+        case kTraceReadTruncated:
+            fprintf(stderr, "Trace file is truncated\n");
+            return 1;
+        case kTraceReadUnknownRecord:
+            fprintf(stderr, "Unknown record, stopping\n");
+            return 1;
+    }
+    return 0;
+}
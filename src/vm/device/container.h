@@ -3,11 +3,25 @@
  * @file container.h
  * @author lotuspar / par0-git
  * @brief Container class to handle multiple MemoryDevice instances
+ *
+ * Devices are mapped at container addresses, anywhere in the 64-bit address space with
+ * gaps between them. Reading a gap gives zeros, writes to gaps are dropped.
+ *
+ * The mapping can change while other threads run operations on the container. Every
+ * change publishes a new MemoryMap (read-copy-update, see any/rcu.h): operations use the
+ * map they started with, replaced maps are freed once no operation uses them. Mapping
+ * after the last device is appended to the current map without copying it. Operations
+ * themselves still run on one thread at a time, the translation caches aren't shared.
  */
 
 #pragma once
 
 #include "device.h" // MemoryDevice
+#include "tlb.h" // TranslationCache
+#include "../../any/rcu.h" // RcuReadGuard, rcu_synchronize
+#include <memory> // std::unique_ptr
+#include <mutex> // std::mutex
+#include <unordered_map> // std::unordered_map
 #include <vector> // std::vector
 
 namespace sasm {
@@ -15,6 +29,36 @@ namespace vm {
     struct MemoryMapChild {
         MemoryDevice* device;
         u64 offset; // Address handled (virtual address) in MemoryContainer
+        u64 size; // Amount of bytes handled, see MemoryContainer::resize
+
+        // End of the space handled, the device might have shrunk below the mapped size
+        u64 end() const { return offset + (size < device->size ? size : device->size); }
+    };
+
+    /**
+     * @brief Published device mapping of a MemoryContainer
+     *
+     * Children [0, count) are sorted by offset and never change once published. Children
+     * are only appended in place (the count is published after the child is written),
+     * every other change creates a new map.
+     */
+    struct MemoryMap {
+        std::unique_ptr<MemoryMapChild[]> children;
+        u64 capacity = 0;
+        u64 count = 0;
+
+        MemoryMap(u64 _capacity) : children(new MemoryMapChild[_capacity]), capacity(_capacity) {}
+    };
+
+    /**
+     * @brief Children of a MemoryMap as seen by one operation
+     */
+    struct MemoryMapView {
+        const MemoryMapChild* children;
+        u64 count;
+
+        const MemoryMapChild& operator[](u64 index) const { return children[index]; }
+        u64 size() const { return count; }
     };
 
     class MemoryContainer : public MemoryDevice {
@@ -22,19 +66,192 @@ namespace vm {
             // constructor: Creates a MemoryContainer
             MemoryContainer() {
                 unset(MemoryDeviceStatus::kSafe); // Doesn't need Out-of-Bounds checking  
+                map = new MemoryMap(kInitialCapacity);
             }
+            ~MemoryContainer() {
+                for (MemoryMap* previous : retired)
+                    delete previous;
+                delete map;
+            }
+
+            MemoryContainer(const MemoryContainer&) = delete;
+            MemoryContainer& operator=(const MemoryContainer&) = delete;
+
+            // MemoryView of container addresses, hidden by the mapping view() otherwise
+            using MemoryDevice::view;
 
             /**
-             * @brief Make this container start handling a new device
+             * @brief Make this container start handling a new device, mapped after the last one
              * 
              * @param device Pointer to MemoryDevice
              */
             MemoryContainer& handle(MemoryDevice* device) {
-                devices.push_back(device); // Push pointer to vector
-                remap(); // Remap container
+                map_at(size, device);
                 return *this; // Return self
             }
 
+            /**
+             * @brief Map a device at a container address
+             * 
+             * Mapping after every other device is amortized O(1), elsewhere the map is copied.
+             * 
+             * @param addr Container address of the first byte of the device
+             * @param device Pointer to MemoryDevice, has to stay valid until unmapped
+             * @return true on success, false if the device is mapped already or the space is used
+             */
+            bool map_at(vptr addr, MemoryDevice* device) {
+                std::lock_guard<std::mutex> lock(reconfigure);
+                if (device == 0x0 || device == this || offsets.count(device) != 0) {
+                    sasm_print("Tried mapping a device twice or into itself. [%s]", uid);
+                    return false;
+                }
+
+                MemoryMapChild child = { device, addr, device->size };
+                if (child.size > ~addr) {
+                    sasm_print("Tried mapping a device past the end of the address space. [%s]", uid);
+                    return false;
+                }
+
+                // Check if the neighbours leave space for the device
+                MemoryMapView mapping = { map->children.get(), map->count };
+                u64 index = insert_position(mapping, child);
+                if ((index != 0 && overlaps(mapping[index - 1], child)) || (index != mapping.size() && overlaps(mapping[index], child))) {
+                    sasm_print("Tried mapping a device over another device. [%s]", uid);
+                    return false;
+                }
+
+                // Append in place if possible, readers only see the child once the count is published.
+                // The space was unmapped, cached translations stay valid
+                if (index == map->count && map->count < map->capacity) {
+                    map->children[index] = child;
+                    __atomic_store_n(&map->count, map->count + 1, __ATOMIC_RELEASE);
+                } else {
+                    MemoryMap* next = new MemoryMap(map->count < map->capacity ? map->capacity : map->capacity * 2);
+                    std::copy(mapping.children, mapping.children + index, next->children.get());
+                    next->children[index] = child;
+                    std::copy(mapping.children + index, mapping.children + mapping.size(), next->children.get() + index + 1);
+                    next->count = mapping.size() + 1;
+                    publish(next, false);
+                }
+
+                offsets[device] = addr;
+                if (addr + child.size > size)
+                    __atomic_store_n(&size, addr + child.size, __ATOMIC_RELEASE);
+                remapped(addr);
+                return true;
+            }
+
+            /**
+             * @brief Stop handling a device
+             * 
+             * Waits for operations still using the device, afterwards it can be destroyed. Called
+             * from inside an operation of the container (e.g. a MmioMemoryDevice handler),
+             * operations in flight may use the device until the container is changed again.
+             * 
+             * @param device Pointer to MemoryDevice
+             * @return true on success, false if the device isn't mapped
+             */
+            bool unmap(MemoryDevice* device) {
+                std::lock_guard<std::mutex> lock(reconfigure);
+                auto found = offsets.find(device);
+                if (found == offsets.end())
+                    return false;
+
+                vptr addr = found->second;
+                offsets.erase(found);
+
+                MemoryMapView mapping = { map->children.get(), map->count };
+                u64 index = child_index(mapping, device, addr);
+                if (index + 1 == mapping.size() && !rcu_reading()) {
+                    // The last child is dropped by publishing a smaller count, its slot is
+                    // reused once no operation can still see it
+                    __atomic_store_n(&map->count, map->count - 1, __ATOMIC_RELEASE);
+                    invalidate_translations();
+                    reclaim();
+                } else {
+                    MemoryMap* next = new MemoryMap(map->capacity);
+                    std::copy(mapping.children, mapping.children + index, next->children.get());
+                    std::copy(mapping.children + index + 1, mapping.children + mapping.size(), next->children.get() + index);
+                    next->count = mapping.size() - 1;
+                    publish(next, true);
+                }
+
+                // Container ends after the highest remaining device
+                const MemoryMapChild* last = map->count != 0 ? &map->children[map->count - 1] : 0x0;
+                __atomic_store_n(&size, last != 0x0 ? last->offset + last->size : 0, __ATOMIC_RELEASE);
+                remapped(addr);
+                return true;
+            }
+
+            /**
+             * @brief Change the amount of bytes handled for a mapped device
+             * 
+             * Devices are handled up to the smaller of this size and their own size. Call this
+             * after growing a device or before shrinking it.
+             * 
+             * @param device Pointer to MemoryDevice
+             * @param new_size Amount of bytes to handle
+             * @return true on success, false if the device isn't mapped or the space is used
+             */
+            bool resize(MemoryDevice* device, u64 new_size) {
+                std::lock_guard<std::mutex> lock(reconfigure);
+                auto found = offsets.find(device);
+                if (found == offsets.end())
+                    return false;
+
+                MemoryMapView mapping = { map->children.get(), map->count };
+                u64 index = child_index(mapping, device, found->second);
+                MemoryMapChild child = mapping[index];
+                child.size = new_size;
+                if (new_size > ~child.offset || (index + 1 != mapping.size() && overlaps(mapping[index + 1], child))) {
+                    sasm_print("Tried resizing a device over another device. [%s]", uid);
+                    return false;
+                }
+
+                // Cached translations can cover the space given up
+                bool shrinking = new_size < mapping[index].size;
+                MemoryMap* next = new MemoryMap(map->capacity);
+                std::copy(mapping.children, mapping.children + mapping.size(), next->children.get());
+                next->children[index] = child;
+                next->count = mapping.size();
+                publish(next, shrinking);
+
+                const MemoryMapChild& last = next->children[next->count - 1];
+                __atomic_store_n(&size, last.offset + last.size, __ATOMIC_RELEASE);
+                remapped(child.offset);
+                return true;
+            }
+
+            /**
+             * @brief Stop handling every device
+             */
+            void clear() {
+                std::lock_guard<std::mutex> lock(reconfigure);
+                if (map->count == 0)
+                    return;
+
+                offsets.clear();
+                publish(new MemoryMap(kInitialCapacity), true);
+                __atomic_store_n(&size, 0, __ATOMIC_RELEASE);
+                remapped(0);
+            }
+
+            /**
+             * @brief Get the container address a device is mapped at
+             * 
+             * @param device Pointer to MemoryDevice
+             * @param addr_out [OUT] Container address of the device
+             * @return true if the device is mapped
+             */
+            bool address_of(MemoryDevice* device, vptr* addr_out) {
+                std::lock_guard<std::mutex> lock(reconfigure);
+                auto found = offsets.find(device);
+                if (found == offsets.end())
+                    return false;
+                *addr_out = found->second;
+                return true;
+            }
+
             /**
              * @brief Finds the MemoryDevice handling the provided container address
              * 
@@ -43,23 +260,24 @@ namespace vm {
              * @return Found MemoryDevice pointer, 0x0 for nothing
              */
             MemoryDevice* find(vptr addr, u64* offset_out = 0x0) {
-                u64 offset = 0x0;
-                for (u8 i = 0; i < devices.size(); i++) {
-                    // device_start_boundary == offset
-                    u64 device_end_boundary = offset + devices[i]->size; // Position (virtual) of last virtual address handled by device
+                RcuReadGuard guard;
+                MemoryMapView mapping = view();
 
-                    // Check if provided address is within the space handled by the device
-                    if (addr >= offset && addr <= device_end_boundary) {
-                        if (offset_out != 0x0)
-                            *offset_out = offset;
+                // Binary search for the last child starting at or before the address
+                u64 index = lower_child(mapping, addr);
+                if (index >= mapping.size())
+                    return 0x0;
 
-                        return devices[i];
-                    }
+                const MemoryMapChild& child = mapping[index];
 
-                    // Add to offset
-                    offset += devices[i]->size;
-                }
-                return 0x0;
+                // Check if provided address is within the space handled by the device
+                if (addr < child.offset || addr >= child.end())
+                    return 0x0;
+
+                if (offset_out != 0x0)
+                    *offset_out = child.offset;
+
+                return child.device;
             }
 
             /**
@@ -70,20 +288,28 @@ namespace vm {
              * @param output Pointer to read bytes to
              */
             void bare_read(vptr offset, u64 amount, void* output) {
-                // operation_position: incremented as more devices are written to 
-                u8* operation_position = (u8*) output;
-
-                // Iterate over all device mappings
-                for (u8 i = 0; i < mapping.size(); i++) {
-                    u64 device_offset = 0;
-                    u64 device_amount = multi_device_operation(mapping[i], offset, amount, &device_offset);
-                    if (device_amount == 0)
-                        continue; // Nothing should be done to this device
+                read_devices(offset, amount, output);
+            }
 
-                    // Read from device
-                    mapping[i].device->read(device_offset, device_amount, operation_position);
-                    operation_position += device_amount;
-                }
+            /**
+             * @brief Read like read(), but report devices refusing their part of the operation
+             * 
+             * read() only fails if the container itself is locked, failures of the handled
+             * devices (locked, failing handler, ...) are dropped there.
+             * 
+             * @param offset Container address to start operation at
+             * @param amount Amount of bytes to read
+             * @param output Pointer to read bytes to
+             * @return (u8 / DeviceOperationResult) Result of the container, otherwise the first failure of a device
+             */
+            u8 read_checked(vptr offset, u64 amount, void* output) {
+                if (check(MemoryDeviceStatus::kReadLocked))
+                    return failed(kTraceRead, offset, amount, DeviceOperationResult::kLocked);
+
+                u8 result = read_devices(offset, amount, output);
+                if (result == DeviceOperationResult::kSuccess)
+                    completed(kTraceRead, offset, amount, 0);
+                return result;
             }
 
             /**
@@ -94,31 +320,449 @@ namespace vm {
              * @param output Pointer to write bytes from
              */
             void bare_write(vptr offset, u64 amount, void* input) {
-                // operation_position: incremented as more devices are written to 
-                u8* operation_position = (u8*) input;
+                write_devices(offset, amount, input);
+            }
 
-                // Iterate over all device mappings
-                for (u8 i = 0; i < mapping.size(); i++) {
+            /**
+             * @brief Write like write(), but report devices refusing their part of the operation
+             * 
+             * @param offset Container address to start operation at
+             * @param amount Amount of bytes to write
+             * @param input Pointer to write bytes from
+             * @return (u8 / DeviceOperationResult) Result of the container, otherwise the first failure of a device
+             */
+            u8 write_checked(vptr offset, u64 amount, void* input) {
+                if (check(MemoryDeviceStatus::kWriteLocked))
+                    return failed(kTraceWrite, offset, amount, DeviceOperationResult::kLocked);
+
+                u8 result = write_devices(offset, amount, input);
+                if (result == DeviceOperationResult::kSuccess)
+                    completed(kTraceWrite, offset, 0, amount);
+                return result;
+            }
+
+            /**
+             * @brief Set an amount of bytes starting at the provided container address to a value
+             * 
+             * @param offset Container address to start operation at
+             * @param amount Amount of bytes to set
+             * @param value Value to set bytes to
+             */
+            void bare_fill(vptr offset, u64 amount, u8 value) {
+                if (amount == 0)
+                    return;
+
+                RcuReadGuard guard;
+                MemoryMapView mapping = view();
+                u64 operation_last = last_address(offset, amount);
+
+                for (u64 i = lower_child(mapping, offset); i < mapping.size() && mapping[i].offset <= operation_last; i++) {
                     u64 device_offset = 0;
                     u64 device_amount = multi_device_operation(mapping[i], offset, amount, &device_offset);
+                    if (device_amount == 0)
+                        continue; // Nothing should be done to this device
+
+                    mapping[i].device->fill(device_offset, device_amount, value);
+                }
+            }
+
+            /**
+             * @brief Copy bytes between two container addresses, the ranges may overlap
+             * 
+             * @param destination Container address to copy bytes to
+             * @param source Container address to copy bytes from
+             * @param amount Amount of bytes to copy
+             */
+            void bare_move(vptr destination, vptr source, u64 amount) {
+                RcuReadGuard guard;
+                MemoryMapView mapping = view();
+
+                // Let the device handle it if both ranges are inside the same device
+                u64 source_child = lower_child(mapping, source);
+                if (source_child < mapping.size() && source_child == lower_child(mapping, destination)) {
+                    const MemoryMapChild& child = mapping[source_child];
+                    u64 source_offset = 0, destination_offset = 0;
+                    if (multi_device_operation(child, source, amount, &source_offset) == amount &&
+                        multi_device_operation(child, destination, amount, &destination_offset) == amount) {
+                        child.device->move(destination_offset, source_offset, amount);
+                        return;
+                    }
+                }
 
+                // Spans several devices, copy through bare_read / bare_write
+                MemoryDevice::bare_move(destination, source, amount);
+            }
+
+            /**
+             * @brief Compare an amount of bytes starting at the provided container address with the other pointer
+             * 
+             * @param offset Container address to start operation at
+             * @param amount Amount of bytes to compare
+             * @param other Pointer to bytes to compare against
+             * @return int 0 if equal, otherwise difference of the first differing bytes (container - other)
+             */
+            int bare_compare(vptr offset, u64 amount, const void* other) {
+                if (amount == 0)
+                    return 0;
+
+                RcuReadGuard guard;
+                MemoryMapView mapping = view();
+                u64 operation_last = last_address(offset, amount);
+
+                for (u64 i = lower_child(mapping, offset); i < mapping.size() && mapping[i].offset <= operation_last; i++) {
+                    u64 device_offset = 0;
+                    u64 device_amount = multi_device_operation(mapping[i], offset, amount, &device_offset);
                     if (device_amount == 0)
                         continue; // Nothing should be done to this device
 
-                    // Write to device
-                    mapping[i].device->write(device_offset, device_amount, operation_position);
-                    operation_position += device_amount;
+                    int result = 0;
+                    const u8* operation_position = ((const u8*) other) + (mapping[i].offset + device_offset - offset);
+                    mapping[i].device->compare(device_offset, device_amount, operation_position, &result);
+                    if (result != 0)
+                        return result;
+                }
+                return 0;
+            }
+
+            /**
+             * @brief Get a host pointer to memory of the device handling a container address range
+             * 
+             * Only available when the range stays inside one unlocked device with direct memory.
+             * The pointer can be written, so the range counts as written.
+             * 
+             * @param offset Container address of the range
+             * @param amount Amount of bytes in the range
+             * @return u8* Host pointer, 0x0 if not available
+             */
+            u8* bare_direct(vptr offset, u64 amount) {
+                return bare_view(offset, amount, MemoryViewAccess::kViewReadWrite);
+            }
+
+            /**
+             * @brief Get a host pointer to memory of the device handling a container address range
+             * 
+             * Like bare_direct, but the range only counts as written if access includes kViewWrite
+             * 
+             * @param offset Container address of the range
+             * @param amount Amount of bytes in the range
+             * @param access What the pointer is used for (MemoryViewAccess)
+             * @return u8* Host pointer, 0x0 if not available
+             */
+            u8* bare_view(vptr offset, u64 amount, u8 access) {
+                RcuReadGuard guard;
+                MemoryMapView mapping = view();
+                u64 index = lower_child(mapping, offset);
+                if (index >= mapping.size())
+                    return 0x0;
+
+                const MemoryMapChild& child = mapping[index];
+                u64 device_offset = 0;
+                if (multi_device_operation(child, offset, amount, &device_offset) != amount)
+                    return 0x0; // Range spans several devices
+
+                // The pointer bypasses the checks of the device
+                if (child.device->check(MemoryDeviceStatus::kReadLocked) || child.device->check(MemoryDeviceStatus::kWriteLocked))
+                    return 0x0;
+
+                // Writes through the pointer bypass write tracking of the device
+                if (access & MemoryViewAccess::kViewWrite)
+                    child.device->mark_dirty(device_offset, amount);
+                return child.device->bare_view(device_offset, amount, access);
+            }
+
+            /**
+             * @brief Run a batch of reads and writes on the handled devices
+             * 
+             * Segments inside a page with a cached host translation are copied directly. The
+             * others are ordered by address at device granularity (a stable counting sort over
+             * the device mapping), then the segments of every device are handed to that device
+             * as one batch, so each device checks its lock state once. Segments spanning several
+             * devices are split like bare_read / bare_write. Segments not inside the container
+             * fail with kOutOfBounds.
+             * 
+             * @param segments Segments to run, see MemoryDevice::submit
+             * @param count Amount of segments
+             */
+            void bare_submit(MemorySegment* segments, u64 count) {
+                RcuReadGuard guard;
+                MemoryMapView mapping = view();
+
+                // Scratch space is local, devices handling a batch can submit to this container again
+                std::vector<u64> batch_count(mapping.size() + 1, 0); // Segments per device, then start of every device run
+                std::vector<u64> batch_child; // Pairs of segment index / mapping child index
+                read_cache.validate(current_translation_epoch());
+                write_cache.validate(current_translation_epoch());
+
+                // Find the device of every valid segment
+                u64 child_index = 0;
+                for (u64 i = 0; i < count; i++) {
+                    MemorySegment& segment = segments[i];
+                    if (segment.result != DeviceOperationResult::kSuccess || segment.amount == 0)
+                        continue;
+
+                    // Fast path: segment inside a recently used page with host memory
+                    bool write = segment.kind == MemorySegmentKind::kSegmentWrite;
+                    TranslationCache& cache = write ? write_cache : read_cache;
+                    TranslationCacheEntry* entry = cache.lookup(segment.offset, segment.amount);
+                    sasm_metric(metrics_id, entry != 0x0 ? kMetricCacheHits : kMetricCacheMisses, 1);
+                    if (entry != 0x0 && entry->host != 0x0) {
+                        u8* host = entry->host + (segment.offset - entry->start);
+                        if (write) {
+                            memcpy(host, segment.buffer, segment.amount);
+                            sasm_metric(entry->device->metrics_id, kMetricWrites, 1);
+                            sasm_metric(entry->device->metrics_id, kMetricBytesWritten, segment.amount);
+                        } else {
+                            memcpy(segment.buffer, host, segment.amount);
+                            sasm_metric(entry->device->metrics_id, kMetricReads, 1);
+                            sasm_metric(entry->device->metrics_id, kMetricBytesRead, segment.amount);
+                        }
+                        continue;
+                    }
+
+                    // Batches are often sorted, check the device of the previous segment first
+                    if (child_index >= mapping.size() || segment.offset < mapping[child_index].offset ||
+                        segment.offset >= mapping[child_index].end())
+                        child_index = lower_child(mapping, segment.offset);
+
+                    // Check if the segment is handled by any device
+                    if (!within(segment.offset, segment.amount) || child_index >= mapping.size() || mapping[child_index].offset > segment.offset ||
+                        segment.offset >= mapping[child_index].end()) {
+                        segment.result = failed(write ? kTraceWrite : kTraceRead, segment.offset, segment.amount, DeviceOperationResult::kOutOfBounds);
+                        continue;
+                    }
+
+                    // Segment spans several devices
+                    const MemoryMapChild& child = mapping[child_index];
+                    if (segment.amount > child.end() - segment.offset) {
+                        sasm_metric(metrics_id, kMetricCrossings, 1);
+                        submit_spanning(mapping, segment, child_index);
+                        continue;
+                    }
+
+                    // Remember translation for later segments / batches
+                    if (entry == 0x0)
+                        cache_translation(cache, child, segment.offset, write ? MemoryDeviceStatus::kWriteLocked : MemoryDeviceStatus::kReadLocked);
+
+                    batch_child.push_back(i);
+                    batch_child.push_back(child_index);
+                    batch_count[child_index + 1]++;
+                }
+
+                if (batch_child.empty())
+                    return;
+
+                // Start of every device run in batch_group
+                for (u64 i = 1; i < batch_count.size(); i++)
+                    batch_count[i] += batch_count[i - 1];
+
+                // Place segments into their device run, in device addresses
+                std::vector<u64> batch_order(batch_child.size() / 2); // Segment index of every batch_group entry
+                std::vector<MemorySegment> batch_group(batch_child.size() / 2); // Segments grouped per device
+                for (u64 i = 0; i < batch_child.size(); i += 2) {
+                    MemorySegment& segment = segments[batch_child[i]];
+                    u64 position = batch_count[batch_child[i + 1]]++;
+                    batch_order[position] = batch_child[i];
+                    batch_group[position] = MemorySegment {segment.offset - mapping[batch_child[i + 1]].offset, segment.amount, segment.buffer, segment.kind};
+                }
+
+                // batch_count[i] is now the end of the run of device i, which is where run i + 1 starts
+                u64 run_start = 0;
+                for (u64 i = 0; i < mapping.size(); i++) {
+                    u64 run_end = batch_count[i];
+                    if (run_end != run_start)
+                        mapping[i].device->submit(batch_group.data() + run_start, run_end - run_start);
+                    run_start = run_end;
                 }
+
+                // Copy results back
+                for (u64 i = 0; i < batch_order.size(); i++)
+                    segments[batch_order[i]].result = batch_group[i].result;
             }
+
+            /**
+             * @brief Change the amount of entries in the translation caches
+             * 
+             * @param entries Amount of entries per cache, rounded up to a power of two
+             */
+            void set_translation_cache_size(u64 entries) {
+                read_cache.resize(entries);
+                write_cache.resize(entries);
+            }
+
+            /**
+             * @brief Get the access counters of the container and every handled device
+             * 
+             * @param samples_out [OUT] Samples are appended, container first
+             */
+            void metrics_samples(std::vector<MetricsSample>* samples_out) {
+                RcuReadGuard guard;
+                MemoryMapView mapping = view();
+                samples_out->push_back(metrics_sample());
+                for (u64 i = 0; i < mapping.size(); i++)
+                    samples_out->push_back(mapping[i].device->metrics_sample());
+            }
+
+            /**
+             * @brief Get hit/miss counters of the read and write translation caches
+             */
+            TranslationCacheStats read_translation_stats() { return read_cache.statistics(); }
+            TranslationCacheStats write_translation_stats() { return write_cache.statistics(); }
             
         private:
-            std::vector<MemoryDevice*> devices;
-            std::vector<MemoryMapChild> mapping;
+            static const u64 kInitialCapacity = 8;
+
+            MemoryMap* map; // Published with release, loaded by view()
+            std::vector<MemoryMap*> retired; // Replaced maps, freed once no operation can use them
+
+            // Serializes changes of the mapping, operations don't take it
+            std::mutex reconfigure;
+            std::unordered_map<MemoryDevice*, vptr> offsets; // Container address of every mapped device
+
+            // Direct-mapped caches of recently used translations
+            TranslationCache read_cache;
+            TranslationCache write_cache;
+
+            /**
+             * @brief Internal function to read from the handled devices, see bare_read
+             * 
+             * @return (u8 / DeviceOperationResult) First failure of a device, kSuccess otherwise
+             */
+            u8 read_devices(vptr offset, u64 amount, void* output) {
+                RcuReadGuard guard;
+
+                // Fast path: operation handled by a single recently used device
+                read_cache.validate(current_translation_epoch());
+                if (TranslationCacheEntry* entry = read_cache.lookup(offset, amount)) {
+                    sasm_metric(metrics_id, kMetricCacheHits, 1);
+                    if (entry->host != 0x0) {
+                        memcpy(output, entry->host + (offset - entry->start), amount);
+                        sasm_metric(entry->device->metrics_id, kMetricReads, 1);
+                        sasm_metric(entry->device->metrics_id, kMetricBytesRead, amount);
+                        return DeviceOperationResult::kSuccess;
+                    }
+                    return entry->device->read(offset - entry->base, amount, output);
+                }
+                sasm_metric(metrics_id, kMetricCacheMisses, 1);
+
+                if (amount == 0)
+                    return DeviceOperationResult::kSuccess;
+
+                MemoryMapView mapping = view();
+                u64 operation_last = last_address(offset, amount);
+                u64 covered = 0; // Bytes of the output read or zeroed
+                u8 result = DeviceOperationResult::kSuccess;
+
+                // Only visit the device mappings overlapping the operation
+                for (u64 i = lower_child(mapping, offset); i < mapping.size() && mapping[i].offset <= operation_last; i++) {
+                    u64 device_offset = 0;
+                    u64 device_amount = multi_device_operation(mapping[i], offset, amount, &device_offset);
+                    if (device_amount == 0)
+                        continue; // Nothing should be done to this device
+
+                    // Remember translation if the device handles the whole operation
+                    if (device_amount == amount)
+                        cache_translation(read_cache, mapping[i], offset, MemoryDeviceStatus::kReadLocked);
+                    else if (mapping[i].offset + device_offset == offset)
+                        sasm_metric(metrics_id, kMetricCrossings, 1); // Starts here, continues in the next device
+
+                    // Unmapped space before the device reads as zero
+                    u64 output_offset = mapping[i].offset + device_offset - offset;
+                    if (output_offset > covered)
+                        bulk_fill(((u8*) output) + covered, 0, output_offset - covered);
+                    covered = output_offset + device_amount;
+
+                    // Read from device
+                    u8 device_result = mapping[i].device->read(device_offset, device_amount, ((u8*) output) + output_offset);
+                    if (result == DeviceOperationResult::kSuccess)
+                        result = device_result;
+                }
+
+                if (amount > covered)
+                    bulk_fill(((u8*) output) + covered, 0, amount - covered);
+                return result;
+            }
+
+            /**
+             * @brief Internal function to write to the handled devices, see bare_write
+             * 
+             * @return (u8 / DeviceOperationResult) First failure of a device, kSuccess otherwise
+             */
+            u8 write_devices(vptr offset, u64 amount, void* input) {
+                RcuReadGuard guard;
+
+                // Fast path: operation handled by a single recently used device
+                write_cache.validate(current_translation_epoch());
+                if (TranslationCacheEntry* entry = write_cache.lookup(offset, amount)) {
+                    sasm_metric(metrics_id, kMetricCacheHits, 1);
+                    if (entry->host != 0x0) {
+                        memcpy(entry->host + (offset - entry->start), input, amount);
+                        sasm_metric(entry->device->metrics_id, kMetricWrites, 1);
+                        sasm_metric(entry->device->metrics_id, kMetricBytesWritten, amount);
+                        return DeviceOperationResult::kSuccess;
+                    }
+                    return entry->device->write(offset - entry->base, amount, input);
+                }
+                sasm_metric(metrics_id, kMetricCacheMisses, 1);
+
+                if (amount == 0)
+                    return DeviceOperationResult::kSuccess;
+
+                MemoryMapView mapping = view();
+                u64 operation_last = last_address(offset, amount);
+                u8 result = DeviceOperationResult::kSuccess;
+
+                // Only visit the device mappings overlapping the operation, writes to unmapped space are dropped
+                for (u64 i = lower_child(mapping, offset); i < mapping.size() && mapping[i].offset <= operation_last; i++) {
+                    u64 device_offset = 0;
+                    u64 device_amount = multi_device_operation(mapping[i], offset, amount, &device_offset);
+                    if (device_amount == 0)
+                        continue; // Nothing should be done to this device
+
+                    // Remember translation if the device handles the whole operation
+                    if (device_amount == amount)
+                        cache_translation(write_cache, mapping[i], offset, MemoryDeviceStatus::kWriteLocked);
+                    else if (mapping[i].offset + device_offset == offset)
+                        sasm_metric(metrics_id, kMetricCrossings, 1); // Starts here, continues in the next device
+
+                    // Write to device
+                    u8* operation_position = ((u8*) input) + (mapping[i].offset + device_offset - offset);
+                    u8 device_result = mapping[i].device->write(device_offset, device_amount, operation_position);
+                    if (result == DeviceOperationResult::kSuccess)
+                        result = device_result;
+                }
+                return result;
+            }
+
+            /**
+             * @brief Internal function to run a batch segment spanning multiple MemoryDevices
+             * 
+             * @param mapping Mapping the operation started with
+             * @param segment Segment to run, result is set to the first failure of a device
+             * @param first_child Index of the mapping child handling the start of the segment
+             */
+            void submit_spanning(MemoryMapView mapping, MemorySegment& segment, u64 first_child) {
+                u64 operation_last = last_address(segment.offset, segment.amount);
+
+                for (u64 i = first_child; i < mapping.size() && mapping[i].offset <= operation_last; i++) {
+                    u64 device_offset = 0;
+                    u64 device_amount = multi_device_operation(mapping[i], segment.offset, segment.amount, &device_offset);
+                    if (device_amount == 0)
+                        continue; // Nothing should be done to this device
+
+                    u8* operation_position = ((u8*) segment.buffer) + (mapping[i].offset + device_offset - segment.offset);
+                    u8 result = segment.kind == MemorySegmentKind::kSegmentWrite
+                        ? mapping[i].device->write(device_offset, device_amount, operation_position)
+                        : mapping[i].device->read(device_offset, device_amount, operation_position);
+
+                    if (segment.result == DeviceOperationResult::kSuccess)
+                        segment.result = result;
+                }
+            }
 
             /**
              * @brief Internal function to help handle an operation spanning multiple MemoryDevices
              * 
-             * This function returns a few values to help with the operation
+             * Clamps the operation to the space handled by the device
              * 
              * @param child Memory container mapping child for the device
              * @param position Position in memory to start operation at
@@ -126,83 +770,176 @@ namespace vm {
              * @param offset_out [OUT] Position into device memory operation should start at
              * @return u64 Amount of bytes for device to handle
              */
-            u64 multi_device_operation(MemoryMapChild& child, u64 position, u64 amount, u64* offset_out) {
-                // Check if device mapping is related to operation
-                // Make sure address isn't before what this device is meant to handle
-                if (position > child.offset + child.device->size) 
-                    return 0;
+            u64 multi_device_operation(const MemoryMapChild& child, u64 position, u64 amount, u64* offset_out) {
+                // Ends are inclusive, operations can end at the top of the address space
+                u64 device_end = child.end();
+                if (amount == 0 || device_end == child.offset)
+                    return 0; // Nothing handled
 
                 // device_start_bounds / child.offset: first address handled by device
                 // device_end_bounds: last address handled by device
-                u64 device_end_bounds = child.offset + (child.device->size - 1);
+                u64 device_end_bounds = device_end - 1;
 
-                // operation_start_bounds / position: first address written to by operation
-                // operation_end_bounds: last address written to by operation
-                u64 operation_end_bounds = position + (amount - 1);
+                // operation_end_bounds: last address handled by operation
+                u64 operation_end_bounds = last_address(position, amount);
 
-                // Check if device is surrounded
-                // "Operation Start <= Device Start && Operation End >= Device End"
-                if (position <= child.offset && operation_end_bounds >= device_end_bounds) {
-                    if (offset_out != 0x0)
-                        *offset_out = 0; // Operation should deal with whole device, so start at beginning
+                // Intersection of both ranges
+                u64 start = position > child.offset ? position : child.offset;
+                u64 end = operation_end_bounds < device_end_bounds ? operation_end_bounds : device_end_bounds;
+                if (start > end)
+                    return 0; // Device mapping isn't related to operation
 
-                    // Device is fully surrounded by operation, use whole size
-                    return child.device->size;
-                }
+                if (offset_out != 0x0)
+                    *offset_out = start - child.offset;
+
+                return (end - start) + 1;
+            }
 
-                // Check if operation start is surrounded
-                // "Operation Start >= Device Start && Operation Start <= Device End"
-                if (position >= child.offset && position <= device_end_bounds) {
-                    if (offset_out != 0x0)
-                        *offset_out = position - child.offset; // Operation is currently handling first device, so start at specified offset
+            /**
+             * @brief Internal function to find the first mapping child an address could be handled by
+             * 
+             * Mapping children are sorted by offset, so this is a binary search for the last
+             * child starting at or before the address. If the address is past the end of that
+             * child (or before every child) the next child is returned instead.
+             * 
+             * @param mapping Mapping the operation started with
+             * @param addr Container address
+             * @return u64 Index into mapping, mapping.size() if there is no such child
+             */
+            u64 lower_child(MemoryMapView mapping, vptr addr) {
+                u64 low = 0;
+                u64 high = mapping.size();
+
+                // Find the first child starting after the address
+                while (low < high) {
+                    u64 middle = low + ((high - low) >> 1);
+                    if (mapping[middle].offset <= addr)
+                        low = middle + 1;
+                    else
+                        high = middle;
+                }
 
-                    // (Device End - Operation Start) + 1
-                    u64 device_amount = (device_end_bounds - position) + 1;
+                // Nothing starts at or before the address, first child is the closest one
+                if (low == 0)
+                    return 0;
 
-                    // Cap amount to operation size
-                    if (device_amount > amount)
-                        device_amount = amount;
+                // Use previous child if it still handles the address
+                const MemoryMapChild& previous = mapping[low - 1];
+                if (addr < previous.end())
+                    return low - 1;
 
-                    return device_amount;
-                }
+                return low;
+            }
 
-                // Check if operation end is surrounded
-                // "Operation End >= Device Start && Operation End <= Device End"
-                if (operation_end_bounds >= child.offset && operation_end_bounds <= device_end_bounds) {
-                    if (offset_out != 0x0)
-                        *offset_out = 0; // Operation should start at beginning
-                    
-                    // (Operation End - Device Start) + 1
-                    return (operation_end_bounds - child.offset) + 1;
-                }
+            /**
+             * @brief Internal function to cache the page of a device containing an address
+             * 
+             * @param cache Translation cache to fill
+             * @param child Memory container mapping child for the device
+             * @param addr Container address of the operation
+             * @param lock Status bit locking the device for the kind of operation, locked devices aren't cached
+             */
+            void cache_translation(TranslationCache& cache, const MemoryMapChild& child, vptr addr, MemoryDeviceStatus lock) {
+                // Part of the page handled by the device, last addresses are inclusive so the top page doesn't wrap
+                u64 page_start = addr & ~((((u64) 1) << SASM_TRANSLATION_PAGE_BITS) - 1);
+                u64 page_last = page_start + ((((u64) 1) << SASM_TRANSLATION_PAGE_BITS) - 1);
+                u64 device_last = child.end() - 1;
+                u64 start = page_start > child.offset ? page_start : child.offset;
+                u64 span = (page_last < device_last ? page_last : device_last) - start + 1;
+
+                // Epoch is read before the lock state, locking afterwards makes the entry miss
+                u64 epoch = child.device->current_translation_epoch();
+                if (child.device->check(lock))
+                    return;
+
+                // Writes through host pointers wouldn't be tracked, copies wouldn't be atomic
+                bool direct = !child.device->tracking_writes() && child.device->bare_copyable();
+                u8 access = lock == MemoryDeviceStatus::kWriteLocked ? MemoryViewAccess::kViewWrite : MemoryViewAccess::kViewRead;
+                u8* host = direct ? child.device->bare_view(start - child.offset, span, access) : 0x0;
+                cache.fill(addr, start, span, child.offset, child.device, host, &child.device->translation_epoch, epoch);
+            }
 
-                return 0;
+            // Last address of a non-empty operation, clamped to the top of the address space
+            static u64 last_address(vptr offset, u64 amount) {
+                return amount - 1 > ~offset ? ~(u64) 0 : offset + (amount - 1);
             }
 
-            void remap() {
-                // Clear memory map
-                mapping.clear();
+            // Mapping of the calling operation, valid until its RcuReadGuard ends
+            MemoryMapView view() {
+                MemoryMap* current = __atomic_load_n(&map, __ATOMIC_ACQUIRE);
+                return { current->children.get(), __atomic_load_n(&current->count, __ATOMIC_ACQUIRE) };
+            }
 
-                // Iterate over all devices and add them to the mapping
-                u64 offset = 0x0;
-                for (u8 i = 0; i < devices.size(); i++) {
-                    // Create new child
-                    MemoryMapChild child;
-                    child.device = devices[i];
-                    child.offset = offset;
+            // True if two children share any address, empty children only conflict strictly inside others
+            static bool overlaps(const MemoryMapChild& a, const MemoryMapChild& b) {
+                return a.offset < b.offset + b.size && b.offset < a.offset + a.size;
+            }
 
-                    // Add child to mapping
-                    mapping.push_back(child);
+            // Index a child is inserted at, empty children go before a device at the same address
+            static u64 insert_position(MemoryMapView mapping, const MemoryMapChild& child) {
+                u64 low = 0;
+                u64 high = mapping.size();
+                while (low < high) {
+                    u64 middle = low + ((high - low) >> 1);
+                    const MemoryMapChild& other = mapping[middle];
+                    if (other.offset > child.offset || (other.offset == child.offset && (child.size == 0 || other.size != 0)))
+                        high = middle;
+                    else
+                        low = middle + 1;
+                }
+                return low;
+            }
 
-                    // Increment offset
-                    offset += devices[i]->size;
+            // Index of the child of a mapped device
+            static u64 child_index(MemoryMapView mapping, MemoryDevice* device, vptr addr) {
+                u64 low = 0;
+                u64 high = mapping.size();
+                while (low < high) {
+                    u64 middle = low + ((high - low) >> 1);
+                    if (mapping[middle].offset < addr)
+                        low = middle + 1;
+                    else
+                        high = middle;
                 }
 
-                // Offset is now the size of all devices combined
-                size = offset;
+                // Empty devices can share the address
+                while (mapping[low].device != device)
+                    low++;
+                return low;
+            }
+
+            /**
+             * @brief Internal function to replace the published mapping
+             * 
+             * @param next New mapping, owned by the container
+             * @param invalidate True if cached translations can point to space the new mapping doesn't handle
+             */
+            void publish(MemoryMap* next, bool invalidate) {
+                retired.push_back(map);
+                __atomic_store_n(&map, next, __ATOMIC_RELEASE);
+
+                // Cached translations point to the old mapping
+                if (invalidate)
+                    invalidate_translations();
+                reclaim();
+            }
+
+            // Free replaced maps once running operations are done with them, unless the caller is one of them
+            void reclaim() {
+                if (rcu_reading())
+                    return;
+
+                rcu_synchronize();
+                for (MemoryMap* previous : retired)
+                    delete previous;
+                retired.clear();
+            }
 
+            void remapped(vptr addr) {
+                (void) addr; // Only used by traces
                 // Debug information
-                sasm_debug_print("Remapped MemoryContainer devices (%lu devices)", mapping.size());
+                sasm_debug_print("Remapped MemoryContainer devices (%lu devices)", map->count);
+                sasm_trace(trace_id, kTraceRemap, addr, map->count, DeviceOperationResult::kSuccess);
             }
     };
 }
@@ -9,14 +9,21 @@
 
 #include "../../any/number.h" // u*, vptr
 #include "../../any/debug.h" // sasm_*
+#include "../../any/memory.h" // bulk_*
+#include "../../any/atomic.h" // atomic_*
+#include "../../any/metrics.h" // sasm_metric, MetricsSnapshot
+#include "../../any/trace.h" // sasm_trace
 #include "status.h" // MemoryDeviceStatus
+#include "view.h" // MemoryView
+#include "segment.h" // MemorySegment
+#include "dirty.h" // DirtyBitmap
 #include <string.h> // strlen, memcpy?
 
 namespace sasm {
 namespace vm {
     class MemoryDevice {
     public:
-        MemoryDevice() : size (0) {}
+        MemoryDevice() : size (0) { uid[0] = 0; }
         MemoryDevice(const char* uid, u64 _size) {
             set_uid(uid);
             size = _size;
@@ -36,6 +43,7 @@ namespace vm {
                 identifier_len = 32;
 
             memcpy(uid, new_uid, identifier_len);
+            sasm_trace_name(trace_id, (const char*) uid, identifier_len - 1);
         }
 
         /**
@@ -51,19 +59,20 @@ namespace vm {
             // Check if read-locked
             if (check(MemoryDeviceStatus::kReadLocked)) {
                 sasm_debug_print("Tried reading from locked MemoryDevice. [%s]", uid);
-                return DeviceOperationResult::kLocked;
+                return failed(kTraceRead, offset, amount, DeviceOperationResult::kLocked);
             }
 
             // Check if operation OOB
             if (check(MemoryDeviceStatus::kSafe)) {
                 if (offset + amount < 0 || offset + amount > size) {
                     sasm_debug_print("Operation OOB (offset %llu, device size %llu, read end %llu)", offset, size, offset + amount);
-                    return DeviceOperationResult::kOutOfBounds;
+                    return failed(kTraceRead, offset, amount, DeviceOperationResult::kOutOfBounds);
                 }
             }
 
             // Run bare operation
             bare_read(offset, amount, output);
+            completed(kTraceRead, offset, amount, 0);
 
             // Assume success
             return DeviceOperationResult::kSuccess;
@@ -82,24 +91,261 @@ namespace vm {
             // Check if write-locked
             if (check(MemoryDeviceStatus::kWriteLocked)) {
                 sasm_debug_print("Tried writing to locked MemoryDevice. [%s]", uid);
-                return DeviceOperationResult::kLocked;
+                return failed(kTraceWrite, offset, amount, DeviceOperationResult::kLocked);
             }
                 
             // Check if operation OOB
             if (check(MemoryDeviceStatus::kSafe)) {
                 if (offset + amount < 0 || offset + amount > size) {
                     sasm_debug_print("Operation OOB (offset %llu, device size %llu, read end %llu)", offset, size, offset + amount);
-                    return DeviceOperationResult::kOutOfBounds;
+                    return failed(kTraceWrite, offset, amount, DeviceOperationResult::kOutOfBounds);
                 }
             }
 
             // Run bare operation
             bare_write(offset, amount, input);
+            completed(kTraceWrite, offset, 0, amount);
 
             // Assume success
             return DeviceOperationResult::kSuccess;
         }
 
+        /**
+         * @brief Set the specified amount of bytes at the provided location to a value
+         * 
+         * @param offset Position in device memory to operate at
+         * @param amount Amount of bytes to set
+         * @param value Value to set bytes to
+         * @return (u8 / DeviceOperationResult) Result of operation
+         */
+        u8 fill(vptr offset, u64 amount, u8 value) {
+            // Check if write-locked
+            if (check(MemoryDeviceStatus::kWriteLocked)) {
+                sasm_debug_print("Tried filling locked MemoryDevice. [%s]", uid);
+                return failed(kTraceFill, offset, amount, DeviceOperationResult::kLocked);
+            }
+
+            // Check if operation OOB
+            if (check(MemoryDeviceStatus::kSafe) && !within(offset, amount))
+                return failed(kTraceFill, offset, amount, DeviceOperationResult::kOutOfBounds);
+
+            bare_fill(offset, amount, value);
+            completed(kTraceFill, offset, 0, amount);
+            return DeviceOperationResult::kSuccess;
+        }
+
+        /**
+         * @brief Copy bytes from one location of the device to another, the locations may overlap
+         * 
+         * @param destination Position in device memory to copy bytes to
+         * @param source Position in device memory to copy bytes from
+         * @param amount Amount of bytes to copy
+         * @return (u8 / DeviceOperationResult) Result of operation
+         */
+        u8 move(vptr destination, vptr source, u64 amount) {
+            // Check if read or write locked
+            if (check(MemoryDeviceStatus::kWriteLocked) || check(MemoryDeviceStatus::kReadLocked)) {
+                sasm_debug_print("Tried moving inside locked MemoryDevice. [%s]", uid);
+                return failed(kTraceMove, destination, amount, DeviceOperationResult::kLocked);
+            }
+
+            // Check if operation OOB
+            if (check(MemoryDeviceStatus::kSafe) && (!within(destination, amount) || !within(source, amount)))
+                return failed(kTraceMove, destination, amount, DeviceOperationResult::kOutOfBounds);
+
+            bare_move(destination, source, amount);
+            completed(kTraceMove, destination, amount, amount);
+            return DeviceOperationResult::kSuccess;
+        }
+
+        /**
+         * @brief Compare the specified amount of bytes at the provided location with the other pointer
+         * 
+         * @param offset Position in device memory to operate at
+         * @param amount Amount of bytes to compare
+         * @param other Pointer to bytes to compare against
+         * @param result_out [OUT] 0 if equal, otherwise difference of the first differing bytes (device - other)
+         * @return (u8 / DeviceOperationResult) Result of operation
+         */
+        u8 compare(vptr offset, u64 amount, const void* other, int* result_out) {
+            // Check if read-locked
+            if (check(MemoryDeviceStatus::kReadLocked)) {
+                sasm_debug_print("Tried comparing locked MemoryDevice. [%s]", uid);
+                return failed(kTraceCompare, offset, amount, DeviceOperationResult::kLocked);
+            }
+
+            // Check if operation OOB
+            if (check(MemoryDeviceStatus::kSafe) && !within(offset, amount))
+                return failed(kTraceCompare, offset, amount, DeviceOperationResult::kOutOfBounds);
+
+            *result_out = bare_compare(offset, amount, other);
+            completed(kTraceCompare, offset, amount, 0);
+            return DeviceOperationResult::kSuccess;
+        }
+
+        /**
+         * @brief Run a lock-free atomic read-modify-write operation on device memory
+         * 
+         * Only possible on devices with directly addressable memory (see bare_direct). The
+         * operation is sequentially consistent.
+         * 
+         * @param offset Position in device memory of the value, has to be aligned to width
+         * @param width Size of the value (1, 2, 4 or 8)
+         * @param operation Operation to run (AtomicOperation)
+         * @param operand Value used by the operation
+         * @param old_out [OUT] Value before the operation
+         * @param expected Value compared against by kAtomicCompareExchange
+         * @return (u8 / DeviceOperationResult) Result of operation
+         */
+        u8 atomic(vptr offset, u64 width, u8 operation, u64 operand, u64* old_out, u64 expected = 0) {
+            // Check if read or write locked
+            if (check(MemoryDeviceStatus::kWriteLocked) || check(MemoryDeviceStatus::kReadLocked)) {
+                sasm_debug_print("Tried atomic operation on locked MemoryDevice. [%s]", uid);
+                return failed(kTraceAtomic, offset, width, DeviceOperationResult::kLocked);
+            }
+
+            // Check if operation OOB
+            if (check(MemoryDeviceStatus::kSafe) && !within(offset, width))
+                return failed(kTraceAtomic, offset, width, DeviceOperationResult::kOutOfBounds);
+
+            u8* host = bare_view(offset, width, MemoryViewAccess::kViewReadWrite);
+            if (host == 0x0)
+                return failed(kTraceAtomic, offset, width, DeviceOperationResult::kUnsupported);
+
+            // Check if aligned (unaligned atomics can tear across cache lines)
+            if (((u64) host) & (width - 1))
+                return failed(kTraceAtomic, offset, width, DeviceOperationResult::kMisaligned);
+
+            if (!atomic_apply(host, width, operation, operand, expected, old_out))
+                return failed(kTraceAtomic, offset, width, DeviceOperationResult::kUnsupported);
+            completed(kTraceAtomic, offset, width, width);
+
+            return DeviceOperationResult::kSuccess;
+        }
+
+        /**
+         * @brief Borrow the specified amount of bytes at the provided location
+         * 
+         * The view points directly at device memory if the device allows it, otherwise it
+         * uses a bounce buffer that is written back when the view is committed / destroyed.
+         * 
+         * @param offset Position in device memory to borrow
+         * @param amount Amount of bytes to borrow
+         * @param access What the view is used for (MemoryViewAccess)
+         * @return MemoryView View of the memory, check MemoryView::result on failure
+         */
+        MemoryView view(vptr offset, u64 amount, u8 access = MemoryViewAccess::kViewReadWrite) {
+            // Check if locked for the requested access
+            if (((access & MemoryViewAccess::kViewRead) && check(MemoryDeviceStatus::kReadLocked)) ||
+                ((access & MemoryViewAccess::kViewWrite) && check(MemoryDeviceStatus::kWriteLocked))) {
+                sasm_debug_print("Tried viewing locked MemoryDevice. [%s]", uid);
+                return MemoryView(failed(kTraceView, offset, amount, DeviceOperationResult::kLocked));
+            }
+
+            // Check if operation OOB
+            if (check(MemoryDeviceStatus::kSafe) && !within(offset, amount))
+                return MemoryView(failed(kTraceView, offset, amount, DeviceOperationResult::kOutOfBounds));
+
+            completed(kTraceView, offset, access & MemoryViewAccess::kViewRead ? amount : 0, access & MemoryViewAccess::kViewWrite ? amount : 0);
+
+            // Borrow device memory directly if possible
+            u8* host = bare_view(offset, amount, access);
+            if (host != 0x0)
+                return MemoryView(this, offset, amount, access, host, 0x0);
+
+            // Fall back to a bounce buffer
+            std::unique_ptr<u8[]> bounce(new u8[amount]);
+            if (check(MemoryDeviceStatus::kReadLocked))
+                bulk_fill(bounce.get(), 0, amount);
+            else
+                bare_read(offset, amount, bounce.get());
+
+            u8* pointer = bounce.get();
+            return MemoryView(this, offset, amount, access, pointer, std::move(bounce));
+        }
+
+        /**
+         * @brief Run a batch of reads and writes
+         * 
+         * Lock state is checked once for the whole batch. Segments are independent: each one
+         * gets its own result code and a failing segment doesn't stop the others. Segments
+         * may run in any order, so a batch shouldn't write to bytes another segment reads or
+         * writes.
+         * 
+         * @param segments Segments to run, results are stored in MemorySegment::result
+         * @param count Amount of segments
+         * @return (u8 / DeviceOperationResult) kSuccess if every segment succeeded, otherwise result of the first failed segment
+         */
+        u8 submit(MemorySegment* segments, u64 count) {
+            bool read_locked = check(MemoryDeviceStatus::kReadLocked);
+            bool write_locked = check(MemoryDeviceStatus::kWriteLocked);
+            bool safe = check(MemoryDeviceStatus::kSafe);
+
+            // Validate every segment, only valid segments reach the bare operation
+            u64 valid = 0;
+            for (u64 i = 0; i < count; i++) {
+                MemorySegment& segment = segments[i];
+                bool write = segment.kind == MemorySegmentKind::kSegmentWrite;
+                if (write ? write_locked : read_locked)
+                    segment.result = failed(write ? kTraceWrite : kTraceRead, segment.offset, segment.amount, DeviceOperationResult::kLocked);
+                else if (safe && !within(segment.offset, segment.amount))
+                    segment.result = failed(write ? kTraceWrite : kTraceRead, segment.offset, segment.amount, DeviceOperationResult::kOutOfBounds);
+                else {
+                    segment.result = DeviceOperationResult::kSuccess;
+                    valid++;
+                }
+            }
+
+            if (valid != 0)
+                bare_submit(segments, count);
+
+            for (u64 i = 0; i < count; i++) {
+                MemorySegment& segment = segments[i];
+                if (segment.result != DeviceOperationResult::kSuccess)
+                    continue;
+
+                if (segment.kind == MemorySegmentKind::kSegmentWrite)
+                    completed(kTraceWrite, segment.offset, 0, segment.amount);
+                else
+                    completed(kTraceRead, segment.offset, segment.amount, 0);
+            }
+
+            // Report the first failure
+            for (u64 i = 0; i < count; i++) {
+                if (segments[i].result != DeviceOperationResult::kSuccess) {
+                    sasm_debug_print("Batch segment %llu failed (result %u). [%s]", i, segments[i].result, uid);
+                    return segments[i].result;
+                }
+            }
+            return DeviceOperationResult::kSuccess;
+        }
+
+        /**
+         * @brief Read several ranges of device memory in one batch, see submit
+         * 
+         * @param segments Ranges to read, MemorySegment::kind is set to kSegmentRead
+         * @param count Amount of segments
+         * @return (u8 / DeviceOperationResult) kSuccess if every segment succeeded, otherwise result of the first failed segment
+         */
+        u8 readv(MemorySegment* segments, u64 count) {
+            for (u64 i = 0; i < count; i++)
+                segments[i].kind = MemorySegmentKind::kSegmentRead;
+            return submit(segments, count);
+        }
+
+        /**
+         * @brief Write several ranges of device memory in one batch, see submit
+         * 
+         * @param segments Ranges to write, MemorySegment::kind is set to kSegmentWrite
+         * @param count Amount of segments
+         * @return (u8 / DeviceOperationResult) kSuccess if every segment succeeded, otherwise result of the first failed segment
+         */
+        u8 writev(MemorySegment* segments, u64 count) {
+            for (u64 i = 0; i < count; i++)
+                segments[i].kind = MemorySegmentKind::kSegmentWrite;
+            return submit(segments, count);
+        }
+
         /**
          * @brief Easier way to write to device memory using a type rather than a pointer to a value
          * 
@@ -126,19 +372,284 @@ namespace vm {
             return output;
         }
 
-        void set(MemoryDeviceStatus bit) {status |= bit;}
-        void unset(MemoryDeviceStatus bit) {status &= ~(bit);}
-        bool check(MemoryDeviceStatus bit) {return status & (1 << bit);}
+        // Status changes invalidate cached translations (lock state is cached)
+        // Status is accessed atomically, devices can be shared between threads
+        void set(MemoryDeviceStatus bit) {__atomic_fetch_or(&status, (u8) bit, __ATOMIC_ACQ_REL); invalidate_translations();}
+        void unset(MemoryDeviceStatus bit) {__atomic_fetch_and(&status, (u8) ~(bit), __ATOMIC_ACQ_REL); invalidate_translations();}
+        bool check(MemoryDeviceStatus bit) {return __atomic_load_n(&status, __ATOMIC_ACQUIRE) & bit;}
+        u8 get_status() {return __atomic_load_n(&status, __ATOMIC_ACQUIRE);}
+        void set_status(u8 bits) {__atomic_store_n(&status, bits, __ATOMIC_RELEASE); invalidate_translations();}
+
+        /**
+         * @brief Invalidate every translation MemoryContainers cached for this device
+         * 
+         * Should be called whenever a device changes its status, size or host memory
+         */
+        void invalidate_translations() {__atomic_fetch_add(&translation_epoch, 1, __ATOMIC_ACQ_REL);}
+
+        // Current value of translation_epoch, safe to call while other threads invalidate
+        u64 current_translation_epoch() {return __atomic_load_n(&translation_epoch, __ATOMIC_ACQUIRE);}
+
+        /**
+         * @brief Start tracking writes with page granularity, see dirty_ranges
+         * 
+         * While tracking, MemoryContainers don't cache host pointers of the device so every
+         * write goes through the device. Tracking shouldn't be started / stopped while other
+         * threads use the device. Call again after the device size changed.
+         * 
+         * @param page_bits Page size as a shift (12 = 4096 byte pages)
+         */
+        void track_writes(u64 page_bits = 12) {
+            dirty.reset(new DirtyBitmap(size, page_bits));
+            invalidate_translations(); // Cached host pointers bypass tracking
+        }
+
+        // Stop tracking writes
+        void untrack_writes() {
+            dirty.reset();
+            invalidate_translations();
+        }
+
+        bool tracking_writes() { return dirty != 0x0; }
+
+        /**
+         * @brief Get the pages written since tracking started / the last clearing collection
+         * 
+         * @param ranges_out [OUT] Dirty ranges are appended, sorted by offset
+         * @param clear Mark the collected pages clean, later writes show up in the next collection
+         * @return u64 Amount of dirty bytes, 0 if not tracking
+         */
+        u64 dirty_ranges(std::vector<DirtyRange>* ranges_out, bool clear = true) {
+            return dirty ? dirty->collect(ranges_out, clear) : 0;
+        }
+
+        // Mark every page clean
+        void clear_dirty() {
+            if (dirty)
+                dirty->clear();
+        }
+
+        /**
+         * @brief Mark a range as written, for writes done through host pointers (bare_direct / views)
+         * 
+         * @param offset Position in device memory
+         * @param amount Amount of bytes
+         */
+        void mark_dirty(vptr offset, u64 amount) {
+            if (dirty)
+                dirty->mark(offset, amount);
+        }
+
+        /**
+         * @brief Get the access counters of the device, summed over every thread
+         * 
+         * @return MetricsSnapshot Counters, zero unless built with SASM_METRICS
+         */
+        MetricsSnapshot metrics() {
+#ifdef SASM_METRICS
+            return metrics_collect(metrics_id);
+#else
+            return MetricsSnapshot();
+#endif
+        }
+
+        /**
+         * @brief Get the access counters of the device with its identifier, for metrics_prometheus / metrics_json
+         */
+        MetricsSample metrics_sample() {
+            MetricsSample sample;
+            sample.name = std::string((const char*) uid, strnlen((const char*) uid, sizeof(uid)));
+#ifdef SASM_METRICS
+            sample.id = metrics_id;
+#else
+            sample.id = kMetricsNone;
+#endif
+            sample.snapshot = metrics();
+            return sample;
+        }
 
         u8 uid[32]; 
         u64 size;
+#ifdef SASM_METRICS
+        u32 metrics_id = metrics_register(); // Id the access counters of the device are kept under
+#endif
+#ifdef SASM_TRACE
+        u32 trace_id = trace_register(); // Id of the device in trace events
+#endif
+    protected:
+        // Count / trace a failed operation (TraceOperation), returns the result
+        u8 failed(u8 operation, vptr offset, u64 amount, u8 result) {
+            (void) operation; (void) offset; (void) amount; // Only used by traces / metrics
+            sasm_metric(metrics_id, kMetricFailures + result - 1, 1);
+            sasm_trace(trace_id, operation, offset, amount, result);
+            return result;
+        }
+
+        // Written pages, 0x0 if writes aren't tracked
+        std::unique_ptr<DirtyBitmap> dirty;
+
+        // Count / trace a successful operation (TraceOperation) reading / writing the provided amounts of bytes, track written pages
+        void completed(u8 operation, vptr offset, u64 bytes_read, u64 bytes_written) {
+            (void) operation; // Only used by traces
+            if (dirty && bytes_written != 0)
+                dirty->mark(offset, bytes_written);
+            sasm_trace(trace_id, operation, offset, bytes_read > bytes_written ? bytes_read : bytes_written, DeviceOperationResult::kSuccess);
+            if (bytes_read != 0) {
+                sasm_metric(metrics_id, kMetricReads, 1);
+                sasm_metric(metrics_id, kMetricBytesRead, bytes_read);
+            }
+            if (bytes_written != 0) {
+                sasm_metric(metrics_id, kMetricWrites, 1);
+                sasm_metric(metrics_id, kMetricBytesWritten, bytes_written);
+            }
+        }
+
+        // Size of the stack buffer used by operations going through bare_read / bare_write
+        static const u64 kBounceSize = 4096;
+
+        /**
+         * @brief Check if an operation stays inside the device
+         * 
+         * @param offset Position in device memory the operation starts at
+         * @param amount Amount of bytes handled by the operation
+         */
+        bool within(vptr offset, u64 amount) {
+            return offset <= size && amount <= size - offset;
+        }
+
+        // Bulk bare operations, by default these go through bare_read / bare_write in chunks
+        virtual void bare_fill(vptr offset, u64 amount, u8 value) {
+            u8 buffer[kBounceSize];
+            bulk_fill(buffer, value, amount < kBounceSize ? amount : kBounceSize);
+
+            for (u64 done = 0; done < amount;) {
+                u64 chunk = amount - done < kBounceSize ? amount - done : kBounceSize;
+                bare_write(offset + done, chunk, buffer);
+                done += chunk;
+            }
+        }
+
+        virtual void bare_move(vptr destination, vptr source, u64 amount) {
+            u8 buffer[kBounceSize];
+
+            // Copy forwards unless the destination starts inside the source
+            if (destination <= source || destination >= source + amount) {
+                for (u64 done = 0; done < amount;) {
+                    u64 chunk = amount - done < kBounceSize ? amount - done : kBounceSize;
+                    bare_read(source + done, chunk, buffer);
+                    bare_write(destination + done, chunk, buffer);
+                    done += chunk;
+                }
+                return;
+            }
+
+            // Copy backwards
+            for (u64 remaining = amount; remaining > 0;) {
+                u64 chunk = remaining < kBounceSize ? remaining : kBounceSize;
+                remaining -= chunk;
+                bare_read(source + remaining, chunk, buffer);
+                bare_write(destination + remaining, chunk, buffer);
+            }
+        }
+
+        virtual int bare_compare(vptr offset, u64 amount, const void* other) {
+            u8 buffer[kBounceSize];
+            const u8* other_u8p = (const u8*) other;
+
+            for (u64 done = 0; done < amount;) {
+                u64 chunk = amount - done < kBounceSize ? amount - done : kBounceSize;
+                bare_read(offset + done, chunk, buffer);
+
+                int result = bulk_compare(buffer, other_u8p + done, chunk);
+                if (result != 0)
+                    return result;
+
+                done += chunk;
+            }
+            return 0;
+        }
+
+        /**
+         * @brief Bare batch operation, runs every segment whose result is still kSuccess
+         * 
+         * By default segments go through bare_read / bare_write one by one. Segments that
+         * fail while running have their result changed.
+         */
+        virtual void bare_submit(MemorySegment* segments, u64 count) {
+            for (u64 i = 0; i < count; i++) {
+                MemorySegment& segment = segments[i];
+                if (segment.result != DeviceOperationResult::kSuccess)
+                    continue;
+
+                if (segment.kind == MemorySegmentKind::kSegmentWrite)
+                    bare_write(segment.offset, segment.amount, segment.buffer);
+                else
+                    bare_read(segment.offset, segment.amount, segment.buffer);
+            }
+        }
+
     private:
+        friend class MemoryContainer;
+        friend class MemoryView;
+
         // Current status of device
         u8 status = MemoryDeviceStatus::kHeader | MemoryDeviceStatus::kSafe;
 
+        // Incremented when translations cached for the device become invalid
+        u64 translation_epoch = 0;
+
         // Bare operations (operations without checks for validity)
         virtual void bare_read(vptr offset, u64 amount, void* output) = 0;
         virtual void bare_write(vptr offset, u64 amount, void* input) = 0;
+
+        /**
+         * @brief Get a host pointer to device memory, if the device memory is directly addressable
+         * 
+         * @param offset Position in device memory
+         * @param amount Amount of bytes the pointer has to be valid for
+         * @return u8* Host pointer, 0x0 if not available
+         */
+        virtual u8* bare_direct(vptr /* offset */, u64 /* amount */) { return 0x0; }
+
+        /**
+         * @brief Get a host pointer for a view / atomic operation, see bare_direct
+         * 
+         * Devices handling their memory through other devices count the range as written
+         * in those devices when access includes kViewWrite.
+         * 
+         * @param offset Position in device memory
+         * @param amount Amount of bytes the pointer has to be valid for
+         * @param access What the pointer is used for (MemoryViewAccess)
+         * @return u8* Host pointer, 0x0 if not available
+         */
+        virtual u8* bare_view(vptr offset, u64 amount, u8 /* access */) { return bare_direct(offset, amount); }
+
+        /**
+         * @brief True if reads / writes can be plain copies through the bare_direct pointer
+         * 
+         * MemoryContainers only cache host pointers of such devices. Devices whose accesses
+         * have to stay atomic return false, their pointer is only used by atomic() and views.
+         */
+        virtual bool bare_copyable() { return true; }
     };
+    u8 MemoryView::commit() {
+        u8 result = DeviceOperationResult::kSuccess;
+
+        // Write bounce buffer back
+        if (bounce && device != 0x0 && (access & MemoryViewAccess::kViewWrite)) {
+            if (device->check(MemoryDeviceStatus::kWriteLocked))
+                result = DeviceOperationResult::kLocked;
+            else {
+                device->bare_write(offset, length, bounce.get());
+                device->mark_dirty(offset, length);
+            }
+        }
+
+        device = 0x0;
+        pointer = 0x0;
+        length = 0;
+        bounce.reset();
+        return result;
+    }
 }
 }
\ No newline at end of file
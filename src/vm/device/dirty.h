@@ -0,0 +1,116 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file dirty.h
+ * @author lotuspar / par0-git
+ * @brief Page granularity write tracking for memory devices
+ *
+ * A DirtyBitmap has one bit per page of a device, set by every write going through
+ * the device. Collecting the dirty ranges clears the bits word by word with an atomic
+ * exchange, so a write racing with a collection is either in this collection or the
+ * next one, never lost.
+ */
+
+#pragma once
+
+#include "../../any/number.h" // u*, vptr
+#include <memory> // std::unique_ptr
+#include <vector> // std::vector
+
+namespace sasm {
+namespace vm {
+    struct DirtyRange {
+        vptr offset; // Offset into the device
+        u64 amount; // Amount of bytes, whole pages except at the end of the device
+    };
+
+    class DirtyBitmap {
+        public:
+            /**
+             * @brief Create a bitmap without dirty pages
+             *
+             * @param _size Size of the tracked device
+             * @param _page_bits Page size as a shift (12 = 4096 byte pages)
+             */
+            DirtyBitmap(u64 _size, u64 _page_bits) : size(_size), page_bits(_page_bits) {
+                pages = (size + (((u64) 1) << page_bits) - 1) >> page_bits;
+                words_count = (pages + 63) >> 6;
+                words.reset(new u64[words_count]());
+            }
+
+            /**
+             * @brief Mark the pages of a range as dirty
+             *
+             * @param offset Offset into the device
+             * @param amount Amount of bytes, ranges outside of the device are clamped
+             */
+            inline void mark(vptr offset, u64 amount) {
+                if (amount == 0 || offset >= size)
+                    return;
+
+                u64 first = offset >> page_bits;
+                u64 last = (amount > size - offset ? size - 1 : offset + amount - 1) >> page_bits;
+                for (u64 page = first; page <= last; page++) {
+                    u64* word = &words[page >> 6];
+                    u64 bit = ((u64) 1) << (page & 63);
+
+                    // Pages written repeatedly are already marked, skip the atomic operation
+                    if (!(__atomic_load_n(word, __ATOMIC_RELAXED) & bit))
+                        __atomic_fetch_or(word, bit, __ATOMIC_RELAXED);
+                }
+            }
+
+            /**
+             * @brief Get the dirty ranges, adjacent dirty pages are merged
+             *
+             * @param ranges_out [OUT] Ranges are appended, sorted by offset
+             * @param clear Clear the dirty bits that were collected (start a new epoch)
+             * @return u64 Amount of dirty bytes
+             */
+            u64 collect(std::vector<DirtyRange>* ranges_out, bool clear) {
+                u64 page_size = ((u64) 1) << page_bits;
+                u64 total = 0;
+                bool extend = false; // Previous page was dirty, extend the last range
+
+                for (u64 w = 0; w < words_count; w++) {
+                    u64 bits = clear ? __atomic_exchange_n(&words[w], 0, __ATOMIC_ACQ_REL) : __atomic_load_n(&words[w], __ATOMIC_ACQUIRE);
+                    if (bits == 0) {
+                        extend = false;
+                        continue;
+                    }
+
+                    for (u64 b = 0; b < 64; b++) {
+                        if (!(bits & (((u64) 1) << b))) {
+                            extend = false;
+                            continue;
+                        }
+
+                        vptr offset = ((w << 6) + b) << page_bits;
+                        u64 amount = size - offset < page_size ? size - offset : page_size;
+                        if (extend)
+                            ranges_out->back().amount += amount;
+                        else
+                            ranges_out->push_back(DirtyRange { offset, amount });
+                        total += amount;
+                        extend = true;
+                    }
+                }
+                return total;
+            }
+
+            // Mark every page clean
+            void clear() {
+                for (u64 w = 0; w < words_count; w++)
+                    __atomic_store_n(&words[w], 0, __ATOMIC_RELEASE);
+            }
+
+            u64 tracked_size() { return size; }
+            u64 page_shift() { return page_bits; }
+        private:
+            u64 size;
+            u64 page_bits;
+            u64 pages;
+            u64 words_count;
+            std::unique_ptr<u64[]> words;
+    };
+}
+}
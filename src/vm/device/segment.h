@@ -0,0 +1,34 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file segment.h
+ * @author lotuspar / par0-git
+ * @brief Segments for vectored / batched MemoryDevice operations
+ *
+ * A batch is an array of MemorySegment handed to MemoryDevice::submit (or readv / writev).
+ * Every segment gets its own result code, a failing segment doesn't stop the others.
+ */
+
+#pragma once
+
+#include "../../any/number.h" // u*, vptr
+#include "status.h" // DeviceOperationResult
+
+namespace sasm {
+namespace vm {
+    /**
+     * @brief Operation done by a MemorySegment
+     */
+    enum MemorySegmentKind {
+        kSegmentRead = 0, // "kSegmentRead" Read device memory into the segment buffer
+        kSegmentWrite = 1 // "kSegmentWrite" Write the segment buffer to device memory
+    };
+
+    struct MemorySegment {
+        vptr offset; // Position in device memory to operate at
+        u64 amount; // Amount of bytes to handle
+        void* buffer; // Bytes are read to / written from here
+        u8 kind = MemorySegmentKind::kSegmentRead;
+        u8 result = DeviceOperationResult::kSuccess; // [OUT] Result of the segment (DeviceOperationResult)
+    };
+}
+}
@@ -0,0 +1,301 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file static.h
+ * @author lotuspar / par0-git
+ * @brief Containers with a memory layout fixed at compile time
+ *
+ * StaticMemoryContainer<Devices...> maps its devices back to back like MemoryContainer,
+ * but the device types and sizes are template arguments. Offsets are constexpr and
+ * devices are called through their concrete type, so read_type / write_type compile
+ * down to a bounds check and a load / store. The container is still a MemoryDevice and
+ * can be handled by a MemoryContainer.
+ *
+ * Device types need a "static constexpr u64 kSize" and public bare operations, like
+ * FixedMemoryDevice or another StaticMemoryContainer.
+ */
+
+#pragma once
+
+#include "device.h" // MemoryDevice
+#include <tuple> // std::tuple, std::get
+#include <type_traits> // std::tuple_element_t
+
+namespace sasm {
+namespace vm {
+    /**
+     * @brief Device with Size bytes of memory stored inside the object
+     *
+     * @tparam Size Size of the device memory
+     */
+    template <u64 Size>
+    class FixedMemoryDevice final : public MemoryDevice {
+        static_assert(Size > 0, "FixedMemoryDevice needs memory");
+    public:
+        static constexpr u64 kSize = Size;
+
+        FixedMemoryDevice(const char* _uid = "fixed") {
+            set_uid(_uid);
+            size = Size;
+        }
+
+        FixedMemoryDevice(const FixedMemoryDevice&) = delete;
+        FixedMemoryDevice& operator=(const FixedMemoryDevice&) = delete;
+
+        void bare_read(vptr offset, u64 amount, void* output) { memcpy(output, memory + offset, amount); }
+        void bare_write(vptr offset, u64 amount, void* input) { memcpy(memory + offset, input, amount); }
+        u8* bare_direct(vptr offset, u64 /* amount */) { return memory + offset; }
+        u8* bare_view(vptr offset, u64 /* amount */, u8 /* access */) { return memory + offset; }
+        void bare_fill(vptr offset, u64 amount, u8 value) { bulk_fill(memory + offset, value, amount); }
+        void bare_move(vptr destination, vptr source, u64 amount) { bulk_move(memory + destination, memory + source, amount); }
+        int bare_compare(vptr offset, u64 amount, const void* other) { return bulk_compare(memory + offset, other, amount); }
+    private:
+        alignas(64) u8 memory[Size] = {};
+    };
+
+    template <class... Devices>
+    class StaticMemoryContainer : public MemoryDevice {
+        static_assert(sizeof...(Devices) > 0, "StaticMemoryContainer needs devices");
+    public:
+        static constexpr u64 kCount = sizeof...(Devices);
+        static constexpr u64 kSize = (Devices::kSize + ...);
+
+        /**
+         * @brief Container address of a device, offset_of(kCount) is the container size
+         *
+         * @param index Index of the device
+         */
+        static constexpr u64 offset_of(u64 index) {
+            constexpr u64 sizes[] = { Devices::kSize... };
+            u64 offset = 0;
+            for (u64 i = 0; i < index && i < kCount; i++)
+                offset += sizes[i];
+            return offset;
+        }
+
+        /**
+         * @brief Index of the device handling a container address, kCount if none
+         *
+         * @param addr Container address
+         */
+        static constexpr u64 index_of(vptr addr) {
+            for (u64 i = 0; i < kCount; i++) {
+                if (addr < offset_of(i + 1))
+                    return i;
+            }
+            return kCount;
+        }
+
+        StaticMemoryContainer(const char* _uid = "static") {
+            set_uid(_uid);
+            size = kSize;
+        }
+
+        StaticMemoryContainer(const StaticMemoryContainer&) = delete;
+        StaticMemoryContainer& operator=(const StaticMemoryContainer&) = delete;
+
+        /**
+         * @brief Get a device of the container
+         *
+         * @tparam I Index of the device
+         */
+        template <u64 I>
+        auto& device() { return std::get<I>(devices); }
+
+        /**
+         * @brief Read a value without virtual calls, see MemoryDevice::read_type
+         *
+         * Only the lock state of the container is checked, not the one of its devices.
+         *
+         * @tparam T Value type to read from memory
+         * @param offset Container address to read from
+         * @return T Value read from memory, 0 on failure
+         */
+        template <class T = u8>
+        T read_type(vptr offset) {
+            T output = T();
+            if (check(MemoryDeviceStatus::kReadLocked) || offset > kSize - sizeof(T) || sizeof(T) > kSize)
+                return output;
+
+            read_from<0>(offset, sizeof(T), &output);
+            return output;
+        }
+
+        /**
+         * @brief Write a value without virtual calls, see MemoryDevice::write_type
+         *
+         * Only the lock state of the container is checked, not the one of its devices.
+         *
+         * @tparam T Value type to write to memory
+         * @param offset Container address to write to
+         * @param value Value to write into memory
+         */
+        template <class T = u8>
+        void write_type(vptr offset, T value) {
+            if (check(MemoryDeviceStatus::kWriteLocked) || offset > kSize - sizeof(T) || sizeof(T) > kSize)
+                return;
+
+            write_to<0>(offset, sizeof(T), &value);
+            mark_dirty(offset, sizeof(T));
+        }
+
+        /**
+         * @brief Read a value at an address known at compile time, bounds are checked at compile time
+         *
+         * @tparam Offset Container address to read from
+         * @tparam T Value type to read from memory
+         * @return T Value read from memory, 0 if read-locked
+         */
+        template <vptr Offset, class T = u8>
+        T read_at() {
+            static_assert(Offset + sizeof(T) <= kSize, "read_at outside of StaticMemoryContainer");
+            T output = T();
+            if (!check(MemoryDeviceStatus::kReadLocked))
+                read_from<index_of(Offset)>(Offset, sizeof(T), &output);
+            return output;
+        }
+
+        /**
+         * @brief Write a value at an address known at compile time, bounds are checked at compile time
+         *
+         * @tparam Offset Container address to write to
+         * @tparam T Value type to write to memory
+         * @param value Value to write into memory
+         */
+        template <vptr Offset, class T = u8>
+        void write_at(T value) {
+            static_assert(Offset + sizeof(T) <= kSize, "write_at outside of StaticMemoryContainer");
+            if (!check(MemoryDeviceStatus::kWriteLocked)) {
+                write_to<index_of(Offset)>(Offset, sizeof(T), &value);
+                mark_dirty(Offset, sizeof(T));
+            }
+        }
+
+        void bare_read(vptr offset, u64 amount, void* output) { read_from<0>(offset, amount, output); }
+        void bare_write(vptr offset, u64 amount, void* input) { write_to<0>(offset, amount, input); }
+        void bare_fill(vptr offset, u64 amount, u8 value) { fill_from<0>(offset, amount, value); }
+        int bare_compare(vptr offset, u64 amount, const void* other) { return compare_from<0>(offset, amount, (const u8*) other); }
+        u8* bare_direct(vptr offset, u64 amount) { return direct_from<0>(offset, amount, MemoryViewAccess::kViewReadWrite); }
+        u8* bare_view(vptr offset, u64 amount, u8 access) { return direct_from<0>(offset, amount, access); }
+
+        void bare_move(vptr destination, vptr source, u64 amount) {
+            // Let the device handle it if both ranges are inside the same device
+            if (!move_inside<0>(destination, source, amount))
+                MemoryDevice::bare_move(destination, source, amount);
+        }
+    private:
+        std::tuple<Devices...> devices;
+
+        template <u64 I>
+        using Device = std::tuple_element_t<I, std::tuple<Devices...>>;
+
+        /**
+         * Every operation walks the devices starting at index I. Devices ending before the
+         * operation are skipped, operations spanning devices are split. The recursion ends
+         * at kCount, past the last device. Devices are called bare, so changed ranges are
+         * marked dirty here for devices tracking writes.
+         */
+        template <u64 I>
+        void read_from(vptr offset, u64 amount, void* output) {
+            if constexpr (I < kCount) {
+                constexpr u64 start = offset_of(I), end = offset_of(I + 1);
+                if (offset >= end)
+                    return read_from<I + 1>(offset, amount, output);
+
+                if (amount <= end - offset)
+                    return std::get<I>(devices).Device<I>::bare_read(offset - start, amount, output);
+
+                // Spans into the next device
+                u64 chunk = end - offset;
+                std::get<I>(devices).Device<I>::bare_read(offset - start, chunk, output);
+                read_from<I + 1>(end, amount - chunk, ((u8*) output) + chunk);
+            }
+        }
+
+        template <u64 I>
+        void write_to(vptr offset, u64 amount, void* input) {
+            if constexpr (I < kCount) {
+                constexpr u64 start = offset_of(I), end = offset_of(I + 1);
+                if (offset >= end)
+                    return write_to<I + 1>(offset, amount, input);
+
+                u64 chunk = amount <= end - offset ? amount : end - offset;
+                std::get<I>(devices).Device<I>::bare_write(offset - start, chunk, input);
+                std::get<I>(devices).mark_dirty(offset - start, chunk);
+                if (chunk == amount)
+                    return;
+
+                // Spans into the next device
+                write_to<I + 1>(end, amount - chunk, ((u8*) input) + chunk);
+            }
+        }
+
+        template <u64 I>
+        void fill_from(vptr offset, u64 amount, u8 value) {
+            if constexpr (I < kCount) {
+                constexpr u64 start = offset_of(I), end = offset_of(I + 1);
+                if (offset >= end)
+                    return fill_from<I + 1>(offset, amount, value);
+
+                u64 chunk = amount <= end - offset ? amount : end - offset;
+                std::get<I>(devices).Device<I>::bare_fill(offset - start, chunk, value);
+                std::get<I>(devices).mark_dirty(offset - start, chunk);
+                if (chunk == amount)
+                    return;
+
+                // Spans into the next device
+                fill_from<I + 1>(end, amount - chunk, value);
+            }
+        }
+
+        template <u64 I>
+        int compare_from(vptr offset, u64 amount, const u8* other) {
+            if constexpr (I < kCount) {
+                constexpr u64 start = offset_of(I), end = offset_of(I + 1);
+                if (offset >= end)
+                    return compare_from<I + 1>(offset, amount, other);
+
+                u64 chunk = amount <= end - offset ? amount : end - offset;
+                int result = std::get<I>(devices).Device<I>::bare_compare(offset - start, chunk, other);
+                if (result != 0 || chunk == amount)
+                    return result;
+                return compare_from<I + 1>(end, amount - chunk, other + chunk);
+            }
+            return 0;
+        }
+
+        template <u64 I>
+        u8* direct_from(vptr offset, u64 amount, u8 access) {
+            if constexpr (I < kCount) {
+                constexpr u64 start = offset_of(I), end = offset_of(I + 1);
+                if (offset >= end)
+                    return direct_from<I + 1>(offset, amount, access);
+
+                // Range spans several devices
+                if (amount > end - offset)
+                    return 0x0;
+                if (access & MemoryViewAccess::kViewWrite)
+                    std::get<I>(devices).mark_dirty(offset - start, amount); // The pointer can be written
+                return std::get<I>(devices).Device<I>::bare_view(offset - start, amount, access);
+            }
+            return 0x0;
+        }
+
+        template <u64 I>
+        bool move_inside(vptr destination, vptr source, u64 amount) {
+            if constexpr (I < kCount) {
+                constexpr u64 start = offset_of(I), end = offset_of(I + 1);
+                if (source >= end)
+                    return move_inside<I + 1>(destination, source, amount);
+
+                if (destination < start || destination >= end || amount > end - source || amount > end - destination)
+                    return false;
+
+                std::get<I>(devices).Device<I>::bare_move(destination - start, source - start, amount);
+                std::get<I>(devices).mark_dirty(destination - start, amount);
+                return true;
+            }
+            return false;
+        }
+    };
+}
+}
@@ -28,7 +28,9 @@ namespace vm {
     enum DeviceOperationResult {
         kSuccess = 0, // Operation succeeded
         kLocked = 1, // Failed due to device being locked "kWriteLocked" / "kReadLocked"
-        kOutOfBounds = 2 // Failed, operation is not within device handled bounds and "kSafe" is on 
+        kOutOfBounds = 2, // Failed, operation is not within device handled bounds and "kSafe" is on 
+        kUnsupported = 3, // Failed, device can't run this operation (e.g. atomics without host memory)
+        kMisaligned = 4 // Failed, atomic operation on an address not aligned to its width
     };
 }
 }
\ No newline at end of file
@@ -0,0 +1,159 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file tlb.h
+ * @author lotuspar / par0-git
+ * @brief Translation cache used by MemoryContainer to skip the mapping search
+ * 
+ * The cache is direct-mapped: a container address picks its entry using its page
+ * number. Each entry remembers the part of that page handled by a single device, so
+ * a hit can resolve an access without searching the container mapping.
+ *
+ * Entries remember the translation epoch of their device, a device invalidating its
+ * translations only drops its own entries. The container flushes the whole cache when
+ * its mapping changes (see validate).
+ */
+
+#pragma once
+
+#include "../../any/number.h" // u*, vptr
+#include <vector> // std::vector
+
+// Default amount of entries in a translation cache (power of two)
+#ifndef SASM_TRANSLATION_CACHE_ENTRIES
+    #define SASM_TRANSLATION_CACHE_ENTRIES 64
+#endif
+
+// Default page size of a translation cache, as a shift (12 = 4096 byte pages)
+#ifndef SASM_TRANSLATION_PAGE_BITS
+    #define SASM_TRANSLATION_PAGE_BITS 12
+#endif
+
+namespace sasm {
+namespace vm {
+    class MemoryDevice;
+
+    struct TranslationCacheEntry {
+        vptr start; // First container address covered by the entry
+        u64 span; // Amount of bytes covered by the entry, 0 for an empty entry
+        u64 base; // Container address of the first byte of the device
+        MemoryDevice* device; // Device handling the covered space
+        u8* host; // Host pointer for "start", 0x0 if the device has no direct memory
+        const u64* device_epoch; // Translation epoch of the device
+        u64 epoch; // Value of device_epoch when the entry was filled
+    };
+
+    struct TranslationCacheStats {
+        u64 hits;
+        u64 misses;
+        u64 flushes;
+        u64 entries;
+    };
+
+    class TranslationCache {
+        public:
+            TranslationCache() { resize(SASM_TRANSLATION_CACHE_ENTRIES); }
+
+            /**
+             * @brief Change the amount of entries in the cache, rounded up to a power of two
+             * 
+             * @param amount New amount of entries
+             */
+            void resize(u64 amount) {
+                u64 rounded = 1;
+                while (rounded < amount)
+                    rounded <<= 1;
+
+                entries.assign(rounded, TranslationCacheEntry());
+                mask = rounded - 1;
+                flush();
+            }
+
+            /**
+             * @brief Find the entry covering a whole operation
+             * 
+             * @param addr Container address of the operation
+             * @param amount Amount of bytes handled by the operation
+             * @return Entry covering the operation, 0x0 on a miss
+             */
+            inline TranslationCacheEntry* lookup(vptr addr, u64 amount) {
+                TranslationCacheEntry& entry = entries[(addr >> SASM_TRANSLATION_PAGE_BITS) & mask];
+
+                // Written to avoid overflowing on addresses near the end of the address space
+                u64 relative = addr - entry.start;
+                if (relative < entry.span && amount <= entry.span - relative && __atomic_load_n(entry.device_epoch, __ATOMIC_ACQUIRE) == entry.epoch) {
+                    stats.hits++;
+                    return &entry;
+                }
+
+                stats.misses++;
+                return 0x0;
+            }
+
+            /**
+             * @brief Fill the entry for a page with a device
+             * 
+             * @param addr Container address inside the page
+             * @param start First container address of the page handled by the device
+             * @param span Amount of bytes of the page handled by the device
+             * @param base Container address of the first byte of the device
+             * @param device Device handling the space
+             * @param host Host pointer for "start", 0x0 if not available
+             * @param device_epoch Translation epoch of the device
+             * @param epoch Value of the epoch the translation was made in
+             */
+            inline void fill(vptr addr, vptr start, u64 span, u64 base, MemoryDevice* device, u8* host, const u64* device_epoch, u64 epoch) {
+                TranslationCacheEntry& entry = entries[(addr >> SASM_TRANSLATION_PAGE_BITS) & mask];
+                entry.start = start;
+                entry.span = span;
+                entry.base = base;
+                entry.device = device;
+                entry.host = host;
+                entry.device_epoch = device_epoch;
+                entry.epoch = epoch;
+            }
+
+            /**
+             * @brief Empty the cache if the provided epoch differs from the one it was filled in
+             * 
+             * @param current Current translation epoch of the container
+             */
+            inline void validate(u64 current) {
+                if (epoch != current) {
+                    flush();
+                    epoch = current;
+                }
+            }
+
+            /**
+             * @brief Empty every entry of the cache
+             */
+            void flush() {
+                for (u64 i = 0; i < entries.size(); i++)
+                    entries[i].span = 0;
+                stats.flushes++;
+            }
+
+            /**
+             * @brief Get hit/miss counters of the cache
+             */
+            TranslationCacheStats statistics() {
+                TranslationCacheStats result = stats;
+                result.entries = entries.size();
+                return result;
+            }
+
+            /**
+             * @brief Reset hit/miss counters of the cache
+             */
+            void reset_statistics() {
+                stats = TranslationCacheStats();
+            }
+
+        private:
+            std::vector<TranslationCacheEntry> entries;
+            u64 mask = 0;
+            u64 epoch = 0;
+            TranslationCacheStats stats = TranslationCacheStats();
+    };
+}
+}
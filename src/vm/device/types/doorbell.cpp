@@ -0,0 +1,167 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file doorbell.cpp
+ * @author lotuspar / par0-git
+ * @brief DoorbellMemoryDevice
+ */
+
+#include "doorbell.h"
+
+using namespace sasm::vm;
+
+void DoorbellMemoryDevice::init(const char* _uid, u32 _entries, DoorbellHandler _handler, void* _context) {
+    stop();
+    set_uid(_uid);
+
+    // Power of two, so slots wrap with the 32-bit counters
+    entries = 1;
+    while (entries < _entries && entries < (1u << 31))
+        entries <<= 1;
+
+    handler = _handler;
+    context = _context;
+    claimed = 0;
+    reserved = 0;
+
+    size = completion_base() + (vptr) entries * sizeof(DoorbellCompletion);
+    storage.reset(new u64[size / sizeof(u64)]());
+    memory = (u8*) storage.get();
+    *header_field(kDoorbellEntries) = entries;
+    invalidate_translations(); // Host memory changed
+}
+
+void DoorbellMemoryDevice::start(u32 workers) {
+    if (memory == 0x0 || handler == 0x0) {
+        sasm_print("Tried starting DoorbellMemoryDevice without rings / handler. [%s]", uid);
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    running = true;
+    for (u32 i = 0; i < workers; i++)
+        threads.emplace_back(&DoorbellMemoryDevice::worker, this);
+}
+
+void DoorbellMemoryDevice::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        running = false;
+    }
+    wakeup.notify_all();
+
+    for (std::thread& thread : threads)
+        thread.join();
+    threads.clear();
+}
+
+u64 DoorbellMemoryDevice::poll(u64 limit) {
+    u64 amount = 0;
+    while (amount < limit && run_one())
+        amount++;
+    return amount;
+}
+
+bool DoorbellMemoryDevice::run_one() {
+    // Claim the next submitted request
+    u32 index = __atomic_load_n(&claimed, __ATOMIC_ACQUIRE);
+    do {
+        if (index == header(kDoorbellSubmitted))
+            return false;
+    } while (!__atomic_compare_exchange_n(&claimed, &index, index + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    DoorbellRequest request;
+    bulk_copy(&request, memory + kDoorbellRequests + (vptr) (index & (entries - 1)) * sizeof(DoorbellRequest), sizeof(request));
+
+    DoorbellCompletion completion;
+    completion.tag = request.tag;
+    completion.result = handler(context, request);
+
+    u32 slot = __atomic_fetch_add(&reserved, 1, __ATOMIC_RELAXED);
+    bulk_copy(memory + completion_base() + (vptr) (slot & (entries - 1)) * sizeof(DoorbellCompletion), &completion, sizeof(completion));
+
+    // Publish in slot order, the completion count never covers a slot still being written
+    while (header(kDoorbellCompleted) != slot)
+        std::this_thread::yield();
+    __atomic_store_n(header_field(kDoorbellCompleted), slot + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void DoorbellMemoryDevice::worker() {
+    while (true) {
+        // Run requests until the ring is empty, one doorbell can submit a whole batch
+        if (run_one())
+            continue;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        __atomic_fetch_add(&sleeping, 1, __ATOMIC_SEQ_CST);
+        wakeup.wait(lock, [this] { return !running || available(); });
+        __atomic_fetch_sub(&sleeping, 1, __ATOMIC_SEQ_CST);
+
+        if (!running && !available())
+            return;
+    }
+}
+
+void DoorbellMemoryDevice::bare_read(vptr offset, u64 amount, void* output) {
+    u8* output_u8p = (u8*) output;
+
+    // Header, fields are read atomically
+    if (offset < kDoorbellRequests) {
+        u32 fields[4] = { header(kDoorbellSubmitted), header(kDoorbellCompleted), entries, 0 };
+        u64 chunk = kDoorbellRequests - offset < amount ? kDoorbellRequests - offset : amount;
+        for (u64 i = 0; i < chunk; i++)
+            output_u8p[i] = offset + i < sizeof(fields) ? ((u8*) fields)[offset + i] : 0;
+
+        output_u8p += chunk;
+        offset += chunk;
+        amount -= chunk;
+    }
+
+    if (amount != 0)
+        bulk_copy(output_u8p, memory + offset, amount);
+}
+
+void DoorbellMemoryDevice::bare_write(vptr offset, u64 amount, void* input) {
+    const u8* input_u8p = (const u8*) input;
+
+    // Header, only the submission count can be written
+    if (offset < kDoorbellRequests) {
+        if (offset < kDoorbellSubmitted + sizeof(u32)) {
+            u32 previous = header(kDoorbellSubmitted);
+            u32 value = previous;
+            for (u64 i = offset; i < sizeof(u32) && i - offset < amount; i++)
+                ((u8*) &value)[i] = input_u8p[i - offset];
+
+            // Check if the guest submitted more requests than there are slots
+            if (value - header(kDoorbellCompleted) > entries || value - previous > entries)
+                sasm_debug_print("Ignored invalid doorbell write (%u). [%s]", value, uid);
+            else if (value != previous) {
+                __atomic_store_n(header_field(kDoorbellSubmitted), value, __ATOMIC_SEQ_CST);
+
+                // Only wake workers if one is sleeping, busy workers find the requests themselves
+                if (__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST) != 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (value - previous > 1)
+                        wakeup.notify_all();
+                    else
+                        wakeup.notify_one();
+                }
+            }
+        }
+
+        u64 chunk = kDoorbellRequests - offset < amount ? kDoorbellRequests - offset : amount;
+        input_u8p += chunk;
+        offset += chunk;
+        amount -= chunk;
+    }
+
+    if (amount != 0)
+        bulk_copy(memory + offset, input_u8p, amount);
+}
+
+u8* DoorbellMemoryDevice::bare_direct(vptr offset, u64 /* amount */) {
+    // Header writes have to ring the doorbell
+    if (offset < kDoorbellRequests)
+        return 0x0;
+    return memory + offset;
+}
@@ -0,0 +1,160 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file doorbell.h
+ * @author lotuspar / par0-git
+ * @brief Definition of DoorbellMemoryDevice
+ *
+ * A DoorbellMemoryDevice is a request ring and a completion ring shared between the
+ * guest and host worker threads. The guest fills request slots with plain writes, then
+ * rings the doorbell by writing the new submission count. Workers take the requests,
+ * run the host handler and write completions back, so the guest only pays for one
+ * device write per batch of requests.
+ *
+ * Device layout (entries is a power of two):
+ *  0x0                         u32 submitted, requests [0, submitted) were written (doorbell, guest writes)
+ *  0x4                         u32 completed, completions [0, completed) were written (host writes)
+ *  0x8                         u32 entries
+ *  kDoorbellRequests           DoorbellRequest[entries], request n is in slot n % entries
+ *  completion_base()           DoorbellCompletion[entries], completion n is in slot n % entries
+ *
+ * Completions are published in the order workers finish, the tag tells which request
+ * completed. The guest must not have more than entries requests without a completion
+ * it has read, older slots would be overwritten.
+ */
+
+#pragma once
+
+#include "../../../any/number.h" // u*, vptr
+#include "../../../any/debug.h" // sasm_*
+#include "../device.h"
+#include <condition_variable> // std::condition_variable
+#include <memory> // std::unique_ptr
+#include <mutex> // std::mutex
+#include <thread> // std::thread
+#include <vector> // std::vector
+
+namespace sasm {
+namespace vm {
+    struct DoorbellRequest {
+        u64 tag; // Copied into the completion
+        u32 opcode;
+        u32 length;
+        u64 address;
+        u64 argument;
+    };
+
+    struct DoorbellCompletion {
+        u64 tag; // Tag of the request
+        u64 result; // Return value of the handler
+    };
+
+    // Device offsets of the header fields
+    static const vptr kDoorbellSubmitted = 0x0;
+    static const vptr kDoorbellCompleted = 0x4;
+    static const vptr kDoorbellEntries = 0x8;
+
+    // Rings start on their own translation page, so MemoryContainers can access them through host pointers
+    static const vptr kDoorbellRequests = 0x1000;
+
+    /**
+     * @brief Host handler running a request, called on a worker thread
+     *
+     * @param context Pointer given to the device
+     * @param request Copy of the request slot
+     * @return u64 Result written to the completion
+     */
+    typedef u64 (*DoorbellHandler)(void* context, const DoorbellRequest& request);
+
+    class DoorbellMemoryDevice : public MemoryDevice {
+    public:
+        /**
+         * @brief Create the rings and start the workers
+         *
+         * @param _uid Unique identifier
+         * @param _entries Amount of slots per ring, rounded up to a power of two
+         * @param _handler Host handler running requests
+         * @param _context Pointer passed to the handler
+         * @param workers Amount of worker threads, 0 to only run requests through poll()
+         */
+        DoorbellMemoryDevice(const char* _uid, u32 _entries, DoorbellHandler _handler, void* _context, u32 workers = 1) {
+            init(_uid, _entries, _handler, _context);
+            start(workers);
+        }
+        DoorbellMemoryDevice() {}
+        ~DoorbellMemoryDevice() { stop(); }
+
+        DoorbellMemoryDevice(const DoorbellMemoryDevice&) = delete;
+        DoorbellMemoryDevice& operator=(const DoorbellMemoryDevice&) = delete;
+
+        /**
+         * @brief Create empty rings, stops the workers first
+         *
+         * @param _uid Unique identifier
+         * @param _entries Amount of slots per ring, rounded up to a power of two
+         * @param _handler Host handler running requests
+         * @param _context Pointer passed to the handler
+         */
+        void init(const char* _uid, u32 _entries, DoorbellHandler _handler, void* _context);
+
+        /**
+         * @brief Start worker threads, they run requests until stop()
+         *
+         * @param workers Amount of worker threads to add
+         */
+        void start(u32 workers);
+
+        /**
+         * @brief Stop the workers, requests submitted before are completed first
+         */
+        void stop();
+
+        /**
+         * @brief Run submitted requests on the calling thread
+         *
+         * @param limit Largest amount of requests to run
+         * @return u64 Amount of requests run
+         */
+        u64 poll(u64 limit = ~((u64) 0));
+
+        // Amount of submitted requests without a completion
+        u32 pending() { return header(kDoorbellSubmitted) - header(kDoorbellCompleted); }
+
+        // Device offset of the completion ring
+        vptr completion_base() { return kDoorbellRequests + (vptr) entries * sizeof(DoorbellRequest); }
+
+        void bare_read(vptr offset, u64 amount, void* output);
+        void bare_write(vptr offset, u64 amount, void* input);
+        u8* bare_direct(vptr offset, u64 amount);
+    private:
+        std::unique_ptr<u64[]> storage;
+        u8* memory = 0x0;
+        u32 entries = 0;
+        DoorbellHandler handler = 0x0;
+        void* context = 0x0;
+
+        u32 claimed = 0; // Next request to give to a worker
+        u32 reserved = 0; // Next completion slot
+
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wakeup;
+        bool running = false;
+        u32 sleeping = 0; // Workers waiting for the doorbell
+
+        u32* header_field(vptr offset) { return (u32*) (memory + offset); }
+        u32 header(vptr offset) { return __atomic_load_n(header_field(offset), __ATOMIC_ACQUIRE); }
+
+        // Submitted requests not taken by a worker yet
+        bool available() { return __atomic_load_n(&claimed, __ATOMIC_SEQ_CST) != __atomic_load_n(header_field(kDoorbellSubmitted), __ATOMIC_SEQ_CST); }
+
+        /**
+         * @brief Take one request, run it and publish its completion
+         *
+         * @return true if a request was run
+         */
+        bool run_one();
+
+        void worker();
+    };
+}
+}
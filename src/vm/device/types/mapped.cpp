@@ -0,0 +1,145 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file mapped.cpp
+ * @author lotuspar / par0-git
+ * @brief MappedMemoryDevice
+ */
+
+#include "mapped.h"
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap, munmap, madvise, msync
+#include <sys/stat.h> // fstat
+#include <unistd.h> // close, sysconf
+
+using namespace sasm::vm;
+
+bool MappedMemoryDevice::init(const char* _uid, const char* path, MappedMemoryMode _mode, u64 file_offset, u64 length) {
+    release();
+    set_uid(_uid);
+
+    int fd = open(path, _mode == kMappedShared ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        sasm_print("Failed to initialize MappedMemoryDevice, couldn't open %s", path);
+        return false;
+    }
+
+    // Find out how much of the file should be mapped
+    struct stat info;
+    if (fstat(fd, &info) != 0 || file_offset > (u64) info.st_size) {
+        sasm_print("Failed to initialize MappedMemoryDevice, bad file offset for %s", path);
+        close(fd);
+        return false;
+    }
+    u64 available = (u64) info.st_size - file_offset;
+    if (length == 0)
+        length = available;
+    if (length > available) {
+        sasm_print("Failed to initialize MappedMemoryDevice, %s ends before the requested length", path);
+        close(fd);
+        return false;
+    }
+    if (length == 0) {
+        sasm_print("Failed to initialize MappedMemoryDevice, nothing to map in %s", path);
+        close(fd);
+        return false;
+    }
+
+    // mmap needs a page aligned file offset
+    u64 page_size = (u64) sysconf(_SC_PAGESIZE);
+    u64 page_delta = file_offset % page_size;
+
+    int protection = _mode == kMappedReadOnly ? PROT_READ : PROT_READ | PROT_WRITE;
+    int flags = _mode == kMappedShared ? MAP_SHARED : MAP_PRIVATE;
+    void* result = mmap(0x0, length + page_delta, protection, flags, fd, file_offset - page_delta);
+
+    // The mapping keeps its own reference to the file
+    close(fd);
+
+    if (result == MAP_FAILED) {
+        sasm_print("Failed to initialize MappedMemoryDevice, 0x0 mmap result");
+        return false;
+    }
+
+    mapping = result;
+    mapping_length = length + page_delta;
+    real = ((u8*) result) + page_delta;
+    size = length;
+    mode = _mode;
+
+    // Read-only mappings can't be written to
+    if (_mode == kMappedReadOnly)
+        set(MemoryDeviceStatus::kWriteLocked);
+    else
+        unset(MemoryDeviceStatus::kWriteLocked);
+
+    invalidate_translations(); // Host memory changed
+    return true;
+}
+
+void MappedMemoryDevice::release() {
+    if (mapping == 0x0)
+        return;
+
+    munmap(mapping, mapping_length);
+    mapping = 0x0;
+    mapping_length = 0;
+    real = 0x0;
+    size = 0;
+    invalidate_translations(); // Host memory changed
+}
+
+bool MappedMemoryDevice::advise(MappedMemoryAdvice advice, vptr offset, u64 amount) {
+    if (mapping == 0x0 || offset > size)
+        return false;
+
+    // Dropped copy-on-write pages lose the writes of the guest
+    if (advice == kAdviceDontNeed && mode == kMappedPrivate) {
+        sasm_print("Refusing kAdviceDontNeed for private MappedMemoryDevice, writes would be lost");
+        return false;
+    }
+
+    if (amount == 0 || amount > size - offset)
+        amount = size - offset;
+
+    int native = MADV_NORMAL;
+    switch (advice) {
+        case kAdviceNormal: native = MADV_NORMAL; break;
+        case kAdviceSequential: native = MADV_SEQUENTIAL; break;
+        case kAdviceRandom: native = MADV_RANDOM; break;
+        case kAdviceWillNeed: native = MADV_WILLNEED; break;
+        case kAdviceDontNeed: native = MADV_DONTNEED; break;
+    }
+
+    // madvise needs a page aligned address
+    u64 page_size = (u64) sysconf(_SC_PAGESIZE);
+    u8* start = ((u8*) real) + offset;
+    u8* aligned = (u8*) (((uintptr_t) start) & ~(uintptr_t) (page_size - 1));
+    return madvise(aligned, amount + (start - aligned), native) == 0;
+}
+
+bool MappedMemoryDevice::sync(bool wait) {
+    if (mapping == 0x0)
+        return false;
+
+    return msync(mapping, mapping_length, wait ? MS_SYNC : MS_ASYNC) == 0;
+}
+
+void MappedMemoryDevice::bare_read(vptr offset, u64 amount, void* output) {
+    bulk_copy(output, ((u8*) real) + offset, amount);
+}
+
+void MappedMemoryDevice::bare_write(vptr offset, u64 amount, void* input) {
+    bulk_copy(((u8*) real) + offset, input, amount);
+}
+
+void MappedMemoryDevice::bare_fill(vptr offset, u64 amount, u8 value) {
+    bulk_fill(((u8*) real) + offset, value, amount);
+}
+
+void MappedMemoryDevice::bare_move(vptr destination, vptr source, u64 amount) {
+    bulk_move(((u8*) real) + destination, ((u8*) real) + source, amount);
+}
+
+int MappedMemoryDevice::bare_compare(vptr offset, u64 amount, const void* other) {
+    return bulk_compare(((u8*) real) + offset, other, amount);
+}
@@ -0,0 +1,108 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file mapped.h
+ * @author lotuspar / par0-git
+ * @brief Definition of MappedMemoryDevice
+ * 
+ * A MappedMemoryDevice maps (part of) a file into memory. Pages of the file are only
+ * loaded when the device touches them, so large images cost nothing until used.
+ * Writing to 0x0 of the device writes to the first mapped byte of the file.
+ */
+
+#pragma once
+
+#include "../../../any/number.h" // u*, vptr
+#include "../../../any/debug.h" // sasm_*
+#include "../device.h"
+
+namespace sasm {
+namespace vm {
+    /**
+     * @brief How the file backing a MappedMemoryDevice is mapped
+     */
+    enum MappedMemoryMode {
+        kMappedReadOnly = 0, // "kMappedReadOnly" Writing is disallowed (the device is kWriteLocked)
+        kMappedPrivate = 1, // "kMappedPrivate" Writes are copy-on-write and never reach the file
+        kMappedShared = 2 // "kMappedShared" Writes are written back to the file
+    };
+
+    /**
+     * @brief Access pattern hints for a MappedMemoryDevice (see madvise)
+     */
+    enum MappedMemoryAdvice {
+        kAdviceNormal = 0, // "kAdviceNormal" No special treatment
+        kAdviceSequential = 1, // "kAdviceSequential" Pages will be accessed in order, read ahead aggressively
+        kAdviceRandom = 2, // "kAdviceRandom" Pages will be accessed randomly, don't read ahead
+        kAdviceWillNeed = 3, // "kAdviceWillNeed" Pages will be needed soon, start loading them
+        kAdviceDontNeed = 4 // "kAdviceDontNeed" Pages won't be needed soon, they can be dropped (not for kMappedPrivate)
+    };
+
+    class MappedMemoryDevice : public MemoryDevice {
+    public:
+        MappedMemoryDevice(const char* _uid, const char* path, MappedMemoryMode _mode = kMappedReadOnly, u64 file_offset = 0, u64 length = 0) {
+            init(_uid, path, _mode, file_offset, length);
+        }
+        MappedMemoryDevice() {}
+        ~MappedMemoryDevice() { release(); }
+
+        MappedMemoryDevice(const MappedMemoryDevice&) = delete;
+        MappedMemoryDevice& operator=(const MappedMemoryDevice&) = delete;
+
+        /**
+         * @brief Map a file
+         * 
+         * @param _uid Unique identifier to give to the device
+         * @param path Path of the file to map
+         * @param _mode How the file is mapped
+         * @param file_offset Position in the file the device starts at
+         * @param length Amount of bytes to map, 0 for everything after file_offset. Has to be
+         * inside the file, pages past its end would fault (SIGBUS) when accessed
+         * @return true on success
+         */
+        bool init(const char* _uid, const char* path, MappedMemoryMode _mode = kMappedReadOnly, u64 file_offset = 0, u64 length = 0);
+
+        /**
+         * @brief Unmap the file, the device is empty afterwards
+         */
+        void release();
+
+        /**
+         * @brief Tell the kernel how a range of the device will be accessed
+         * 
+         * kAdviceDontNeed is refused for kMappedPrivate mappings, dropping their pages would
+         * throw away every write and reload the file contents.
+         * 
+         * @param advice Access pattern hint
+         * @param offset Position in device memory the hint applies to
+         * @param amount Amount of bytes the hint applies to, 0 for the rest of the device
+         * @return true on success
+         */
+        bool advise(MappedMemoryAdvice advice, vptr offset = 0, u64 amount = 0);
+
+        /**
+         * @brief Write changes back to the file (kMappedShared only)
+         * 
+         * @param wait Wait for the write to finish
+         * @return true on success
+         */
+        bool sync(bool wait = true);
+
+        bool mapped() { return real != 0x0; }
+
+        void bare_read(vptr offset, u64 amount, void* output);
+        void bare_write(vptr offset, u64 amount, void* input);
+        u8* bare_direct(vptr offset, u64 /* amount */) { return ((u8*) real) + offset; }
+        void bare_fill(vptr offset, u64 amount, u8 value);
+        void bare_move(vptr destination, vptr source, u64 amount);
+        int bare_compare(vptr offset, u64 amount, const void* other);
+    private:
+        // Start of the mapping (page aligned) and its length
+        void* mapping = 0x0;
+        u64 mapping_length = 0;
+
+        // Pointer to the first byte handled by the device, inside the mapping
+        void* real = 0x0;
+        MappedMemoryMode mode = kMappedReadOnly;
+    };
+}
+}
@@ -0,0 +1,111 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file mmio.cpp
+ * @author lotuspar / par0-git
+ * @brief MmioMemoryDevice
+ */
+
+#include "mmio.h"
+
+using namespace sasm::vm;
+
+bool MmioMemoryDevice::map(vptr offset, u64 amount, MmioReadHandler read, MmioWriteHandler write, void* context) {
+    // Check if the range is inside of the device
+    if (amount == 0 || offset > size || amount > size - offset) {
+        sasm_print("Tried mapping MMIO range outside of MmioMemoryDevice. [%s]", uid);
+        return false;
+    }
+
+    // Check if the range overlaps the ranges around it
+    u64 index = first_range(offset);
+    if (index < ranges.size() && ranges[index].offset < offset + amount) {
+        sasm_print("Tried mapping overlapping MMIO range. [%s]", uid);
+        return false;
+    }
+
+    ranges.insert(ranges.begin() + index, MmioRange { offset, amount, read, write, context });
+    return true;
+}
+
+bool MmioMemoryDevice::unmap(vptr offset) {
+    u64 index = first_range(offset);
+    if (index == ranges.size() || ranges[index].offset != offset)
+        return false;
+
+    ranges.erase(ranges.begin() + index);
+    return true;
+}
+
+u64 MmioMemoryDevice::first_range(vptr offset) {
+    u64 low = 0, high = ranges.size();
+    while (low < high) {
+        u64 middle = (low + high) / 2;
+        if (ranges[middle].offset + ranges[middle].amount <= offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+void MmioMemoryDevice::bare_read(vptr offset, u64 amount, void* output) {
+    u8* output_u8p = (u8*) output;
+    vptr end = offset + amount;
+
+    for (u64 i = first_range(offset); offset < end; i++) {
+        // Unmapped bytes before the next range read as zero
+        vptr next = i < ranges.size() && ranges[i].offset < end ? ranges[i].offset : end;
+        if (offset < next) {
+            bulk_fill(output_u8p, 0, next - offset);
+            output_u8p += next - offset;
+            offset = next;
+        }
+        if (offset == end)
+            break;
+
+        const MmioRange& range = ranges[i];
+        u64 chunk = (range.offset + range.amount < end ? range.offset + range.amount : end) - offset;
+        if (range.read != 0x0)
+            range.read(range.context, offset - range.offset, chunk, output_u8p);
+        else
+            bulk_fill(output_u8p, 0, chunk);
+
+        output_u8p += chunk;
+        offset += chunk;
+    }
+}
+
+void MmioMemoryDevice::bare_write(vptr offset, u64 amount, void* input) {
+    const u8* input_u8p = (const u8*) input;
+    vptr end = offset + amount;
+
+    for (u64 i = first_range(offset); i < ranges.size() && ranges[i].offset < end; i++) {
+        const MmioRange& range = ranges[i];
+        vptr start = range.offset > offset ? range.offset : offset;
+        vptr stop = range.offset + range.amount < end ? range.offset + range.amount : end;
+
+        if (range.write != 0x0)
+            range.write(range.context, start - range.offset, stop - start, input_u8p + (start - offset));
+    }
+}
+
+void MmioMemoryDevice::bare_fill(vptr offset, u64 amount, u8 value) {
+    // Only mapped ranges see the fill, once per range when it fits the bounce buffer
+    u8 buffer[kBounceSize];
+    bulk_fill(buffer, value, amount < kBounceSize ? amount : kBounceSize);
+
+    vptr end = offset + amount;
+    for (u64 i = first_range(offset); i < ranges.size() && ranges[i].offset < end; i++) {
+        const MmioRange& range = ranges[i];
+        if (range.write == 0x0)
+            continue;
+
+        vptr start = range.offset > offset ? range.offset : offset;
+        vptr stop = range.offset + range.amount < end ? range.offset + range.amount : end;
+        for (vptr done = start; done < stop;) {
+            u64 chunk = stop - done < kBounceSize ? stop - done : kBounceSize;
+            range.write(range.context, done - range.offset, chunk, buffer);
+            done += chunk;
+        }
+    }
+}
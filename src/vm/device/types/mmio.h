@@ -0,0 +1,111 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file mmio.h
+ * @author lotuspar / par0-git
+ * @brief Definition of MmioMemoryDevice
+ *
+ * A MmioMemoryDevice has no memory of its own: reads and writes of a mapped range call
+ * host handlers with the offset into the range. Reads outside of every range return
+ * zero, writes outside of every range are ignored.
+ *
+ * Handlers are called on the thread running the operation, once per range an operation
+ * touches (an 8 byte write is one handler call, not eight). Ranges can't be changed
+ * while the device is used.
+ */
+
+#pragma once
+
+#include "../../../any/number.h" // u*, vptr
+#include "../../../any/debug.h" // sasm_*
+#include "../device.h"
+#include <vector> // std::vector
+
+namespace sasm {
+namespace vm {
+    /**
+     * @brief Handler for reads of a MMIO range
+     *
+     * @param context Pointer given to MmioMemoryDevice::map
+     * @param offset Offset into the range
+     * @param amount Amount of bytes to read
+     * @param output [OUT] Bytes read
+     */
+    typedef void (*MmioReadHandler)(void* context, vptr offset, u64 amount, void* output);
+
+    /**
+     * @brief Handler for writes to a MMIO range
+     *
+     * @param context Pointer given to MmioMemoryDevice::map
+     * @param offset Offset into the range
+     * @param amount Amount of bytes written
+     * @param input Bytes written
+     */
+    typedef void (*MmioWriteHandler)(void* context, vptr offset, u64 amount, const void* input);
+
+    class MmioMemoryDevice : public MemoryDevice {
+    public:
+        MmioMemoryDevice(const char* _uid, u64 _size) {
+            init(_uid, _size);
+        }
+        MmioMemoryDevice() {}
+
+        MmioMemoryDevice(const MmioMemoryDevice&) = delete;
+        MmioMemoryDevice& operator=(const MmioMemoryDevice&) = delete;
+
+        /**
+         * @brief Set the size of the device, every range is unmapped
+         *
+         * @param _uid Unique identifier
+         * @param _size Size of the device
+         */
+        void init(const char* _uid, u64 _size) {
+            set_uid(_uid);
+            ranges.clear();
+            size = _size;
+            invalidate_translations();
+        }
+
+        /**
+         * @brief Call handlers for reads / writes of a range
+         *
+         * @param offset Position in device memory
+         * @param amount Size of the range
+         * @param read Handler for reads, 0x0 to read zero
+         * @param write Handler for writes, 0x0 to ignore writes
+         * @param context Pointer passed to the handlers
+         * @return true on success, false if the range is outside of the device or overlaps another range
+         */
+        bool map(vptr offset, u64 amount, MmioReadHandler read, MmioWriteHandler write, void* context);
+
+        /**
+         * @brief Remove a range added with map
+         *
+         * @param offset Position in device memory the range starts at
+         * @return true if a range was removed
+         */
+        bool unmap(vptr offset);
+
+        void bare_read(vptr offset, u64 amount, void* output);
+        void bare_write(vptr offset, u64 amount, void* input);
+        void bare_fill(vptr offset, u64 amount, u8 value);
+    private:
+        struct MmioRange {
+            vptr offset;
+            u64 amount;
+            MmioReadHandler read;
+            MmioWriteHandler write;
+            void* context;
+        };
+
+        // Mapped ranges, sorted by offset
+        std::vector<MmioRange> ranges;
+
+        /**
+         * @brief Index of the first range ending after an offset, ranges.size() if none
+         *
+         * @param offset Position in device memory
+         */
+        u64 first_range(vptr offset);
+    };
+}
+}
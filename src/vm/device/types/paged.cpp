@@ -0,0 +1,157 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file paged.cpp
+ * @author lotuspar / par0-git
+ * @brief PagedMemoryDevice
+ */
+
+#include "paged.h"
+
+using namespace sasm::vm;
+
+// Shared by every page that was never written to
+alignas(64) static const u8 zero_page[PagedMemoryDevice::kPageSize] = {};
+
+std::unique_ptr<PagedMemoryDevice> PagedMemoryDevice::fork(const char* _uid) {
+    std::unique_ptr<PagedMemoryDevice> copy(new PagedMemoryDevice());
+    copy->set_uid(_uid != 0x0 ? _uid : (const char*) uid);
+    copy->size = size;
+    copy->set_status(get_status());
+
+    // Only copies page references
+    copy->pages = pages;
+
+    // Host pointers into handed out pages keep writing to this device, the copy gets its own page
+    for (u64 number : direct_pages) {
+        Page& page = copy->pages[number];
+        Page detached(new u8[kPageSize]);
+        bulk_copy(detached.get(), page.get(), kPageSize);
+        page = detached;
+    }
+    return copy;
+}
+
+u64 PagedMemoryDevice::private_pages() {
+    u64 amount = 0;
+    for (auto& entry : pages) {
+        if (entry.second.use_count() == 1)
+            amount++;
+    }
+    return amount;
+}
+
+u8* PagedMemoryDevice::writable_page(u64 number) {
+    Page& page = pages[number];
+
+    // First write, allocate page
+    if (!page) {
+        page.reset(new u8[kPageSize]);
+        bulk_fill(page.get(), 0, kPageSize);
+        return page.get();
+    }
+
+    // Shared with a fork, copy page
+    if (page.use_count() > 1) {
+        Page copy(new u8[kPageSize]);
+        bulk_copy(copy.get(), page.get(), kPageSize);
+        page = copy;
+    }
+
+    return page.get();
+}
+
+void PagedMemoryDevice::bare_read(vptr offset, u64 amount, void* output) {
+    u8* output_u8p = (u8*) output;
+
+    while (amount > 0) {
+        // Part of the operation handled by the current page
+        u64 number = offset >> SASM_PAGED_PAGE_BITS;
+        u64 page_offset = offset & (kPageSize - 1);
+        u64 chunk = kPageSize - page_offset;
+        if (chunk > amount)
+            chunk = amount;
+
+        auto found = pages.find(number);
+        const u8* source = found != pages.end() ? found->second.get() : zero_page;
+        bulk_copy(output_u8p, source + page_offset, chunk);
+
+        offset += chunk;
+        output_u8p += chunk;
+        amount -= chunk;
+    }
+}
+
+void PagedMemoryDevice::bare_write(vptr offset, u64 amount, void* input) {
+    u8* input_u8p = (u8*) input;
+
+    while (amount > 0) {
+        // Part of the operation handled by the current page
+        u64 number = offset >> SASM_PAGED_PAGE_BITS;
+        u64 page_offset = offset & (kPageSize - 1);
+        u64 chunk = kPageSize - page_offset;
+        if (chunk > amount)
+            chunk = amount;
+
+        bulk_copy(writable_page(number) + page_offset, input_u8p, chunk);
+
+        offset += chunk;
+        input_u8p += chunk;
+        amount -= chunk;
+    }
+}
+
+u8* PagedMemoryDevice::bare_direct(vptr offset, u64 amount) {
+    // Only available inside a single allocated page owned by this device
+    u64 page_offset = offset & (kPageSize - 1);
+    if (amount > kPageSize - page_offset)
+        return 0x0;
+
+    u64 number = offset >> SASM_PAGED_PAGE_BITS;
+    auto found = pages.find(number);
+    if (found == pages.end() || found->second.use_count() != 1)
+        return 0x0;
+
+    direct_pages.insert(number);
+    return found->second.get() + page_offset;
+}
+
+u8* PagedMemoryDevice::bare_view(vptr offset, u64 amount, u8 access) {
+    // Reading views of pages that were never written use a bounce buffer instead of allocating
+    if (!(access & MemoryViewAccess::kViewWrite))
+        return bare_direct(offset, amount);
+
+    // Writing views / atomics get their own page
+    u64 page_offset = offset & (kPageSize - 1);
+    if (amount > kPageSize - page_offset)
+        return 0x0;
+
+    u64 number = offset >> SASM_PAGED_PAGE_BITS;
+    u8* page = writable_page(number);
+    direct_pages.insert(number);
+    return page + page_offset;
+}
+
+void PagedMemoryDevice::bare_fill(vptr offset, u64 amount, u8 value) {
+    while (amount > 0) {
+        // Part of the operation handled by the current page
+        u64 number = offset >> SASM_PAGED_PAGE_BITS;
+        u64 page_offset = offset & (kPageSize - 1);
+        u64 chunk = kPageSize - page_offset;
+        if (chunk > amount)
+            chunk = amount;
+
+        if (value == 0 && chunk == kPageSize) {
+            // Whole page cleared, go back to the zero page
+            if (pages.erase(number) != 0) {
+                direct_pages.erase(number);
+                invalidate_translations();
+            }
+        } else if (value != 0 || pages.count(number) != 0) {
+            // Clearing part of a page that was never written does nothing
+            bulk_fill(writable_page(number) + page_offset, value, chunk);
+        }
+
+        offset += chunk;
+        amount -= chunk;
+    }
+}
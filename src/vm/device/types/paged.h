@@ -0,0 +1,93 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file paged.h
+ * @author lotuspar / par0-git
+ * @brief Definition of PagedMemoryDevice
+ * 
+ * A PagedMemoryDevice splits its memory into pages that are only allocated when first
+ * written to. Pages that were never written read as zero. Forking a device shares every
+ * page with the fork, a page is copied by whichever device writes to it first.
+ */
+
+#pragma once
+
+#include "../../../any/number.h" // u*, vptr
+#include "../../../any/debug.h" // sasm_*
+#include "../device.h"
+#include <memory> // std::shared_ptr, std::unique_ptr
+#include <unordered_map> // std::unordered_map
+#include <unordered_set> // std::unordered_set
+
+// Page size of a PagedMemoryDevice, as a shift (12 = 4096 byte pages)
+#ifndef SASM_PAGED_PAGE_BITS
+    #define SASM_PAGED_PAGE_BITS 12
+#endif
+
+namespace sasm {
+namespace vm {
+    class PagedMemoryDevice : public MemoryDevice {
+    public:
+        static const u64 kPageSize = ((u64) 1) << SASM_PAGED_PAGE_BITS;
+
+        PagedMemoryDevice(const char* _uid, u64 _size) {
+            init(_uid, _size);
+        }
+        PagedMemoryDevice() {}
+
+        PagedMemoryDevice(const PagedMemoryDevice&) = delete;
+        PagedMemoryDevice& operator=(const PagedMemoryDevice&) = delete;
+
+        void init(const char* _uid, u64 _size) {
+            set_uid(_uid);
+            pages.clear();
+            direct_pages.clear();
+            size = _size;
+            invalidate_translations(); // Host memory changed
+        }
+
+        /**
+         * @brief Create a copy of the device sharing every page with it
+         * 
+         * Costs O(allocated pages). Pages are copied when either device writes to them. Pages
+         * this device handed out host pointers for (views, atomics, container caches) are
+         * copied right away, those pointers keep writing to this device only.
+         * 
+         * @param _uid Unique identifier for the copy, 0x0 to reuse the identifier of this device
+         * @return std::unique_ptr<PagedMemoryDevice> The copy
+         */
+        std::unique_ptr<PagedMemoryDevice> fork(const char* _uid = 0x0);
+
+        /**
+         * @brief Amount of pages allocated by the device (including pages shared with forks)
+         */
+        u64 allocated_pages() { return pages.size(); }
+
+        /**
+         * @brief Amount of pages only owned by this device
+         */
+        u64 private_pages();
+
+        void bare_read(vptr offset, u64 amount, void* output);
+        void bare_write(vptr offset, u64 amount, void* input);
+        u8* bare_direct(vptr offset, u64 amount);
+        u8* bare_view(vptr offset, u64 amount, u8 access);
+        void bare_fill(vptr offset, u64 amount, u8 value);
+    private:
+        typedef std::shared_ptr<u8[]> Page;
+
+        // Allocated pages, keyed by page number
+        std::unordered_map<u64, Page> pages;
+
+        // Pages host pointers were handed out for, never shared by fork()
+        std::unordered_set<u64> direct_pages;
+
+        /**
+         * @brief Get a page that can be written to, allocating or copying it if needed
+         * 
+         * @param number Page number
+         * @return u8* Page memory
+         */
+        u8* writable_page(u64 number);
+    };
+}
+}
@@ -10,23 +10,46 @@
 using namespace sasm::vm;
 
 void PureMemoryDevice::bare_read(vptr offset, u64 amount, void* output) {
-    // Get pointer to device real address as u8* & add offset
-    u8* device_real_u8p = ((u8*) real) + offset;
-    u8* output_u8p = (u8*) output;
-
     // Copy data from device to output
-    for (u64 x = 0; x < amount; x++) {
-        output_u8p[x] = device_real_u8p[x];
-    }
+    bulk_copy(output, ((u8*) real) + offset, amount);
 }
 
 void PureMemoryDevice::bare_write(vptr offset, u64 amount, void* input) {
-    // Get pointer to device real address as u8* & add offset
-    u8* device_real_u8p = ((u8*) real) + offset;
-    u8* input_u8p = (u8*) input;
-
     // Copy data from input to device
-    for (u64 x = 0; x < amount; x++) {
-        device_real_u8p[x] = input_u8p[x];
+    bulk_copy(((u8*) real) + offset, input, amount);
+}
+
+void PureMemoryDevice::bare_fill(vptr offset, u64 amount, u8 value) {
+    bulk_fill(((u8*) real) + offset, value, amount);
+}
+
+void PureMemoryDevice::bare_move(vptr destination, vptr source, u64 amount) {
+    bulk_move(((u8*) real) + destination, ((u8*) real) + source, amount);
+}
+
+int PureMemoryDevice::bare_compare(vptr offset, u64 amount, const void* other) {
+    return bulk_compare(((u8*) real) + offset, other, amount);
+}
+
+void PureMemoryDevice::bare_submit(MemorySegment* segments, u64 count) {
+    // Copy every valid segment without going through bare_read / bare_write
+    u8* memory = (u8*) real;
+    for (u64 i = 0; i < count; i++) {
+        MemorySegment& segment = segments[i];
+        if (segment.result != DeviceOperationResult::kSuccess)
+            continue;
+
+        // Batches are usually many small segments, skip the kernel dispatch for those
+        u8* destination = (u8*) segment.buffer;
+        u8* source = memory + segment.offset;
+        if (segment.kind == MemorySegmentKind::kSegmentWrite) {
+            destination = source;
+            source = (u8*) segment.buffer;
+        }
+
+        if (segment.amount <= 16)
+            memcpy(destination, source, segment.amount);
+        else
+            bulk_copy(destination, source, segment.amount);
     }
-}
\ No newline at end of file
+}
@@ -26,23 +26,67 @@ namespace vm {
             init(_uid, _size);
         }
         PureMemoryDevice() {}
+        ~PureMemoryDevice() { release(); }
+
+        PureMemoryDevice(const PureMemoryDevice&) = delete;
+        PureMemoryDevice& operator=(const PureMemoryDevice&) = delete;
 
         void init(const char* _uid, u64 _size) {
+            release();
             set_uid(_uid);
             real = malloc(_size);
+            owned = true;
             size = _size;
+            invalidate_translations(); // Host memory changed
 
             if (real == 0x0) {
                 size = 0;
+                owned = false;
                 sasm_print("Failed to initialize PureMemoryDevice, 0x0 malloc result");
             }
         }
 
+        /**
+         * @brief Use memory owned by something else (e.g. a MemoryArena) for the device
+         * 
+         * @param _uid Unique identifier
+         * @param _size Size of the memory
+         * @param backing Memory to use, has to stay valid while the device uses it
+         */
+        void init(const char* _uid, u64 _size, void* backing) {
+            release();
+            set_uid(_uid);
+            real = backing;
+            owned = false;
+            size = backing != 0x0 ? _size : 0;
+            invalidate_translations(); // Host memory changed
+        }
+
+        /**
+         * @brief Free the device memory if the device owns it
+         */
+        void release() {
+            if (owned)
+                free(real);
+            if (real != 0x0)
+                invalidate_translations(); // Host memory is gone
+
+            real = 0x0;
+            owned = false;
+            size = 0;
+        }
+
         void bare_read(vptr offset, u64 amount, void* output);
         void bare_write(vptr offset, u64 amount, void* input);
+        u8* bare_direct(vptr offset, u64 /* amount */) { return ((u8*) real) + offset; }
+        void bare_fill(vptr offset, u64 amount, u8 value);
+        void bare_move(vptr destination, vptr source, u64 amount);
+        int bare_compare(vptr offset, u64 amount, const void* other);
+        void bare_submit(MemorySegment* segments, u64 count);
     private:
         // Pointer to memory handled by the MemoryDevice
-        void* real;
+        void* real = 0x0;
+        bool owned = false; // True if real was allocated by the device
     };
 }
 }
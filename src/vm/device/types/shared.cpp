@@ -0,0 +1,86 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file shared.cpp
+ * @author lotuspar / par0-git
+ * @brief SharedMemoryDevice
+ */
+
+#include "shared.h"
+#include <stdlib.h> // aligned_alloc, free
+
+using namespace sasm::vm;
+
+void SharedMemoryDevice::init(const char* _uid, u64 _size) {
+    set_uid(_uid);
+
+    // aligned_alloc needs a multiple of the alignment
+    u64 allocation = (_size + 63) & ~((u64) 63);
+    u8* pointer = (u8*) aligned_alloc(64, allocation != 0 ? allocation : 64);
+    if (pointer == 0x0) {
+        memory.reset();
+        real = 0x0;
+        size = 0;
+        sasm_print("Failed to initialize SharedMemoryDevice, 0x0 aligned_alloc result");
+        invalidate_translations();
+        return;
+    }
+
+    bulk_fill(pointer, 0, allocation);
+    memory.reset(pointer, free);
+    real = pointer;
+    size = _size;
+    invalidate_translations(); // Host memory changed
+}
+
+std::unique_ptr<SharedMemoryDevice> SharedMemoryDevice::share(const char* _uid) {
+    std::unique_ptr<SharedMemoryDevice> copy(new SharedMemoryDevice());
+    copy->set_uid(_uid != 0x0 ? _uid : (const char*) uid);
+    copy->memory = memory;
+    copy->real = real;
+    copy->size = size;
+    return copy;
+}
+
+void SharedMemoryDevice::bare_read(vptr offset, u64 amount, void* output) {
+    u8* source = real + offset;
+
+    // Aligned scalar reads are single atomic loads
+    if ((amount & (amount - 1)) == 0 && amount <= 8 && (((u64) source) & (amount - 1)) == 0) {
+        switch (amount) {
+            case 1: *(u8*) output = __atomic_load_n(source, __ATOMIC_RELAXED); return;
+            case 2: { u16 value = __atomic_load_n((u16*) source, __ATOMIC_RELAXED); memcpy(output, &value, 2); return; }
+            case 4: { u32 value = __atomic_load_n((u32*) source, __ATOMIC_RELAXED); memcpy(output, &value, 4); return; }
+            case 8: { u64 value = __atomic_load_n((u64*) source, __ATOMIC_RELAXED); memcpy(output, &value, 8); return; }
+        }
+    }
+
+    bulk_copy(output, source, amount);
+}
+
+void SharedMemoryDevice::bare_write(vptr offset, u64 amount, void* input) {
+    u8* destination = real + offset;
+
+    // Aligned scalar writes are single atomic stores
+    if ((amount & (amount - 1)) == 0 && amount <= 8 && (((u64) destination) & (amount - 1)) == 0) {
+        switch (amount) {
+            case 1: __atomic_store_n(destination, *(u8*) input, __ATOMIC_RELAXED); return;
+            case 2: { u16 value; memcpy(&value, input, 2); __atomic_store_n((u16*) destination, value, __ATOMIC_RELAXED); return; }
+            case 4: { u32 value; memcpy(&value, input, 4); __atomic_store_n((u32*) destination, value, __ATOMIC_RELAXED); return; }
+            case 8: { u64 value; memcpy(&value, input, 8); __atomic_store_n((u64*) destination, value, __ATOMIC_RELAXED); return; }
+        }
+    }
+
+    bulk_copy(destination, input, amount);
+}
+
+void SharedMemoryDevice::bare_fill(vptr offset, u64 amount, u8 value) {
+    bulk_fill(real + offset, value, amount);
+}
+
+void SharedMemoryDevice::bare_move(vptr destination, vptr source, u64 amount) {
+    bulk_move(real + destination, real + source, amount);
+}
+
+int SharedMemoryDevice::bare_compare(vptr offset, u64 amount, const void* other) {
+    return bulk_compare(real + offset, other, amount);
+}
@@ -0,0 +1,70 @@
+/**
+ * SemiAssembly / sasm virtual machine code: device type
+ * @file shared.h
+ * @author lotuspar / par0-git
+ * @brief Definition of SharedMemoryDevice
+ * 
+ * A SharedMemoryDevice is memory that can be used by several processors on different
+ * threads at once. One device can be handled by several MemoryContainers, or share()
+ * can create more devices on top of the same memory (each with its own uid and status).
+ * 
+ * Reads and writes don't take locks: aligned 1, 2, 4 and 8 byte accesses are single
+ * atomic loads / stores, so they never tear. MemoryContainers don't cache host pointers
+ * to the device, every access goes through it. Read-modify-write operations go through
+ * MemoryDevice::atomic.
+ */
+
+#pragma once
+
+#include "../../../any/number.h" // u*, vptr
+#include "../../../any/debug.h" // sasm_*
+#include "../device.h"
+#include <memory> // std::shared_ptr, std::unique_ptr
+
+namespace sasm {
+namespace vm {
+    class SharedMemoryDevice : public MemoryDevice {
+    public:
+        SharedMemoryDevice(const char* _uid, u64 _size) {
+            init(_uid, _size);
+        }
+        SharedMemoryDevice() {}
+
+        SharedMemoryDevice(const SharedMemoryDevice&) = delete;
+        SharedMemoryDevice& operator=(const SharedMemoryDevice&) = delete;
+
+        /**
+         * @brief Allocate zeroed memory for the device, cache line aligned
+         * 
+         * @param _uid Unique identifier
+         * @param _size Size of the memory
+         */
+        void init(const char* _uid, u64 _size);
+
+        /**
+         * @brief Create another device using the same memory
+         * 
+         * @param _uid Unique identifier for the new device, 0x0 to reuse the identifier of this device
+         * @return std::unique_ptr<SharedMemoryDevice> The new device
+         */
+        std::unique_ptr<SharedMemoryDevice> share(const char* _uid = 0x0);
+
+        /**
+         * @brief Amount of devices using the memory of this device (including itself)
+         */
+        u64 sharers() { return memory.use_count(); }
+
+        void bare_read(vptr offset, u64 amount, void* output);
+        void bare_write(vptr offset, u64 amount, void* input);
+        u8* bare_direct(vptr offset, u64 /* amount */) { return real + offset; }
+        bool bare_copyable() { return false; } // Cached memcpy would skip the atomic loads / stores
+        void bare_fill(vptr offset, u64 amount, u8 value);
+        void bare_move(vptr destination, vptr source, u64 amount);
+        int bare_compare(vptr offset, u64 amount, const void* other);
+    private:
+        // Memory shared by every device created through share()
+        std::shared_ptr<u8> memory;
+        u8* real = 0x0;
+    };
+}
+}
@@ -0,0 +1,136 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file view.h
+ * @author lotuspar / par0-git
+ * @brief Borrowed views into MemoryDevice memory
+ * 
+ * A MemoryView points directly at device memory when the device allows it. Otherwise
+ * it owns a bounce buffer filled from the device, written back when committed.
+ */
+
+#pragma once
+
+#include "../../any/number.h" // u*, vptr
+#include "../../any/memory.h" // bulk_*
+#include "status.h" // DeviceOperationResult
+#include <memory> // std::unique_ptr
+
+namespace sasm {
+namespace vm {
+    class MemoryDevice;
+
+    /**
+     * @brief Bitflags for what a MemoryView is used for
+     */
+    enum MemoryViewAccess {
+        kViewRead = 0b01, // "kViewRead" View contents are read
+        kViewWrite = 0b10, // "kViewWrite" View contents are written, changes reach the device once committed
+        kViewReadWrite = 0b11
+    };
+
+    class MemoryView {
+        public:
+            // constructor: Creates an empty view, see MemoryDevice::view
+            MemoryView() {}
+            MemoryView(u8 _status) : status(_status) {}
+            MemoryView(MemoryDevice* _device, vptr _offset, u64 _length, u8 _access, u8* _pointer, std::unique_ptr<u8[]> _bounce)
+                : device(_device), offset(_offset), length(_length), access(_access), pointer(_pointer), bounce(std::move(_bounce)) {}
+
+            MemoryView(const MemoryView&) = delete;
+            MemoryView& operator=(const MemoryView&) = delete;
+
+            MemoryView(MemoryView&& other) { *this = std::move(other); }
+            MemoryView& operator=(MemoryView&& other) {
+                if (this != &other) {
+                    commit();
+                    device = other.device;
+                    offset = other.offset;
+                    length = other.length;
+                    access = other.access;
+                    status = other.status;
+                    pointer = other.pointer;
+                    bounce = std::move(other.bounce);
+                    other.device = 0x0;
+                    other.pointer = 0x0;
+                    other.length = 0;
+                }
+                return *this;
+            }
+
+            // destructor: Commits pending writes
+            ~MemoryView() { commit(); }
+
+            /**
+             * @brief Write bounce buffer contents back to the device and release the view
+             * 
+             * Borrowed views have nothing to write back. Either way the view is empty afterwards.
+             * 
+             * @return (u8 / DeviceOperationResult) Result of the write back
+             */
+            inline u8 commit();
+
+            /**
+             * @brief Checked read from the view
+             * 
+             * @param position Position in the view to start reading at
+             * @param amount Amount of bytes to read
+             * @param output Output location to read bytes to
+             * @return (u8 / DeviceOperationResult) Result of operation
+             */
+            u8 read(u64 position, u64 amount, void* output) {
+                if (!within(position, amount))
+                    return DeviceOperationResult::kOutOfBounds;
+
+                bulk_copy(output, pointer + position, amount);
+                return DeviceOperationResult::kSuccess;
+            }
+
+            /**
+             * @brief Checked write to the view
+             * 
+             * @param position Position in the view to start writing at
+             * @param amount Amount of bytes to write
+             * @param input Input location to write bytes from
+             * @return (u8 / DeviceOperationResult) Result of operation
+             */
+            u8 write(u64 position, u64 amount, const void* input) {
+                if (!(access & MemoryViewAccess::kViewWrite))
+                    return DeviceOperationResult::kLocked;
+                if (!within(position, amount))
+                    return DeviceOperationResult::kOutOfBounds;
+
+                bulk_copy(pointer + position, input, amount);
+                return DeviceOperationResult::kSuccess;
+            }
+
+            const u8* data() { return pointer; }
+            u64 size() { return length; }
+            const u8* begin() { return pointer; }
+            const u8* end() { return pointer + length; }
+            const u8& operator[](u64 position) { return pointer[position]; }
+
+            // Writable pointer to the view contents, 0x0 unless the view was created with kViewWrite
+            u8* writable() { return (access & MemoryViewAccess::kViewWrite) ? pointer : 0x0; }
+
+            // True if the view points at device memory instead of a bounce buffer
+            bool borrowed() { return pointer != 0x0 && !bounce; }
+
+            // Result of creating the view (DeviceOperationResult)
+            u8 result() { return status; }
+            explicit operator bool() { return status == DeviceOperationResult::kSuccess && pointer != 0x0; }
+
+        private:
+            MemoryDevice* device = 0x0;
+            vptr offset = 0;
+            u64 length = 0;
+            u8 access = 0;
+            u8 status = DeviceOperationResult::kSuccess;
+            u8* pointer = 0x0; // Device memory or bounce buffer
+            std::unique_ptr<u8[]> bounce;
+
+            bool within(u64 position, u64 amount) {
+                return position <= length && amount <= length - position;
+            }
+    };
+}
+}
@@ -0,0 +1,315 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file bytecode.h
+ * @author lotuspar / par0-git
+ * @brief SemiAssembly bytecode encoding
+ * 
+ * Every instruction starts with a one byte opcode. The operands following it depend on
+ * the instruction format:
+ * 
+ *   kFormatNone   [op]                              1 byte
+ *   kFormatR      [op][a]                           2 bytes
+ *   kFormatRR     [op][a | b << 4]                  2 bytes
+ *   kFormatRI32   [op][a][imm32]                    6 bytes, imm32 is sign extended
+ *   kFormatRI64   [op][a][imm64]                   10 bytes
+ *   kFormatT32    [op][target32]                    5 bytes, target is an offset into "user"
+ *   kFormatRRI32  [op][a | b << 4][imm32]           6 bytes, imm32 is sign extended
+ * 
+ * Immediates are little-endian. There are 16 general purpose registers (r0 - r15), the
+ * stack pointer and instruction pointer are separate. Only cmp / cmpi / cas change the flags.
+ */
+
+#pragma once
+
+#include "../../any/number.h" // u*
+#include <string.h> // memcpy
+#include <vector> // std::vector
+
+namespace sasm {
+namespace vm {
+    const u8 kRegisterCount = 16;
+    const u8 kMaxInstructionLength = 10;
+
+    /**
+     * @brief Operand layouts of instructions
+     */
+    enum InstructionFormat {
+        kFormatNone = 0,
+        kFormatR = 1,
+        kFormatRR = 2,
+        kFormatRI32 = 3,
+        kFormatRI64 = 4,
+        kFormatT32 = 5,
+        kFormatRRI32 = 6
+    };
+
+    /**
+     * List of every instruction: X(enum name, mnemonic, format)
+     * 
+     * Loads: a = destination, b = base register. Stores: a = base register, b = source.
+     * Atomics: a = address register (aligned to the width in device memory), b = operand, receives the old
+     * value (cas uses r0 as expected value and receives the old value in r0 instead).
+     */
+    #define SASM_OPCODES(X) \
+        X(Nop, "nop", kFormatNone) /* Do nothing */ \
+        X(Halt, "halt", kFormatNone) /* Stop execution */ \
+        X(Wait, "wait", kFormatNone) /* Block until woken by the host */ \
+        X(Mov, "mov", kFormatRR) /* a = b */ \
+        X(Movi, "movi", kFormatRI32) /* a = imm */ \
+        X(Movq, "movq", kFormatRI64) /* a = imm64 */ \
+        X(Add, "add", kFormatRR) /* a += b */ \
+        X(Sub, "sub", kFormatRR) /* a -= b */ \
+        X(Mul, "mul", kFormatRR) /* a *= b */ \
+        X(Divu, "divu", kFormatRR) /* a /= b (unsigned) */ \
+        X(Remu, "remu", kFormatRR) /* a %= b (unsigned) */ \
+        X(And, "and", kFormatRR) /* a &= b */ \
+        X(Or, "or", kFormatRR) /* a |= b */ \
+        X(Xor, "xor", kFormatRR) /* a ^= b */ \
+        X(Shl, "shl", kFormatRR) /* a <<= b & 63 */ \
+        X(Shr, "shr", kFormatRR) /* a >>= b & 63 (logical) */ \
+        X(Sar, "sar", kFormatRR) /* a >>= b & 63 (arithmetic) */ \
+        X(Addi, "addi", kFormatRI32) /* a += imm */ \
+        X(Andi, "andi", kFormatRI32) /* a &= imm */ \
+        X(Shli, "shli", kFormatRI32) /* a <<= imm & 63 */ \
+        X(Shri, "shri", kFormatRI32) /* a >>= imm & 63 (logical) */ \
+        X(Not, "not", kFormatR) /* a = ~a */ \
+        X(Neg, "neg", kFormatR) /* a = -a */ \
+        X(Cmp, "cmp", kFormatRR) /* flags = compare(a, b) */ \
+        X(Cmpi, "cmpi", kFormatRI32) /* flags = compare(a, imm) */ \
+        X(Jmp, "jmp", kFormatT32) /* ip = target */ \
+        X(Jz, "jz", kFormatT32) /* ip = target if equal */ \
+        X(Jnz, "jnz", kFormatT32) /* ip = target if not equal */ \
+        X(Jlt, "jlt", kFormatT32) /* ip = target if less (signed) */ \
+        X(Jge, "jge", kFormatT32) /* ip = target if greater or equal (signed) */ \
+        X(Jltu, "jltu", kFormatT32) /* ip = target if below (unsigned) */ \
+        X(Jgeu, "jgeu", kFormatT32) /* ip = target if above or equal (unsigned) */ \
+        X(Call, "call", kFormatT32) /* push ip of next instruction, ip = target */ \
+        X(Ret, "ret", kFormatNone) /* pop ip */ \
+        X(Push, "push", kFormatR) /* sp -= 8, [sp] = a */ \
+        X(Pop, "pop", kFormatR) /* a = [sp], sp += 8 */ \
+        X(Ld8, "ld8", kFormatRRI32) /* a = u8 [b + imm] */ \
+        X(Ld16, "ld16", kFormatRRI32) /* a = u16 [b + imm] */ \
+        X(Ld32, "ld32", kFormatRRI32) /* a = u32 [b + imm] */ \
+        X(Ld64, "ld64", kFormatRRI32) /* a = u64 [b + imm] */ \
+        X(St8, "st8", kFormatRRI32) /* u8 [a + imm] = b */ \
+        X(St16, "st16", kFormatRRI32) /* u16 [a + imm] = b */ \
+        X(St32, "st32", kFormatRRI32) /* u32 [a + imm] = b */ \
+        X(St64, "st64", kFormatRRI32) /* u64 [a + imm] = b */ \
+        X(Cas8, "cas8", kFormatRR) /* atomic u8: if [a] == r0: [a] = b. r0 = old [a], zero flag set if stored */ \
+        X(Cas16, "cas16", kFormatRR) /* atomic u16: if [a] == r0: [a] = b. r0 = old [a], zero flag set if stored */ \
+        X(Cas32, "cas32", kFormatRR) /* atomic u32: if [a] == r0: [a] = b. r0 = old [a], zero flag set if stored */ \
+        X(Cas64, "cas64", kFormatRR) /* atomic u64: if [a] == r0: [a] = b. r0 = old [a], zero flag set if stored */ \
+        X(Swap8, "swap8", kFormatRR) /* atomic u8: [a] = b, b = old [a] */ \
+        X(Swap16, "swap16", kFormatRR) /* atomic u16: [a] = b, b = old [a] */ \
+        X(Swap32, "swap32", kFormatRR) /* atomic u32: [a] = b, b = old [a] */ \
+        X(Swap64, "swap64", kFormatRR) /* atomic u64: [a] = b, b = old [a] */ \
+        X(Fadd8, "fadd8", kFormatRR) /* atomic u8: [a] += b, b = old [a] */ \
+        X(Fadd16, "fadd16", kFormatRR) /* atomic u16: [a] += b, b = old [a] */ \
+        X(Fadd32, "fadd32", kFormatRR) /* atomic u32: [a] += b, b = old [a] */ \
+        X(Fadd64, "fadd64", kFormatRR) /* atomic u64: [a] += b, b = old [a] */ \
+        X(Fand8, "fand8", kFormatRR) /* atomic u8: [a] &= b, b = old [a] */ \
+        X(Fand16, "fand16", kFormatRR) /* atomic u16: [a] &= b, b = old [a] */ \
+        X(Fand32, "fand32", kFormatRR) /* atomic u32: [a] &= b, b = old [a] */ \
+        X(Fand64, "fand64", kFormatRR) /* atomic u64: [a] &= b, b = old [a] */ \
+        X(For8, "for8", kFormatRR) /* atomic u8: [a] |= b, b = old [a] */ \
+        X(For16, "for16", kFormatRR) /* atomic u16: [a] |= b, b = old [a] */ \
+        X(For32, "for32", kFormatRR) /* atomic u32: [a] |= b, b = old [a] */ \
+        X(For64, "for64", kFormatRR) /* atomic u64: [a] |= b, b = old [a] */ \
+        X(Acquire, "acquire", kFormatNone) /* Acquire fence */ \
+        X(Release, "release", kFormatNone) /* Release fence */ \
+        X(Fence, "fence", kFormatNone) /* Full fence */
+
+    #define SASM_OPCODE_ENUM(name, mnemonic, format) kOp##name,
+    enum Opcode : u8 {
+        SASM_OPCODES(SASM_OPCODE_ENUM)
+        kOpcodeCount
+    };
+    #undef SASM_OPCODE_ENUM
+
+    /**
+     * @brief Bitflags stored in the "flags" device
+     */
+    enum ProcessorFlags {
+        kFlagZero = 0b001, // "kFlagZero" Compared values were equal
+        kFlagLess = 0b010, // "kFlagLess" First compared value was less (signed)
+        kFlagBelow = 0b100 // "kFlagBelow" First compared value was less (unsigned)
+    };
+
+    /**
+     * @brief Get the format of an opcode
+     * 
+     * @param opcode Opcode to check
+     * @return InstructionFormat Format, kFormatNone for invalid opcodes
+     */
+    inline InstructionFormat opcode_format(u8 opcode) {
+        #define SASM_OPCODE_FORMAT(name, mnemonic, format) format,
+        static const InstructionFormat formats[] = { SASM_OPCODES(SASM_OPCODE_FORMAT) };
+        #undef SASM_OPCODE_FORMAT
+        return opcode < kOpcodeCount ? formats[opcode] : kFormatNone;
+    }
+
+    /**
+     * @brief Get the mnemonic of an opcode
+     * 
+     * @param opcode Opcode to check
+     * @return const char* Mnemonic, 0x0 for invalid opcodes
+     */
+    inline const char* opcode_mnemonic(u8 opcode) {
+        #define SASM_OPCODE_MNEMONIC(name, mnemonic, format) mnemonic,
+        static const char* mnemonics[] = { SASM_OPCODES(SASM_OPCODE_MNEMONIC) };
+        #undef SASM_OPCODE_MNEMONIC
+        return opcode < kOpcodeCount ? mnemonics[opcode] : 0x0;
+    }
+
+    /**
+     * @brief Get the length of an instruction in a format
+     * 
+     * @param format Instruction format
+     * @return u8 Length in bytes
+     */
+    inline u8 format_length(InstructionFormat format) {
+        static const u8 lengths[] = { 1, 2, 2, 6, 10, 5, 6 };
+        return lengths[format];
+    }
+
+    /**
+     * @brief Flags set by comparing two values (cmp / cmpi)
+     */
+    inline u32 compare_flags(u64 a, u64 b) {
+        return (a == b ? kFlagZero : 0) |
+            ((i64) a < (i64) b ? kFlagLess : 0) |
+            (a < b ? kFlagBelow : 0);
+    }
+
+    // Read an unaligned little-endian i32 from bytecode
+    inline i32 read_i32(const u8* code) {
+        i32 value;
+        memcpy(&value, code, 4);
+        return value;
+    }
+
+    struct Instruction {
+        u8 opcode;
+        u8 a; // First register
+        u8 b; // Second register
+        u8 length; // Length of the encoded instruction
+        u64 immediate; // Immediate / jump target (sign extended)
+    };
+
+    /**
+     * @brief Decode one instruction
+     * 
+     * @param code Pointer to the instruction
+     * @param available Amount of bytes readable at the pointer
+     * @param output [OUT] Decoded instruction
+     * @return true on success, false if the opcode is invalid or the instruction is truncated
+     */
+    inline bool decode(const u8* code, u64 available, Instruction* output) {
+        if (available == 0 || code[0] >= kOpcodeCount)
+            return false;
+
+        InstructionFormat format = opcode_format(code[0]);
+        u8 length = format_length(format);
+        if (length > available)
+            return false;
+
+        output->opcode = code[0];
+        output->a = 0;
+        output->b = 0;
+        output->length = length;
+        output->immediate = 0;
+
+        switch (format) {
+            case kFormatNone:
+                break;
+            case kFormatR:
+                output->a = code[1] & 0xF;
+                break;
+            case kFormatRR:
+                output->a = code[1] & 0xF;
+                output->b = code[1] >> 4;
+                break;
+            case kFormatRI32: {
+                i32 immediate;
+                memcpy(&immediate, code + 2, 4);
+                output->a = code[1] & 0xF;
+                output->immediate = (u64) (i64) immediate;
+                break;
+            }
+            case kFormatRI64:
+                output->a = code[1] & 0xF;
+                memcpy(&output->immediate, code + 2, 8);
+                break;
+            case kFormatT32: {
+                u32 target;
+                memcpy(&target, code + 1, 4);
+                output->immediate = target;
+                break;
+            }
+            case kFormatRRI32: {
+                i32 immediate;
+                memcpy(&immediate, code + 2, 4);
+                output->a = code[1] & 0xF;
+                output->b = code[1] >> 4;
+                output->immediate = (u64) (i64) immediate;
+                break;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Helper to encode bytecode
+     */
+    class BytecodeWriter {
+        public:
+            // Encode instruction of any format, unused operands are ignored
+            BytecodeWriter& emit(u8 opcode, u8 a = 0, u8 b = 0, u64 immediate = 0) {
+                InstructionFormat format = opcode_format(opcode);
+                bytes.push_back(opcode);
+
+                switch (format) {
+                    case kFormatNone:
+                        break;
+                    case kFormatR:
+                        bytes.push_back(a & 0xF);
+                        break;
+                    case kFormatRR:
+                        bytes.push_back((a & 0xF) | (b << 4));
+                        break;
+                    case kFormatRI32:
+                        bytes.push_back(a & 0xF);
+                        push(immediate, 4);
+                        break;
+                    case kFormatRI64:
+                        bytes.push_back(a & 0xF);
+                        push(immediate, 8);
+                        break;
+                    case kFormatT32:
+                        push(immediate, 4);
+                        break;
+                    case kFormatRRI32:
+                        bytes.push_back((a & 0xF) | (b << 4));
+                        push(immediate, 4);
+                        break;
+                }
+                return *this;
+            }
+
+            // Position of the next instruction
+            u64 position() { return bytes.size(); }
+
+            // Change the target of a kFormatT32 instruction emitted at "at"
+            void patch_target(u64 at, u32 target) {
+                memcpy(bytes.data() + at + 1, &target, 4);
+            }
+
+            std::vector<u8> bytes;
+        private:
+            void push(u64 value, u8 amount) {
+                for (u8 i = 0; i < amount; i++)
+                    bytes.push_back((u8) (value >> (i * 8)));
+            }
+    };
+}
+}
@@ -0,0 +1,341 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file checkpoint.cpp
+ * @author lotuspar / par0-git
+ * @brief ProcessorCheckpoint save / restore
+ */
+
+#include "checkpoint.h"
+#include "../../any/compress.h" // lz_*
+#include <vector> // std::vector
+#include <stdio.h> // FILE
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // sysconf, close
+
+using namespace sasm;
+using namespace sasm::vm;
+
+// Largest amount of device bytes compressed at once
+static const u64 kCompressChunk = 64 << 10;
+
+// Compressed chunks have to be smaller than this part of the original to be kept
+static const u64 kCompressKeepNumerator = 7;
+static const u64 kCompressKeepDenominator = 8;
+
+// Amount of devices of a BaseProcessor
+static const u64 kProcessorDevices = 3;
+
+namespace {
+    struct CheckpointWriter {
+        FILE* file = 0x0;
+        u64 position = 0;
+        bool ok = true;
+
+        void write(const void* data, u64 amount) {
+            if (ok && amount != 0 && fwrite(data, 1, amount, file) != amount)
+                ok = false;
+            position += amount;
+        }
+
+        // Write zeros up to the next multiple of alignment
+        void pad(u64 alignment) {
+            static const u8 zeros[4096] = {};
+            u64 target = (position + alignment - 1) & ~(alignment - 1);
+            while (position < target) {
+                u64 chunk = target - position < sizeof(zeros) ? target - position : sizeof(zeros);
+                write(zeros, chunk);
+            }
+        }
+    };
+
+    bool page_is_zero(const u8* page, u64 amount) {
+        u64 accumulated = 0;
+        u64 i = 0;
+        for (; i + 8 <= amount; i += 8) {
+            u64 value;
+            memcpy(&value, page + i, sizeof(value));
+            accumulated |= value;
+        }
+        for (; i < amount; i++)
+            accumulated |= page[i];
+        return accumulated == 0;
+    }
+
+    /**
+     * Write a range of device memory [offset, size) as extents, all-zero pages are skipped
+     * or, for delta checkpoints, written as kEncodingZero extents
+     */
+    void write_device(CheckpointWriter& writer, const u8* memory, u64 offset, u64 size, u64 page_size, bool compress,
+        bool zero_extents, u64 first_extent, std::vector<CheckpointExtent>& extents, std::vector<u8>& scratch) {
+        while (offset < size) {
+            // Skip zero pages
+            u64 page = size - offset < page_size ? size - offset : page_size;
+            if (page_is_zero(memory + offset, page)) {
+                if (zero_extents) {
+                    // Extend the previous zero extent of this device if it ends here
+                    CheckpointExtent* last = extents.size() > first_extent ? &extents.back() : 0x0;
+                    if (last != 0x0 && last->encoding == kEncodingZero && last->offset + last->length == offset)
+                        last->length += page;
+                    else {
+                        CheckpointExtent extent = CheckpointExtent();
+                        extent.offset = offset;
+                        extent.length = page;
+                        extent.encoding = kEncodingZero;
+                        extents.push_back(extent);
+                    }
+                }
+                offset += page;
+                continue;
+            }
+
+            // Run of non-zero pages, limited to a chunk if compressing
+            u64 end = offset + page;
+            while (end < size && (!compress || end - offset < kCompressChunk)) {
+                u64 next = size - end < page_size ? size - end : page_size;
+                if (page_is_zero(memory + end, next))
+                    break;
+                end += next;
+            }
+
+            CheckpointExtent extent = CheckpointExtent();
+            extent.offset = offset;
+            extent.length = end - offset;
+
+            if (compress) {
+                scratch.resize(lz_bound(extent.length));
+                u64 stored = lz_compress(memory + offset, extent.length, scratch.data(), scratch.size());
+                if (stored != 0 && stored * kCompressKeepDenominator < extent.length * kCompressKeepNumerator) {
+                    extent.file_offset = writer.position;
+                    extent.stored = stored;
+                    extent.encoding = kEncodingLz;
+                    writer.write(scratch.data(), stored);
+                    extents.push_back(extent);
+                    offset = end;
+                    continue;
+                }
+            }
+
+            // Raw extents are page aligned and padded so they can be mapped
+            writer.pad(page_size);
+            extent.file_offset = writer.position;
+            extent.stored = extent.length;
+            extent.encoding = kEncodingRaw;
+            writer.write(memory + offset, extent.length);
+            writer.pad(page_size);
+            extents.push_back(extent);
+            offset = end;
+        }
+    }
+}
+
+u8 ProcessorCheckpoint::save(BaseProcessor& processor, const char* path, u8 flags) {
+    PureMemoryDevice* devices[kProcessorDevices] = { &processor.prm_flags, &processor.prm_stack, &processor.prm_user };
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    bool delta = flags & kCheckpointDelta;
+
+    CheckpointWriter writer;
+    writer.file = fopen(path, "wb");
+    if (writer.file == 0x0) {
+        sasm_print("Failed to open checkpoint %s", path);
+        return CheckpointResult::kCheckpointFileError;
+    }
+
+    // Written again once the table offset is known
+    CheckpointHeader header = CheckpointHeader();
+    memcpy(header.magic, kCheckpointMagic, sizeof(header.magic));
+    header.page_size = page_size;
+    header.register_count = kRegisterCount;
+    header.device_count = kProcessorDevices;
+    header.container_status = processor.prm.get_status();
+    header.flags = flags;
+    header.state = processor.state;
+    writer.write(&header, sizeof(header));
+
+    std::vector<CheckpointDevice> table(kProcessorDevices);
+    std::vector<CheckpointExtent> extents;
+    std::vector<u8> scratch;
+    std::vector<DirtyRange> ranges;
+    u64 container_offset = 0;
+    for (u64 i = 0; i < kProcessorDevices; i++) {
+        PureMemoryDevice& device = *devices[i];
+        CheckpointDevice& entry = table[i];
+        memcpy(entry.uid, device.uid, sizeof(entry.uid));
+        entry.size = device.size;
+        entry.offset = container_offset;
+        entry.status = device.get_status();
+        entry.first_extent = extents.size();
+        container_offset += device.size;
+
+        // Saving starts a new delta, also for full checkpoints
+        ranges.clear();
+        if (delta && device.tracking_writes())
+            device.dirty_ranges(&ranges);
+        else {
+            device.clear_dirty();
+            ranges.push_back(DirtyRange { 0, device.size });
+        }
+
+        const u8* memory = device.bare_direct(0, device.size);
+        for (u64 r = 0; r < ranges.size() && memory != 0x0; r++) {
+            write_device(writer, memory, ranges[r].offset, ranges[r].offset + ranges[r].amount, page_size,
+                flags & kCheckpointCompress, delta, entry.first_extent, extents, scratch);
+        }
+        entry.extent_count = extents.size() - entry.first_extent;
+    }
+
+    writer.pad(8);
+    header.table_offset = writer.position;
+    header.extent_count = extents.size();
+    writer.write(table.data(), table.size() * sizeof(CheckpointDevice));
+    writer.write(extents.data(), extents.size() * sizeof(CheckpointExtent));
+
+    if (writer.ok && (fseek(writer.file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, writer.file) != 1))
+        writer.ok = false;
+    if (fclose(writer.file) != 0)
+        writer.ok = false;
+
+    if (!writer.ok) {
+        // The next delta has to include everything again
+        for (u64 i = 0; i < kProcessorDevices; i++)
+            devices[i]->mark_dirty(0, devices[i]->size);
+
+        sasm_print("Failed to write checkpoint %s", path);
+        return CheckpointResult::kCheckpointFileError;
+    }
+    return CheckpointResult::kCheckpointSuccess;
+}
+
+u8 ProcessorCheckpoint::restore(BaseProcessor& processor, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        sasm_print("Failed to open checkpoint %s", path);
+        return CheckpointResult::kCheckpointFileError;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (u64) info.st_size < sizeof(CheckpointHeader)) {
+        close(fd);
+        return CheckpointResult::kCheckpointInvalid;
+    }
+
+    // Only the header, tables and copied extents of this mapping are read
+    u64 file_size = info.st_size;
+    void* mapping = mmap(0x0, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(fd);
+        return CheckpointResult::kCheckpointFileError;
+    }
+    const u8* file = (const u8*) mapping;
+
+    u8 result = CheckpointResult::kCheckpointSuccess;
+    CheckpointHeader header;
+    memcpy(&header, file, sizeof(header));
+    const CheckpointDevice* table = 0x0;
+    const CheckpointExtent* extents = 0x0;
+
+    // Check if the tables are inside the file
+    u64 table_size = header.device_count * sizeof(CheckpointDevice);
+    u64 extents_size = header.extent_count * sizeof(CheckpointExtent);
+    if (memcmp(header.magic, kCheckpointMagic, sizeof(header.magic)) != 0 || header.register_count != kRegisterCount ||
+        header.device_count > file_size / sizeof(CheckpointDevice) || header.extent_count > file_size / sizeof(CheckpointExtent) ||
+        header.table_offset > file_size || table_size + extents_size > file_size - header.table_offset) {
+        result = CheckpointResult::kCheckpointInvalid;
+    } else {
+        table = (const CheckpointDevice*) (file + header.table_offset);
+        extents = (const CheckpointExtent*) (file + header.table_offset + table_size);
+    }
+
+    // Check if the layout is the one of a BaseProcessor, deltas need the current device sizes
+    static const char* kNames[kProcessorDevices] = { "flags", "stack", "user" };
+    bool delta = header.flags & kCheckpointDelta;
+    if (result == CheckpointResult::kCheckpointSuccess) {
+        if (header.device_count != kProcessorDevices || table[0].size != processor.prm_flags.size)
+            result = CheckpointResult::kCheckpointLayout;
+        else if (delta && (table[1].size != processor.prm_stack.size || table[2].size != processor.prm_user.size))
+            result = CheckpointResult::kCheckpointLayout;
+
+        u64 container_offset = 0;
+        for (u64 i = 0; i < header.device_count && result == CheckpointResult::kCheckpointSuccess; i++) {
+            if (strncmp((const char*) table[i].uid, kNames[i], sizeof(table[i].uid)) != 0 || table[i].offset != container_offset)
+                result = CheckpointResult::kCheckpointLayout;
+            else if (table[i].first_extent > header.extent_count || table[i].extent_count > header.extent_count - table[i].first_extent)
+                result = CheckpointResult::kCheckpointInvalid;
+            container_offset += table[i].size;
+        }
+    }
+
+    if (result != CheckpointResult::kCheckpointSuccess) {
+        munmap(mapping, file_size);
+        close(fd);
+        return result;
+    }
+
+    // Fresh memory with page aligned devices, zero pages stay untouched. Deltas change current memory
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    if (!delta) {
+        processor.init(table[1].size, table[2].size, page_size);
+        if (processor.prm_stack.size != table[1].size || processor.prm_user.size != table[2].size)
+            result = CheckpointResult::kCheckpointNoMemory;
+    }
+
+    PureMemoryDevice* devices[kProcessorDevices] = { &processor.prm_flags, &processor.prm_stack, &processor.prm_user };
+    MemoryArena* arena = processor.arena.get();
+    for (u64 i = 0; i < kProcessorDevices && result == CheckpointResult::kCheckpointSuccess; i++) {
+        PureMemoryDevice& device = *devices[i];
+        u8* memory = device.bare_direct(0, device.size);
+
+        for (u64 e = 0; e < table[i].extent_count; e++) {
+            const CheckpointExtent& extent = extents[table[i].first_extent + e];
+            if (extent.offset > device.size || extent.length > device.size - extent.offset ||
+                extent.file_offset > file_size || extent.stored > file_size - extent.file_offset) {
+                result = CheckpointResult::kCheckpointInvalid;
+                break;
+            }
+
+            u8* destination = memory + extent.offset;
+            if (extent.encoding == kEncodingLz) {
+                if (!lz_decompress(file + extent.file_offset, extent.stored, destination, extent.length))
+                    result = CheckpointResult::kCheckpointInvalid;
+            } else if (extent.encoding == kEncodingZero && extent.stored == 0) {
+                memset(destination, 0, extent.length);
+            } else if (extent.encoding == kEncodingRaw && extent.stored == extent.length) {
+                // Map whole pages, the rest of the last page belongs to this device as blocks are page aligned.
+                // Deltas keep the rest of a partial page
+                u64 mapped = (extent.length + page_size - 1) & ~(page_size - 1);
+                u64 device_end = (device.size + page_size - 1) & ~(page_size - 1);
+                bool whole = !delta || mapped == extent.length || extent.offset + extent.length == device.size;
+                bool mappable = whole && extent.length >= page_size && mapped <= device_end - extent.offset &&
+                    extent.file_offset + mapped <= file_size;
+                if (!mappable || arena == 0x0 || !arena->map_file(destination, fd, extent.file_offset, extent.length))
+                    memcpy(destination, file + extent.file_offset, extent.length);
+            } else {
+                result = CheckpointResult::kCheckpointInvalid;
+            }
+
+            if (result != CheckpointResult::kCheckpointSuccess)
+                break;
+        }
+    }
+
+    if (result == CheckpointResult::kCheckpointSuccess) {
+        // Memory matches the checkpoint, the next delta starts here
+        for (u64 i = 0; i < kProcessorDevices; i++) {
+            devices[i]->set_status(table[i].status);
+            devices[i]->clear_dirty();
+        }
+        processor.prm.set_status(header.container_status);
+        processor.state = header.state;
+        processor.code_watch.epoch++; // Deltas change "user" without init()
+    }
+
+    munmap(mapping, file_size);
+    close(fd); // Mapped extents keep the file open
+
+    if (result != CheckpointResult::kCheckpointSuccess) {
+        sasm_print("Failed to restore checkpoint %s (result %u)", path, result);
+        processor.init(processor.prm_stack.size, processor.prm_user.size);
+    }
+    return result;
+}
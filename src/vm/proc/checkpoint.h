@@ -0,0 +1,124 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file checkpoint.h
+ * @author lotuspar / par0-git
+ * @brief Saving / restoring processors to / from checkpoint files
+ *
+ * A checkpoint holds the processor state, the container layout, the uid / size / status
+ * of every device and the device contents. Contents are stored as extents: all-zero
+ * pages are left out, the others are stored raw (page aligned in the file) or, with
+ * kCheckpointCompress, lz_compress'd in chunks.
+ *
+ * Restoring maps raw extents straight from the file (copy-on-write), so pages are only
+ * read once the processor touches them. Restore time depends on the amount of
+ * compressed / small extents, not on the memory size.
+ *
+ * With BaseProcessor::track_writes, kCheckpointDelta saves only the pages written since
+ * the previous save / restore. Dirty pages that are all zero are stored as kEncodingZero
+ * extents. A delta is restored on top of the checkpoint it was taken after.
+ *
+ * File layout: CheckpointHeader, extent data, then at header.table_offset the
+ * CheckpointDevice table followed by the CheckpointExtent table.
+ */
+
+#pragma once
+
+#include "processor.h" // BaseProcessor, ProcessorState
+
+namespace sasm {
+namespace vm {
+    /**
+     * @brief Options for saving checkpoints
+     */
+    enum CheckpointFlags {
+        kCheckpointCompress = 0b01, // "kCheckpointCompress" Compress contents, smaller files but restoring has to decompress
+        kCheckpointDelta = 0b10 // "kCheckpointDelta" Only save pages written since the last save / restore, needs track_writes
+    };
+
+    /**
+     * @brief Result codes of checkpoint operations
+     */
+    enum CheckpointResult {
+        kCheckpointSuccess = 0,
+        kCheckpointFileError = 1, // Failed to open / read / write / map the file
+        kCheckpointInvalid = 2, // Not a checkpoint, other version or corrupted
+        kCheckpointLayout = 3, // Devices don't match the processor
+        kCheckpointNoMemory = 4 // Failed to allocate processor memory
+    };
+
+    /**
+     * @brief How an extent is stored
+     */
+    enum CheckpointEncoding {
+        kEncodingRaw = 0, // "kEncodingRaw" Stored as is, page aligned in the file
+        kEncodingLz = 1, // "kEncodingLz" Stored lz_compress'd
+        kEncodingZero = 2 // "kEncodingZero" All zero, nothing stored (delta checkpoints)
+    };
+
+    struct CheckpointHeader {
+        char magic[8]; // "SASMCKP1"
+        u32 page_size; // Zero-skip granularity / alignment of raw extents
+        u32 register_count; // kRegisterCount of the saving processor
+        u64 table_offset; // File offset of the device table
+        u64 device_count;
+        u64 extent_count;
+        u8 container_status;
+        u8 flags; // CheckpointFlags used for saving
+        u8 reserved[6];
+        ProcessorState state;
+    };
+
+    struct CheckpointDevice {
+        u8 uid[32];
+        u64 size;
+        u64 offset; // Container address
+        u64 first_extent; // Index into the extent table
+        u64 extent_count;
+        u8 status;
+        u8 reserved[7];
+    };
+
+    struct CheckpointExtent {
+        u64 offset; // Offset into the device
+        u64 length; // Amount of device bytes
+        u64 file_offset;
+        u64 stored; // Amount of bytes in the file
+        u32 encoding; // CheckpointEncoding
+        u32 reserved;
+    };
+
+    static const char kCheckpointMagic[8] = { 'S', 'A', 'S', 'M', 'C', 'K', 'P', '1' };
+
+    class ProcessorCheckpoint {
+    public:
+        /**
+         * @brief Write a processor to a checkpoint file, the file is overwritten
+         *
+         * Saving clears the dirty pages of devices tracking writes. Devices not tracking
+         * writes are saved completely, also in delta checkpoints.
+         *
+         * @param processor Processor to save, shouldn't be running
+         * @param path Path of the checkpoint file
+         * @param flags Options (CheckpointFlags)
+         * @return (u8 / CheckpointResult) Result of operation
+         */
+        static u8 save(BaseProcessor& processor, const char* path, u8 flags = 0);
+
+        /**
+         * @brief Replace processor memory / state with a checkpoint
+         *
+         * Memory is recreated with page aligned devices. Raw extents of at least a page are
+         * mapped from the file instead of copied, the file can be deleted afterwards.
+         * Compiled code of a JitProcessor is dropped before it runs again.
+         *
+         * Delta checkpoints keep the processor memory and only replace the saved pages,
+         * device sizes have to match. Dirty pages are cleared after restoring.
+         *
+         * @param processor Processor to restore into, shouldn't be running
+         * @param path Path of the checkpoint file
+         * @return (u8 / CheckpointResult) Result of operation, processor memory is reset on failure
+         */
+        static u8 restore(BaseProcessor& processor, const char* path);
+    };
+}
+}
@@ -0,0 +1,141 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file image.cpp
+ * @author lotuspar / par0-git
+ * @brief BytecodeImage
+ */
+
+#include "image.h"
+#include "../../any/hash.h" // hash_bytes
+#include <string> // std::string
+#include <stdio.h> // FILE, rename
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h> // sysconf, close, getpid
+
+using namespace sasm;
+using namespace sasm::vm;
+
+namespace {
+    // Write zeros up to the next multiple of alignment
+    bool write_padding(FILE* file, u64 position, u64 alignment) {
+        static const u8 zeros[4096] = {};
+        u64 target = (position + alignment - 1) & ~(alignment - 1);
+        while (position < target) {
+            u64 chunk = target - position < sizeof(zeros) ? target - position : sizeof(zeros);
+            if (fwrite(zeros, 1, chunk, file) != chunk)
+                return false;
+            position += chunk;
+        }
+        return true;
+    }
+}
+
+bool BytecodeImage::write(const char* path, const void* code, u64 amount) {
+    u64 page_size = sysconf(_SC_PAGESIZE);
+
+    ImageHeader header = {};
+    memcpy(header.magic, kImageMagic, sizeof(header.magic));
+    header.page_size = page_size;
+    header.code_offset = (sizeof(ImageHeader) + page_size - 1) & ~(page_size - 1);
+    header.code_size = amount;
+    header.code_hash = hash_bytes(code, amount);
+
+    // Write next to the image and rename, processors mapping the old image keep their pages
+    std::string temporary = std::string(path) + "." + std::to_string(getpid()) + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == 0x0) {
+        sasm_print("Failed to open image %s", temporary.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+        write_padding(file, sizeof(header), header.code_offset) &&
+        (amount == 0 || fwrite(code, 1, amount, file) == amount) &&
+        write_padding(file, header.code_offset + amount, page_size);
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(temporary.c_str(), path) != 0) {
+        remove(temporary.c_str());
+        sasm_print("Failed to write image %s", path);
+        return false;
+    }
+    return true;
+}
+
+bool BytecodeImage::open(const char* path, bool verify) {
+    close();
+
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        sasm_print("Failed to open image %s", path);
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (u64) info.st_size < sizeof(ImageHeader)) {
+        sasm_print("Invalid image %s", path);
+        close();
+        return false;
+    }
+
+    mapping_length = info.st_size;
+    mapping = mmap(0x0, mapping_length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED) {
+        mapping = 0x0;
+        sasm_print("Failed to map image %s", path);
+        close();
+        return false;
+    }
+
+    // Check if the code is inside of the file
+    memcpy(&header, mapping, sizeof(header));
+    bool valid = memcmp(header.magic, kImageMagic, sizeof(header.magic)) == 0 &&
+        header.code_offset <= mapping_length && header.code_size <= mapping_length - header.code_offset;
+    if (valid && verify)
+        valid = hash_bytes(code(), header.code_size) == header.code_hash;
+
+    if (!valid) {
+        sasm_print("Invalid image %s", path);
+        close();
+        return false;
+    }
+    return true;
+}
+
+void BytecodeImage::close() {
+    if (mapping != 0x0)
+        munmap(mapping, mapping_length);
+    if (fd >= 0)
+        ::close(fd);
+
+    mapping = 0x0;
+    mapping_length = 0;
+    fd = -1;
+    header = ImageHeader();
+}
+
+u8 BytecodeImage::load(BaseProcessor& processor) {
+    PureMemoryDevice& user = processor.prm_user;
+    if (mapping == 0x0 || header.code_size > user.size) {
+        sasm_debug_print("Image doesn't fit into \"user\" (%llu bytes)", header.code_size);
+        return DeviceOperationResult::kOutOfBounds;
+    }
+    if (user.check(MemoryDeviceStatus::kWriteLocked))
+        return DeviceOperationResult::kLocked;
+
+    // Map whole pages, copy the rest. Needs the page size the image was written with
+    u64 page_size = sysconf(_SC_PAGESIZE);
+    u64 mapped = header.page_size == page_size ? header.code_size & ~(page_size - 1) : 0;
+    u8* memory = user.bare_direct(0, user.size);
+    MemoryArena* arena = processor.arena.get();
+    processor.code_watch.epoch++;
+
+    if (mapped != 0 && memory != 0x0 && arena != 0x0 && arena->map_file(memory, fd, header.code_offset, mapped))
+        user.mark_dirty(0, mapped);
+    else
+        mapped = 0;
+
+    return user.write(mapped, header.code_size - mapped, (void*) (code() + mapped));
+}
@@ -0,0 +1,95 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file image.h
+ * @author lotuspar / par0-git
+ * @brief Bytecode image files
+ *
+ * A bytecode image holds a linked program for "user" (written by the assembler, see
+ * asm/assembler.h). The code starts page aligned in the file, so it can be used without
+ * copying:
+ *  - code() points into a read-only mapping of the file (e.g. for LockstepProcessor::load)
+ *  - load() maps whole pages copy-on-write over "user" of a BaseProcessor, pages are only
+ *    read from the file once the processor touches them
+ *  - a MappedMemoryDevice over [code_offset(), code_offset() + size()) of the file can be
+ *    used as "user" of a custom container
+ *
+ * File layout: ImageHeader, zero padding up to header.code_offset, the code, zero padding
+ * up to a multiple of header.page_size.
+ */
+
+#pragma once
+
+#include "processor.h" // BaseProcessor
+
+namespace sasm {
+namespace vm {
+    struct ImageHeader {
+        char magic[8]; // "SASMIMG1"
+        u32 page_size; // Alignment of the code in the file
+        u32 reserved0;
+        u64 code_offset; // File offset of the code
+        u64 code_size;
+        u64 code_hash; // hash_bytes of the code
+        u8 reserved[24];
+    };
+
+    static const char kImageMagic[8] = { 'S', 'A', 'S', 'M', 'I', 'M', 'G', '1' };
+
+    class BytecodeImage {
+    public:
+        BytecodeImage() {}
+        ~BytecodeImage() { close(); }
+
+        BytecodeImage(const BytecodeImage&) = delete;
+        BytecodeImage& operator=(const BytecodeImage&) = delete;
+
+        /**
+         * @brief Write code to an image file, the file is replaced once it's complete
+         *
+         * @param path Path of the image file
+         * @param code Pointer to bytecode
+         * @param amount Size of the bytecode
+         * @return true on success
+         */
+        static bool write(const char* path, const void* code, u64 amount);
+
+        /**
+         * @brief Map an image file, closes the current image first
+         *
+         * @param path Path of the image file
+         * @param verify Check the code against header.code_hash, reads the whole file
+         * @return true on success
+         */
+        bool open(const char* path, bool verify = false);
+
+        /**
+         * @brief Unmap the image, memory mapped into processors by load() stays valid
+         */
+        void close();
+
+        /**
+         * @brief Put the code at the beginning of "user"
+         *
+         * Whole pages are mapped if "user" is page aligned (BaseProcessor::init with the
+         * page size as alignment), the rest is copied. A JitProcessor has to be
+         * invalidate()'d after loading.
+         *
+         * @param processor Processor to load into
+         * @return (u8 / DeviceOperationResult) Result of operation
+         */
+        u8 load(BaseProcessor& processor);
+
+        bool opened() { return mapping != 0x0; }
+
+        // Code in the read-only mapping, 0x0 if no image is open
+        const u8* code() { return mapping != 0x0 ? (const u8*) mapping + header.code_offset : 0x0; }
+        u64 size() { return mapping != 0x0 ? header.code_size : 0; }
+        u64 code_offset() { return header.code_offset; }
+    private:
+        ImageHeader header = {};
+        int fd = -1;
+        void* mapping = 0x0;
+        u64 mapping_length = 0;
+    };
+}
+}
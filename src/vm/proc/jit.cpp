@@ -0,0 +1,872 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file jit.cpp
+ * @author lotuspar / par0-git
+ * @brief Template JIT tier for hot basic blocks (x86-64)
+ *
+ * Compiled blocks are called as "u64 block(ProcessorState* state)". rbx holds the state
+ * pointer for the whole block; guest registers, ip, sp and flags are read / written
+ * through it. The JitContext lives at a fixed distance from the state (both are members
+ * of the processor) so it is addressed through rbx as well. rax, rcx, rdx, r8 and r9 are
+ * scratch registers.
+ */
+
+#include "jit.h"
+#include <algorithm> // std::min, std::max
+#include <stddef.h> // offsetof
+#include <stdlib.h> // getenv
+
+#if defined(__x86_64__) && defined(__unix__)
+    #define SASM_JIT_X64
+    #include <sys/mman.h> // mmap, mprotect, munmap
+#endif
+
+using namespace sasm::vm;
+
+// Maximum amount of instructions in a block
+static const u32 kMaxBlockInstructions = 256;
+
+/**
+ * @brief Load used by compiled code when an address isn't in a direct region
+ */
+static u64 jit_load(ProcessorState* state, JitContext* context, u64 address, u64 width) {
+    if (width > context->memory_size || address > context->memory_size - width) {
+        state->fault = kFaultMemory;
+        return 0;
+    }
+
+    u64 value = 0;
+    if (context->memory->read_checked(address, width, &value) != DeviceOperationResult::kSuccess)
+        state->fault = kFaultMemory;
+    return value;
+}
+
+/**
+ * @brief Store used by compiled code when an address isn't in a direct region
+ */
+static void jit_store(ProcessorState* state, JitContext* context, u64 address, u64 width, u64 value) {
+    if (width > context->memory_size || address > context->memory_size - width) {
+        state->fault = kFaultMemory;
+        return;
+    }
+
+    if (context->memory->write_checked(address, width, &value) != DeviceOperationResult::kSuccess)
+        state->fault = kFaultMemory;
+}
+
+JitCodeBuffer::JitCodeBuffer(u64 _capacity) {
+#ifdef SASM_JIT_X64
+    void* result = mmap(0x0, _capacity, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (result == MAP_FAILED) {
+        sasm_print("Failed to allocate JIT code buffer, 0x0 mmap result");
+        return;
+    }
+
+    memory = (u8*) result;
+    capacity = _capacity;
+#endif
+}
+
+JitCodeBuffer::~JitCodeBuffer() {
+#ifdef SASM_JIT_X64
+    if (memory != 0x0)
+        munmap(memory, capacity);
+#endif
+}
+
+void* JitCodeBuffer::install(const u8* code, u64 amount) {
+#ifdef SASM_JIT_X64
+    // Keep blocks 16 byte aligned
+    u64 start = (used + 15) & ~(u64) 15;
+    if (memory == 0x0 || start + amount > capacity)
+        return 0x0;
+
+    // W^X: writable while copying, executable afterwards
+    if (mprotect(memory, capacity, PROT_READ | PROT_WRITE) != 0)
+        return 0x0;
+    memcpy(memory + start, code, amount);
+    mprotect(memory, capacity, PROT_READ | PROT_EXEC);
+
+    used = start + amount;
+    return memory + start;
+#else
+    return 0x0;
+#endif
+}
+
+namespace {
+    // x86-64 registers
+    enum X64Register : u8 { kRax = 0, kRcx = 1, kRdx = 2, kRbx = 3, kRsi = 6, kRdi = 7, kR8 = 8 };
+
+    // Condition codes for jcc
+    enum X64Condition : u8 { kBelow = 0x2, kAboveEqual = 0x3, kEqual = 0x4, kNotEqual = 0x5, kBelowEqual = 0x6 };
+
+    /**
+     * @brief Minimal x86-64 encoder, only what the instruction templates need
+     *
+     * Memory operands are always [rbx + disp32].
+     */
+    class X64Emitter {
+        public:
+            std::vector<u8> code;
+
+            void byte(u8 value) { code.push_back(value); }
+            void bytes(std::initializer_list<u8> values) { code.insert(code.end(), values); }
+            void imm32(u32 value) { for (u8 i = 0; i < 4; i++) byte((u8) (value >> (i * 8))); }
+            void imm64(u64 value) { for (u8 i = 0; i < 8; i++) byte((u8) (value >> (i * 8))); }
+            u64 position() { return code.size(); }
+
+            // [REX.W] opcode modrm(reg, [rbx + disp32]) disp32
+            void rbx_operand(std::initializer_list<u8> opcode, u8 reg, i32 disp, bool wide = true) {
+                u8 rex = (wide ? 0x48 : 0x40) | (reg >= 8 ? 0x04 : 0);
+                if (rex != 0x40)
+                    byte(rex);
+                bytes(opcode);
+                byte(0x80 | ((reg & 7) << 3) | kRbx);
+                imm32((u32) disp);
+            }
+
+            void load(u8 reg, i32 disp) { rbx_operand({0x8B}, reg, disp); } // mov reg, [rbx + disp]
+            void store(i32 disp, u8 reg) { rbx_operand({0x89}, reg, disp); } // mov [rbx + disp], reg
+            void load32(u8 reg, i32 disp) { rbx_operand({0x8B}, reg, disp, false); } // mov reg32, [rbx + disp]
+            void store32(i32 disp, u8 reg) { rbx_operand({0x89}, reg, disp, false); } // mov [rbx + disp], reg32
+
+            // mov rax, imm64
+            void mov_rax(u64 value) { bytes({0x48, 0xB8}); imm64(value); }
+
+            // jcc / jmp with a rel32 patched later by bind()
+            u64 jcc(X64Condition condition) { bytes({0x0F, (u8) (0x80 | condition)}); imm32(0); return position() - 4; }
+            u64 jmp() { byte(0xE9); imm32(0); return position() - 4; }
+            void bind(u64 patch) { patch_rel32(patch, position()); }
+            void jmp_to(u64 target) { byte(0xE9); imm32(0); patch_rel32(position() - 4, target); }
+
+        private:
+            void patch_rel32(u64 patch, u64 target) {
+                u32 relative = (u32) (i32) ((i64) target - (i64) (patch + 4));
+                memcpy(code.data() + patch, &relative, 4);
+            }
+    };
+
+    /**
+     * @brief Emits the instruction templates of one block
+     */
+    class BlockCompiler {
+        public:
+            BlockCompiler(i32 _context, i32 _watch) : context(_context), watch(_watch) {}
+
+            X64Emitter x;
+            i32 context; // Offset from ProcessorState to JitContext
+            i32 watch; // Offset from ProcessorState to the CodeWatch of the processor
+
+            i32 reg(u8 index) { return (i32) (offsetof(ProcessorState, registers) + index * 8); }
+            i32 ip() { return (i32) offsetof(ProcessorState, ip); }
+            i32 sp() { return (i32) offsetof(ProcessorState, sp); }
+            i32 flags() { return (i32) offsetof(ProcessorState, flags); }
+            i32 fault() { return (i32) offsetof(ProcessorState, fault); }
+            i32 field(u64 offset) { return context + (i32) offset; }
+
+            void prologue() {
+                x.byte(0x53); // push rbx
+                x.bytes({0x48, 0x89, 0xFB}); // mov rbx, rdi
+            }
+
+            // Leave the block with ip = next, returning 0
+            void exit(u64 next) {
+                x.mov_rax(next);
+                x.store(ip(), kRax);
+                x.bytes({0x31, 0xC0}); // xor eax, eax
+                x.bytes({0x5B, 0xC3}); // pop rbx; ret
+            }
+
+            // Leave the block with a fault at instruction "at", returning 1
+            void exit_fault(u64 at, u8 code) {
+                if (code != kFaultNone) {
+                    // mov byte [rbx + fault], code
+                    x.bytes({0xC6, 0x83});
+                    x.imm32((u32) fault());
+                    x.byte(code);
+                }
+                x.mov_rax(at);
+                x.store(ip(), kRax);
+                x.byte(0xB8);
+                x.imm32(1); // mov eax, 1
+                x.bytes({0x5B, 0xC3}); // pop rbx; ret
+            }
+
+            /**
+             * @brief Access memory at the address in rax
+             *
+             * Loads leave the value in rax. Stores write the value in r8.
+             */
+            void memory(u64 at, u64 width, bool is_store) {
+                u8 width_index = width == 1 ? 0 : width == 2 ? 1 : width == 4 ? 2 : 3;
+                u64 done[2];
+
+                // Direct regions
+                for (u8 i = 0; i < 2; i++) {
+                    i32 region = field(offsetof(JitContext, regions) + i * sizeof(JitRegion));
+                    x.bytes({0x48, 0x89, 0xC2}); // mov rdx, rax
+                    x.rbx_operand({0x2B}, kRdx, region + (i32) offsetof(JitRegion, base)); // sub rdx, [base]
+                    x.rbx_operand({0x3B}, kRdx, region + (i32) (offsetof(JitRegion, limits) + width_index * 8)); // cmp rdx, [limit]
+                    u64 next = x.jcc(kAboveEqual);
+                    x.load(kRcx, region + (i32) offsetof(JitRegion, host)); // mov rcx, [host]
+
+                    if (is_store) {
+                        // mov [rcx + rdx], r8(b/w/d/q)
+                        if (width == 8) x.bytes({0x4C, 0x89, 0x04, 0x11});
+                        if (width == 4) x.bytes({0x44, 0x89, 0x04, 0x11});
+                        if (width == 2) x.bytes({0x66, 0x44, 0x89, 0x04, 0x11});
+                        if (width == 1) x.bytes({0x44, 0x88, 0x04, 0x11});
+                    } else {
+                        // mov / movzx rax, [rcx + rdx]
+                        if (width == 8) x.bytes({0x48, 0x8B, 0x04, 0x11});
+                        if (width == 4) x.bytes({0x8B, 0x04, 0x11});
+                        if (width == 2) x.bytes({0x0F, 0xB7, 0x04, 0x11});
+                        if (width == 1) x.bytes({0x0F, 0xB6, 0x04, 0x11});
+                    }
+
+                    done[i] = x.jmp();
+                    x.bind(next);
+                }
+
+                // Everything else goes through the MemoryContainer
+                x.bytes({0x48, 0x89, 0xDF}); // mov rdi, rbx
+                x.rbx_operand({0x8D}, kRsi, context); // lea rsi, [rbx + context]
+                x.bytes({0x48, 0x89, 0xC2}); // mov rdx, rax
+                x.byte(0xB9);
+                x.imm32((u32) width); // mov ecx, width
+                x.mov_rax(is_store ? (u64) (uintptr_t) &jit_store : (u64) (uintptr_t) &jit_load);
+                x.bytes({0xFF, 0xD0}); // call rax
+
+                // Fault set by the helper
+                x.bytes({0x80, 0xBB});
+                x.imm32((u32) fault());
+                x.byte(0); // cmp byte [rbx + fault], 0
+                u64 success = x.jcc(kEqual);
+                exit_fault(at, kFaultNone);
+                x.bind(success);
+
+                x.bind(done[0]);
+                x.bind(done[1]);
+            }
+
+            /**
+             * @brief Leave the block if the store of width bytes at the address in rax changed
+             * decoded code, continuing at next
+             * 
+             * The code epoch is bumped so the blocks are dropped before anything else runs.
+             * The remaining instructions of the block are given back to the budget.
+             */
+            void watch_store(u64 width, u64 next, u32 remaining) {
+                x.rbx_operand({0x3B}, kRax, watch + (i32) offsetof(CodeWatch, high)); // cmp rax, [high]
+                u64 below = x.jcc(kAboveEqual);
+                x.bytes({0x48, 0x83, 0xC0, (u8) width}); // add rax, width
+                x.rbx_operand({0x3B}, kRax, watch + (i32) offsetof(CodeWatch, low)); // cmp rax, [low]
+                u64 above = x.jcc(kBelowEqual);
+
+                x.rbx_operand({0xFF}, 0, watch + (i32) offsetof(CodeWatch, epoch)); // inc qword [epoch]
+                x.rbx_operand({0x81}, 0, field(offsetof(JitContext, budget)));
+                x.imm32(remaining); // add qword [budget], remaining
+                exit(next);
+
+                x.bind(below);
+                x.bind(above);
+            }
+
+            // Push r8 (fault at "at" on overflow)
+            void push(u64 at) {
+                x.load(kRax, sp());
+                x.bytes({0x48, 0x89, 0xC1}); // mov rcx, rax
+                x.rbx_operand({0x2B}, kRcx, field(offsetof(JitContext, stack_low))); // sub rcx, [stack_low]
+                x.bytes({0x48, 0x83, 0xF9, 0x08}); // cmp rcx, 8
+                u64 room = x.jcc(kAboveEqual);
+                exit_fault(at, kFaultStackOverflow);
+                x.bind(room);
+
+                x.bytes({0x48, 0x83, 0xE8, 0x08}); // sub rax, 8
+                memory(at, 8, true);
+                x.rbx_operand({0x83}, 5, sp());
+                x.byte(8); // sub qword [rbx + sp], 8
+            }
+
+            // Pop into rax (fault at "at" on underflow)
+            void pop(u64 at) {
+                x.load(kRax, sp());
+                x.bytes({0x48, 0x8D, 0x48, 0x08}); // lea rcx, [rax + 8]
+                x.rbx_operand({0x3B}, kRcx, field(offsetof(JitContext, stack_high))); // cmp rcx, [stack_high]
+                u64 inside = x.jcc(kBelowEqual);
+                exit_fault(at, kFaultStackUnderflow);
+                x.bind(inside);
+
+                memory(at, 8, false);
+                x.rbx_operand({0x83}, 0, sp());
+                x.byte(8); // add qword [rbx + sp], 8
+            }
+
+            // flags = compare_flags(rax, rcx)
+            void compare() {
+                x.bytes({0x31, 0xD2}); // xor edx, edx
+                x.bytes({0x45, 0x31, 0xC0}); // xor r8d, r8d
+                x.bytes({0x45, 0x31, 0xC9}); // xor r9d, r9d
+                x.bytes({0x48, 0x39, 0xC8}); // cmp rax, rcx
+                x.bytes({0x0F, 0x94, 0xC2}); // sete dl
+                x.bytes({0x41, 0x0F, 0x9C, 0xC0}); // setl r8b
+                x.bytes({0x41, 0x0F, 0x92, 0xC1}); // setb r9b
+                x.bytes({0x41, 0xD1, 0xE0}); // shl r8d, 1
+                x.bytes({0x41, 0xC1, 0xE1, 0x02}); // shl r9d, 2
+                x.bytes({0x44, 0x09, 0xC2}); // or edx, r8d
+                x.bytes({0x44, 0x09, 0xCA}); // or edx, r9d
+                x.store32(flags(), kRdx);
+            }
+    };
+
+    // True if the instruction ends a block
+    bool ends_block(u8 opcode) {
+        return (opcode >= kOpJmp && opcode <= kOpCall) || opcode == kOpRet;
+    }
+
+    // True if the instruction can't be compiled (left to the interpreter)
+    bool interpreted_only(u8 opcode) {
+        return opcode == kOpHalt || opcode == kOpWait || (opcode >= kOpCas8 && opcode <= kOpFence);
+    }
+}
+
+bool JitProcessor::supported() {
+#ifdef SASM_JIT_X64
+    return true;
+#else
+    return false;
+#endif
+}
+
+void JitProcessor::configure() {
+    const char* setting = getenv("SASM_JIT");
+    enabled = supported() && !(setting != 0x0 && setting[0] == '0');
+    context = JitContext();
+}
+
+void JitProcessor::invalidate() {
+    blocks.clear();
+    code_buffer.clear();
+
+    code_watch.low = ~(u64) 0;
+    code_watch.high = 0;
+    decoded_epoch = code_watch.epoch;
+}
+
+void JitProcessor::refresh_context() {
+    context.stack_low = stack_base();
+    context.stack_high = stack_base() + prm_stack.size;
+    context.memory_size = prm.size;
+    context.memory = &prm;
+
+    // Direct regions, only for unlocked untracked devices. The host pointer is taken without
+    // a view, accesses of compiled code aren't counted as device operations
+    PureMemoryDevice* devices[2] = { &prm_user, &prm_stack };
+    vptr bases[2] = { user_base(), stack_base() };
+    for (u8 i = 0; i < 2; i++) {
+        JitRegion& region = context.regions[i];
+        region = JitRegion();
+        region.base = bases[i];
+
+        // Stores through host memory wouldn't be tracked
+        if (devices[i]->tracking_writes() || devices[i]->size == 0 ||
+            devices[i]->check(MemoryDeviceStatus::kReadLocked) || devices[i]->check(MemoryDeviceStatus::kWriteLocked))
+            continue;
+
+        region.host = devices[i]->bare_direct(0, devices[i]->size);
+        for (u8 w = 0; w < 4; w++) {
+            u64 width = ((u64) 1) << w;
+            region.limits[w] = devices[i]->size >= width ? devices[i]->size - width + 1 : 0;
+        }
+    }
+}
+
+JitBlock& JitProcessor::find_block(u64 ip) {
+    auto found = blocks.find(ip);
+    if (found != blocks.end())
+        return found->second;
+
+    // Decode block: everything up to (and including) the first jump, call or ret
+    JitBlock& block = blocks[ip];
+    u64 position = ip;
+    Instruction instruction;
+    while (block.instructions < kMaxBlockInstructions && position < code_size &&
+        decode(code + position, code_size - position, &instruction) && !interpreted_only(instruction.opcode)) {
+        block.instructions++;
+        position += instruction.length;
+        if (ends_block(instruction.opcode))
+            break;
+    }
+
+    block.compilable = block.instructions > 0;
+
+    // Stores into decoded code drop the blocks
+    if (position > ip) {
+        code_watch.low = std::min(code_watch.low, user_base() + ip);
+        code_watch.high = std::max(code_watch.high, user_base() + position);
+    }
+    return block;
+}
+
+bool JitProcessor::compile(u64 ip, JitBlock& block) {
+    BlockCompiler c((i32) ((u8*) &context - (u8*) &state), (i32) ((u8*) &code_watch - (u8*) &state));
+    X64Emitter& x = c.x;
+
+    c.prologue();
+    u64 body = x.position();
+
+    u64 position = ip;
+    bool ended = false;
+    for (u32 n = 0; n < block.instructions; n++) {
+        Instruction in = Instruction();
+        decode(code + position, code_size - position, &in);
+        u64 at = position;
+        u64 next = position + in.length;
+        position = next;
+
+        switch (in.opcode) {
+            case kOpNop:
+                break;
+            case kOpMov:
+                x.load(kRax, c.reg(in.b));
+                x.store(c.reg(in.a), kRax);
+                break;
+            case kOpMovi:
+                x.bytes({0x48, 0xC7, 0xC0});
+                x.imm32((u32) in.immediate); // mov rax, imm32
+                x.store(c.reg(in.a), kRax);
+                break;
+            case kOpMovq:
+                x.mov_rax(in.immediate);
+                x.store(c.reg(in.a), kRax);
+                break;
+            case kOpAdd:
+            case kOpSub:
+            case kOpAnd:
+            case kOpOr:
+            case kOpXor: {
+                u8 opcode = in.opcode == kOpAdd ? 0x03 : in.opcode == kOpSub ? 0x2B : in.opcode == kOpAnd ? 0x23 : in.opcode == kOpOr ? 0x0B : 0x33;
+                x.load(kRax, c.reg(in.a));
+                x.rbx_operand({opcode}, kRax, c.reg(in.b)); // op rax, [b]
+                x.store(c.reg(in.a), kRax);
+                break;
+            }
+            case kOpMul:
+                x.load(kRax, c.reg(in.a));
+                x.rbx_operand({0x0F, 0xAF}, kRax, c.reg(in.b)); // imul rax, [b]
+                x.store(c.reg(in.a), kRax);
+                break;
+            case kOpDivu:
+            case kOpRemu: {
+                x.load(kRcx, c.reg(in.b));
+                x.bytes({0x48, 0x85, 0xC9}); // test rcx, rcx
+                u64 nonzero = x.jcc(kNotEqual);
+                c.exit_fault(at, kFaultDivideByZero);
+                x.bind(nonzero);
+                x.load(kRax, c.reg(in.a));
+                x.bytes({0x31, 0xD2}); // xor edx, edx
+                x.bytes({0x48, 0xF7, 0xF1}); // div rcx
+                x.store(c.reg(in.a), in.opcode == kOpDivu ? kRax : kRdx);
+                break;
+            }
+            case kOpShl:
+            case kOpShr:
+            case kOpSar: {
+                u8 modrm = in.opcode == kOpShl ? 0xE0 : in.opcode == kOpShr ? 0xE8 : 0xF8;
+                x.load(kRcx, c.reg(in.b));
+                x.load(kRax, c.reg(in.a));
+                x.bytes({0x48, 0xD3, modrm}); // shl / shr / sar rax, cl
+                x.store(c.reg(in.a), kRax);
+                break;
+            }
+            case kOpAddi:
+            case kOpAndi:
+                x.load(kRax, c.reg(in.a));
+                x.bytes({0x48, (u8) (in.opcode == kOpAddi ? 0x05 : 0x25)});
+                x.imm32((u32) in.immediate); // add / and rax, imm32
+                x.store(c.reg(in.a), kRax);
+                break;
+            case kOpShli:
+            case kOpShri:
+                x.load(kRax, c.reg(in.a));
+                x.bytes({0x48, 0xC1, (u8) (in.opcode == kOpShli ? 0xE0 : 0xE8), (u8) (in.immediate & 63)}); // shl / shr rax, imm8
+                x.store(c.reg(in.a), kRax);
+                break;
+            case kOpNot:
+            case kOpNeg:
+                x.load(kRax, c.reg(in.a));
+                x.bytes({0x48, 0xF7, (u8) (in.opcode == kOpNot ? 0xD0 : 0xD8)}); // not / neg rax
+                x.store(c.reg(in.a), kRax);
+                break;
+            case kOpCmp:
+                x.load(kRax, c.reg(in.a));
+                x.load(kRcx, c.reg(in.b));
+                c.compare();
+                break;
+            case kOpCmpi:
+                x.load(kRax, c.reg(in.a));
+                x.bytes({0x48, 0xC7, 0xC1});
+                x.imm32((u32) in.immediate); // mov rcx, imm32
+                c.compare();
+                break;
+            case kOpLd8:
+            case kOpLd16:
+            case kOpLd32:
+            case kOpLd64:
+                x.load(kRax, c.reg(in.b));
+                x.bytes({0x48, 0x05});
+                x.imm32((u32) in.immediate); // add rax, imm32
+                c.memory(at, ((u64) 1) << (in.opcode - kOpLd8), false);
+                x.store(c.reg(in.a), kRax);
+                break;
+            case kOpSt8:
+            case kOpSt16:
+            case kOpSt32:
+            case kOpSt64:
+                x.load(kR8, c.reg(in.b));
+                x.load(kRax, c.reg(in.a));
+                x.bytes({0x48, 0x05});
+                x.imm32((u32) in.immediate); // add rax, imm32
+                c.memory(at, ((u64) 1) << (in.opcode - kOpSt8), true);
+
+                // Address again, the helper doesn't keep it
+                x.load(kRax, c.reg(in.a));
+                x.bytes({0x48, 0x05});
+                x.imm32((u32) in.immediate); // add rax, imm32
+                c.watch_store(((u64) 1) << (in.opcode - kOpSt8), next, block.instructions - n - 1);
+                break;
+            case kOpPush:
+                x.load(kR8, c.reg(in.a));
+                c.push(at);
+                break;
+            case kOpPop:
+                c.pop(at);
+                x.store(c.reg(in.a), kRax);
+                break;
+            case kOpRet:
+                c.pop(at);
+                x.store(c.ip(), kRax);
+                x.bytes({0x31, 0xC0}); // xor eax, eax
+                x.bytes({0x5B, 0xC3}); // pop rbx; ret
+                ended = true;
+                break;
+            case kOpCall:
+                x.bytes({0x49, 0xB8});
+                x.imm64(next); // mov r8, return ip
+                c.push(at);
+                [[fallthrough]];
+            case kOpJmp:
+            case kOpJz:
+            case kOpJnz:
+            case kOpJlt:
+            case kOpJge:
+            case kOpJltu:
+            case kOpJgeu: {
+                u64 target = in.immediate;
+                u64 not_taken = 0;
+                bool conditional = in.opcode != kOpJmp && in.opcode != kOpCall;
+
+                if (conditional) {
+                    u32 mask = (in.opcode == kOpJz || in.opcode == kOpJnz) ? kFlagZero :
+                        (in.opcode == kOpJlt || in.opcode == kOpJge) ? kFlagLess : kFlagBelow;
+                    bool taken_if_set = in.opcode == kOpJz || in.opcode == kOpJlt || in.opcode == kOpJltu;
+
+                    x.load32(kRax, c.flags());
+                    x.byte(0xA9);
+                    x.imm32(mask); // test eax, mask
+                    not_taken = x.jcc(taken_if_set ? kEqual : kNotEqual);
+                }
+
+                if (target == ip) {
+                    // Loop back into the block while the budget allows it
+                    i32 budget = c.field(offsetof(JitContext, budget));
+                    x.load(kRax, budget);
+                    x.bytes({0x48, 0x3D});
+                    x.imm32(block.instructions); // cmp rax, instructions
+                    u64 out_of_budget = x.jcc(kBelow);
+                    x.bytes({0x48, 0x2D});
+                    x.imm32(block.instructions); // sub rax, instructions
+                    x.store(budget, kRax);
+                    x.jmp_to(body);
+                    x.bind(out_of_budget);
+                }
+                c.exit(target);
+
+                if (conditional) {
+                    x.bind(not_taken);
+                    c.exit(next);
+                }
+                ended = true;
+                break;
+            }
+            default:
+                return false;
+        }
+    }
+
+    // Block ended without a jump (halt / wait / size limit), continue in the interpreter
+    if (!ended)
+        c.exit(position);
+
+    void* installed = code_buffer.install(x.code.data(), x.code.size());
+    if (installed == 0x0) {
+        // Buffer full, drop every compiled block and try again
+        for (auto& entry : blocks) {
+            entry.second.code = 0x0;
+            entry.second.executions = 0;
+        }
+        code_buffer.clear();
+
+        installed = code_buffer.install(x.code.data(), x.code.size());
+        if (installed == 0x0)
+            return false;
+    }
+
+    block.code = (JitBlock::Code) installed;
+    stats.compiled_blocks++;
+    return true;
+}
+
+bool JitProcessor::reference_step(std::vector<WriteLogEntry>& log) {
+    Instruction in = Instruction();
+    if (state.ip >= code_size || !decode(code + state.ip, code_size - state.ip, &in)) {
+        state.fault = kFaultInvalidInstruction;
+        return false;
+    }
+
+    u64* r = state.registers;
+    u64 next = state.ip + in.length;
+    u64 memory_size = prm.size;
+    u64 stack_low = stack_base();
+    u64 stack_high = stack_base() + prm_stack.size;
+
+    auto load = [&](u64 address, u64 width, u64* output) {
+        if (width > memory_size || address > memory_size - width) {
+            state.fault = kFaultMemory;
+            return false;
+        }
+        *output = 0;
+        if (prm.read_checked(address, width, output) != DeviceOperationResult::kSuccess) {
+            state.fault = kFaultMemory;
+            return false;
+        }
+        return true;
+    };
+    auto store = [&](u64 address, u64 width, u64 value) {
+        if (width > memory_size || address > memory_size - width) {
+            state.fault = kFaultMemory;
+            return false;
+        }
+        WriteLogEntry entry = { address, width, 0, 0 };
+        prm.read(address, width, &entry.before);
+        if (prm.write_checked(address, width, &value) != DeviceOperationResult::kSuccess) {
+            state.fault = kFaultMemory;
+            return false;
+        }
+        log.push_back(entry);
+        return true;
+    };
+
+    switch (in.opcode) {
+        case kOpNop: break;
+        case kOpMov: r[in.a] = r[in.b]; break;
+        case kOpMovi: case kOpMovq: r[in.a] = in.immediate; break;
+        case kOpAdd: r[in.a] += r[in.b]; break;
+        case kOpSub: r[in.a] -= r[in.b]; break;
+        case kOpMul: r[in.a] *= r[in.b]; break;
+        case kOpDivu:
+        case kOpRemu:
+            if (r[in.b] == 0) {
+                state.fault = kFaultDivideByZero;
+                return false;
+            }
+            r[in.a] = in.opcode == kOpDivu ? r[in.a] / r[in.b] : r[in.a] % r[in.b];
+            break;
+        case kOpAnd: r[in.a] &= r[in.b]; break;
+        case kOpOr: r[in.a] |= r[in.b]; break;
+        case kOpXor: r[in.a] ^= r[in.b]; break;
+        case kOpShl: r[in.a] <<= (r[in.b] & 63); break;
+        case kOpShr: r[in.a] >>= (r[in.b] & 63); break;
+        case kOpSar: r[in.a] = (u64) (((i64) r[in.a]) >> (r[in.b] & 63)); break;
+        case kOpAddi: r[in.a] += in.immediate; break;
+        case kOpAndi: r[in.a] &= in.immediate; break;
+        case kOpShli: r[in.a] <<= (in.immediate & 63); break;
+        case kOpShri: r[in.a] >>= (in.immediate & 63); break;
+        case kOpNot: r[in.a] = ~r[in.a]; break;
+        case kOpNeg: r[in.a] = (u64) -(i64) r[in.a]; break;
+        case kOpCmp: state.flags = compare_flags(r[in.a], r[in.b]); break;
+        case kOpCmpi: state.flags = compare_flags(r[in.a], in.immediate); break;
+        case kOpJmp: next = in.immediate; break;
+        case kOpJz: if (state.flags & kFlagZero) next = in.immediate; break;
+        case kOpJnz: if (!(state.flags & kFlagZero)) next = in.immediate; break;
+        case kOpJlt: if (state.flags & kFlagLess) next = in.immediate; break;
+        case kOpJge: if (!(state.flags & kFlagLess)) next = in.immediate; break;
+        case kOpJltu: if (state.flags & kFlagBelow) next = in.immediate; break;
+        case kOpJgeu: if (!(state.flags & kFlagBelow)) next = in.immediate; break;
+        case kOpCall:
+        case kOpPush:
+            if (state.sp < stack_low + 8) {
+                state.fault = kFaultStackOverflow;
+                return false;
+            }
+            if (!store(state.sp - 8, 8, in.opcode == kOpCall ? next : r[in.a]))
+                return false;
+            state.sp -= 8;
+            if (in.opcode == kOpCall)
+                next = in.immediate;
+            break;
+        case kOpRet:
+        case kOpPop: {
+            if (state.sp + 8 > stack_high) {
+                state.fault = kFaultStackUnderflow;
+                return false;
+            }
+            u64 value;
+            if (!load(state.sp, 8, &value))
+                return false;
+            state.sp += 8;
+            if (in.opcode == kOpRet)
+                next = value;
+            else
+                r[in.a] = value;
+            break;
+        }
+        case kOpLd8: case kOpLd16: case kOpLd32: case kOpLd64:
+            if (!load(r[in.b] + in.immediate, ((u64) 1) << (in.opcode - kOpLd8), &r[in.a]))
+                return false;
+            break;
+        case kOpSt8: case kOpSt16: case kOpSt32: case kOpSt64:
+            if (!store(r[in.a] + in.immediate, ((u64) 1) << (in.opcode - kOpSt8), r[in.b]))
+                return false;
+            break;
+        default:
+            state.fault = kFaultInvalidInstruction;
+            return false;
+    }
+
+    state.ip = next;
+    return true;
+}
+
+bool JitProcessor::run_verified(u64 ip, JitBlock& block) {
+    ProcessorState before = state;
+
+    // Reference: plain stepped evaluation of the block, logging writes
+    std::vector<WriteLogEntry> log;
+    u64 unused = 0; // Instructions given back to the budget, like watch_store does
+    for (u32 n = 0; n < block.instructions; n++) {
+        u64 logged = log.size();
+        if (!reference_step(log))
+            break;
+
+        // Compiled code leaves the block after changing decoded code
+        if (log.size() > logged && code_watch.hit(log.back().address, log.back().width)) {
+            unused = block.instructions - n - 1;
+            break;
+        }
+    }
+    ProcessorState reference = state;
+    for (WriteLogEntry& entry : log)
+        prm.read(entry.address, entry.width, &entry.after);
+
+    // Undo reference writes
+    for (u64 i = log.size(); i > 0; i--)
+        prm.write(log[i - 1].address, log[i - 1].width, &log[i - 1].before);
+
+    // Compiled code, without looping
+    u64 budget = context.budget;
+    state = before;
+    state.fault = kFaultNone;
+    context.budget = 0;
+    block.code(&state);
+    context.budget = budget + unused;
+    stats.verified++;
+
+    // Compare
+    bool match = memcmp(state.registers, reference.registers, sizeof(state.registers)) == 0 &&
+        state.ip == reference.ip && state.sp == reference.sp &&
+        state.flags == reference.flags && state.fault == reference.fault;
+    for (WriteLogEntry& entry : log) {
+        u64 value = 0;
+        prm.read(entry.address, entry.width, &value);
+        match = match && value == entry.after;
+    }
+
+    if (!match) {
+        sasm_print("JIT mismatch in block at ip %lu, falling back to the interpreter", (unsigned long) ip);
+        stats.mismatches++;
+        block.code = 0x0;
+        block.compilable = false;
+
+        // Keep the reference result
+        state = reference;
+        for (WriteLogEntry& entry : log)
+            prm.write(entry.address, entry.width, &entry.after);
+    }
+
+    return state.fault == kFaultNone;
+}
+
+ExecutionResult JitProcessor::run(u64 budget) {
+    if (!enabled)
+        return BasicInterpretedProcessor::run(budget);
+    if (state.halted)
+        return kExecutionHalted;
+    if (state.blocked)
+        return kExecutionBlocked;
+    if (state.fault != kFaultNone)
+        return kExecutionFault;
+
+    MemoryView code_view = prm_user.view(0, prm_user.size, MemoryViewAccess::kViewRead);
+    code = code_view.data();
+    code_size = code_view.size();
+    refresh_context();
+
+    ExecutionResult result = kExecutionBudget;
+    while (budget > 0) {
+        // Code changed since the blocks were decoded
+        if (code_watch.epoch != decoded_epoch)
+            invalidate();
+
+        JitBlock& block = find_block(state.ip);
+
+        // Compiled
+        if (block.code != 0x0 && budget >= block.instructions) {
+            budget -= block.instructions;
+            stats.compiled_executions++;
+
+            context.budget = budget;
+            bool faulted = verify ? !run_verified(state.ip, block) : block.code(&state) != 0;
+            budget = context.budget;
+
+            if (faulted) {
+                result = kExecutionFault;
+                break;
+            }
+            continue;
+        }
+
+        // Compile once hot
+        if (block.compilable && block.code == 0x0 && ++block.executions >= threshold) {
+            if (compile(state.ip, block))
+                continue;
+            block.compilable = false;
+        }
+
+        // Interpret
+        stats.interpreted_executions++;
+        u64 amount = block.instructions > 0 ? block.instructions : 1;
+        if (amount > budget)
+            amount = budget;
+
+        result = BasicInterpretedProcessor::run(amount);
+        if (result != kExecutionBudget)
+            return result; // Interpreter already wrote flags back
+        budget -= amount;
+    }
+
+    // Compiled code only updates the flags register
+    prm_flags.write_type<u32>(0, state.flags);
+    return result;
+}
@@ -0,0 +1,171 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file jit.h
+ * @author lotuspar / par0-git
+ * @brief Template JIT tier for hot basic blocks (x86-64)
+ *
+ * JitProcessor interprets code like BasicInterpretedProcessor while counting how often
+ * each basic block runs. Blocks that get hot are compiled to x86-64 machine code, one
+ * template per instruction. Loads and stores hitting the "stack" or "user" device go
+ * straight to host memory, everything else goes through the MemoryContainer.
+ *
+ * The tier is disabled on other hosts, with set_enabled(false) or with the environment
+ * variable SASM_JIT=0.
+ */
+
+#pragma once
+
+#include "processor.h"
+#include <unordered_map> // std::unordered_map
+#include <vector> // std::vector
+
+namespace sasm {
+namespace vm {
+    /**
+     * @brief Memory region compiled code can access without the MemoryContainer
+     */
+    struct JitRegion {
+        u64 base; // Container address of the region
+        u8* host; // Host pointer to the region
+        u64 limits[4]; // Offsets of 1, 2, 4 and 8 byte accesses have to be below these (0 disables the region)
+    };
+
+    /**
+     * @brief Data used by compiled code next to ProcessorState
+     */
+    struct JitContext {
+        u64 budget; // Instructions left, compiled loops stop when it runs out
+        u64 stack_low; // Container address range of "stack"
+        u64 stack_high;
+        u64 memory_size; // Size of the processor memory
+        JitRegion regions[2]; // "user", "stack"
+        MemoryContainer* memory;
+    };
+
+    /**
+     * @brief Executable memory for compiled blocks
+     *
+     * Memory is never writable and executable at the same time (W^X): it is switched to
+     * writable while installing a block and back to executable afterwards.
+     */
+    class JitCodeBuffer {
+        public:
+            JitCodeBuffer(u64 _capacity = 4 << 20);
+            ~JitCodeBuffer();
+
+            JitCodeBuffer(const JitCodeBuffer&) = delete;
+            JitCodeBuffer& operator=(const JitCodeBuffer&) = delete;
+
+            /**
+             * @brief Copy position independent machine code into the buffer
+             *
+             * @param code Machine code
+             * @param amount Size of the machine code
+             * @return void* Executable copy, 0x0 if the buffer is full
+             */
+            void* install(const u8* code, u64 amount);
+
+            // Forget every installed block
+            void clear() { used = 0; }
+
+            u64 size() { return used; }
+        private:
+            u8* memory = 0x0;
+            u64 capacity = 0;
+            u64 used = 0;
+    };
+
+    /**
+     * @brief Per-block bookkeeping of the JIT tier
+     */
+    struct JitBlock {
+        typedef u64 (*Code)(ProcessorState* state);
+
+        u64 executions = 0; // Times the block ran in the interpreter
+        u32 instructions = 0; // Amount of instructions in the block
+        bool compilable = false; // False if the block can't be compiled
+        Code code = 0x0; // Compiled block, returns 0 on success / 1 on fault
+    };
+
+    struct JitStats {
+        u64 compiled_blocks;
+        u64 compiled_executions; // Block executions in compiled code
+        u64 interpreted_executions; // Block executions in the interpreter
+        u64 verified; // Compiled executions checked against the reference evaluator
+        u64 mismatches; // Compiled executions that didn't match the reference evaluator
+        u64 code_bytes;
+    };
+
+    class JitProcessor : public BasicInterpretedProcessor {
+    public:
+        JitProcessor() { configure(); }
+        JitProcessor(u64 _stack, u64 _user, MemoryArenaPool* _pool = 0x0, u8 _arena_flags = 0)
+            : BasicInterpretedProcessor(_stack, _user, _pool, _arena_flags) { configure(); }
+
+        /**
+         * @brief Execute instructions until the budget runs out or execution stops
+         *
+         * @param budget Maximum amount of instructions to execute
+         * @return ExecutionResult Why execution stopped
+         */
+        ExecutionResult run(u64 budget) override;
+
+        // Enable / disable the JIT tier (disabled: everything is interpreted)
+        void set_enabled(bool _enabled) { enabled = _enabled && supported(); }
+        bool is_enabled() { return enabled; }
+
+        // Amount of interpreted executions before a block gets compiled
+        void set_threshold(u64 _threshold) { threshold = _threshold; }
+
+        /**
+         * @brief Check every compiled block execution against a plain stepped evaluation
+         *
+         * Slow, meant for testing the JIT. Blocks producing different results are reported
+         * and fall back to the interpreter.
+         */
+        void set_verify(bool _verify) { verify = _verify; }
+
+        /**
+         * @brief Forget decoded / compiled code
+         * 
+         * Done automatically after load(), init(), images, checkpoints and guest stores into
+         * decoded code. Needed if code in "user" is changed through memory().
+         */
+        void invalidate();
+
+        // True if this host can run compiled code
+        static bool supported();
+
+        JitStats statistics() { stats.code_bytes = code_buffer.size(); return stats; }
+
+    private:
+        // Memory write done by the reference evaluator
+        struct WriteLogEntry {
+            u64 address;
+            u64 width;
+            u64 before; // Value before the write
+            u64 after; // Value at the address once the reference evaluation finished
+        };
+
+        bool enabled = true;
+        bool verify = false;
+        u64 threshold = 64;
+        std::unordered_map<u64, JitBlock> blocks; // Keyed by ip of the first instruction
+        JitCodeBuffer code_buffer;
+        JitContext context;
+        JitStats stats = JitStats();
+        u64 decoded_epoch = 0; // code_watch.epoch the blocks were decoded at
+
+        // Code in "user" while running
+        const u8* code = 0x0;
+        u64 code_size = 0;
+
+        void configure();
+        void refresh_context();
+        JitBlock& find_block(u64 ip);
+        bool compile(u64 ip, JitBlock& block);
+        bool run_verified(u64 ip, JitBlock& block);
+        bool reference_step(std::vector<WriteLogEntry>& log);
+    };
+}
+}
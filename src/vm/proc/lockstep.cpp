@@ -0,0 +1,627 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file lockstep.cpp
+ * @author lotuspar / par0-git
+ * @brief LockstepProcessor
+ *
+ * The lanes at the current instruction are the mask: all ones / zero per lane, so
+ * masked register updates are a blend. Arithmetic runs on several lanes at once through
+ * GCC vector extensions: 2 lanes (SSE2 / NEON), 4 lanes with AVX2. On x86-64 builds
+ * without AVX2 enabled, an AVX2 build of the loop is picked at runtime if the processor
+ * supports it. Rows are padded so no lane loop needs a scalar tail. While every running lane is in
+ * the mask (converged) the ip of the lanes is only kept in pc, divergent control flow
+ * writes the ip of every lane and picks a new mask.
+ */
+
+#include "lockstep.h"
+
+using namespace sasm;
+using namespace sasm::vm;
+
+#if defined(__AVX2__)
+    #define SASM_LOCKSTEP_WIDE // Built for AVX2, always 4 lanes
+#elif defined(__GNUC__) && defined(__x86_64__)
+    #define SASM_LOCKSTEP_DISPATCH // Pick 4 lanes at runtime if AVX2 is supported
+#endif
+
+typedef u64 LaneVector2 __attribute__((vector_size(2 * sizeof(u64))));
+typedef i64 LaneSigned2 __attribute__((vector_size(2 * sizeof(u64))));
+typedef u64 LaneVector4 __attribute__((vector_size(4 * sizeof(u64))));
+typedef i64 LaneSigned4 __attribute__((vector_size(4 * sizeof(u64))));
+
+// Unaligned vector load / store, macros as vectors wider than the enabled instruction set can't be passed to functions
+#define SASM_LANES_LOAD(vector, row) memcpy(&(vector), (row), sizeof(LaneVector))
+#define SASM_LANES_STORE(row, vector) memcpy((row), &(vector), sizeof(LaneVector))
+
+void LockstepProcessor::init(u64 _lanes, u64 _stack, u64 _user) {
+    lanes = _lanes;
+    lane_stride = (lanes + 7) & ~((u64) 7);
+    stack_size = _stack;
+    user_size = _user;
+    memory_stride = MemoryArena::footprint(memory_size());
+
+    // Reuse current arena if possible
+    u64 needed = memory_stride * lanes;
+    if (arena && arena->capacity() >= needed && arena->flags() == arena_flags) {
+        arena->reset();
+    } else {
+        release_arena();
+        if (arena_pool != 0x0)
+            arena = arena_pool->acquire(needed, arena_flags);
+        else {
+            arena.reset(new MemoryArena());
+            if (!arena->init(needed, arena_flags))
+                arena.reset();
+        }
+    }
+
+    memory = arena ? arena->allocate(needed) : 0x0;
+    if (memory == 0x0 && lanes != 0) {
+        sasm_print("Failed to allocate lockstep processor memory (%lu bytes)", (unsigned long) needed);
+        lanes = 0;
+        lane_stride = 0;
+    }
+
+    code.assign(user_size, 0);
+    registers.assign(kRegisterCount * lane_stride, 0);
+    ip.assign(lane_stride, 0);
+    sp.assign(lane_stride, 0);
+    flags.assign(lane_stride, 0);
+    status.assign(lane_stride, kLaneHalted); // Padding lanes never run
+    fault.assign(lane_stride, kFaultNone);
+    mask.assign(lane_stride, 0);
+    mask_chunks.assign(lane_stride, 0);
+
+    reset();
+}
+
+void LockstepProcessor::reset() {
+    bulk_fill(registers.data(), 0, registers.size() * sizeof(u64));
+    for (u64 l = 0; l < lanes; l++) {
+        ip[l] = 0;
+        sp[l] = stack_base() + stack_size;
+        flags[l] = 0;
+        status[l] = kLaneRunning;
+        fault[l] = kFaultNone;
+        bulk_fill(lane_memory(l), 0, 4);
+    }
+}
+
+u8 LockstepProcessor::load(const void* program, u64 amount) {
+    // Check if the program fits "user"
+    if (amount > user_size)
+        return DeviceOperationResult::kOutOfBounds;
+
+    bulk_copy(code.data(), program, amount);
+    bulk_fill(code.data() + amount, 0, user_size - amount);
+    for (u64 l = 0; l < lanes; l++)
+        bulk_copy(lane_memory(l) + user_base(), program, amount);
+    return DeviceOperationResult::kSuccess;
+}
+
+ProcessorState LockstepProcessor::lane_state(u64 lane) {
+    ProcessorState state = ProcessorState();
+    if (lane >= lanes)
+        return state;
+
+    for (u8 i = 0; i < kRegisterCount; i++)
+        state.registers[i] = lane_register(lane, i);
+    state.ip = ip[lane];
+    state.sp = sp[lane];
+    state.flags = flags[lane];
+    state.fault = fault[lane];
+    state.halted = status[lane] == kLaneHalted;
+    state.blocked = status[lane] == kLaneBlocked;
+    return state;
+}
+
+void LockstepProcessor::set_lane_state(u64 lane, const ProcessorState& state) {
+    if (lane >= lanes)
+        return;
+
+    for (u8 i = 0; i < kRegisterCount; i++)
+        lane_register(lane, i) = state.registers[i];
+    ip[lane] = state.ip;
+    sp[lane] = state.sp;
+    flags[lane] = state.flags;
+    fault[lane] = state.fault;
+    if (state.fault != kFaultNone)
+        status[lane] = kLaneFault;
+    else if (state.halted)
+        status[lane] = kLaneHalted;
+    else if (state.blocked)
+        status[lane] = kLaneBlocked;
+    else
+        status[lane] = kLaneRunning;
+}
+
+/**
+ * Read-modify-write for atomic instructions, lanes don't share memory so plain loads /
+ * stores are enough
+ */
+static u64 lane_apply(u8* host, u64 width, u8 operation, u64 operand, u64 expected) {
+    u64 old = 0;
+    memcpy(&old, host, width);
+
+    u64 value;
+    switch (operation) {
+        case kAtomicExchange: value = operand; break;
+        case kAtomicCompareExchange: value = old == expected ? operand : old; break;
+        case kAtomicFetchAdd: value = old + operand; break;
+        case kAtomicFetchAnd: value = old & operand; break;
+        default: value = old | operand; break;
+    }
+
+    memcpy(host, &value, width);
+    return old;
+}
+
+template <class LaneVector, class LaneSigned>
+ExecutionResult LockstepProcessor::run_lanes(u64 budget) {
+    // Lanes per vector operation, lane_stride is a multiple of it
+    const u64 width = sizeof(LaneVector) / sizeof(u64);
+
+    const u8* program = code.data();
+    u64 code_size = code.size();
+    u64 n = lanes;
+    u64 stride = lane_stride;
+    u64* m = mask.data();
+    u64* chunks = mask_chunks.data();
+    u64 chunk_count = 0;
+
+    u64 memory_end = memory_size();
+    u64 stack_low = stack_base();
+    u64 stack_high = stack_low + stack_size;
+    u64 user_low = user_base();
+
+    u64 pc = 0; // ip of the lanes in the mask
+    u64 active = 0; // Amount of lanes in the mask
+    bool converged = false; // Every running lane is in the mask
+    bool full = false; // Every lane is in the mask, no blending needed
+    bool select = true; // The ip of every lane is stored, pick a new mask
+
+    // Operand access for the instruction at pc
+    #define SASM_A (program[pc + 1] & 0xF)
+    #define SASM_B (program[pc + 1] >> 4)
+    #define SASM_IMM32 ((u64) (i64) read_i32(program + pc + 2))
+    #define SASM_TARGET ((u64) (u32) read_i32(program + pc + 1))
+    #define SASM_ROW(index) (registers.data() + (index) * lane_stride)
+    #define SASM_LANE(l) (memory + (l) * memory_stride)
+
+    // Every lane of the chunks with lanes in the mask, check m[l] for the lanes in the mask
+    #define SASM_FOR_CHUNKS(l) \
+        for (u64 chunk = 0; chunk < chunk_count; chunk++) \
+            for (u64 l = chunks[chunk], chunk_end = l + width; l < chunk_end; l++)
+
+    // Continue at new_pc with the current mask, other lanes might be at a lower ip
+    #define SASM_GOTO(new_pc) { \
+            pc = (new_pc); \
+            if (!converged) { \
+                SASM_FOR_CHUNKS(l) \
+                    ip[l] = m[l] ? pc : ip[l]; \
+                select = true; \
+            } \
+        }
+
+    // Masked lanes continue at pc + length unless they faulted
+    #define SASM_NEXT_CHECKED(length) { \
+            if (faulted) { \
+                SASM_FOR_CHUNKS(l) { \
+                    if (m[l] && status[l] == kLaneRunning) \
+                        ip[l] = pc + (length); \
+                } \
+                select = true; \
+            } else \
+                SASM_GOTO(pc + (length)); \
+        }
+
+    // Stop a lane, its ip stays at the instruction
+    #define SASM_FAULT(l, reason) { \
+            status[l] = kLaneFault; \
+            fault[l] = (reason); \
+            ip[l] = pc; \
+            faulted = true; \
+        }
+
+    // output_row = expression for every lane in the mask, expression works on vectors of
+    // width lanes: ra / rb (registers a / b) and imm (immediate in every lane)
+    #define SASM_LANES(output_row, expression, length) { \
+            u64* row = (output_row); \
+            const u64* row_a = SASM_ROW(SASM_A); \
+            const u64* row_b = SASM_ROW(SASM_B); \
+            LaneVector imm = LaneVector() + ((length) == 6 ? SASM_IMM32 : 0); \
+            (void) imm; \
+            for (u64 chunk = 0; chunk < chunk_count; chunk++) { \
+                u64 l = chunks[chunk]; \
+                LaneVector ra, rb; \
+                SASM_LANES_LOAD(ra, row_a + l); \
+                SASM_LANES_LOAD(rb, row_b + l); \
+                LaneVector value = (expression); \
+                if (!full) { \
+                    LaneVector lanes_mask, previous; \
+                    SASM_LANES_LOAD(lanes_mask, m + l); \
+                    SASM_LANES_LOAD(previous, row + l); \
+                    value = (value & lanes_mask) | (previous & ~lanes_mask); \
+                } \
+                SASM_LANES_STORE(row + l, value); \
+            } \
+            SASM_GOTO(pc + (length)); \
+        }
+
+    #define SASM_BINARY(expression, length) SASM_LANES(SASM_ROW(SASM_A), expression, length)
+
+    // flags = compare(a, other)
+    #define SASM_COMPARE(other, length) SASM_LANES(flags.data(), \
+            ((LaneVector) (ra == (other)) & (u64) kFlagZero) | \
+            ((LaneVector) ((LaneSigned) ra < (LaneSigned) (other)) & (u64) kFlagLess) | \
+            ((LaneVector) (ra < (other)) & (u64) kFlagBelow), length)
+
+    // Lanes where flag is set / clear (when) continue at the target, the mask splits if they disagree
+    #define SASM_BRANCH(flag, when) { \
+            u64 target = SASM_TARGET; \
+            LaneVector counted = LaneVector(); \
+            for (u64 chunk = 0; chunk < chunk_count; chunk++) { \
+                u64 l = chunks[chunk]; \
+                LaneVector lane_flags, lanes_mask; \
+                SASM_LANES_LOAD(lane_flags, flags.data() + l); \
+                SASM_LANES_LOAD(lanes_mask, m + l); \
+                LaneVector taken_lanes = (LaneVector) (((lane_flags & (u64) (flag)) != 0) == ((when) ? -1 : 0)); \
+                counted += taken_lanes & lanes_mask & 1; \
+            } \
+            u64 taken = 0; \
+            for (u64 i = 0; i < width; i++) \
+                taken += counted[i]; \
+            if (taken == active) \
+                SASM_GOTO(target) \
+            else if (taken == 0) \
+                SASM_GOTO(pc + 5) \
+            else { \
+                SASM_FOR_CHUNKS(l) { \
+                    u64 next = ((flags[l] & (flag)) != 0) == (when) ? target : pc + 5; \
+                    ip[l] = m[l] ? next : ip[l]; \
+                } \
+                select = true; \
+            } \
+        }
+
+    #define SASM_CHECK_MEMORY(l, address, width) \
+        if ((width) > memory_end || (address) > memory_end - (width)) { \
+            SASM_FAULT(l, kFaultMemory); \
+            continue; \
+        }
+
+    #define SASM_LOAD(type) { \
+            u64* ra = SASM_ROW(SASM_A); \
+            const u64* rb = SASM_ROW(SASM_B); \
+            u64 imm = SASM_IMM32; \
+            SASM_FOR_CHUNKS(l) { \
+                if (!m[l]) \
+                    continue; \
+                u64 address = rb[l] + imm; \
+                SASM_CHECK_MEMORY(l, address, sizeof(type)); \
+                type value; \
+                memcpy(&value, SASM_LANE(l) + address, sizeof(type)); \
+                ra[l] = value; \
+            } \
+            SASM_NEXT_CHECKED(6); \
+        }
+
+    #define SASM_STORE(type) { \
+            const u64* ra = SASM_ROW(SASM_A); \
+            const u64* rb = SASM_ROW(SASM_B); \
+            u64 imm = SASM_IMM32; \
+            SASM_FOR_CHUNKS(l) { \
+                if (!m[l]) \
+                    continue; \
+                u64 address = ra[l] + imm; \
+                SASM_CHECK_MEMORY(l, address, sizeof(type)); \
+                type value = (type) rb[l]; \
+                memcpy(SASM_LANE(l) + address, &value, sizeof(type)); \
+            } \
+            SASM_NEXT_CHECKED(6); \
+        }
+
+    // Fault unless the value is aligned inside of one device, like MemoryDevice::atomic
+    #define SASM_CHECK_ATOMIC(l, address, width) { \
+            SASM_CHECK_MEMORY(l, address, width); \
+            u64 device_start = (address) < stack_low ? 0 : (address) < user_low ? stack_low : user_low; \
+            u64 device_end = (address) < stack_low ? stack_low : (address) < user_low ? user_low : memory_end; \
+            if ((((address) - device_start) & ((width) - 1)) != 0 || (address) + (width) > device_end) { \
+                SASM_FAULT(l, kFaultAtomic); \
+                continue; \
+            } \
+        }
+
+    // Atomic read-modify-write, the old value is returned in b
+    #define SASM_ATOMIC(operation, type) { \
+            const u64* ra = SASM_ROW(SASM_A); \
+            u64* rb = SASM_ROW(SASM_B); \
+            SASM_FOR_CHUNKS(l) { \
+                if (!m[l]) \
+                    continue; \
+                u64 address = ra[l]; \
+                SASM_CHECK_ATOMIC(l, address, sizeof(type)); \
+                rb[l] = lane_apply(SASM_LANE(l) + address, sizeof(type), operation, (type) rb[l], 0); \
+            } \
+            SASM_NEXT_CHECKED(2); \
+        }
+
+    // Compare-exchange against r0, the old value is returned in r0
+    #define SASM_CAS(type) { \
+            const u64* ra = SASM_ROW(SASM_A); \
+            const u64* rb = SASM_ROW(SASM_B); \
+            u64* r0 = SASM_ROW(0); \
+            SASM_FOR_CHUNKS(l) { \
+                if (!m[l]) \
+                    continue; \
+                u64 address = ra[l]; \
+                SASM_CHECK_ATOMIC(l, address, sizeof(type)); \
+                u64 expected = (type) r0[l]; \
+                u64 old = lane_apply(SASM_LANE(l) + address, sizeof(type), kAtomicCompareExchange, (type) rb[l], expected); \
+                flags[l] = old == expected ? kFlagZero : 0; \
+                r0[l] = old; \
+            } \
+            SASM_NEXT_CHECKED(2); \
+        }
+
+    for (; budget != 0; budget--) {
+        if (select) {
+            // Lowest ip of the running lanes
+            u64 lowest = ~((u64) 0);
+            u64 running = 0;
+            for (u64 l = 0; l < n; l++) {
+                // Branchless, lanes diverge so any branch on them is mispredicted
+                u64 candidate = status[l] == kLaneRunning ? ip[l] : ~((u64) 0);
+                running += status[l] == kLaneRunning;
+                lowest = candidate < lowest ? candidate : lowest;
+            }
+            if (running == 0)
+                break;
+
+            // Mask, lane loops only visit chunks of width lanes with lanes in the mask
+            active = 0;
+            chunk_count = 0;
+            for (u64 chunk = 0; chunk < stride; chunk += width) {
+                u64 any = 0;
+                for (u64 l = chunk; l < chunk + width; l++) {
+                    m[l] = (u64) 0 - (u64) ((status[l] == kLaneRunning) & (ip[l] == lowest));
+                    any |= m[l];
+                    active += m[l] & 1;
+                }
+                if (any != 0)
+                    chunks[chunk_count++] = chunk;
+            }
+
+            pc = lowest;
+            converged = active == running;
+            full = active == n;
+            select = false;
+        }
+
+        bool faulted = false;
+
+        // Fault if pc doesn't point at a complete instruction
+        u8 opcode = pc < code_size ? program[pc] : (u8) kOpcodeCount;
+        if (opcode >= kOpcodeCount || format_length(opcode_format(opcode)) > code_size - pc) {
+            SASM_FOR_CHUNKS(l) {
+                if (m[l])
+                    SASM_FAULT(l, kFaultInvalidInstruction);
+            }
+            select = true;
+            continue;
+        }
+
+        switch (opcode) {
+            case kOpNop: SASM_GOTO(pc + 1); break;
+            case kOpHalt:
+                SASM_FOR_CHUNKS(l) {
+                    if (m[l]) {
+                        status[l] = kLaneHalted;
+                        ip[l] = pc;
+                    }
+                }
+                select = true;
+                break;
+            case kOpWait:
+                SASM_FOR_CHUNKS(l) {
+                    if (m[l]) {
+                        status[l] = kLaneBlocked;
+                        ip[l] = pc + 1;
+                    }
+                }
+                select = true;
+                break;
+            case kOpMov: SASM_BINARY(rb, 2); break;
+            case kOpMovi: SASM_BINARY(imm, 6); break;
+            case kOpMovq: {
+                u64 imm64;
+                memcpy(&imm64, program + pc + 2, 8);
+                SASM_BINARY(LaneVector() + imm64, 10);
+                break;
+            }
+            case kOpAdd: SASM_BINARY(ra + rb, 2); break;
+            case kOpSub: SASM_BINARY(ra - rb, 2); break;
+            case kOpMul: SASM_BINARY(ra * rb, 2); break;
+            case kOpDivu:
+            case kOpRemu: {
+                u64* ra = SASM_ROW(SASM_A);
+                const u64* rb = SASM_ROW(SASM_B);
+                SASM_FOR_CHUNKS(l) {
+                    if (!m[l])
+                        continue;
+                    if (rb[l] == 0) {
+                        SASM_FAULT(l, kFaultDivideByZero);
+                        continue;
+                    }
+                    ra[l] = opcode == kOpDivu ? ra[l] / rb[l] : ra[l] % rb[l];
+                }
+                SASM_NEXT_CHECKED(2);
+                break;
+            }
+            case kOpAnd: SASM_BINARY(ra & rb, 2); break;
+            case kOpOr: SASM_BINARY(ra | rb, 2); break;
+            case kOpXor: SASM_BINARY(ra ^ rb, 2); break;
+            case kOpShl: SASM_BINARY(ra << (rb & 63), 2); break;
+            case kOpShr: SASM_BINARY(ra >> (rb & 63), 2); break;
+            case kOpSar: SASM_BINARY((LaneVector) ((LaneSigned) ra >> (LaneSigned) (rb & 63)), 2); break;
+            case kOpAddi: SASM_BINARY(ra + imm, 6); break;
+            case kOpAndi: SASM_BINARY(ra & imm, 6); break;
+            case kOpShli: SASM_BINARY(ra << (imm & 63), 6); break;
+            case kOpShri: SASM_BINARY(ra >> (imm & 63), 6); break;
+            case kOpNot: SASM_BINARY(~ra, 2); break;
+            case kOpNeg: SASM_BINARY(-ra, 2); break;
+            case kOpCmp: SASM_COMPARE(rb, 2); break;
+            case kOpCmpi: SASM_COMPARE(imm, 6); break;
+            case kOpJmp: SASM_GOTO(SASM_TARGET); break;
+            case kOpJz: SASM_BRANCH(kFlagZero, true); break;
+            case kOpJnz: SASM_BRANCH(kFlagZero, false); break;
+            case kOpJlt: SASM_BRANCH(kFlagLess, true); break;
+            case kOpJge: SASM_BRANCH(kFlagLess, false); break;
+            case kOpJltu: SASM_BRANCH(kFlagBelow, true); break;
+            case kOpJgeu: SASM_BRANCH(kFlagBelow, false); break;
+            case kOpCall:
+            case kOpPush: {
+                // Push the return ip (call) / register a (push)
+                const u64* ra = SASM_ROW(SASM_A);
+                SASM_FOR_CHUNKS(l) {
+                    if (!m[l])
+                        continue;
+                    if (sp[l] < stack_low + 8) {
+                        SASM_FAULT(l, kFaultStackOverflow);
+                        continue;
+                    }
+                    u64 value = opcode == kOpCall ? pc + 5 : ra[l];
+                    sp[l] -= 8;
+                    memcpy(SASM_LANE(l) + sp[l], &value, 8);
+                }
+
+                if (opcode == kOpPush)
+                    SASM_NEXT_CHECKED(2)
+                else if (faulted) {
+                    SASM_FOR_CHUNKS(l) {
+                        if (m[l] && status[l] == kLaneRunning)
+                            ip[l] = SASM_TARGET;
+                    }
+                    select = true;
+                } else
+                    SASM_GOTO(SASM_TARGET);
+                break;
+            }
+            case kOpRet:
+            case kOpPop: {
+                u64* ra = SASM_ROW(SASM_A);
+                SASM_FOR_CHUNKS(l) {
+                    if (!m[l])
+                        continue;
+                    if (sp[l] + 8 > stack_high) {
+                        SASM_FAULT(l, kFaultStackUnderflow);
+                        continue;
+                    }
+                    memcpy(opcode == kOpRet ? &ip[l] : &ra[l], SASM_LANE(l) + sp[l], 8);
+                    sp[l] += 8;
+                }
+
+                // Return addresses can differ between lanes
+                if (opcode == kOpPop)
+                    SASM_NEXT_CHECKED(2)
+                else
+                    select = true;
+                break;
+            }
+            case kOpLd8: SASM_LOAD(u8); break;
+            case kOpLd16: SASM_LOAD(u16); break;
+            case kOpLd32: SASM_LOAD(u32); break;
+            case kOpLd64: SASM_LOAD(u64); break;
+            case kOpSt8: SASM_STORE(u8); break;
+            case kOpSt16: SASM_STORE(u16); break;
+            case kOpSt32: SASM_STORE(u32); break;
+            case kOpSt64: SASM_STORE(u64); break;
+            case kOpCas8: SASM_CAS(u8); break;
+            case kOpCas16: SASM_CAS(u16); break;
+            case kOpCas32: SASM_CAS(u32); break;
+            case kOpCas64: SASM_CAS(u64); break;
+            case kOpSwap8: SASM_ATOMIC(kAtomicExchange, u8); break;
+            case kOpSwap16: SASM_ATOMIC(kAtomicExchange, u16); break;
+            case kOpSwap32: SASM_ATOMIC(kAtomicExchange, u32); break;
+            case kOpSwap64: SASM_ATOMIC(kAtomicExchange, u64); break;
+            case kOpFadd8: SASM_ATOMIC(kAtomicFetchAdd, u8); break;
+            case kOpFadd16: SASM_ATOMIC(kAtomicFetchAdd, u16); break;
+            case kOpFadd32: SASM_ATOMIC(kAtomicFetchAdd, u32); break;
+            case kOpFadd64: SASM_ATOMIC(kAtomicFetchAdd, u64); break;
+            case kOpFand8: SASM_ATOMIC(kAtomicFetchAnd, u8); break;
+            case kOpFand16: SASM_ATOMIC(kAtomicFetchAnd, u16); break;
+            case kOpFand32: SASM_ATOMIC(kAtomicFetchAnd, u32); break;
+            case kOpFand64: SASM_ATOMIC(kAtomicFetchAnd, u64); break;
+            case kOpFor8: SASM_ATOMIC(kAtomicFetchOr, u8); break;
+            case kOpFor16: SASM_ATOMIC(kAtomicFetchOr, u16); break;
+            case kOpFor32: SASM_ATOMIC(kAtomicFetchOr, u32); break;
+            case kOpFor64: SASM_ATOMIC(kAtomicFetchOr, u64); break;
+
+            // Lane memory isn't shared, fences have nothing to order
+            case kOpAcquire:
+            case kOpRelease:
+            case kOpFence:
+                SASM_GOTO(pc + 1);
+                break;
+        }
+    }
+
+    // Store the ip of the lanes still in the mask
+    if (!select) {
+        SASM_FOR_CHUNKS(l)
+            ip[l] = m[l] ? pc : ip[l];
+    }
+
+    bool running = false, blocked = false, faulted = false;
+    for (u64 l = 0; l < n; l++) {
+        memcpy(SASM_LANE(l), &flags[l], 4);
+        running |= status[l] == kLaneRunning;
+        blocked |= status[l] == kLaneBlocked;
+        faulted |= status[l] == kLaneFault;
+    }
+
+    if (running)
+        return kExecutionBudget;
+    if (blocked)
+        return kExecutionBlocked;
+    return faulted ? kExecutionFault : kExecutionHalted;
+
+    #undef SASM_A
+    #undef SASM_B
+    #undef SASM_IMM32
+    #undef SASM_TARGET
+    #undef SASM_ROW
+    #undef SASM_LANE
+    #undef SASM_FOR_CHUNKS
+    #undef SASM_GOTO
+    #undef SASM_NEXT_CHECKED
+    #undef SASM_FAULT
+    #undef SASM_LANES
+    #undef SASM_BINARY
+    #undef SASM_COMPARE
+    #undef SASM_BRANCH
+    #undef SASM_CHECK_MEMORY
+    #undef SASM_LOAD
+    #undef SASM_STORE
+    #undef SASM_CHECK_ATOMIC
+    #undef SASM_ATOMIC
+    #undef SASM_CAS
+}
+
+#ifdef SASM_LOCKSTEP_DISPATCH
+__attribute__((target("avx2"))) ExecutionResult LockstepProcessor::run_wide(u64 budget) {
+    return run_lanes<LaneVector4, LaneSigned4>(budget);
+}
+#endif
+
+ExecutionResult LockstepProcessor::run(u64 budget) {
+#if defined(SASM_LOCKSTEP_WIDE)
+    return run_lanes<LaneVector4, LaneSigned4>(budget);
+#else
+    #ifdef SASM_LOCKSTEP_DISPATCH
+        if (__builtin_cpu_supports("avx2"))
+            return run_wide(budget);
+    #endif
+    return run_lanes<LaneVector2, LaneSigned2>(budget);
+#endif
+}
@@ -0,0 +1,167 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file lockstep.h
+ * @author lotuspar / par0-git
+ * @brief Running one program over many inputs in lockstep
+ *
+ * A LockstepProcessor runs "lanes": copies of one program, each with its own registers
+ * and memory, laid out like a BaseProcessor ("flags", "stack", "user"). Every step
+ * decodes one instruction and runs it for every lane at that instruction, registers are
+ * stored per register across lanes (structure of arrays) so arithmetic runs as vector
+ * loops over the lanes.
+ *
+ * Lanes whose branches go different ways are masked: each step runs the lanes with the
+ * lowest ip, so lanes that left a loop or skipped an if wait until the others catch up
+ * and run together again.
+ *
+ * Lane memory is plain host memory, only the processor accesses it while running. Code
+ * is fetched from the program given to load(), stores into "user" don't change the code
+ * that runs. Atomic instructions / fences behave like on a single processor, lanes don't
+ * share memory.
+ */
+
+#pragma once
+
+#include "processor.h" // ExecutionResult, ProcessorState, ProcessorFault
+#include "bytecode.h" // kRegisterCount
+#include "../../any/arena.h" // MemoryArena
+#include <vector> // std::vector
+
+namespace sasm {
+namespace vm {
+    /**
+     * @brief Execution state of a lane
+     */
+    enum LaneStatus {
+        kLaneRunning = 0,
+        kLaneHalted = 1, // Lane ran "halt"
+        kLaneBlocked = 2, // Lane ran "wait", see wake
+        kLaneFault = 3 // Lane faulted, see lane_state
+    };
+
+    class LockstepProcessor {
+    public:
+        LockstepProcessor(u64 _lanes, u64 _stack, u64 _user, MemoryArenaPool* _pool = 0x0, u8 _arena_flags = 0) {
+            arena_pool = _pool;
+            arena_flags = _arena_flags;
+            init(_lanes, _stack, _user);
+        }
+        ~LockstepProcessor() { release_arena(); }
+
+        LockstepProcessor(const LockstepProcessor&) = delete;
+        LockstepProcessor& operator=(const LockstepProcessor&) = delete;
+
+        /**
+         * @brief (Re)create lanes with zeroed memory, the program is unloaded
+         *
+         * @param _lanes Amount of lanes
+         * @param _stack Size of "stack" of every lane
+         * @param _user Size of "user" of every lane
+         */
+        void init(u64 _lanes, u64 _stack, u64 _user);
+
+        /**
+         * @brief Reset registers of every lane, start executing at the beginning of "user" with an empty stack
+         */
+        void reset();
+
+        /**
+         * @brief Copy a program into "user" of every lane
+         *
+         * @param program Pointer to bytecode
+         * @param amount Size of the bytecode
+         * @return (u8 / DeviceOperationResult) Result of operation
+         */
+        u8 load(const void* program, u64 amount);
+
+        /**
+         * @brief Run steps until the budget runs out or no lane can run
+         *
+         * A step runs one instruction for the lanes at the lowest ip, so lanes that
+         * diverged take more steps than instructions.
+         *
+         * @param budget Maximum amount of steps to run
+         * @return ExecutionResult kExecutionBudget if a lane can keep running, otherwise
+         * kExecutionBlocked if a lane is blocked, kExecutionFault if a lane faulted, else kExecutionHalted
+         */
+        ExecutionResult run(u64 budget);
+
+        // Unblock a lane that ran "wait"
+        void wake(u64 lane) {
+            if (lane < lanes && status[lane] == kLaneBlocked)
+                status[lane] = kLaneRunning;
+        }
+
+        /**
+         * @brief Get the registers / state of a lane
+         *
+         * @param lane Index of the lane
+         * @return ProcessorState State as a BaseProcessor would have it
+         */
+        ProcessorState lane_state(u64 lane);
+
+        /**
+         * @brief Replace the registers / state of a lane
+         *
+         * @param lane Index of the lane
+         * @param state New state
+         */
+        void set_lane_state(u64 lane, const ProcessorState& state);
+
+        // Access a register of a lane
+        u64& lane_register(u64 lane, u8 index) { return registers[(index & 0xF) * lane_stride + lane]; }
+
+        // Host pointer to the memory of a lane, container addresses (see stack_base / user_base), 0x0 if out of range
+        u8* lane_memory(u64 lane) { return lane < lanes && memory != 0x0 ? memory + lane * memory_stride : 0x0; }
+
+        u8 lane_status(u64 lane) { return lane < lanes ? status[lane] : (u8) kLaneFault; }
+        u64 lane_count() { return lanes; }
+
+        // Container addresses of the devices, the same for every lane
+        vptr stack_base() { return 4; }
+        vptr user_base() { return 4 + stack_size; }
+        u64 memory_size() { return 4 + stack_size + user_size; }
+    private:
+        std::unique_ptr<MemoryArena> arena;
+        MemoryArenaPool* arena_pool = 0x0;
+        u8 arena_flags = 0;
+
+        u64 lanes = 0;
+        u64 lane_stride = 0; // Lanes per register row, rounded up to a multiple of 8 (vector width)
+        u64 stack_size = 0;
+        u64 user_size = 0;
+
+        // Lane memory, memory_stride bytes per lane
+        u8* memory = 0x0;
+        u64 memory_stride = 0;
+
+        // Code of every lane, "user" after load()
+        std::vector<u8> code;
+
+        // Structure of arrays, register i of lane l is registers[i * lane_stride + l]
+        std::vector<u64> registers;
+        std::vector<u64> ip;
+        std::vector<u64> sp;
+        std::vector<u64> flags; // ProcessorFlags, 64-bit like the registers so they share the vector code
+        std::vector<u8> status; // LaneStatus
+        std::vector<u8> fault; // ProcessorFault
+
+        // Lanes running the current step, all ones / zero per lane
+        std::vector<u64> mask;
+        std::vector<u64> mask_chunks; // First lane of every vector chunk with lanes in the mask
+
+        // run() with LaneVector holding the lanes of one operation, inlined into each build of run (see lockstep.cpp)
+        template <class LaneVector, class LaneSigned>
+        __attribute__((always_inline)) inline ExecutionResult run_lanes(u64 budget);
+
+        // run_lanes with 4 lanes, built for AVX2
+        ExecutionResult run_wide(u64 budget);
+
+        void release_arena() {
+            if (arena_pool != 0x0)
+                arena_pool->release(std::move(arena));
+            arena.reset();
+        }
+    };
+}
+}
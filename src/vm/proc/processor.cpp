@@ -0,0 +1,333 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file processor.cpp
+ * @author lotuspar / par0-git
+ * @brief BasicInterpretedProcessor interpreter loop
+ *
+ * Registers, ip, sp and flags are kept in locals while running and written back when
+ * execution stops. Dispatch is direct-threaded (computed goto) when the compiler
+ * supports it, otherwise it falls back to a switch. Define SASM_NO_THREADED_DISPATCH
+ * to force the switch.
+ */
+
+#include "processor.h"
+
+#if defined(__GNUC__) && !defined(SASM_NO_THREADED_DISPATCH)
+    #define SASM_THREADED_DISPATCH
+#endif
+
+using namespace sasm::vm;
+
+ExecutionResult BasicInterpretedProcessor::run(u64 budget) {
+    if (state.halted)
+        return kExecutionHalted;
+    if (state.blocked)
+        return kExecutionBlocked;
+    if (state.fault != kFaultNone)
+        return kExecutionFault;
+
+    // Code is read straight from "user" when possible
+    MemoryView code_view = prm_user.view(0, prm_user.size, MemoryViewAccess::kViewRead);
+    const u8* code = code_view.data();
+    u64 code_size = code_view.size();
+
+    // Instructions starting before fast_end can't be truncated, no need to check their length
+    u64 fast_end = code_size >= kMaxInstructionLength ? code_size - kMaxInstructionLength + 1 : 0;
+
+    // Hot state in locals
+    u64 r[kRegisterCount];
+    memcpy(r, state.registers, sizeof(r));
+    u64 ip = state.ip;
+    u64 sp = state.sp;
+    u32 flags = state.flags;
+    u8 fault = kFaultNone;
+    ExecutionResult result = kExecutionBudget;
+
+    u64 memory_size = prm.size;
+    u64 stack_low = stack_base();
+    u64 stack_high = stack_low + prm_stack.size;
+    CodeWatch watch = code_watch;
+
+    // Operand access for the instruction at ip
+    #define SASM_A (code[ip + 1] & 0xF)
+    #define SASM_B (code[ip + 1] >> 4)
+    #define SASM_IMM32 ((u64) (i64) read_i32(code + ip + 2))
+    #define SASM_TARGET ((u64) (u32) read_i32(code + ip + 1))
+
+    // Fault if ip doesn't point at a complete instruction
+    #define SASM_CHECK_FETCH() \
+        if (ip >= fast_end) { \
+            if (ip >= code_size || code[ip] >= kOpcodeCount || \
+                ip + format_length(opcode_format(code[ip])) > code_size) \
+                goto invalid_instruction; \
+        }
+
+    // Fault if a memory operation isn't inside processor memory
+    #define SASM_CHECK_MEMORY(address, width) \
+        if ((width) > memory_size || (address) > memory_size - (width)) { \
+            fault = kFaultMemory; \
+            goto faulted; \
+        }
+
+    // Fault if a device refused a memory operation (locked, handler failure, ...)
+    #define SASM_CHECK_RESULT(operation) \
+        if ((operation) != DeviceOperationResult::kSuccess) { \
+            fault = kFaultMemory; \
+            goto faulted; \
+        }
+
+    #define SASM_LOAD(type) { \
+            u64 address = r[SASM_B] + SASM_IMM32; \
+            SASM_CHECK_MEMORY(address, sizeof(type)); \
+            type value = 0; \
+            SASM_CHECK_RESULT(prm.read_checked(address, sizeof(type), &value)); \
+            r[SASM_A] = value; \
+            ip += 6; \
+        }
+
+    #define SASM_STORE(type) { \
+            u64 address = r[SASM_A] + SASM_IMM32; \
+            SASM_CHECK_MEMORY(address, sizeof(type)); \
+            type value = (type) r[SASM_B]; \
+            SASM_CHECK_RESULT(prm.write_checked(address, sizeof(type), &value)); \
+            if (watch.hit(address, sizeof(type))) \
+                code_watch.epoch++; \
+            ip += 6; \
+        }
+
+    // Atomic read-modify-write, the old value is returned in b
+    #define SASM_ATOMIC(operation, type) { \
+            u64 address = r[SASM_A]; \
+            SASM_CHECK_MEMORY(address, sizeof(type)); \
+            u64 old = 0; \
+            if (prm.atomic(address, sizeof(type), operation, r[SASM_B], &old) != DeviceOperationResult::kSuccess) { \
+                fault = kFaultAtomic; \
+                goto faulted; \
+            } \
+            if (watch.hit(address, sizeof(type))) \
+                code_watch.epoch++; \
+            r[SASM_B] = old; \
+            ip += 2; \
+        }
+
+    // Compare-exchange against r0, the old value is returned in r0
+    #define SASM_CAS(type) { \
+            u64 address = r[SASM_A]; \
+            SASM_CHECK_MEMORY(address, sizeof(type)); \
+            u64 expected = (type) r[0]; \
+            u64 old = 0; \
+            if (prm.atomic(address, sizeof(type), kAtomicCompareExchange, r[SASM_B], &old, expected) != DeviceOperationResult::kSuccess) { \
+                fault = kFaultAtomic; \
+                goto faulted; \
+            } \
+            if (watch.hit(address, sizeof(type))) \
+                code_watch.epoch++; \
+            flags = old == expected ? kFlagZero : 0; \
+            r[0] = old; \
+            ip += 2; \
+        }
+
+    #define SASM_BRANCH(condition) { \
+            if (condition) \
+                ip = SASM_TARGET; \
+            else \
+                ip += 5; \
+        }
+
+#ifdef SASM_THREADED_DISPATCH
+    // Every opcode jumps straight to the handler of the next instruction. The table is
+    // built at compile time, handlers are stored relative to invalid_instruction so every
+    // byte past the last opcode (zero offset) lands there
+    #define SASM_HANDLER_OFFSET(name, mnemonic, format) (i32) ((char*) &&handler_##name - (char*) &&invalid_instruction),
+    static const i32 handlers[256] = { SASM_OPCODES(SASM_HANDLER_OFFSET) };
+    #undef SASM_HANDLER_OFFSET
+
+    #define SASM_HANDLER(name) handler_##name:
+    #define SASM_DISPATCH() \
+        do { \
+            if (budget == 0) \
+                goto stop; \
+            budget--; \
+            SASM_CHECK_FETCH(); \
+            goto *(void*) ((char*) &&invalid_instruction + handlers[code[ip]]); \
+        } while (0)
+
+    SASM_DISPATCH();
+#else
+    #define SASM_HANDLER(name) case kOp##name:
+    #define SASM_DISPATCH() continue
+
+    for (;;) {
+        if (budget == 0)
+            goto stop;
+        budget--;
+        SASM_CHECK_FETCH();
+
+        switch (code[ip]) {
+#endif
+
+    SASM_HANDLER(Nop) { ip += 1; } SASM_DISPATCH();
+    SASM_HANDLER(Halt) {
+        state.halted = true;
+        result = kExecutionHalted;
+        goto stop;
+    }
+    SASM_HANDLER(Wait) {
+        ip += 1;
+        state.blocked = true;
+        result = kExecutionBlocked;
+        goto stop;
+    }
+    SASM_HANDLER(Mov) { r[SASM_A] = r[SASM_B]; ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Movi) { r[SASM_A] = SASM_IMM32; ip += 6; } SASM_DISPATCH();
+    SASM_HANDLER(Movq) { memcpy(&r[SASM_A], code + ip + 2, 8); ip += 10; } SASM_DISPATCH();
+    SASM_HANDLER(Add) { r[SASM_A] += r[SASM_B]; ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Sub) { r[SASM_A] -= r[SASM_B]; ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Mul) { r[SASM_A] *= r[SASM_B]; ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Divu) {
+        if (r[SASM_B] == 0) {
+            fault = kFaultDivideByZero;
+            goto faulted;
+        }
+        r[SASM_A] /= r[SASM_B];
+        ip += 2;
+    } SASM_DISPATCH();
+    SASM_HANDLER(Remu) {
+        if (r[SASM_B] == 0) {
+            fault = kFaultDivideByZero;
+            goto faulted;
+        }
+        r[SASM_A] %= r[SASM_B];
+        ip += 2;
+    } SASM_DISPATCH();
+    SASM_HANDLER(And) { r[SASM_A] &= r[SASM_B]; ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Or) { r[SASM_A] |= r[SASM_B]; ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Xor) { r[SASM_A] ^= r[SASM_B]; ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Shl) { r[SASM_A] <<= (r[SASM_B] & 63); ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Shr) { r[SASM_A] >>= (r[SASM_B] & 63); ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Sar) { r[SASM_A] = (u64) (((i64) r[SASM_A]) >> (r[SASM_B] & 63)); ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Addi) { r[SASM_A] += SASM_IMM32; ip += 6; } SASM_DISPATCH();
+    SASM_HANDLER(Andi) { r[SASM_A] &= SASM_IMM32; ip += 6; } SASM_DISPATCH();
+    SASM_HANDLER(Shli) { r[SASM_A] <<= (SASM_IMM32 & 63); ip += 6; } SASM_DISPATCH();
+    SASM_HANDLER(Shri) { r[SASM_A] >>= (SASM_IMM32 & 63); ip += 6; } SASM_DISPATCH();
+    SASM_HANDLER(Not) { r[SASM_A] = ~r[SASM_A]; ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Neg) { r[SASM_A] = (u64) -(i64) r[SASM_A]; ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Cmp) { flags = compare_flags(r[SASM_A], r[SASM_B]); ip += 2; } SASM_DISPATCH();
+    SASM_HANDLER(Cmpi) { flags = compare_flags(r[SASM_A], SASM_IMM32); ip += 6; } SASM_DISPATCH();
+    SASM_HANDLER(Jmp) { ip = SASM_TARGET; } SASM_DISPATCH();
+    SASM_HANDLER(Jz) SASM_BRANCH(flags & kFlagZero) SASM_DISPATCH();
+    SASM_HANDLER(Jnz) SASM_BRANCH(!(flags & kFlagZero)) SASM_DISPATCH();
+    SASM_HANDLER(Jlt) SASM_BRANCH(flags & kFlagLess) SASM_DISPATCH();
+    SASM_HANDLER(Jge) SASM_BRANCH(!(flags & kFlagLess)) SASM_DISPATCH();
+    SASM_HANDLER(Jltu) SASM_BRANCH(flags & kFlagBelow) SASM_DISPATCH();
+    SASM_HANDLER(Jgeu) SASM_BRANCH(!(flags & kFlagBelow)) SASM_DISPATCH();
+    SASM_HANDLER(Call) {
+        if (sp < stack_low + 8) {
+            fault = kFaultStackOverflow;
+            goto faulted;
+        }
+        u64 return_ip = ip + 5;
+        SASM_CHECK_RESULT(prm.write_checked(sp - 8, 8, &return_ip));
+        sp -= 8;
+        ip = SASM_TARGET;
+    } SASM_DISPATCH();
+    SASM_HANDLER(Ret) {
+        if (sp + 8 > stack_high) {
+            fault = kFaultStackUnderflow;
+            goto faulted;
+        }
+        u64 return_ip = 0;
+        SASM_CHECK_RESULT(prm.read_checked(sp, 8, &return_ip));
+        ip = return_ip;
+        sp += 8;
+    } SASM_DISPATCH();
+    SASM_HANDLER(Push) {
+        if (sp < stack_low + 8) {
+            fault = kFaultStackOverflow;
+            goto faulted;
+        }
+        SASM_CHECK_RESULT(prm.write_checked(sp - 8, 8, &r[SASM_A]));
+        sp -= 8;
+        ip += 2;
+    } SASM_DISPATCH();
+    SASM_HANDLER(Pop) {
+        if (sp + 8 > stack_high) {
+            fault = kFaultStackUnderflow;
+            goto faulted;
+        }
+        u64 value = 0;
+        SASM_CHECK_RESULT(prm.read_checked(sp, 8, &value));
+        r[SASM_A] = value;
+        sp += 8;
+        ip += 2;
+    } SASM_DISPATCH();
+    SASM_HANDLER(Ld8) SASM_LOAD(u8) SASM_DISPATCH();
+    SASM_HANDLER(Ld16) SASM_LOAD(u16) SASM_DISPATCH();
+    SASM_HANDLER(Ld32) SASM_LOAD(u32) SASM_DISPATCH();
+    SASM_HANDLER(Ld64) SASM_LOAD(u64) SASM_DISPATCH();
+    SASM_HANDLER(St8) SASM_STORE(u8) SASM_DISPATCH();
+    SASM_HANDLER(St16) SASM_STORE(u16) SASM_DISPATCH();
+    SASM_HANDLER(St32) SASM_STORE(u32) SASM_DISPATCH();
+    SASM_HANDLER(St64) SASM_STORE(u64) SASM_DISPATCH();
+    SASM_HANDLER(Cas8) SASM_CAS(u8) SASM_DISPATCH();
+    SASM_HANDLER(Cas16) SASM_CAS(u16) SASM_DISPATCH();
+    SASM_HANDLER(Cas32) SASM_CAS(u32) SASM_DISPATCH();
+    SASM_HANDLER(Cas64) SASM_CAS(u64) SASM_DISPATCH();
+    SASM_HANDLER(Swap8) SASM_ATOMIC(kAtomicExchange, u8) SASM_DISPATCH();
+    SASM_HANDLER(Swap16) SASM_ATOMIC(kAtomicExchange, u16) SASM_DISPATCH();
+    SASM_HANDLER(Swap32) SASM_ATOMIC(kAtomicExchange, u32) SASM_DISPATCH();
+    SASM_HANDLER(Swap64) SASM_ATOMIC(kAtomicExchange, u64) SASM_DISPATCH();
+    SASM_HANDLER(Fadd8) SASM_ATOMIC(kAtomicFetchAdd, u8) SASM_DISPATCH();
+    SASM_HANDLER(Fadd16) SASM_ATOMIC(kAtomicFetchAdd, u16) SASM_DISPATCH();
+    SASM_HANDLER(Fadd32) SASM_ATOMIC(kAtomicFetchAdd, u32) SASM_DISPATCH();
+    SASM_HANDLER(Fadd64) SASM_ATOMIC(kAtomicFetchAdd, u64) SASM_DISPATCH();
+    SASM_HANDLER(Fand8) SASM_ATOMIC(kAtomicFetchAnd, u8) SASM_DISPATCH();
+    SASM_HANDLER(Fand16) SASM_ATOMIC(kAtomicFetchAnd, u16) SASM_DISPATCH();
+    SASM_HANDLER(Fand32) SASM_ATOMIC(kAtomicFetchAnd, u32) SASM_DISPATCH();
+    SASM_HANDLER(Fand64) SASM_ATOMIC(kAtomicFetchAnd, u64) SASM_DISPATCH();
+    SASM_HANDLER(For8) SASM_ATOMIC(kAtomicFetchOr, u8) SASM_DISPATCH();
+    SASM_HANDLER(For16) SASM_ATOMIC(kAtomicFetchOr, u16) SASM_DISPATCH();
+    SASM_HANDLER(For32) SASM_ATOMIC(kAtomicFetchOr, u32) SASM_DISPATCH();
+    SASM_HANDLER(For64) SASM_ATOMIC(kAtomicFetchOr, u64) SASM_DISPATCH();
+    SASM_HANDLER(Acquire) { atomic_fence(kOrderAcquire); ip += 1; } SASM_DISPATCH();
+    SASM_HANDLER(Release) { atomic_fence(kOrderRelease); ip += 1; } SASM_DISPATCH();
+    SASM_HANDLER(Fence) { atomic_fence(kOrderSequential); ip += 1; } SASM_DISPATCH();
+
+#ifndef SASM_THREADED_DISPATCH
+            default:
+                goto invalid_instruction;
+        }
+    }
+#endif
+
+invalid_instruction:
+    fault = kFaultInvalidInstruction;
+
+faulted:
+    state.fault = fault;
+    result = kExecutionFault;
+
+stop:
+    // Write hot state back
+    memcpy(state.registers, r, sizeof(r));
+    state.ip = ip;
+    state.sp = sp;
+    state.flags = flags;
+    prm_flags.write_type<u32>(0, flags);
+    return result;
+
+    #undef SASM_A
+    #undef SASM_B
+    #undef SASM_IMM32
+    #undef SASM_TARGET
+    #undef SASM_CHECK_FETCH
+    #undef SASM_CHECK_MEMORY
+    #undef SASM_CHECK_RESULT
+    #undef SASM_LOAD
+    #undef SASM_STORE
+    #undef SASM_BRANCH
+    #undef SASM_ATOMIC
+    #undef SASM_CAS
+    #undef SASM_HANDLER
+    #undef SASM_DISPATCH
+}
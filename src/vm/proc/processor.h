@@ -5,8 +5,12 @@
  * @brief Main processor class
  */
 
+#pragma once
+
 #include "../device/container.h"
 #include "../device/types/pure.h"
+#include "bytecode.h" // kRegisterCount
+#include "../../any/arena.h" // MemoryArena
 
 namespace sasm {
 namespace vm {
@@ -23,31 +27,230 @@ namespace vm {
         akSafe = 0b00001000 // "kSafe" Disallows out-of-bounds reading and writing. Enabled by default
     };
 
+    /**
+     * @brief Result of running a processor for a while
+     */
+    enum ExecutionResult {
+        kExecutionBudget = 0, // Instruction budget ran out, processor can keep running
+        kExecutionHalted = 1, // Processor ran "halt"
+        kExecutionBlocked = 2, // Processor ran "wait" and is blocked until woken
+        kExecutionFault = 3 // Processor faulted, see ProcessorState::fault
+    };
+
+    /**
+     * @brief Reasons for a processor to fault
+     */
+    enum ProcessorFault {
+        kFaultNone = 0,
+        kFaultInvalidInstruction = 1, // Invalid opcode or instruction outside of "user"
+        kFaultMemory = 2, // Load / store outside of the processor memory
+        kFaultStackOverflow = 3, // Push / call with a full stack
+        kFaultStackUnderflow = 4, // Pop / ret with an empty stack
+        kFaultDivideByZero = 5, // divu / remu by zero
+        kFaultAtomic = 6 // Atomic operation on misaligned memory or memory without atomic support
+    };
+
+    /**
+     * @brief Processor registers, kept outside of device memory
+     */
+    struct ProcessorState {
+        u64 registers[kRegisterCount];
+        u64 ip; // Offset into "user"
+        u64 sp; // Container address into "stack", grows down
+        u32 flags; // ProcessorFlags, also written to the "flags" device
+        u8 fault; // ProcessorFault
+        bool halted;
+        bool blocked;
+    };
+
+    /**
+     * @brief Range of code something depends on (compiled JIT blocks), watched for changes
+     */
+    struct CodeWatch {
+        u64 low = ~(u64) 0; // Container address range [low, high), empty by default
+        u64 high = 0;
+        u64 epoch = 0; // Incremented when watched code / all of "user" may have changed
+
+        // True if a store of width bytes at address changes watched code
+        bool hit(u64 address, u64 width) { return address < high && address + width > low; }
+    };
+
+    class ProcessorCheckpoint;
+    class BytecodeImage;
+
     class BaseProcessor {
+        friend class ProcessorCheckpoint; // Saves / restores devices and state
+        friend class BytecodeImage; // Maps code into "user"
     public:
         BaseProcessor() { init(16, 16); }
-        BaseProcessor(u64 _stack, u64 _user) { init(_stack, _user); }
+        BaseProcessor(u64 _stack, u64 _user, MemoryArenaPool* _pool = 0x0, u8 _arena_flags = 0) {
+            use_arena_pool(_pool, _arena_flags);
+            init(_stack, _user);
+        }
+        ~BaseProcessor() { release_arena(); }
+
+        /**
+         * @brief (Re)create processor memory
+         * 
+         * Every device is backed by one MemoryArena. The arena is reused (and zeroed) if it
+         * is large enough, otherwise a new one is taken from the arena pool / mapped.
+         * 
+         * @param _stack Size of "stack"
+         * @param _user Size of "user"
+         * @param alignment Alignment of the "stack" / "user" memory, the page size lets checkpoints map pages in
+         */
+        void init(u64 _stack, u64 _user, u64 alignment = MemoryArena::kAlignment) {
+            // Worst case, every aligned block needs a full alignment of padding
+            u64 padding = alignment > MemoryArena::kAlignment ? 2 * alignment : 0;
+            u64 needed = MemoryArena::footprint(4) + MemoryArena::footprint(_stack) + MemoryArena::footprint(_user) + padding;
 
-        void init(u64 _stack, u64 _user) {
-            prm_flags = PureMemoryDevice("flags", 4);
-            prm_stack = PureMemoryDevice("stack", _stack);
-            prm_user = PureMemoryDevice("user", _user);
+            // Reuse current arena if possible
+            if (arena && arena->capacity() >= needed && arena->flags() == arena_flags) {
+                arena->reset();
+            } else {
+                release_arena();
+                if (arena_pool != 0x0)
+                    arena = arena_pool->acquire(needed, arena_flags);
+                else {
+                    arena.reset(new MemoryArena());
+                    if (!arena->init(needed, arena_flags))
+                        arena.reset();
+                }
 
+                if (!arena)
+                    sasm_print("Failed to allocate processor memory (%lu bytes)", (unsigned long) needed);
+            }
+
+            prm_flags.init("flags", 4, arena ? arena->allocate(4) : 0x0);
+            prm_stack.init("stack", _stack, arena ? arena->allocate(_stack, alignment) : 0x0);
+            prm_user.init("user", _user, arena ? arena->allocate(_user, alignment) : 0x0);
+
+            prm.clear();
             prm.handle(&prm_flags)
                 .handle(&prm_stack)
                 .handle(&prm_user);
 
+            // New "user", nothing is watched anymore
+            code_watch = CodeWatch { ~(u64) 0, 0, code_watch.epoch + 1 };
+
+            // New memory, nothing matches an earlier checkpoint
+            if (dirty_page_bits != 0)
+                track_writes(true, dirty_page_bits);
 
+            reset();
         }
-    private:
+
+        /**
+         * @brief Track writes to the processor devices, delta checkpoints (kCheckpointDelta)
+         * only save pages written since the last checkpoint
+         * 
+         * Every page starts out dirty. Kept across init(). Tracked devices aren't accessed
+         * through host pointers, so memory access is slower while tracking.
+         * 
+         * @param enable Start / stop tracking
+         * @param page_bits Page size as a shift (12 = 4096 byte pages)
+         */
+        void track_writes(bool enable, u64 page_bits = 12) {
+            dirty_page_bits = enable ? page_bits : 0;
+            PureMemoryDevice* devices[] = { &prm_flags, &prm_stack, &prm_user };
+            for (PureMemoryDevice* device : devices) {
+                if (enable) {
+                    device->track_writes(page_bits);
+                    device->mark_dirty(0, device->size);
+                } else {
+                    device->untrack_writes();
+                }
+            }
+        }
+
+        bool tracking_writes() { return dirty_page_bits != 0; }
+
+        /**
+         * @brief Take arenas from a pool instead of mapping new ones, used from the next init()
+         * (or pass the pool to the constructor)
+         * 
+         * The arena is given back to the pool when the processor is destroyed or needs a
+         * larger arena.
+         * 
+         * @param pool Pool to use, 0x0 to map arenas directly
+         * @param flags Backing options for new arenas (MemoryArenaFlags)
+         */
+        void use_arena_pool(MemoryArenaPool* pool, u8 flags = 0) {
+            arena_pool = pool;
+            arena_flags = flags;
+        }
+
+        /**
+         * @brief Reset registers, start executing at the beginning of "user" with an empty stack
+         */
+        void reset() {
+            state = ProcessorState();
+            state.sp = stack_base() + prm_stack.size;
+            prm_flags.write_type<u32>(0, 0);
+        }
+
+        /**
+         * @brief Copy a program into "user"
+         * 
+         * @param program Pointer to bytecode
+         * @param amount Size of the bytecode
+         * @return (u8 / DeviceOperationResult) Result of operation
+         */
+        u8 load(const void* program, u64 amount) {
+            code_watch.epoch++;
+            return prm_user.write(0, amount, (void*) program);
+        }
+
+        // Unblock a processor that ran "wait"
+        void wake() { state.blocked = false; }
+
+        // Container addresses of the devices
+        vptr stack_base() { return prm_flags.size; }
+        vptr user_base() { return prm_flags.size + prm_stack.size; }
+
+        MemoryContainer& memory() { return prm; }
+        MemoryArena* memory_arena() { return arena.get(); }
+        ProcessorState state;
+    protected:
+        // Backing of every device, declared first so it outlives them
+        std::unique_ptr<MemoryArena> arena;
+        MemoryArenaPool* arena_pool = 0x0;
+        u8 arena_flags = 0;
+        u64 dirty_page_bits = 0; // 0 if writes aren't tracked
+
         MemoryContainer prm;
         PureMemoryDevice prm_flags;
         PureMemoryDevice prm_stack;
         PureMemoryDevice prm_user;
+
+        // Stores into watched code and changes of "user" through load() / images / checkpoints
+        CodeWatch code_watch;
+
+        // Give the arena back to the pool / unmap it
+        void release_arena() {
+            if (arena_pool != 0x0)
+                arena_pool->release(std::move(arena));
+            arena.reset();
+        }
     };
 
-    class BasicInterpretedProcessor : BaseProcessor {
+    class BasicInterpretedProcessor : public BaseProcessor {
+    public:
+        BasicInterpretedProcessor() {}
+        BasicInterpretedProcessor(u64 _stack, u64 _user, MemoryArenaPool* _pool = 0x0, u8 _arena_flags = 0)
+            : BaseProcessor(_stack, _user, _pool, _arena_flags) {}
+        virtual ~BasicInterpretedProcessor() {}
+
+        /**
+         * @brief Execute instructions until the budget runs out or execution stops
+         * 
+         * @param budget Maximum amount of instructions to execute
+         * @return ExecutionResult Why execution stopped
+         */
+        virtual ExecutionResult run(u64 budget);
 
+        // Execute a single instruction
+        ExecutionResult step() { return run(1); }
     };
 }
 }
\ No newline at end of file
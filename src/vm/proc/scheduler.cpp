@@ -0,0 +1,367 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file scheduler.cpp
+ * @author lotuspar / par0-git
+ * @brief ProcessorRuntime worker threads and WorkStealingDeque
+ */
+
+#include "scheduler.h"
+
+#ifdef __linux__
+    #include <pthread.h> // pthread_setaffinity_np
+    #include <sched.h> // cpu_set_t
+#endif
+
+using namespace sasm::vm;
+
+// Runtime / worker index of the current thread, wake() pushes to the own deque of a worker
+static thread_local ProcessorRuntime* current_runtime = 0x0;
+static thread_local u64 current_worker = 0;
+
+WorkStealingDeque::WorkStealingDeque(u64 _capacity) {
+    // Round capacity up to a power of two so indices can be masked
+    u64 capacity = 2;
+    while (capacity < _capacity)
+        capacity <<= 1;
+
+    buffer.reset(new std::atomic<u64>[capacity]);
+    mask = capacity - 1;
+}
+
+void WorkStealingDeque::push(u64 item) {
+    i64 b = bottom.load(std::memory_order_relaxed);
+    buffer[b & mask].store(item, std::memory_order_relaxed);
+
+    // Item (and everything written before pushing it, e.g. processor state) has to be
+    // visible before thieves can see the new bottom
+    bottom.store(b + 1, std::memory_order_release);
+}
+
+bool WorkStealingDeque::pop(u64* item_out) {
+    i64 b = bottom.load(std::memory_order_relaxed) - 1;
+    bottom.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    i64 t = top.load(std::memory_order_relaxed);
+
+    // Empty
+    if (t > b) {
+        bottom.store(b + 1, std::memory_order_relaxed);
+        return false;
+    }
+
+    *item_out = buffer[b & mask].load(std::memory_order_relaxed);
+    if (t != b)
+        return true; // More than one item left, no thief can reach this one
+
+    // Last item, race thieves for it
+    bool won = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    bottom.store(b + 1, std::memory_order_relaxed);
+    return won;
+}
+
+bool WorkStealingDeque::steal(u64* item_out) {
+    i64 t = top.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    i64 b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b)
+        return false; // Empty
+
+    u64 item = buffer[t & mask].load(std::memory_order_relaxed);
+    if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+        return false; // Lost the race against the owner or another thief
+
+    *item_out = item;
+    return true;
+}
+
+ProcessorRuntime::ProcessorRuntime(u64 _workers, u64 _slice, bool _pin) : pin(_pin), slice(_slice) {
+    worker_total = _workers;
+    if (worker_total == 0)
+        worker_total = std::thread::hardware_concurrency();
+    if (worker_total == 0)
+        worker_total = 1;
+
+    for (u64 i = 0; i < worker_total; i++) {
+        workers.emplace_back(new Worker());
+        workers[i]->deque.reset(new WorkStealingDeque());
+        workers[i]->expired.reset(new WorkStealingDeque());
+        workers[i]->random = 0x9E3779B97F4A7C15ull * (i + 1);
+    }
+}
+
+ProcessorRuntime::~ProcessorRuntime() {
+    stop();
+}
+
+u64 ProcessorRuntime::add(std::unique_ptr<BasicInterpretedProcessor> processor) {
+    if (running) {
+        sasm_print("Can't add processors to a running ProcessorRuntime");
+        return ~((u64) 0);
+    }
+
+    u64 id = slots.size();
+    slots.emplace_back(new Slot());
+    Slot& slot = *slots[id];
+    slot.processor = std::move(processor);
+
+    // Only runnable processors are queued
+    ProcessorState& state = slot.processor->state;
+    if (state.halted || state.fault != kFaultNone) {
+        slot.state.store(kScheduleFinished, std::memory_order_relaxed);
+        finished.fetch_add(1, std::memory_order_relaxed);
+    } else if (state.blocked) {
+        slot.state.store(kScheduleBlocked, std::memory_order_relaxed);
+    } else {
+        runnable.fetch_add(1, std::memory_order_relaxed);
+        enqueue(id);
+    }
+
+    return id;
+}
+
+void ProcessorRuntime::start() {
+    if (running)
+        return;
+
+    // Collect everything queued while stopped
+    std::vector<u64> pending;
+    u64 id = 0;
+    for (u64 i = 0; i < worker_total; i++) {
+        while (workers[i]->deque->pop(&id))
+            pending.push_back(id);
+        while (workers[i]->expired->steal(&id))
+            pending.push_back(id);
+    }
+    pending.insert(pending.end(), inject.begin(), inject.end());
+    inject.clear();
+    injected.store(0, std::memory_order_relaxed);
+
+    // A processor is in at most one deque, so deques large enough for every processor never overflow
+    for (u64 i = 0; i < worker_total; i++) {
+        workers[i]->deque.reset(new WorkStealingDeque(slots.size() + 1));
+        workers[i]->expired.reset(new WorkStealingDeque(slots.size() + 1));
+    }
+
+    for (u64 i = 0; i < pending.size(); i++)
+        workers[i % worker_total]->deque->push(pending[i]);
+    queued.store(pending.size(), std::memory_order_seq_cst);
+
+    running = true;
+    stopping.store(false, std::memory_order_release);
+    for (u64 i = 0; i < worker_total; i++)
+        workers[i]->thread = std::thread(&ProcessorRuntime::work, this, i);
+}
+
+void ProcessorRuntime::stop() {
+    if (!running)
+        return;
+
+    stopping.store(true, std::memory_order_seq_cst);
+    {
+        std::lock_guard<std::mutex> lock(idle_mutex);
+        idle_condition.notify_all();
+    }
+
+    for (u64 i = 0; i < worker_total; i++)
+        workers[i]->thread.join();
+
+    running = false;
+}
+
+void ProcessorRuntime::wake(u64 id) {
+    if (id >= slots.size())
+        return;
+
+    Slot& slot = *slots[id];
+    slot.wakes.fetch_add(1, std::memory_order_seq_cst);
+
+    // Count as runnable before it can run, so wait() can't return too early
+    runnable.fetch_add(1, std::memory_order_seq_cst);
+
+    u8 expected = kScheduleBlocked;
+    if (!slot.state.compare_exchange_strong(expected, kScheduleQueued, std::memory_order_seq_cst)) {
+        // Not blocked, the worker running it sees the wake once it blocks
+        release_runnable();
+        return;
+    }
+
+    slot.consumed.store(slot.wakes.load(std::memory_order_seq_cst), std::memory_order_relaxed);
+    slot.processor->wake();
+    enqueue(id);
+}
+
+void ProcessorRuntime::wait() {
+    if (!running && runnable.load(std::memory_order_seq_cst) > 0) {
+        sasm_print("Tried waiting for a ProcessorRuntime that isn't running");
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(done_mutex);
+    done_condition.wait(lock, [this] { return runnable.load(std::memory_order_seq_cst) <= 0; });
+}
+
+RuntimeStats ProcessorRuntime::statistics() {
+    RuntimeStats stats = RuntimeStats();
+    for (u64 i = 0; i < worker_total; i++) {
+        stats.slices += workers[i]->slices.load(std::memory_order_relaxed);
+        stats.steals += workers[i]->steals.load(std::memory_order_relaxed);
+        stats.parks += workers[i]->parks.load(std::memory_order_relaxed);
+    }
+    stats.finished = finished.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void ProcessorRuntime::work(u64 index) {
+    current_runtime = this;
+    current_worker = index;
+
+#ifdef __linux__
+    // Pin worker to a core
+    if (pin) {
+        u64 cores = std::thread::hardware_concurrency();
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cores != 0 ? index % cores : 0, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            sasm_print("Failed to pin worker %lu", index);
+    }
+#endif
+
+    Worker& self = *workers[index];
+    u64 id = 0;
+    while (!stopping.load(std::memory_order_acquire)) {
+        if (find_task(index, &id)) {
+            run_slice(index, id);
+            continue;
+        }
+
+        // Nothing to do anywhere, sleep until something gets queued
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        sleepers.fetch_add(1, std::memory_order_seq_cst);
+        if (queued.load(std::memory_order_seq_cst) <= 0 && !stopping.load(std::memory_order_seq_cst)) {
+            self.parks.fetch_add(1, std::memory_order_relaxed);
+            idle_condition.wait(lock);
+        }
+        sleepers.fetch_sub(1, std::memory_order_seq_cst);
+    }
+
+    current_runtime = 0x0;
+}
+
+bool ProcessorRuntime::find_task(u64 index, u64* id_out) {
+    Worker& self = *workers[index];
+
+    // New / woken processors of the own deque first
+    if (self.deque->pop(id_out)) {
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Processors woken from outside
+    if (injected.load(std::memory_order_acquire) != 0) {
+        std::lock_guard<std::mutex> lock(inject_mutex);
+        if (!inject.empty()) {
+            *id_out = inject.front();
+            inject.pop_front();
+            injected.fetch_sub(1, std::memory_order_relaxed);
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    // Preempted processors, oldest first so every one gets a turn
+    if (self.expired->steal(id_out)) {
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Steal, starting at a random victim so thieves spread out
+    self.random ^= self.random << 13;
+    self.random ^= self.random >> 7;
+    self.random ^= self.random << 17;
+    u64 start = self.random % worker_total;
+    for (u64 i = 0; i < worker_total; i++) {
+        u64 victim = (start + i) % worker_total;
+        if (victim == index)
+            continue;
+
+        if (workers[victim]->deque->steal(id_out) || workers[victim]->expired->steal(id_out)) {
+            self.steals.fetch_add(1, std::memory_order_relaxed);
+            queued.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void ProcessorRuntime::run_slice(u64 index, u64 id) {
+    Slot& slot = *slots[id];
+    slot.state.store(kScheduleRunning, std::memory_order_relaxed);
+
+    ExecutionResult result = slot.processor->run(slice.load(std::memory_order_relaxed));
+    workers[index]->slices.fetch_add(1, std::memory_order_relaxed);
+
+    switch (result) {
+        case kExecutionBudget:
+            // Still runnable, behind the other preempted processors
+            slot.state.store(kScheduleQueued, std::memory_order_relaxed);
+            enqueue(id, true);
+            return;
+        case kExecutionBlocked: {
+            slot.state.store(kScheduleBlocked, std::memory_order_seq_cst);
+
+            // Check if it was woken while running
+            if (slot.wakes.load(std::memory_order_seq_cst) != slot.consumed.load(std::memory_order_relaxed)) {
+                u8 expected = kScheduleBlocked;
+                if (slot.state.compare_exchange_strong(expected, kScheduleQueued, std::memory_order_seq_cst)) {
+                    slot.consumed.store(slot.wakes.load(std::memory_order_seq_cst), std::memory_order_relaxed);
+                    slot.processor->wake();
+                    enqueue(id);
+                    return;
+                }
+            }
+
+            release_runnable();
+            return;
+        }
+        default:
+            // Halted / faulted
+            slot.state.store(kScheduleFinished, std::memory_order_release);
+            finished.fetch_add(1, std::memory_order_relaxed);
+            release_runnable();
+            return;
+    }
+}
+
+void ProcessorRuntime::enqueue(u64 id, bool expired) {
+    if (current_runtime == this) {
+        Worker& self = *workers[current_worker];
+        (expired ? self.expired : self.deque)->push(id);
+    } else {
+        // Deques can only be pushed to by their worker
+        std::lock_guard<std::mutex> lock(inject_mutex);
+        inject.push_back(id);
+        injected.fetch_add(1, std::memory_order_release);
+    }
+
+    queued.fetch_add(1, std::memory_order_seq_cst);
+    notify_idle();
+}
+
+void ProcessorRuntime::notify_idle() {
+    if (sleepers.load(std::memory_order_seq_cst) == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(idle_mutex);
+    idle_condition.notify_one();
+}
+
+void ProcessorRuntime::release_runnable() {
+    if (runnable.fetch_sub(1, std::memory_order_seq_cst) != 1)
+        return;
+
+    std::lock_guard<std::mutex> lock(done_mutex);
+    done_condition.notify_all();
+}
@@ -0,0 +1,194 @@
+/**
+ * SemiAssembly / sasm virtual machine code
+ * @file scheduler.h
+ * @author lotuspar / par0-git
+ * @brief Runtime running many processors on a work-stealing pool of host threads
+ *
+ * Every worker thread owns two WorkStealingDeques of runnable processors: new and woken
+ * processors are run from the bottom (LIFO), processors whose slice (an instruction
+ * budget) ran out are queued behind each other and taken from the top (FIFO), after
+ * processors woken from outside. Workers without work steal from the top of the other
+ * deques, and sleep once nothing is left anywhere. Blocked, halted and faulted processors
+ * are in no deque at all, so they cost nothing until woken.
+ */
+
+#pragma once
+
+#include "processor.h"
+#include <atomic> // std::atomic
+#include <condition_variable> // std::condition_variable
+#include <deque> // std::deque
+#include <memory> // std::unique_ptr
+#include <mutex> // std::mutex
+#include <thread> // std::thread
+#include <vector> // std::vector
+
+namespace sasm {
+namespace vm {
+    /**
+     * @brief Fixed capacity Chase-Lev work-stealing deque of processor ids
+     *
+     * The owner pushes and pops at the bottom, any other thread steals from the top. The
+     * capacity has to be larger than the amount of items that can be queued at once.
+     */
+    class WorkStealingDeque {
+        public:
+            WorkStealingDeque(u64 _capacity = 64);
+
+            WorkStealingDeque(const WorkStealingDeque&) = delete;
+            WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+
+            // Owner only: add an item at the bottom
+            void push(u64 item);
+
+            // Owner only: take the item at the bottom, false if empty
+            bool pop(u64* item_out);
+
+            // Any thread: take the item at the top, false if empty or another thread won the race
+            bool steal(u64* item_out);
+
+            // Approximate amount of items
+            u64 size() {
+                i64 amount = bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+                return amount > 0 ? amount : 0;
+            }
+        private:
+            alignas(64) std::atomic<i64> top {0};
+            alignas(64) std::atomic<i64> bottom {0};
+            std::unique_ptr<std::atomic<u64>[]> buffer;
+            u64 mask;
+    };
+
+    /**
+     * @brief Scheduling state of a processor inside a ProcessorRuntime
+     */
+    enum ScheduleState {
+        kScheduleQueued = 0, // In a deque / the injection queue, waiting for a worker
+        kScheduleRunning = 1, // Being run by a worker
+        kScheduleBlocked = 2, // Ran "wait", not queued until woken
+        kScheduleFinished = 3 // Halted or faulted, never queued again
+    };
+
+    struct RuntimeStats {
+        u64 slices; // Budget slices run
+        u64 steals; // Processors taken from another worker
+        u64 parks; // Times a worker went to sleep without work
+        u64 finished; // Processors that halted or faulted
+    };
+
+    class ProcessorRuntime {
+        public:
+            /**
+             * @brief Create a runtime, workers are started by start()
+             *
+             * @param _workers Amount of worker threads, 0 for one per hardware thread
+             * @param _slice Instructions a processor runs before another one gets a turn
+             * @param _pin Pin worker i to core i (modulo the amount of cores)
+             */
+            ProcessorRuntime(u64 _workers = 0, u64 _slice = 10000, bool _pin = false);
+            ~ProcessorRuntime();
+
+            ProcessorRuntime(const ProcessorRuntime&) = delete;
+            ProcessorRuntime& operator=(const ProcessorRuntime&) = delete;
+
+            /**
+             * @brief Give a processor to the runtime, only possible while the workers are stopped
+             *
+             * @param processor Processor with a loaded program
+             * @return u64 Processor id, ~0 if the workers are running
+             */
+            u64 add(std::unique_ptr<BasicInterpretedProcessor> processor);
+
+            /**
+             * @brief Start the worker threads
+             */
+            void start();
+
+            /**
+             * @brief Stop and join the worker threads, processors keep their state
+             *
+             * Processors that were queued or running are queued again by the next start().
+             */
+            void stop();
+
+            /**
+             * @brief Wake a processor that ran "wait", safe to call from any thread
+             *
+             * Waking a processor that isn't blocked is remembered: its next "wait" returns
+             * immediately.
+             *
+             * @param id Processor id
+             */
+            void wake(u64 id);
+
+            /**
+             * @brief Wait until no processor is runnable (every processor is blocked or finished)
+             */
+            void wait();
+
+            // Change the instruction budget of a slice, takes effect for the next slices
+            void set_slice(u64 _slice) { slice.store(_slice, std::memory_order_relaxed); }
+
+            BasicInterpretedProcessor* processor(u64 id) { return id < slots.size() ? slots[id]->processor.get() : 0x0; }
+            u8 schedule_state(u64 id) { return slots[id]->state.load(std::memory_order_acquire); }
+            u64 size() { return slots.size(); }
+            u64 worker_count() { return worker_total; }
+
+            RuntimeStats statistics();
+        private:
+            struct Slot {
+                std::unique_ptr<BasicInterpretedProcessor> processor;
+                std::atomic<u8> state {kScheduleQueued};
+                std::atomic<u64> wakes {0}; // Incremented by every wake()
+                std::atomic<u64> consumed {0}; // Value of wakes when the processor last left "wait"
+            };
+
+            // Owned by one worker thread, aligned so workers don't share cache lines
+            struct alignas(64) Worker {
+                std::unique_ptr<WorkStealingDeque> deque; // New / woken processors
+                std::unique_ptr<WorkStealingDeque> expired; // Processors whose slice ran out, oldest first
+                std::thread thread;
+                u64 random = 0; // xorshift state for picking steal victims
+                std::atomic<u64> slices {0};
+                std::atomic<u64> steals {0};
+                std::atomic<u64> parks {0};
+            };
+
+            std::vector<std::unique_ptr<Slot>> slots;
+            std::vector<std::unique_ptr<Worker>> workers;
+            u64 worker_total;
+            bool pin;
+            bool running = false;
+            std::atomic<u64> slice;
+            std::atomic<bool> stopping {false};
+
+            // Processors queued / running, wait() returns once this reaches 0
+            std::atomic<i64> runnable {0};
+            std::atomic<u64> finished {0};
+
+            // Items in every deque and the injection queue, workers only sleep when this is 0
+            std::atomic<i64> queued {0};
+
+            // Processors woken by threads that aren't workers, workers can't push to foreign deques
+            std::mutex inject_mutex;
+            std::deque<u64> inject;
+            std::atomic<u64> injected {0}; // Size of inject, checked before taking the lock
+
+            // Sleeping workers, only touched when a worker runs out of work
+            std::mutex idle_mutex;
+            std::condition_variable idle_condition;
+            std::atomic<u64> sleepers {0};
+
+            // wait()
+            std::mutex done_mutex;
+            std::condition_variable done_condition;
+
+            void work(u64 index);
+            bool find_task(u64 index, u64* id_out);
+            void run_slice(u64 index, u64 id);
+            void enqueue(u64 id, bool expired = false);
+            void notify_idle();
+            void release_runnable();
+    };
+}
+}